@@ -62,6 +62,7 @@ int main(int argc, const char *argv[])
 		break;
 
 	case OBJECTMAGIC_DIR_MAGIC_VALUE:
+	case OBJECTMAGIC_DIR_COMPACT_MAGIC_VALUE:
 		{
 			BackupStoreDirectory dir;
 			dir.ReadFromStream(file, IOStream::TimeOutInfinite);
@@ -392,10 +392,11 @@ int main(int argc, const char *argv[])
 	
 	// 4. Log in to server
 	BOX_INFO("Login to store...");
-	// Check the version of the server
+	// Check the version of the server. We never upload files, so the
+	// oldest version is enough, and works with every server.
 	{
-		std::auto_ptr<BackupProtocolVersion> serverVersion(connection.QueryVersion(BACKUP_STORE_SERVER_VERSION));
-		if(serverVersion->GetVersion() != BACKUP_STORE_SERVER_VERSION)
+		std::auto_ptr<BackupProtocolVersion> serverVersion(connection.QueryVersion(BACKUP_STORE_SERVER_MIN_VERSION));
+		if(serverVersion->GetVersion() != BACKUP_STORE_SERVER_MIN_VERSION)
 		{
 			THROW_EXCEPTION(BackupStoreException, WrongServerVersion)
 		}
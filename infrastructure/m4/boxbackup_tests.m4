@@ -102,6 +102,11 @@ esac
 
 AC_CHECK_HEADER([zlib.h],, [AC_MSG_ERROR([[cannot find zlib.h]])])
 AC_CHECK_LIB([z], [zlibVersion],, [AC_MSG_ERROR([[cannot find zlib]])])
+
+## Optional codecs for compressing blocks of files
+AC_CHECK_HEADER([zstd.h], [AC_CHECK_LIB([zstd], [ZSTD_compress])])
+AC_CHECK_HEADER([lz4.h], [AC_CHECK_LIB([lz4], [LZ4_compress_default])])
+
 VL_LIB_READLINE([have_libreadline=yes], [have_libreadline=no])
 AC_CHECK_FUNCS([rl_filename_completion_function])
 
@@ -119,6 +124,13 @@ AX_PATH_BDB([1.x or 4.1], [
   AX_SPLIT_VERSION([BDB_VERSION], [$BDB_VERSION])
 ])
 
+# threads are used to spread CPU-bound work over several processors
+AC_SEARCH_LIBS([pthread_create], [pthread])
+
+# the store's reference count database is memory-mapped, where possible,
+# and the kernel is told when files will be read from start to end
+AC_CHECK_FUNCS([mmap posix_fadvise])
+
 # need to find libdl before trying to link openssl, apparently
 AC_SEARCH_LIBS([dlsym], [dl])
 AC_CHECK_FUNCS([dlsym dladdr])
@@ -150,7 +162,7 @@ AC_HEADER_SYS_WAIT
 AC_CHECK_HEADERS([cxxabi.h dirent.h dlfcn.h fcntl.h getopt.h netdb.h process.h pwd.h signal.h])
 AC_CHECK_HEADERS([syslog.h time.h unistd.h])
 AC_CHECK_HEADERS([netinet/in.h netinet/tcp.h])
-AC_CHECK_HEADERS([sys/file.h sys/param.h sys/poll.h sys/socket.h sys/stat.h sys/time.h])
+AC_CHECK_HEADERS([sys/file.h sys/mman.h sys/param.h sys/poll.h sys/socket.h sys/stat.h sys/time.h])
 AC_CHECK_HEADERS([sys/types.h sys/uio.h sys/un.h sys/wait.h sys/xattr.h])
 AC_CHECK_HEADERS([sys/ucred.h],,, [
 	#ifdef HAVE_SYS_PARAM_H
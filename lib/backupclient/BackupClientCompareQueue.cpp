@@ -0,0 +1,747 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientCompareQueue.cpp
+//		Purpose: Fetch directory listings and files or block indexes
+//			 to compare with several requests in flight, and
+//			 compare them with local files on several threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include <sstream>
+
+#include "BackupClientCompareQueue.h"
+#include "autogen_BackupProtocol.h"
+#include "autogen_ConnectionException.h"
+#include "BackupClientFileAttributes.h"
+#include "BackupStoreDirectory.h"
+#include "BackupStoreFile.h"
+#include "BackupStoreFileDecryptContexts.h"
+#include "CollectInBufferStream.h"
+#include "FileStream.h"
+#include "SelfFlushingStream.h"
+
+#include "MemLeakFindOn.h"
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::BackupClientCompareQueue(BackupProtocolCallable &, int, bool, bool, box_time_t)
+//		Purpose: Constructor. Starts the given number of threads to
+//			 compare files, and keeps up to twice that many
+//			 requests in flight, and files buffered. The other
+//			 arguments are the options of the compare.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientCompareQueue::BackupClientCompareQueue(
+	BackupProtocolCallable &rConnection, int Threads, bool QuickCompare,
+	bool IgnoreAttributes, box_time_t LatestFileUploadTime)
+: mrConnection(rConnection),
+  mPipelined(dynamic_cast<BackupProtocolClient *>(&rConnection) != 0),
+  mMaxRequests(Threads * 2),
+  mQuickCompare(QuickCompare),
+  mIgnoreAttributes(IgnoreAttributes),
+  mLatestFileUploadTime(LatestFileUploadTime),
+  mNumBuffered(0),
+  mStopping(false)
+{
+	try
+	{
+		for(int t = 0; t < Threads; ++t)
+		{
+			mWorkers.push_back(new Worker(*this));
+			mWorkers.back()->Start();
+		}
+	}
+	catch(...)
+	{
+		StopWorkers();
+		throw;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::~BackupClientCompareQueue()
+//		Purpose: Destructor. Waits for the files being compared, and
+//			 discards the replies to any requests still in flight,
+//			 so that the connection can still be used.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientCompareQueue::~BackupClientCompareQueue()
+{
+	StopWorkers();
+
+	try
+	{
+		while(mPipelined && !mRequested.empty())
+		{
+			mRequested.pop_front();
+			std::auto_ptr<BackupProtocolMessage> reply(
+				mrConnection.Receive());
+			if(reply->GetType() == BackupProtocolSuccess::TypeID)
+			{
+				mrConnection.ReceiveStream()->Flush();
+			}
+		}
+	}
+	catch(...)
+	{
+		// The connection has failed anyway
+	}
+
+	for(size_t f = 0; f < mFiles.size(); ++f)
+	{
+		Discard(mFiles[f]);
+	}
+
+	for(std::map<int64_t, BackupStoreDirectory *>::iterator
+		i(mDirectories.begin()); i != mDirectories.end(); ++i)
+	{
+		delete i->second;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::Worker::Worker(BackupClientCompareQueue &)
+//		Purpose: Constructor, for a thread of the given queue, with
+//			 its own copies of the decrypt contexts.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientCompareQueue::Worker::Worker(BackupClientCompareQueue &rQueue)
+: mrQueue(rQueue),
+  mpDecrypt(new BackupStoreFileDecryptContexts)
+{
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::Worker::~Worker()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientCompareQueue::Worker::~Worker()
+{
+	delete mpDecrypt;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::StopWorkers()
+//		Purpose: Private. Tells the threads to finish, and waits for
+//			 them.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::StopWorkers()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mFileAdded.Broadcast();
+	}
+
+	for(size_t w = 0; w < mWorkers.size(); ++w)
+	{
+		if(mWorkers[w]->IsStarted())
+		{
+			try
+			{
+				mWorkers[w]->Join();
+			}
+			catch(...)
+			{
+				// Failures were recorded in the files
+			}
+		}
+		delete mWorkers[w];
+	}
+	mWorkers.clear();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::AddDirectory(int64_t)
+//		Purpose: Requests the listing of a directory which will be
+//			 compared later, if the connection is pipelined and
+//			 not too many listings have been requested already.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::AddDirectory(int64_t DirectoryID)
+{
+	if(!mPipelined ||
+		mDirectories.find(DirectoryID) != mDirectories.end() ||
+		(int)mDirectories.size() >= mMaxRequests)
+	{
+		return;
+	}
+
+	SendListDirectory(DirectoryID);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::GetDirectory(int64_t)
+//		Purpose: Returns the listing of a directory, of the entries
+//			 which aren't old versions or deleted, with their
+//			 attributes. Receives the replies to all the requests
+//			 made before it, if it was requested by AddDirectory(),
+//			 or otherwise requests it now.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupStoreDirectory> BackupClientCompareQueue::GetDirectory(
+	int64_t DirectoryID)
+{
+	if(!mPipelined)
+	{
+		// Files are requested when they're received, so nothing
+		// is in flight
+		mrConnection.QueryListDirectory(DirectoryID,
+			BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+			BackupProtocolListDirectory::Flags_OldVersion |
+			BackupProtocolListDirectory::Flags_Deleted,
+			true /* want attributes */);
+
+		std::auto_ptr<BackupStoreDirectory> apDir(
+			new BackupStoreDirectory);
+		std::auto_ptr<IOStream> dirstream(mrConnection.ReceiveStream());
+		apDir->ReadFromStream(*dirstream, mrConnection.GetTimeout());
+		return apDir;
+	}
+
+	if(mDirectories.find(DirectoryID) == mDirectories.end())
+	{
+		SendListDirectory(DirectoryID);
+	}
+
+	std::map<int64_t, BackupStoreDirectory *>::iterator
+		i(mDirectories.find(DirectoryID));
+	while(i->second == 0)
+	{
+		ReceiveNext();
+	}
+
+	std::auto_ptr<BackupStoreDirectory> apDir(i->second);
+	mDirectories.erase(i);
+	return apDir;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::Add(int64_t, int64_t, const std::string &, const std::string &, const StreamableMemBlock *, int64_t)
+//		Purpose: Adds a file to compare, the one with the given ID
+//			 and size on the store with the local file, and the
+//			 path on the store to report. If pAttributes isn't
+//			 null, they're compared instead of those stored with
+//			 the file. May wait for earlier requests to be
+//			 received or compared.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::Add(int64_t DirectoryID, int64_t ObjectID,
+	const std::string &rLocalFilename, const std::string &rStoreFilename,
+	const StreamableMemBlock *pAttributes, int64_t SizeInBlocks)
+{
+	while((int)mRequested.size() >= mMaxRequests)
+	{
+		ReceiveNext();
+	}
+
+	File *pfile = new File;
+	pfile->mDirectoryID = DirectoryID;
+	pfile->mObjectID = ObjectID;
+	pfile->mpAttributes = 0;
+	pfile->mCompareInPlace = !mQuickCompare &&
+		(SizeInBlocks > BACKUPCLIENTCOMPAREQUEUE_MAX_BUFFERED_BLOCKS);
+	pfile->mpReceived = 0;
+	pfile->mReceived = false;
+	pfile->mDone = false;
+	pfile->mResult.mLocalFilename = rLocalFilename;
+	pfile->mResult.mStoreFilename = rStoreFilename;
+	pfile->mResult.mSize = 0;
+	pfile->mResult.mHasStoreAttributes = (pAttributes != 0);
+	pfile->mResult.mHasDifferentAttributes = false;
+	pfile->mResult.mHasDifferentContents = false;
+	pfile->mResult.mModifiedAfterLastSync = false;
+	pfile->mResult.mDownloadFailed = false;
+	pfile->mResult.mLocalFileReadFailed = false;
+
+	try
+	{
+		if(pAttributes != 0)
+		{
+			pfile->mpAttributes =
+				new BackupClientFileAttributes(*pAttributes);
+		}
+
+		if(mPipelined && mQuickCompare)
+		{
+			mrConnection.Send(BackupProtocolGetBlockIndexByID(
+				ObjectID));
+		}
+		else if(mPipelined)
+		{
+			mrConnection.Send(BackupProtocolGetFile(DirectoryID,
+				ObjectID));
+		}
+	}
+	catch(...)
+	{
+		Discard(pfile);
+		throw;
+	}
+
+	Request request = {pfile, DirectoryID};
+	mRequested.push_back(request);
+	MutexLock lock(mMutex);
+	mFiles.push_back(pfile);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::GetNext(Compared &, bool)
+//		Purpose: Returns true, and the result of comparing the oldest
+//			 file added, once it has been compared. If Wait is
+//			 false, returns false if it hasn't been yet. Returns
+//			 false if there are no files.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientCompareQueue::GetNext(Compared &rComparedOut, bool Wait)
+{
+	File *pfile = 0;
+	while(pfile == 0)
+	{
+		bool received = true;
+		{
+			MutexLock lock(mMutex);
+			if(mFiles.empty())
+			{
+				return false;
+			}
+
+			if(mFiles.front()->mDone)
+			{
+				pfile = mFiles.front();
+				mFiles.pop_front();
+			}
+			else if(!Wait)
+			{
+				return false;
+			}
+			else if(mFiles.front()->mReceived)
+			{
+				mFileDone.Wait(mMutex);
+			}
+			else
+			{
+				received = false;
+			}
+		}
+
+		if(!received)
+		{
+			// It has to be received before it can be compared
+			ReceiveNext();
+		}
+	}
+
+	rComparedOut = pfile->mResult;
+	Discard(pfile);
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::SendListDirectory(int64_t)
+//		Purpose: Private. Requests the listing of a directory, once
+//			 there's room for another request in flight.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::SendListDirectory(int64_t DirectoryID)
+{
+	while((int)mRequested.size() >= mMaxRequests)
+	{
+		ReceiveNext();
+	}
+
+	mrConnection.Send(BackupProtocolListDirectory(DirectoryID,
+		BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+		BackupProtocolListDirectory::Flags_OldVersion |
+		BackupProtocolListDirectory::Flags_Deleted,
+		true /* want attributes */));
+
+	Request request = {0, DirectoryID};
+	mRequested.push_back(request);
+	mDirectories[DirectoryID] = 0;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::ReceiveNext()
+//		Purpose: Private. Receives the reply to the oldest request.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::ReceiveNext()
+{
+	ASSERT(!mRequested.empty());
+	Request request(mRequested.front());
+	mRequested.pop_front();
+
+	if(request.mpFile == 0)
+	{
+		ReceiveDirectory(request.mDirectoryID);
+	}
+	else
+	{
+		ReceiveFile(request.mpFile);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::ReceiveDirectory(int64_t)
+//		Purpose: Private. Receives the listing of a directory, which
+//			 was requested ahead of time.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::ReceiveDirectory(int64_t DirectoryID)
+{
+	std::auto_ptr<BackupProtocolMessage> reply(mrConnection.Receive());
+	int type, subType;
+	if(reply->IsError(type, subType))
+	{
+		THROW_EXCEPTION_MESSAGE(ConnectionException,
+			Protocol_UnexpectedReply, "ListDirectory command "
+			"failed: received error " <<
+			((BackupProtocolError &)*reply).GetMessage());
+	}
+	else if(reply->GetType() != BackupProtocolSuccess::TypeID)
+	{
+		THROW_EXCEPTION_MESSAGE(ConnectionException,
+			Protocol_UnexpectedReply, "ListDirectory command "
+			"failed: received unexpected response type " <<
+			reply->GetType());
+	}
+
+	std::auto_ptr<BackupStoreDirectory> apDir(new BackupStoreDirectory);
+	std::auto_ptr<IOStream> dirstream(mrConnection.ReceiveStream());
+	apDir->ReadFromStream(*dirstream, mrConnection.GetTimeout());
+	mDirectories[DirectoryID] = apDir.release();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::ReceiveFile(File *)
+//		Purpose: Private. Receives the block index or the encoded
+//			 file to compare with a local file (or requests and
+//			 receives it, if requests aren't pipelined), and either
+//			 compares it straight away or buffers it for the
+//			 workers. If the store couldn't send it, the failure
+//			 is recorded, and the connection is still usable.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::ReceiveFile(File *pFile)
+{
+	const char *command = mQuickCompare ? "GetBlockIndexByID" : "GetFile";
+	std::string failure;
+
+	if(mPipelined)
+	{
+		std::auto_ptr<BackupProtocolMessage> reply(mrConnection.Receive());
+		int type, subType;
+		if(reply->IsError(type, subType))
+		{
+			std::ostringstream message;
+			message << command << " command failed: received "
+				"error " <<
+				((BackupProtocolError &)*reply).GetMessage();
+			failure = message.str();
+		}
+		else if(reply->GetType() != BackupProtocolSuccess::TypeID)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_UnexpectedReply, command << " command "
+				"failed: received unexpected response type " <<
+				reply->GetType());
+		}
+	}
+	else
+	{
+		try
+		{
+			if(mQuickCompare)
+			{
+				mrConnection.QueryGetBlockIndexByID(
+					pFile->mObjectID);
+			}
+			else
+			{
+				mrConnection.QueryGetFile(pFile->mDirectoryID,
+					pFile->mObjectID);
+			}
+		}
+		catch(ConnectionException &e)
+		{
+			if(e.GetSubType() !=
+				ConnectionException::Protocol_UnexpectedReply)
+			{
+				throw;
+			}
+			failure = e.what();
+		}
+	}
+
+	if(!failure.empty())
+	{
+		MutexLock lock(mMutex);
+		pFile->mResult.mDownloadFailed = true;
+		pFile->mResult.mFailureMessage = failure;
+		pFile->mReceived = true;
+		pFile->mDone = true;
+		mFileDone.Broadcast();
+		return;
+	}
+
+	std::auto_ptr<IOStream> received(mrConnection.ReceiveStream());
+
+	if(pFile->mCompareInPlace)
+	{
+		// Too big to buffer, so compare it from the connection, while
+		// the workers carry on with the files before it
+		Compare(*pFile, *received, mrConnection.GetTimeout(), NULL);
+		if(pFile->mResult.mDownloadFailed)
+		{
+			// Keep the connection usable
+			received->Flush();
+		}
+
+		MutexLock lock(mMutex);
+		pFile->mReceived = true;
+		pFile->mDone = true;
+		mFileDone.Broadcast();
+		return;
+	}
+
+	pFile->mpReceived = new CollectInBufferStream;
+	received->CopyStreamTo(*pFile->mpReceived, mrConnection.GetTimeout());
+	pFile->mpReceived->SetForReading();
+
+	MutexLock lock(mMutex);
+	while(mNumBuffered >= mMaxRequests)
+	{
+		mFileDone.Wait(mMutex);
+	}
+	pFile->mReceived = true;
+	mWaiting.push_back(pFile);
+	mNumBuffered++;
+	mFileAdded.Signal();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::RunWorker(BackupStoreFileDecryptContexts &)
+//		Purpose: Private. Compares files as they're received, until
+//			 the queue is destroyed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::RunWorker(
+	BackupStoreFileDecryptContexts &rDecrypt)
+{
+	MutexLock lock(mMutex);
+	while(true)
+	{
+		while(mWaiting.empty() && !mStopping)
+		{
+			mFileAdded.Wait(mMutex);
+		}
+		if(mStopping)
+		{
+			return;
+		}
+
+		File *pfile = mWaiting.front();
+		mWaiting.pop_front();
+
+		// Compare without holding the lock
+		mMutex.Unlock();
+		Compare(*pfile, *pfile->mpReceived, IOStream::TimeOutInfinite,
+			&rDecrypt);
+		delete pfile->mpReceived;
+		pfile->mpReceived = 0;
+		mMutex.Lock();
+
+		pfile->mDone = true;
+		mNumBuffered--;
+		mFileDone.Broadcast();
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::Compare(File &, IOStream &, int, BackupStoreFileDecryptContexts *)
+//		Purpose: Private. Compares a local file with its block index
+//			 or encoded file from the store, in the same way as
+//			 BackupQueries::CompareOneFile(), recording the result
+//			 in the file.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::Compare(File &rFile, IOStream &rReceived,
+	int Timeout, BackupStoreFileDecryptContexts *pDecrypt)
+{
+	Compared &rResult(rFile.mResult);
+	const char *localFilename = rResult.mLocalFilename.c_str();
+
+	EMU_STRUCT_STAT st;
+	if(EMU_STAT(localFilename, &st) == 0)
+	{
+		rResult.mSize = st.st_size;
+	}
+
+	try
+	{
+		if(mQuickCompare)
+		{
+			rResult.mHasDifferentContents =
+				!BackupStoreFile::CompareFileContentsAgainstBlockIndex(
+					localFilename, rReceived, Timeout,
+					pDecrypt);
+			return;
+		}
+
+		std::auto_ptr<BackupStoreFile::DecodedStream> fileOnServerStream(
+			BackupStoreFile::DecodeFileStream(rReceived, Timeout,
+				rFile.mpAttributes, pDecrypt));
+
+		// Compare attributes
+		BackupClientFileAttributes localAttr;
+		box_time_t fileModTime = 0;
+		localAttr.ReadAttributes(localFilename,
+			false /* don't zero mod times */, &fileModTime);
+		rResult.mModifiedAfterLastSync =
+			(fileModTime > mLatestFileUploadTime);
+		bool ignoreAttrModTime = true;
+
+		#ifdef WIN32
+		// attr mod time is really
+		// creation time, so check it
+		ignoreAttrModTime = false;
+		#endif
+
+		if(!mIgnoreAttributes &&
+		#ifdef PLATFORM_DISABLE_SYMLINK_ATTRIB_COMPARE
+		   !fileOnServerStream->IsSymLink() &&
+		#endif
+		   !localAttr.Compare(fileOnServerStream->GetAttributes(),
+				ignoreAttrModTime,
+				fileOnServerStream->IsSymLink() /* ignore modification time if it's a symlink */))
+		{
+			rResult.mHasDifferentAttributes = true;
+		}
+
+		// Compare contents, if it's a regular file not a link, always
+		// reading the entire stream from the store
+		SelfFlushingStream flushObject(rReceived);
+
+		if(!fileOnServerStream->IsSymLink())
+		{
+			SelfFlushingStream flushFile(*fileOnServerStream);
+			std::auto_ptr<FileStream> apLocalFile;
+
+			try
+			{
+				apLocalFile.reset(new FileStream(localFilename));
+			}
+			catch(std::exception &e)
+			{
+				rResult.mLocalFileReadFailed = true;
+				rResult.mFailureMessage = e.what();
+			}
+			catch(...)
+			{
+				rResult.mLocalFileReadFailed = true;
+			}
+
+			if(apLocalFile.get())
+			{
+				rResult.mHasDifferentContents =
+					!apLocalFile->CompareWith(
+						*fileOnServerStream, Timeout);
+			}
+		}
+	}
+	catch(std::exception &e)
+	{
+		rResult.mDownloadFailed = true;
+		rResult.mFailureMessage = e.what();
+	}
+	catch(...)
+	{
+		rResult.mDownloadFailed = true;
+		rResult.mFailureMessage = "unknown error";
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientCompareQueue::Discard(File *)
+//		Purpose: Private. Frees a file and its buffers.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientCompareQueue::Discard(File *pFile)
+{
+	delete pFile->mpAttributes;
+	delete pFile->mpReceived;
+	delete pFile;
+}
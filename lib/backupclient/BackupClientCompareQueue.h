@@ -0,0 +1,170 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientCompareQueue.h
+//		Purpose: Fetch directory listings and files or block indexes
+//			 to compare with several requests in flight, and
+//			 compare them with local files on several threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTCOMPAREQUEUE__H
+#define BACKUPCLIENTCOMPAREQUEUE__H
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BoxTime.h"
+#include "Thread.h"
+
+class BackupClientFileAttributes;
+class BackupProtocolCallable;
+class BackupStoreDirectory;
+class BackupStoreFileDecryptContexts;
+class CollectInBufferStream;
+class IOStream;
+class StreamableMemBlock;
+
+// Encoded files bigger than this many blocks on the store are compared
+// straight from the connection, instead of being buffered in memory for
+// the worker threads. Block indexes are always buffered.
+#define BACKUPCLIENTCOMPAREQUEUE_MAX_BUFFERED_BLOCKS	256
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientCompareQueue
+//		Purpose: Compares files on the store with local files, keeping
+//			 several requests for their block indexes (for a quick
+//			 compare) or whole files in flight on the connection,
+//			 and reading, hashing or decoding them on a pool of
+//			 worker threads. Files are returned by GetNext() in the
+//			 order they were added.
+//
+//			 Directory listings can be requested ahead of time in
+//			 the same way, with AddDirectory(), and are fetched
+//			 with GetDirectory(), which first receives everything
+//			 requested before them.
+//
+//			 Requests are only pipelined on real connections to
+//			 the server. Nothing else may use the connection until
+//			 every file added has been returned by GetNext(), and
+//			 every directory added has been fetched.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientCompareQueue
+{
+public:
+	BackupClientCompareQueue(BackupProtocolCallable &rConnection,
+		int Threads, bool QuickCompare, bool IgnoreAttributes,
+		box_time_t LatestFileUploadTime);
+	~BackupClientCompareQueue();
+private:
+	// No copying allowed
+	BackupClientCompareQueue(const BackupClientCompareQueue &);
+	BackupClientCompareQueue &operator=(const BackupClientCompareQueue &);
+
+public:
+	typedef struct
+	{
+		std::string mLocalFilename;
+		std::string mStoreFilename;
+		int64_t mSize;
+		bool mHasStoreAttributes;
+		bool mHasDifferentAttributes;
+		bool mHasDifferentContents;
+		bool mModifiedAfterLastSync;
+		bool mDownloadFailed;
+		bool mLocalFileReadFailed;
+		std::string mFailureMessage;
+	} Compared;
+
+	void AddDirectory(int64_t DirectoryID);
+	std::auto_ptr<BackupStoreDirectory> GetDirectory(int64_t DirectoryID);
+	void Add(int64_t DirectoryID, int64_t ObjectID,
+		const std::string &rLocalFilename,
+		const std::string &rStoreFilename,
+		const StreamableMemBlock *pAttributes, int64_t SizeInBlocks);
+	bool GetNext(Compared &rComparedOut, bool Wait);
+	bool IsEmpty() const { return mFiles.empty(); }
+
+private:
+	typedef struct
+	{
+		int64_t mDirectoryID;
+		int64_t mObjectID;
+		BackupClientFileAttributes *mpAttributes;
+		bool mCompareInPlace;
+		CollectInBufferStream *mpReceived;
+		bool mReceived;
+		bool mDone;
+		Compared mResult;
+	} File;
+
+	// A request in flight, for a file, or if that's null, for the
+	// listing of a directory
+	typedef struct
+	{
+		File *mpFile;
+		int64_t mDirectoryID;
+	} Request;
+
+	class Worker : public Thread
+	{
+	public:
+		Worker(BackupClientCompareQueue &rQueue);
+		~Worker();
+	protected:
+		virtual void Run() { mrQueue.RunWorker(*mpDecrypt); }
+	private:
+		BackupClientCompareQueue &mrQueue;
+		// Not a member, so that this header doesn't need the OpenSSL
+		// headers, which clash with SocketStreamTLS.h
+		BackupStoreFileDecryptContexts *mpDecrypt;
+	};
+
+	void RunWorker(BackupStoreFileDecryptContexts &rDecrypt);
+	void StopWorkers();
+	void SendListDirectory(int64_t DirectoryID);
+	void ReceiveNext();
+	void ReceiveDirectory(int64_t DirectoryID);
+	void ReceiveFile(File *pFile);
+	void Compare(File &rFile, IOStream &rReceived, int Timeout,
+		BackupStoreFileDecryptContexts *pDecrypt);
+	void Discard(File *pFile);
+
+	BackupProtocolCallable &mrConnection;
+	bool mPipelined;
+	int mMaxRequests;
+	bool mQuickCompare;
+	bool mIgnoreAttributes;
+	box_time_t mLatestFileUploadTime;
+
+	// Requests sent and not received yet (or for files, not requested
+	// yet if requests aren't pipelined), and directory listings
+	// requested ahead of time, which are null until they're received,
+	// all of which are only used by the main thread
+	std::deque<Request> mRequested;
+	std::map<int64_t, BackupStoreDirectory *> mDirectories;
+
+	// Everything below is protected by mMutex
+	Mutex mMutex;
+	ConditionVariable mFileAdded;
+	ConditionVariable mFileDone;
+	// Files in the order they were added, the ones received and
+	// waiting to be compared, and how many of those there are, or
+	// which are being compared
+	std::deque<File *> mFiles;
+	std::deque<File *> mWaiting;
+	int mNumBuffered;
+	bool mStopping;
+
+	std::vector<Worker *> mWorkers;
+};
+
+#endif // BACKUPCLIENTCOMPAREQUEUE__H
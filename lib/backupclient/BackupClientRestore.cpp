@@ -16,11 +16,12 @@
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <string>
-#include <set>
 #include <limits.h>
 #include <stdio.h>
 #include <errno.h>
 
+#include "BackupClientRestoreJournal.h"
+#include "BackupClientRestoreQueue.h"
 #include "BackupClientRestore.h"
 #include "autogen_BackupProtocol.h"
 #include "CommonException.h"
@@ -28,176 +29,167 @@
 #include "IOStream.h"
 #include "BackupStoreDirectory.h"
 #include "BackupStoreFile.h"
-#include "CollectInBufferStream.h"
-#include "FileStream.h"
 #include "Utils.h"
 
 #include "MemLeakFindOn.h"
 
 #define MAX_BYTES_WRITTEN_BETWEEN_RESTORE_INFO_SAVES (128*1024)
 
-class RestoreResumeInfo
+// parameters structure
+typedef struct
 {
-public:
-	// constructor
-	RestoreResumeInfo()
-		: mNextLevelID(0),
-		  mpNextLevel(0)
-	{
-	}
-	
-	// destructor
-	~RestoreResumeInfo()
+	bool PrintDots;
+	bool RestoreDeleted;
+	bool ContinueAfterErrors;
+	bool ContinuedAfterError;
+	std::string mRestoreResumeInfoFilename;
+	BackupClientRestoreJournal mResumeInfo;
+	BackupClientRestoreQueue *mpQueue;
+} RestoreParams;
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreFinishFile(int64_t, const std::string &,
+//			 RestoreParams &, BackupClientRestoreJournal::Level &, int64_t &)
+//		Purpose: Records that a file has been restored (or failed
+//			 to be), and saves the restore info now and again
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int BackupClientRestoreFinishFile(int64_t ObjectID,
+	const std::string &rLocalFilename, RestoreParams &Params,
+	BackupClientRestoreJournal::Level &rLevel,
+	int64_t &rBytesWrittenSinceLastRestoreInfoSave)
+{
+	// Progress display?
+	if(Params.PrintDots)
 	{
-		delete mpNextLevel;
-		mpNextLevel = 0;
+		printf(".");
+		fflush(stdout);
 	}
-	
-	// Get a next level object
-	RestoreResumeInfo &AddLevel(int64_t ID, const std::string &rLocalName)
+
+	// Add it to the list of done itmes
+	rLevel.SetRestored(ObjectID);
+
+	// Save restore info?
+	int64_t fileSize;
+	bool exists = false;
+
+	try
 	{
-		ASSERT(mpNextLevel == 0 && mNextLevelID == 0);
-		mpNextLevel = new RestoreResumeInfo;
-		mNextLevelID = ID;
-		mNextLevelLocalName = rLocalName;
-		return *mpNextLevel;
+		exists = FileExists(rLocalFilename.c_str(), &fileSize,
+			true /* treat links as not existing */);
 	}
-	
-	// Remove the next level info
-	void RemoveLevel()
+	catch(std::exception &e)
 	{
-		ASSERT(mpNextLevel != 0 && mNextLevelID != 0);
-		delete mpNextLevel;
-		mpNextLevel = 0;
-		mNextLevelID = 0;
-		mNextLevelLocalName.erase();
+		BOX_ERROR("Failed to determine whether file exists: '" <<
+			rLocalFilename << "': " << e.what());
+
+		if (Params.ContinueAfterErrors)
+		{
+			Params.ContinuedAfterError = true;
+		}
+		else
+		{
+			return Restore_UnknownError;
+		}
 	}
-	
-	void Save(const std::string &rFilename) const
+	catch(...)
 	{
-		// TODO: use proper buffered streams when they're done
-		// Build info in memory buffer
-		CollectInBufferStream write;
-		
-		// Save this level
-		SaveLevel(write);
-	
-		// Store in file
-		write.SetForReading();
-		FileStream file(rFilename.c_str(), O_WRONLY | O_CREAT);
-		write.CopyStreamTo(file, IOStream::TimeOutInfinite, 8*1024 /* large buffer */);
-	}
+		BOX_ERROR("Failed to determine whether file exists: '" <<
+			rLocalFilename << "': unknown error");
 
-	void SaveLevel(IOStream &rWrite) const
-	{
-		// Write the restored objects
-		int64_t numObjects = mRestoredObjects.size();
-		rWrite.Write(&numObjects, sizeof(numObjects));
-		for(std::set<int64_t>::const_iterator i(mRestoredObjects.begin()); i != mRestoredObjects.end(); ++i)
+		if (Params.ContinueAfterErrors)
 		{
-			int64_t id = *i;
-			rWrite.Write(&id, sizeof(id));
-		}
-		
-		// Next level?
-		if(mpNextLevel != 0)
-		{
-			// ID
-			rWrite.Write(&mNextLevelID, sizeof(mNextLevelID));
-			// Name string
-			int32_t nsize = mNextLevelLocalName.size();
-			rWrite.Write(&nsize, sizeof(nsize));
-			rWrite.Write(mNextLevelLocalName.c_str(), nsize);
-			// And then the level itself
-			mpNextLevel->SaveLevel(rWrite);
+			Params.ContinuedAfterError = true;
 		}
 		else
 		{
-			// Just write a zero
-			int64_t zero = 0;
-			rWrite.Write(&zero, sizeof(zero));
+			return Restore_UnknownError;
 		}
 	}
 
-	// Not written to be efficient -- shouldn't be called very often.
-	bool Load(const std::string &rFilename)
+	if(exists)
 	{
-		// Delete and reset if necessary
-		if(mpNextLevel != 0)
+		// File exists...
+		rBytesWrittenSinceLastRestoreInfoSave += fileSize;
+
+		if(rBytesWrittenSinceLastRestoreInfoSave > MAX_BYTES_WRITTEN_BETWEEN_RESTORE_INFO_SAVES)
 		{
-			RemoveLevel();
+			// Save the restore info, in case it's needed later
+			try
+			{
+				Params.mResumeInfo.Checkpoint();
+			}
+			catch(std::exception &e)
+			{
+				BOX_ERROR("Failed to save resume info file '" <<
+					Params.mRestoreResumeInfoFilename <<
+					"': " << e.what());
+				return Restore_UnknownError;
+			}
+			catch(...)
+			{
+				BOX_ERROR("Failed to save resume info file '" <<
+					Params.mRestoreResumeInfoFilename <<
+					"': unknown error");
+				return Restore_UnknownError;
+			}
+
+			rBytesWrittenSinceLastRestoreInfoSave = 0;
 		}
-		
-		// Open file
-		FileStream file(rFilename.c_str());
-		
-		// Load this level
-		return LoadLevel(file);
 	}
-	
-	#define CHECKED_READ(x, s) if(!rRead.ReadFullBuffer(x, s, 0)) {return false;}
-	bool LoadLevel(IOStream &rRead)
-	{
-		// Load the restored objects list
-		mRestoredObjects.clear();
-		int64_t numObjects = 0;
-		CHECKED_READ(&numObjects, sizeof(numObjects));
-		for(int64_t o = 0; o < numObjects; ++o)
-		{
-			int64_t id;
-			CHECKED_READ(&id, sizeof(id));
-			mRestoredObjects.insert(id);
-		}
-
-		// ID of next level?
-		int64_t nextID = 0;
-		CHECKED_READ(&nextID, sizeof(nextID));
-		if(nextID != 0)
-		{
-			// Load the next level!
-			std::string name;
-			int32_t nsize = 0;
-			CHECKED_READ(&nsize, sizeof(nsize));
-			char n[PATH_MAX];
-			if(nsize > PATH_MAX) return false;
-			CHECKED_READ(n, nsize);
-			name.assign(n, nsize);
-			
-			// Create a new level
-			mpNextLevel = new RestoreResumeInfo;
-			mNextLevelID = nextID;
-			mNextLevelLocalName = name;
-			
-			// And ask it to read itself in
-			if(!mpNextLevel->LoadLevel(rRead))
+
+	return Restore_Complete;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreCollectFiles(RestoreParams &,
+//			 BackupClientRestoreJournal::Level &, int64_t &, bool)
+//		Purpose: Finishes the files restored by the queue so far, or
+//			 if Wait is true, waits for all of them to be restored
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static int BackupClientRestoreCollectFiles(RestoreParams &Params,
+	BackupClientRestoreJournal::Level &rLevel,
+	int64_t &rBytesWrittenSinceLastRestoreInfoSave, bool Wait)
+{
+	BackupClientRestoreQueue::Restored restored;
+	while(Params.mpQueue->GetNext(restored, Wait))
+	{
+		if(restored.mFailed)
+		{
+			BOX_ERROR("Failed to restore file '" <<
+				restored.mLocalFilename << "': " <<
+				restored.mFailureMessage);
+
+			if (Params.ContinueAfterErrors)
 			{
-				return false;
+				Params.ContinuedAfterError = true;
+			}
+			else
+			{
+				return Restore_UnknownError;
 			}
 		}
 
-		return true;
+		int result = BackupClientRestoreFinishFile(restored.mObjectID,
+			restored.mLocalFilename, Params, rLevel,
+			rBytesWrittenSinceLastRestoreInfoSave);
+		if(result != Restore_Complete)
+		{
+			return result;
+		}
 	}
 
-	// List of objects at this level which have been done already
-	std::set<int64_t> mRestoredObjects;
-	// Next level ID
-	int64_t mNextLevelID;
-	// Pointer to next level
-	RestoreResumeInfo *mpNextLevel;
-	// Local filename of next level
-	std::string mNextLevelLocalName;
-};
-
-// parameters structure
-typedef struct
-{
-	bool PrintDots;
-	bool RestoreDeleted;
-	bool ContinueAfterErrors;
-	bool ContinuedAfterError;
-	std::string mRestoreResumeInfoFilename;
-	RestoreResumeInfo mResumeInfo;
-} RestoreParams;
+	return Restore_Complete;
+}
 
 
 
@@ -213,26 +205,24 @@ typedef struct
 static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 	int64_t DirectoryID, const std::string &rRemoteDirectoryName,
 	const std::string &rLocalDirectoryName,
-	RestoreParams &Params, RestoreResumeInfo &rLevel)
+	RestoreParams &Params, BackupClientRestoreJournal::Level &rLevel)
 {
 	// If we're resuming... check that we haven't got a next level to
 	// look at
-	if(rLevel.mpNextLevel != 0)
+	if(rLevel.HasNextLevel())
 	{
 		// Recurse immediately
 		std::string localDirname(rLocalDirectoryName + 
 			DIRECTORY_SEPARATOR_ASCHAR + 
-			rLevel.mNextLevelLocalName);
-		BackupClientRestoreDir(rConnection, rLevel.mNextLevelID,
+			rLevel.GetNextLevelLocalName());
+		BackupClientRestoreDir(rConnection, rLevel.GetNextLevelID(),
 			rRemoteDirectoryName + '/' +
-			rLevel.mNextLevelLocalName, localDirname,
-			Params, *rLevel.mpNextLevel);
+			rLevel.GetNextLevelLocalName(), localDirname,
+			Params, rLevel.GetNextLevel());
 		
-		// Add it to the list of done itmes
-		rLevel.mRestoredObjects.insert(rLevel.mNextLevelID);
-
-		// Remove the level for the recursed directory
-		rLevel.RemoveLevel();
+		// Remove the level for the recursed directory, and add it
+		// to the list of done items
+		rLevel.FinishLevel();
 	}
 	
 	// Create the local directory, if not already done.
@@ -406,7 +396,7 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 	// Save the restore info, in case it's needed later
 	try
 	{
-		Params.mResumeInfo.Save(Params.mRestoreResumeInfoFilename);
+		Params.mResumeInfo.Checkpoint();
 	}
 	catch(std::exception &e)
 	{
@@ -499,8 +489,7 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 			!= 0)
 		{
 			// Check ID hasn't already been done
-			if(rLevel.mRestoredObjects.find(en->GetObjectID())
-				== rLevel.mRestoredObjects.end())
+			if(!rLevel.IsRestored(en->GetObjectID()))
 			{
 				// Local name
 				BackupStoreFilenameClear nm(en->GetName());
@@ -534,6 +523,26 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 					nm.GetClearFilename() << " (" <<
 					en->GetSizeInBlocks() << " blocks)");
 
+				if(Params.mpQueue != 0)
+				{
+					// Fetch it and decode it in the background
+					Params.mpQueue->Add(DirectoryID,
+						en->GetObjectID(), localFilename,
+						en->HasAttributes() ?
+							&en->GetAttributes() : 0,
+						en->GetSizeInBlocks());
+
+					int result = BackupClientRestoreCollectFiles(
+						Params, rLevel,
+						bytesWrittenSinceLastRestoreInfoSave,
+						false /* don't wait */);
+					if(result != Restore_Complete)
+					{
+						return result;
+					}
+					continue;
+				}
+
 				// Request it from the store
 				rConnection.QueryGetFile(DirectoryID,
 					en->GetObjectID());
@@ -593,105 +602,38 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 					}
 				}
 				
-				// Progress display?
-				if(Params.PrintDots)
+				int result = BackupClientRestoreFinishFile(
+					en->GetObjectID(), localFilename,
+					Params, rLevel,
+					bytesWrittenSinceLastRestoreInfoSave);
+				if(result != Restore_Complete)
 				{
-					printf(".");
-					fflush(stdout);
-				}
-
-				// Add it to the list of done itmes
-				rLevel.mRestoredObjects.insert(en->GetObjectID());
-				
-				// Save restore info?
-				int64_t fileSize;
-				bool exists = false;
-
-				try
-				{
-					exists = FileExists(
-						localFilename.c_str(),
-						&fileSize, 
-						true /* treat links as not 
-							existing */);
-				}
-				catch(std::exception &e)
-				{
-					BOX_ERROR("Failed to determine "
-						"whether file exists: '" <<
-						localFilename << "': " <<
-						e.what());
-
-					if (Params.ContinueAfterErrors)
-					{
-						Params.ContinuedAfterError = true;
-					}
-					else
-					{
-						return Restore_UnknownError;
-					}
-				}
-				catch(...)
-				{
-					BOX_ERROR("Failed to determine "
-						"whether file exists: '" <<
-						localFilename << "': "
-						"unknown error");
-
-					if (Params.ContinueAfterErrors)
-					{
-						Params.ContinuedAfterError = true;
-					}
-					else
-					{
-						return Restore_UnknownError;
-					}
-				}
-
-				if(exists)
-				{
-					// File exists...
-					bytesWrittenSinceLastRestoreInfoSave
-						+= fileSize;
-					
-					if(bytesWrittenSinceLastRestoreInfoSave > MAX_BYTES_WRITTEN_BETWEEN_RESTORE_INFO_SAVES)
-					{
-						// Save the restore info, in
-						// case it's needed later
-						try
-						{
-							Params.mResumeInfo.Save(Params.mRestoreResumeInfoFilename);
-						}
-						catch(std::exception &e)
-						{
-							BOX_ERROR("Failed to save resume info file '" <<
-								Params.mRestoreResumeInfoFilename <<
-								"': " << e.what());
-							return Restore_UnknownError;
-						}
-						catch(...)
-						{
-							BOX_ERROR("Failed to save resume info file '" <<
-								Params.mRestoreResumeInfoFilename <<
-								"': unknown error");
-							return Restore_UnknownError;
-						}
-
-						bytesWrittenSinceLastRestoreInfoSave = 0;
-					}
+					return result;
 				}
 			}
 		}
 	}
 
+	// Wait for the files still being restored, before leaving the
+	// directory, as the restore info can only describe one level at a
+	// time.
+	if(Params.mpQueue != 0)
+	{
+		int result = BackupClientRestoreCollectFiles(Params, rLevel,
+			bytesWrittenSinceLastRestoreInfoSave, true /* wait */);
+		if(result != Restore_Complete)
+		{
+			return result;
+		}
+	}
+
 	// Make sure the restore info has been saved	
 	if(bytesWrittenSinceLastRestoreInfoSave != 0)
 	{
 		// Save the restore info, in case it's needed later
 		try
 		{
-			Params.mResumeInfo.Save(
-				Params.mRestoreResumeInfoFilename);
+			Params.mResumeInfo.Checkpoint();
 		}
 		catch(std::exception &e)
 		{
@@ -734,8 +676,7 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 			!= 0)
 		{
 			// Check ID hasn't already been done
-			if(rLevel.mRestoredObjects.find(en->GetObjectID())
-				== rLevel.mRestoredObjects.end())
+			if(!rLevel.IsRestored(en->GetObjectID()))
 			{
 				// Local name
 				BackupStoreFilenameClear nm(en->GetName());
@@ -744,7 +685,7 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 					+ nm.GetClearFilename());
 				
 				// Add the level for the next entry
-				RestoreResumeInfo &rnextLevel(
+				BackupClientRestoreJournal::Level &rnextLevel(
 					rLevel.AddLevel(en->GetObjectID(),
 						nm.GetClearFilename()));
 				
@@ -765,11 +706,9 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 					return result;
 				}
 				
-				// Remove the level for the above call
-				rLevel.RemoveLevel();
-				
-				// Add it to the list of done itmes
-				rLevel.mRestoredObjects.insert(en->GetObjectID());
+				// Remove the level for the above call, and add
+				// it to the list of done items
+				rLevel.FinishLevel();
 			}
 		}
 	}
@@ -814,7 +753,7 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 //
 // Function
 //		Name:    BackupClientRestore(BackupProtocolCallable &, int64_t,
-//			 const char *, bool, bool, bool, bool, bool)
+//			 const char *, bool, bool, bool, bool, bool, int)
 //		Purpose: Restore a directory on the server to a local
 //			 directory on the disc. The local directory must not
 //			 already exist.
@@ -837,6 +776,10 @@ static int BackupClientRestoreDir(BackupProtocolCallable &rConnection,
 //			 on error, unless ContinueAfterError is true and
 //			 the error is recoverable, in which case it returns
 //			 Restore_CompleteWithErrors)
+//
+//			 If Threads is more than one, the files in each
+//			 directory are requested from the server several at
+//			 a time, and decoded on that many threads.
 //		Created: 23/11/03
 //
 // --------------------------------------------------------------------------
@@ -844,7 +787,7 @@ int BackupClientRestore(BackupProtocolCallable &rConnection,
 	int64_t DirectoryID, const std::string& RemoteDirectoryName,
 	const std::string& LocalDirectoryName, bool PrintDots, bool RestoreDeleted,
 	bool UndeleteAfterRestoreDeleted, bool Resume,
-	bool ContinueAfterErrors)
+	bool ContinueAfterErrors, int Threads)
 {
 	// Parameter block
 	RestoreParams params;
@@ -854,6 +797,7 @@ int BackupClientRestore(BackupProtocolCallable &rConnection,
 	params.ContinuedAfterError = false;
 	params.mRestoreResumeInfoFilename = LocalDirectoryName;
 	params.mRestoreResumeInfoFilename += ".boxbackupresume";
+	params.mpQueue = 0;
 
 	// Target exists?
 	int targetExistance = ObjectExists(LocalDirectoryName);
@@ -871,7 +815,20 @@ int BackupClientRestore(BackupProtocolCallable &rConnection,
 		}
 		
 		// Attempt to load the resume info file
-		if(!params.mResumeInfo.Load(params.mRestoreResumeInfoFilename))
+		bool loaded = false;
+		try
+		{
+			loaded = params.mResumeInfo.Resume(
+				params.mRestoreResumeInfoFilename);
+		}
+		catch(std::exception &e)
+		{
+			BOX_ERROR("Failed to load resume info file '" <<
+				params.mRestoreResumeInfoFilename << "': " <<
+				e.what());
+		}
+
+		if(!loaded)
 		{
 			// failed -- bad file, so things have gone a bit wrong
 			return Restore_TargetExists;
@@ -887,11 +844,27 @@ int BackupClientRestore(BackupProtocolCallable &rConnection,
 		// Don't do anything in this case!
 		return Restore_TargetExists;
 	}
+
+	if(!doingResume)
+	{
+		// Start a new journal, which is written when the local
+		// directory has been created
+		params.mResumeInfo.Create(params.mRestoreResumeInfoFilename);
+	}
 	
+	// Restore files in parallel?
+	std::auto_ptr<BackupClientRestoreQueue> apQueue;
+	if(Threads > 1)
+	{
+		apQueue.reset(new BackupClientRestoreQueue(rConnection,
+			Threads));
+		params.mpQueue = apQueue.get();
+	}
+
 	// Restore the directory
 	int result = BackupClientRestoreDir(rConnection, DirectoryID,
 		RemoteDirectoryName, LocalDirectoryName, params,
-		params.mResumeInfo);
+		params.mResumeInfo.GetRoot());
 	if (result != Restore_Complete)
 	{
 		return result;
@@ -912,7 +885,7 @@ int BackupClientRestore(BackupProtocolCallable &rConnection,
 	}
 	
 	// Delete the resume information file
-	::unlink(params.mRestoreResumeInfoFilename.c_str());
+	params.mResumeInfo.Delete();
 
 	return params.ContinuedAfterError ? Restore_CompleteWithErrors
 		: Restore_Complete;
@@ -0,0 +1,549 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientRestoreJournal.cpp
+//		Purpose: Append-only record of the progress of a restore,
+//			 so that it can be resumed
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+
+#include <algorithm>
+
+#include "BackupClientRestoreJournal.h"
+#include "CommonException.h"
+#include "FileStream.h"
+
+#include "MemLeakFindOn.h"
+
+// Every record in the journal starts with this header, in the byte order
+// of the machine, as journals are never moved between machines. Level
+// records are followed by the local name of the directory.
+typedef struct
+{
+	int32_t mType;
+	int32_t mNameSize;
+	int64_t mObjectID;
+} RestoreJournalRecord;
+
+// The first record of every journal
+#define RESTOREJOURNAL_MAGIC_VALUE	0x524a4e31	// RJN1
+
+enum
+{
+	// An object in the deepest level has been restored
+	RestoreJournal_Restored = 1,
+	// The restore has gone into a subdirectory of the deepest level
+	RestoreJournal_AddLevel = 2,
+	// The deepest level has been restored, and removed
+	RestoreJournal_FinishLevel = 3
+};
+
+// Compact the journal when it's this many times bigger than needed
+#define RESTOREJOURNAL_COMPACT_RATIO	4
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::BackupClientRestoreJournal()
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientRestoreJournal::BackupClientRestoreJournal()
+: mFileSize(0),
+  mRoot(*this)
+{
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::~BackupClientRestoreJournal()
+//		Purpose: Destructor. Doesn't write anything which hasn't
+//			 been checkpointed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientRestoreJournal::~BackupClientRestoreJournal()
+{
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Create(const std::string &)
+//		Purpose: Starts a new journal, for a restore which hasn't
+//			 done anything yet. The file is written (replacing any
+//			 which exists) at the first checkpoint.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::Create(const std::string &rFilename)
+{
+	mapFile.reset();
+	mFilename = rFilename;
+	mRoot.Clear();
+	mBuffer.clear();
+	mFileSize = 0;
+	AppendRecord(RESTOREJOURNAL_MAGIC_VALUE, 0);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Resume(const std::string &)
+//		Purpose: Loads the journal of an interrupted restore, and
+//			 rewrites it compacted, ready to carry on. Returns
+//			 false if the file isn't a journal, or is corrupt.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientRestoreJournal::Resume(const std::string &rFilename)
+{
+	mapFile.reset();
+	mFilename = rFilename;
+	mBuffer.clear();
+
+	bool ok = false;
+	{
+		FileStream file(rFilename);
+		std::vector<uint8_t> data(file.BytesLeftToRead());
+		ok = data.empty() || file.ReadFullBuffer(&data[0],
+			data.size(), 0 /* not interested in bytes read if
+			this fails */);
+		ok = ok && Read(data.empty() ? 0 : &data[0], data.size());
+	}
+
+	if(!ok)
+	{
+		mRoot.Clear();
+		return false;
+	}
+
+	// Drop the finished levels and anything half written
+	Compact();
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Read(const uint8_t *, int64_t)
+//		Purpose: Private. Replays the records of a journal, and
+//			 returns false if they don't make sense. A record cut
+//			 short at the end was being written when the restore
+//			 stopped, and is ignored.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientRestoreJournal::Read(const uint8_t *pData, int64_t Size)
+{
+	mRoot.Clear();
+
+	RestoreJournalRecord record;
+	if(Size < (int64_t)sizeof(record))
+	{
+		return false;
+	}
+	::memcpy(&record, pData, sizeof(record));
+	if(record.mType != RESTOREJOURNAL_MAGIC_VALUE)
+	{
+		return false;
+	}
+
+	std::vector<Level *> levels;
+	levels.push_back(&mRoot);
+	int64_t position = sizeof(record);
+	while(position + (int64_t)sizeof(record) <= Size)
+	{
+		::memcpy(&record, pData + position, sizeof(record));
+		position += sizeof(record);
+
+		switch(record.mType)
+		{
+		case RestoreJournal_Restored:
+			levels.back()->mRestored.push_back(record.mObjectID);
+			break;
+
+		case RestoreJournal_AddLevel:
+			{
+				if(record.mNameSize < 0 || record.mNameSize > PATH_MAX ||
+					levels.back()->mpNextLevel != 0)
+				{
+					return false;
+				}
+				if(position + record.mNameSize > Size)
+				{
+					// Cut short
+					position = Size;
+					break;
+				}
+
+				Level *plevel = new Level(*this);
+				levels.back()->mpNextLevel = plevel;
+				levels.back()->mNextLevelID = record.mObjectID;
+				levels.back()->mNextLevelLocalName.assign(
+					(const char *)pData + position,
+					record.mNameSize);
+				levels.push_back(plevel);
+				position += record.mNameSize;
+			}
+			break;
+
+		case RestoreJournal_FinishLevel:
+			{
+				if(levels.size() < 2)
+				{
+					return false;
+				}
+				levels.pop_back();
+				Level &rparent(*levels.back());
+				if(rparent.mNextLevelID != record.mObjectID)
+				{
+					return false;
+				}
+				delete rparent.mpNextLevel;
+				rparent.mpNextLevel = 0;
+				rparent.mNextLevelID = 0;
+				rparent.mNextLevelLocalName.erase();
+				rparent.mRestored.push_back(record.mObjectID);
+			}
+			break;
+
+		default:
+			return false;
+		}
+	}
+
+	// Sort the objects restored at each level, so that they can be
+	// looked up. The directories being restored count as restored
+	// already, as they're finished before anything else is done.
+	for(size_t l = 0; l < levels.size(); ++l)
+	{
+		Level &rlevel(*levels[l]);
+		if(rlevel.mpNextLevel != 0)
+		{
+			rlevel.mRestored.push_back(rlevel.mNextLevelID);
+		}
+		std::sort(rlevel.mRestored.begin(), rlevel.mRestored.end());
+		rlevel.mRestored.erase(std::unique(rlevel.mRestored.begin(),
+			rlevel.mRestored.end()), rlevel.mRestored.end());
+		rlevel.mNumSorted = rlevel.mRestored.size();
+	}
+
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Checkpoint()
+//		Purpose: Writes the changes made since the last checkpoint
+//			 to the file, or compacts it if it has grown too big.
+//			 Throws exceptions if the file can't be written.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::Checkpoint()
+{
+	if(mBuffer.empty())
+	{
+		return;
+	}
+
+	if(mFileSize > BACKUPCLIENTRESTOREJOURNAL_MIN_COMPACT_SIZE &&
+		mFileSize > RESTOREJOURNAL_COMPACT_RATIO * GetCompactedSize())
+	{
+		Compact();
+		return;
+	}
+
+	if(mapFile.get() == 0)
+	{
+		mapFile.reset(new FileStream(mFilename,
+			O_WRONLY | O_CREAT | O_TRUNC));
+	}
+	mapFile->Write(mBuffer.c_str(), mBuffer.size());
+	mBuffer.clear();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Delete()
+//		Purpose: Deletes the journal, when the restore is complete
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::Delete()
+{
+	mapFile.reset();
+	mBuffer.clear();
+	::unlink(mFilename.c_str());
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::AppendRecord(int32_t, int64_t, const std::string &)
+//		Purpose: Private. Adds a record to be written at the next
+//			 checkpoint.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::AppendRecord(int32_t Type, int64_t ObjectID,
+	const std::string &rName)
+{
+	RestoreJournalRecord record;
+	record.mType = Type;
+	record.mNameSize = rName.size();
+	record.mObjectID = ObjectID;
+	mBuffer.append((const char *)&record, sizeof(record));
+	mBuffer.append(rName);
+	mFileSize += sizeof(record) + rName.size();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::AppendLevel(const Level &)
+//		Purpose: Private. Adds the records which describe a level,
+//			 and the levels below it, from scratch.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::AppendLevel(const Level &rLevel)
+{
+	for(size_t r = 0; r < rLevel.mRestored.size(); ++r)
+	{
+		if(rLevel.mpNextLevel == 0 ||
+			rLevel.mRestored[r] != rLevel.mNextLevelID)
+		{
+			AppendRecord(RestoreJournal_Restored, rLevel.mRestored[r]);
+		}
+	}
+
+	if(rLevel.mpNextLevel != 0)
+	{
+		AppendRecord(RestoreJournal_AddLevel, rLevel.mNextLevelID,
+			rLevel.mNextLevelLocalName);
+		AppendLevel(*rLevel.mpNextLevel);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::GetCompactedSize()
+//		Purpose: Private. Returns the size the journal would be if
+//			 it were compacted now.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupClientRestoreJournal::GetCompactedSize() const
+{
+	int64_t size = sizeof(RestoreJournalRecord);
+	for(const Level *plevel = &mRoot; plevel != 0;
+		plevel = plevel->mpNextLevel)
+	{
+		size += plevel->mRestored.size() * sizeof(RestoreJournalRecord);
+		if(plevel->mpNextLevel != 0)
+		{
+			size += sizeof(RestoreJournalRecord) +
+				plevel->mNextLevelLocalName.size();
+		}
+	}
+	return size;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Compact()
+//		Purpose: Private. Rewrites the journal with just the records
+//			 needed to describe the restore now, and replaces the
+//			 file with it, so that it's never found half written.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::Compact()
+{
+	mBuffer.clear();
+	mFileSize = 0;
+	AppendRecord(RESTOREJOURNAL_MAGIC_VALUE, 0);
+	AppendLevel(mRoot);
+
+	std::string tempFilename(mFilename + ".tmp");
+	{
+		FileStream file(tempFilename, O_WRONLY | O_CREAT | O_TRUNC);
+		file.Write(mBuffer.c_str(), mBuffer.size());
+	}
+	mBuffer.clear();
+
+	// Close the old file first, as open files can't be replaced on
+	// some platforms
+	mapFile.reset();
+	if(::rename(tempFilename.c_str(), mFilename.c_str()) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to replace restore journal",
+			mFilename, CommonException, OSFileError);
+	}
+
+	mapFile.reset(new FileStream(mFilename, O_WRONLY));
+	mapFile->Seek(0, IOStream::SeekType_End);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Level::Level(BackupClientRestoreJournal &)
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientRestoreJournal::Level::Level(BackupClientRestoreJournal &rJournal)
+: mrJournal(rJournal),
+  mNumSorted(0),
+  mNextLevelID(0),
+  mpNextLevel(0)
+{
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Level::~Level()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientRestoreJournal::Level::~Level()
+{
+	delete mpNextLevel;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Level::Clear()
+//		Purpose: Private. Forgets everything at this level and below.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::Level::Clear()
+{
+	delete mpNextLevel;
+	mpNextLevel = 0;
+	mNextLevelID = 0;
+	mNextLevelLocalName.erase();
+	mRestored.clear();
+	mNumSorted = 0;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Level::IsRestored(int64_t)
+//		Purpose: Returns true if the object was restored at this
+//			 level before the restore was resumed. (Objects
+//			 restored since aren't looked up, as the restore
+//			 doesn't come back to them.)
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientRestoreJournal::Level::IsRestored(int64_t ObjectID) const
+{
+	return std::binary_search(mRestored.begin(),
+		mRestored.begin() + mNumSorted, ObjectID);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Level::SetRestored(int64_t)
+//		Purpose: Records that an object in this level has been
+//			 restored.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::Level::SetRestored(int64_t ObjectID)
+{
+	ASSERT(mpNextLevel == 0);
+	mRestored.push_back(ObjectID);
+	mrJournal.AppendRecord(RestoreJournal_Restored, ObjectID);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Level::AddLevel(int64_t, const std::string &)
+//		Purpose: Records that the restore has gone into the given
+//			 subdirectory of this level, and returns its level.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientRestoreJournal::Level &BackupClientRestoreJournal::Level::AddLevel(
+	int64_t ID, const std::string &rLocalName)
+{
+	ASSERT(mpNextLevel == 0 && mNextLevelID == 0);
+	mpNextLevel = new Level(mrJournal);
+	mNextLevelID = ID;
+	mNextLevelLocalName = rLocalName;
+	mrJournal.AppendRecord(RestoreJournal_AddLevel, ID, rLocalName);
+	return *mpNextLevel;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreJournal::Level::FinishLevel()
+//		Purpose: Records that the subdirectory of this level has
+//			 been restored, and removes its level.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreJournal::Level::FinishLevel()
+{
+	ASSERT(mpNextLevel != 0 && mNextLevelID != 0);
+	int64_t id = mNextLevelID;
+	delete mpNextLevel;
+	mpNextLevel = 0;
+	mNextLevelID = 0;
+	mNextLevelLocalName.erase();
+
+	// It's already counted as restored if the restore was resumed in it
+	if(!IsRestored(id))
+	{
+		mRestored.push_back(id);
+	}
+	mrJournal.AppendRecord(RestoreJournal_FinishLevel, id);
+}
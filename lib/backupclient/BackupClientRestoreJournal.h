@@ -0,0 +1,129 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientRestoreJournal.h
+//		Purpose: Append-only record of the progress of a restore,
+//			 so that it can be resumed
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTRESTOREJOURNAL__H
+#define BACKUPCLIENTRESTOREJOURNAL__H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+class FileStream;
+
+// Journals smaller than this are never compacted
+#define BACKUPCLIENTRESTOREJOURNAL_MIN_COMPACT_SIZE	(1024*1024)
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientRestoreJournal
+//		Purpose: Records which objects have been restored, in the
+//			 directory being restored and in each directory above
+//			 it, so that an interrupted restore can carry on where
+//			 it left off.
+//
+//			 Each change is appended to the journal file as a small
+//			 record, and the records are written to disc whenever
+//			 Checkpoint() is called, so a checkpoint costs no more
+//			 than the changes since the last one. Records of
+//			 directories which have been finished are dropped when
+//			 the journal is compacted, which happens when it has
+//			 grown to several times the size of what it describes.
+//			 After a crash the file is read back through a memory
+//			 mapping, and any record left half written is ignored.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientRestoreJournal
+{
+public:
+	BackupClientRestoreJournal();
+	~BackupClientRestoreJournal();
+private:
+	// No copying allowed
+	BackupClientRestoreJournal(const BackupClientRestoreJournal &);
+	BackupClientRestoreJournal &operator=(const BackupClientRestoreJournal &);
+
+public:
+	// ------------------------------------------------------------------
+	//
+	// Class
+	//		Name:    BackupClientRestoreJournal::Level
+	//		Purpose: The progress of the restore in one directory,
+	//			 and the subdirectory being restored, if any.
+	//			 Changes are only made to the deepest level.
+	//		Created: 2026/10/18
+	//
+	// ------------------------------------------------------------------
+	class Level
+	{
+		friend class BackupClientRestoreJournal;
+	private:
+		Level(BackupClientRestoreJournal &rJournal);
+		// No copying allowed
+		Level(const Level &);
+		Level &operator=(const Level &);
+	public:
+		~Level();
+
+		bool IsRestored(int64_t ObjectID) const;
+		void SetRestored(int64_t ObjectID);
+		Level &AddLevel(int64_t ID, const std::string &rLocalName);
+		void FinishLevel();
+
+		bool HasNextLevel() const { return mpNextLevel != 0; }
+		Level &GetNextLevel() { return *mpNextLevel; }
+		int64_t GetNextLevelID() const { return mNextLevelID; }
+		const std::string &GetNextLevelLocalName() const
+		{
+			return mNextLevelLocalName;
+		}
+
+	private:
+		void Clear();
+
+		BackupClientRestoreJournal &mrJournal;
+		// Objects restored at this level. The first mNumSorted were
+		// read from the journal, and are sorted to look them up;
+		// those restored since are kept only to compact the journal.
+		std::vector<int64_t> mRestored;
+		size_t mNumSorted;
+		int64_t mNextLevelID;
+		Level *mpNextLevel;
+		std::string mNextLevelLocalName;
+	};
+	friend class Level;
+
+	void Create(const std::string &rFilename);
+	bool Resume(const std::string &rFilename);
+	void Checkpoint();
+	void Delete();
+
+	Level &GetRoot() { return mRoot; }
+	int64_t GetFileSize() const { return mFileSize; }
+
+private:
+	bool Read(const uint8_t *pData, int64_t Size);
+	void AppendRecord(int32_t Type, int64_t ObjectID,
+		const std::string &rName = std::string());
+	void AppendLevel(const Level &rLevel);
+	int64_t GetCompactedSize() const;
+	void Compact();
+
+	std::string mFilename;
+	std::auto_ptr<FileStream> mapFile;
+	// Records not written to the file yet
+	std::string mBuffer;
+	// Size of the file once the buffer has been written
+	int64_t mFileSize;
+	Level mRoot;
+};
+
+#endif // BACKUPCLIENTRESTOREJOURNAL__H
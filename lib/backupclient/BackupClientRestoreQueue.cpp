@@ -0,0 +1,414 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientRestoreQueue.cpp
+//		Purpose: Fetch files to restore with several requests in
+//			 flight, and decode them on several threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include "BackupClientRestoreQueue.h"
+#include "autogen_BackupProtocol.h"
+#include "autogen_ConnectionException.h"
+#include "BackupClientFileAttributes.h"
+#include "BackupStoreFile.h"
+#include "CollectInBufferStream.h"
+
+#include "MemLeakFindOn.h"
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::BackupClientRestoreQueue(BackupProtocolCallable &, int)
+//		Purpose: Constructor. Starts the given number of threads to
+//			 decode files, and keeps up to twice that many files
+//			 requested or buffered.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientRestoreQueue::BackupClientRestoreQueue(
+	BackupProtocolCallable &rConnection, int Threads)
+: mrConnection(rConnection),
+  mPipelined(dynamic_cast<BackupProtocolClient *>(&rConnection) != 0),
+  mMaxFiles(Threads * 2),
+  mNumBuffered(0),
+  mStopping(false)
+{
+	try
+	{
+		for(int t = 0; t < Threads; ++t)
+		{
+			mWorkers.push_back(new Worker(*this));
+			mWorkers.back()->Start();
+		}
+	}
+	catch(...)
+	{
+		StopWorkers();
+		throw;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::~BackupClientRestoreQueue()
+//		Purpose: Destructor. Waits for the files being decoded, and
+//			 discards the replies to any requests still in flight,
+//			 so that the connection can still be used.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientRestoreQueue::~BackupClientRestoreQueue()
+{
+	StopWorkers();
+
+	try
+	{
+		while(mPipelined && !mRequested.empty())
+		{
+			mRequested.pop_front();
+			std::auto_ptr<BackupProtocolMessage> reply(
+				mrConnection.Receive());
+			if(reply->GetType() == BackupProtocolSuccess::TypeID)
+			{
+				mrConnection.ReceiveStream()->Flush();
+			}
+		}
+	}
+	catch(...)
+	{
+		// The connection has failed anyway
+	}
+
+	for(size_t f = 0; f < mFiles.size(); ++f)
+	{
+		Discard(mFiles[f]);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::StopWorkers()
+//		Purpose: Private. Tells the threads to finish, and waits for
+//			 them.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreQueue::StopWorkers()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mFileAdded.Broadcast();
+	}
+
+	for(size_t w = 0; w < mWorkers.size(); ++w)
+	{
+		if(mWorkers[w]->IsStarted())
+		{
+			try
+			{
+				mWorkers[w]->Join();
+			}
+			catch(...)
+			{
+				// Failures were recorded in the files
+			}
+		}
+		delete mWorkers[w];
+	}
+	mWorkers.clear();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::Add(int64_t, int64_t, const std::string &, const StreamableMemBlock *, int64_t)
+//		Purpose: Adds a file to restore, from the encoded file with
+//			 the given ID and size on the store, which must not
+//			 exist locally. If pAttributes isn't null, they're
+//			 set instead of those stored with the file. May wait
+//			 for earlier files to be received or decoded.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreQueue::Add(int64_t DirectoryID, int64_t ObjectID,
+	const std::string &rLocalFilename,
+	const StreamableMemBlock *pAttributes, int64_t SizeInBlocks)
+{
+	while((int)mRequested.size() >= mMaxFiles)
+	{
+		ReceiveNext();
+	}
+
+	File *pfile = new File;
+	pfile->mDirectoryID = DirectoryID;
+	pfile->mObjectID = ObjectID;
+	pfile->mLocalFilename = rLocalFilename;
+	pfile->mpAttributes = 0;
+	pfile->mDecodeInPlace =
+		(SizeInBlocks > BACKUPCLIENTRESTOREQUEUE_MAX_BUFFERED_BLOCKS);
+	pfile->mpEncoded = 0;
+	pfile->mReceived = false;
+	pfile->mDone = false;
+	pfile->mFailed = false;
+
+	try
+	{
+		if(pAttributes != 0)
+		{
+			pfile->mpAttributes =
+				new BackupClientFileAttributes(*pAttributes);
+		}
+
+		if(mPipelined)
+		{
+			mrConnection.Send(BackupProtocolGetFile(DirectoryID,
+				ObjectID));
+		}
+	}
+	catch(...)
+	{
+		Discard(pfile);
+		throw;
+	}
+
+	mRequested.push_back(pfile);
+	MutexLock lock(mMutex);
+	mFiles.push_back(pfile);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::GetNext(Restored &, bool)
+//		Purpose: Returns true, and the details of the oldest file
+//			 added, once it has been restored, or if it failed to
+//			 be. If Wait is false, returns false if it hasn't been
+//			 yet. Returns false if there are no files.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupClientRestoreQueue::GetNext(Restored &rRestoredOut, bool Wait)
+{
+	File *pfile = 0;
+	while(pfile == 0)
+	{
+		bool received = true;
+		{
+			MutexLock lock(mMutex);
+			if(mFiles.empty())
+			{
+				return false;
+			}
+
+			if(mFiles.front()->mDone)
+			{
+				pfile = mFiles.front();
+				mFiles.pop_front();
+			}
+			else if(!Wait)
+			{
+				return false;
+			}
+			else if(mFiles.front()->mReceived)
+			{
+				mFileDone.Wait(mMutex);
+			}
+			else
+			{
+				received = false;
+			}
+		}
+
+		if(!received)
+		{
+			// It has to be received before it can be decoded
+			ReceiveNext();
+		}
+	}
+
+	rRestoredOut.mObjectID = pfile->mObjectID;
+	rRestoredOut.mLocalFilename = pfile->mLocalFilename;
+	rRestoredOut.mFailed = pfile->mFailed;
+	rRestoredOut.mFailureMessage = pfile->mFailureMessage;
+	Discard(pfile);
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::ReceiveNext()
+//		Purpose: Private. Receives the oldest file requested from the
+//			 store (or requests and receives it, if requests aren't
+//			 pipelined), and either decodes it straight away or
+//			 buffers it for the workers.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreQueue::ReceiveNext()
+{
+	ASSERT(!mRequested.empty());
+	File *pfile = mRequested.front();
+	mRequested.pop_front();
+
+	if(mPipelined)
+	{
+		std::auto_ptr<BackupProtocolMessage> reply(mrConnection.Receive());
+		int type, subType;
+		if(reply->IsError(type, subType))
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_UnexpectedReply, "GetFile command "
+				"failed: received error " <<
+				((BackupProtocolError &)*reply).GetMessage());
+		}
+		else if(reply->GetType() != BackupProtocolSuccess::TypeID)
+		{
+			THROW_EXCEPTION_MESSAGE(ConnectionException,
+				Protocol_UnexpectedReply, "GetFile command "
+				"failed: received unexpected response type " <<
+				reply->GetType());
+		}
+	}
+	else
+	{
+		mrConnection.QueryGetFile(pfile->mDirectoryID,
+			pfile->mObjectID);
+	}
+
+	std::auto_ptr<IOStream> encoded(mrConnection.ReceiveStream());
+
+	if(pfile->mDecodeInPlace)
+	{
+		// Too big to buffer, so decode it from the connection, while
+		// the workers carry on with the files before it
+		Decode(*pfile, *encoded, mrConnection.GetTimeout(), NULL);
+		if(pfile->mFailed)
+		{
+			// Keep the connection usable
+			encoded->Flush();
+		}
+
+		MutexLock lock(mMutex);
+		pfile->mReceived = true;
+		pfile->mDone = true;
+		mFileDone.Broadcast();
+		return;
+	}
+
+	pfile->mpEncoded = new CollectInBufferStream;
+	encoded->CopyStreamTo(*pfile->mpEncoded, mrConnection.GetTimeout());
+	pfile->mpEncoded->SetForReading();
+
+	MutexLock lock(mMutex);
+	while(mNumBuffered >= mMaxFiles)
+	{
+		mFileDone.Wait(mMutex);
+	}
+	pfile->mReceived = true;
+	mWaiting.push_back(pfile);
+	mNumBuffered++;
+	mFileAdded.Signal();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::RunWorker(BackupStoreFileDecryptContexts &)
+//		Purpose: Private. Decodes files as they're received, until the
+//			 queue is destroyed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreQueue::RunWorker(
+	BackupStoreFileDecryptContexts &rDecrypt)
+{
+	MutexLock lock(mMutex);
+	while(true)
+	{
+		while(mWaiting.empty() && !mStopping)
+		{
+			mFileAdded.Wait(mMutex);
+		}
+		if(mStopping)
+		{
+			return;
+		}
+
+		File *pfile = mWaiting.front();
+		mWaiting.pop_front();
+
+		// Decode without holding the lock
+		mMutex.Unlock();
+		Decode(*pfile, *pfile->mpEncoded, IOStream::TimeOutInfinite,
+			&rDecrypt);
+		delete pfile->mpEncoded;
+		pfile->mpEncoded = 0;
+		mMutex.Lock();
+
+		pfile->mDone = true;
+		mNumBuffered--;
+		mFileDone.Broadcast();
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::Decode(File &, IOStream &, int, BackupStoreFileDecryptContexts *)
+//		Purpose: Private. Decodes a file, recording in it whether that
+//			 failed, and why.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreQueue::Decode(File &rFile, IOStream &rEncoded,
+	int Timeout, BackupStoreFileDecryptContexts *pDecrypt)
+{
+	try
+	{
+		BackupStoreFile::DecodeFile(rEncoded,
+			rFile.mLocalFilename.c_str(), Timeout,
+			rFile.mpAttributes, pDecrypt);
+	}
+	catch(std::exception &e)
+	{
+		rFile.mFailed = true;
+		rFile.mFailureMessage = e.what();
+	}
+	catch(...)
+	{
+		rFile.mFailed = true;
+		rFile.mFailureMessage = "unknown error";
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientRestoreQueue::Discard(File *)
+//		Purpose: Private. Frees a file and its buffers.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientRestoreQueue::Discard(File *pFile)
+{
+	delete pFile->mpAttributes;
+	delete pFile->mpEncoded;
+	delete pFile;
+}
@@ -0,0 +1,131 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientRestoreQueue.h
+//		Purpose: Fetch files to restore with several requests in
+//			 flight, and decode them on several threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTRESTOREQUEUE__H
+#define BACKUPCLIENTRESTOREQUEUE__H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "BackupStoreFileDecryptContexts.h"
+#include "Thread.h"
+
+class BackupClientFileAttributes;
+class BackupProtocolCallable;
+class CollectInBufferStream;
+class StreamableMemBlock;
+
+// Encoded files bigger than this many blocks on the store (1 MB with the
+// usual 4 KB blocks) are decoded straight from the connection, instead of
+// being buffered in memory for the worker threads.
+#define BACKUPCLIENTRESTOREQUEUE_MAX_BUFFERED_BLOCKS	256
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientRestoreQueue
+//		Purpose: Restores files from the store, keeping several GetFile
+//			 requests in flight on the connection, so that the
+//			 restore isn't limited by its latency, and decoding and
+//			 writing the files on a pool of worker threads. Files
+//			 are returned by GetNext() in the order they were added.
+//
+//			 Requests are only pipelined on real connections to
+//			 the server. Nothing else may use the connection until
+//			 every file added has been returned by GetNext().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientRestoreQueue
+{
+public:
+	BackupClientRestoreQueue(BackupProtocolCallable &rConnection,
+		int Threads);
+	~BackupClientRestoreQueue();
+private:
+	// No copying allowed
+	BackupClientRestoreQueue(const BackupClientRestoreQueue &);
+	BackupClientRestoreQueue &operator=(const BackupClientRestoreQueue &);
+
+public:
+	typedef struct
+	{
+		int64_t mObjectID;
+		std::string mLocalFilename;
+		bool mFailed;
+		std::string mFailureMessage;
+	} Restored;
+
+	void Add(int64_t DirectoryID, int64_t ObjectID,
+		const std::string &rLocalFilename,
+		const StreamableMemBlock *pAttributes, int64_t SizeInBlocks);
+	bool GetNext(Restored &rRestoredOut, bool Wait);
+	bool IsEmpty() const { return mFiles.empty(); }
+
+private:
+	typedef struct
+	{
+		int64_t mDirectoryID;
+		int64_t mObjectID;
+		std::string mLocalFilename;
+		BackupClientFileAttributes *mpAttributes;
+		bool mDecodeInPlace;
+		CollectInBufferStream *mpEncoded;
+		bool mReceived;
+		bool mDone;
+		bool mFailed;
+		std::string mFailureMessage;
+	} File;
+
+	class Worker : public Thread
+	{
+	public:
+		Worker(BackupClientRestoreQueue &rQueue)
+		: mrQueue(rQueue)
+		{ }
+	protected:
+		virtual void Run() { mrQueue.RunWorker(mDecrypt); }
+	private:
+		BackupClientRestoreQueue &mrQueue;
+		BackupStoreFileDecryptContexts mDecrypt;
+	};
+
+	void RunWorker(BackupStoreFileDecryptContexts &rDecrypt);
+	void StopWorkers();
+	void ReceiveNext();
+	void Decode(File &rFile, IOStream &rEncoded, int Timeout,
+		BackupStoreFileDecryptContexts *pDecrypt);
+	void Discard(File *pFile);
+
+	BackupProtocolCallable &mrConnection;
+	bool mPipelined;
+	int mMaxFiles;
+
+	// Files requested from the store, and not received yet, which is
+	// only used by the main thread
+	std::deque<File *> mRequested;
+
+	// Everything below is protected by mMutex
+	Mutex mMutex;
+	ConditionVariable mFileAdded;
+	ConditionVariable mFileDone;
+	// Files in the order they were added, the ones received and
+	// waiting to be decoded, and how many of those there are, or
+	// which are being decoded
+	std::deque<File *> mFiles;
+	std::deque<File *> mWaiting;
+	int mNumBuffered;
+	bool mStopping;
+
+	std::vector<Worker *> mWorkers;
+};
+
+#endif // BACKUPCLIENTRESTOREQUEUE__H
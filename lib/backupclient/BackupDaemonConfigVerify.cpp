@@ -26,6 +26,8 @@ static const ConfigurationVerifyKey backuplocationkeys[] =
 	ConfigurationVerifyKey("AlwaysIncludeFilesRegex", ConfigTest_MultiValueAllowed),
 	ConfigurationVerifyKey("AlwaysIncludeDir", ConfigTest_MultiValueAllowed),
 	ConfigurationVerifyKey("AlwaysIncludeDirsRegex", ConfigTest_MultiValueAllowed),
+	ConfigurationVerifyKey("Compression", 0),
+	ConfigurationVerifyKey("CompressionLevel", ConfigTest_IsInt),
 	ConfigurationVerifyKey("Path", ConfigTest_Exists | ConfigTest_LastEntry)
 };
 
@@ -107,6 +109,15 @@ static const ConfigurationVerifyKey verifyrootkeys[] =
 		ConfigTest_Exists | ConfigTest_IsInt),
 	ConfigurationVerifyKey("DiffingUploadSizeThreshold",
 		ConfigTest_Exists | ConfigTest_IsInt),
+	ConfigurationVerifyKey("DiffingThreads", ConfigTest_IsInt, 1),
+	ConfigurationVerifyKey("EncodingThreads", ConfigTest_IsInt, 1),
+	// number of block sizes to search for in parallel when diffing
+	ConfigurationVerifyKey("ContentDefinedChunking", ConfigTest_IsBool, false),
+	// split new data into content defined chunks
+	ConfigurationVerifyKey("LargeBlocks", ConfigTest_IsBool, false),
+	// use blocks bigger than 512 KB for huge files
+	ConfigurationVerifyKey("BlockIndexCacheSize", ConfigTest_IsInt, 0),
+	// bytes of block indexes of uploaded files to keep for diffing
 	ConfigurationVerifyKey("ExtendedLogging", ConfigTest_IsBool, false),
 	// extended log to syslog
 	ConfigurationVerifyKey("ExtendedLogFile", 0),
@@ -65,6 +65,9 @@ void BackupStoreDirectory::Dump(void *clibFileHandle, bool ToTrace)
 {
 	FILE *file = (FILE*)clibFileHandle;
 
+	// Don't show the empty slots of deleted entries
+	RemoveDeletedSlots();
+
 	OutputLine(file, ToTrace, "Directory object.\nObject ID: %llx\nContainer ID: %llx\nNumber entries: %d\n"\
 		"Attributes mod time: %llx\nAttributes size: %d\n", mObjectID, mContainerID, mEntries.size(),
 		mAttributesModTime, mAttributes.GetSize());
@@ -188,6 +191,7 @@ void BackupStoreFile::DumpFile(void *clibFileHandle, bool ToTrace, IOStream &rFi
 	file_BlockIndexHeader bhdr;
 	rFile.ReadFullBuffer(&bhdr, sizeof(bhdr), 0);
 	if(bhdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+		&& bhdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2)
 		&& bhdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0))
 	{
 		OutputLine(file, ToTrace, "WARNING: Block header doesn't have the correct magic\n");
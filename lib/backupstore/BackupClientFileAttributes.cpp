@@ -38,6 +38,7 @@
 #include "CipherContext.h"
 #include "CipherBlowfish.h"
 #include "MD5Digest.h"
+#include "Thread.h"
 
 #include "MemLeakFindOn.h"
 
@@ -100,6 +101,9 @@ namespace
 {
 	CipherContext sBlowfishEncrypt;
 	CipherContext sBlowfishDecrypt;
+	// Files may be decoded on several threads, which all decrypt
+	// their attributes with the one context
+	Mutex sBlowfishDecryptMutex;
 	uint8_t sAttributeHashSecret[MAX_ATTRIBUTE_HASH_SECRET_LENGTH];
 	int sAttributeHashSecretLength = 0;
 }
@@ -1076,10 +1080,9 @@ StreamableMemBlock *BackupClientFileAttributes::MakeClear(const StreamableMemBlo
 			THROW_EXCEPTION(BackupStoreException, EncryptedAttributesHaveUnknownEncoding);
 		}
 
-		// Set IV
+		// Set IV and decrypt
+		MutexLock lock(sBlowfishDecryptMutex);
 		sBlowfishDecrypt.SetIV(encBlock + 1);
-		
-		// Decrypt
 		int decryptedSize = sBlowfishDecrypt.TransformBlock(pdecrypted->GetBuffer(), maxDecryptedSize, encBlock + 1 + ivSize, rEncrypted.GetSize() - (ivSize + 1));
 
 		// Resize block to fit
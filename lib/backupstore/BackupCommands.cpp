@@ -15,12 +15,14 @@
 #include "autogen_BackupProtocol.h"
 #include "autogen_RaidFileException.h"
 #include "BackupConstants.h"
+#include "BackupStoreCombinedFileCache.h"
 #include "BackupStoreContext.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreInfo.h"
+#include "BackupStoreObjectMagic.h"
 #include "BufferedStream.h"
 #include "CollectInBufferStream.h"
 #include "FileStream.h"
@@ -110,7 +112,7 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolReplyable::HandleException(Bo
 // Function
 //		Name:    BackupProtocolVersion::DoCommand(Protocol &,
 //			 BackupStoreContext &)
-//		Purpose: Return the current version, or an error if the
+//		Purpose: Return the requested version, or an error if the
 //			 requested version isn't allowed
 //		Created: 2003/08/20
 //
@@ -119,8 +121,9 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolVersion::DoCommand(BackupProt
 {
 	CHECK_PHASE(Phase_Version)
 
-	// Correct version?
-	if(mVersion != BACKUP_STORE_SERVER_VERSION)
+	// Supported version?
+	if(mVersion < BACKUP_STORE_SERVER_MIN_VERSION ||
+		mVersion > BACKUP_STORE_SERVER_VERSION)
 	{
 		return PROTOCOL_ERROR(Err_WrongVersion);
 	}
@@ -128,8 +131,8 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolVersion::DoCommand(BackupProt
 	// Mark the next phase
 	rContext.SetPhase(BackupStoreContext::Phase_Login);
 
-	// Return our version
-	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolVersion(BACKUP_STORE_SERVER_VERSION));
+	// Agree to speak the version the client asked for
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolVersion(mVersion));
 }
 
 // --------------------------------------------------------------------------
@@ -329,6 +332,26 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolGetObject::DoCommand(BackupPr
 	// Open the object
 	std::auto_ptr<IOStream> object(rContext.OpenObject(mObjectID));
 
+	// Directories are sent with the changes in their journals made, and
+	// in the standard format, which is the only one clients understand
+	uint32_t magic;
+	if(object->ReadFullBuffer(&magic, sizeof(magic), 0) &&
+		OBJECTMAGIC_IS_DIR_MAGIC_VALUE(ntohl(magic)))
+	{
+		object.reset();
+		const BackupStoreDirectory &rdir(
+			rContext.GetDirectory(mObjectID));
+		std::auto_ptr<CollectInBufferStream> standard(
+			new CollectInBufferStream);
+		rdir.WriteToStream(*standard);
+		standard->SetForReading();
+		object.reset(standard.release());
+	}
+	else
+	{
+		object->Seek(0, IOStream::SeekType_Absolute);
+	}
+
 	// Stream it to the peer
 	rProtocol.SendStreamAfterCommand(object);
 
@@ -369,8 +392,29 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolGetFile::DoCommand(BackupProt
 	// The result
 	std::auto_ptr<IOStream> stream;
 
+	// Old versions have to be rebuilt from a chain of patches, unless
+	// the result of doing so last time is still in the cache
+	BackupStoreCombinedFileCache *pcache = rContext.GetCombinedFileCache();
+	int64_t revisionID = 0;
+	if(pfileEntry->GetDependsNewer() != 0 && pcache != 0)
+	{
+		revisionID = rContext.GetObjectRevisionID(mObjectID);
+		std::auto_ptr<IOStream> cached(pcache->Get(
+			rContext.GetClientID(), mObjectID, revisionID));
+		if(cached.get() != 0)
+		{
+			std::auto_ptr<IOStream> t(BackupStoreFile::ReorderFileToStreamOrder(cached.get(), true /* take ownership */));
+			stream = t;
+			cached.release();
+		}
+	}
+
 	// Does this depend on anything?
-	if(pfileEntry->GetDependsNewer() != 0)
+	if(stream.get() != 0)
+	{
+		// Already rebuilt, from the cache
+	}
+	else if(pfileEntry->GetDependsNewer() != 0)
 	{
 		// File exists, but is a patch from a new version. Generate the older version.
 		std::vector<int64_t> patchChain;
@@ -436,6 +480,14 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolGetFile::DoCommand(BackupProt
 			from = combined;
 		}
 
+		// Keep it for next time
+		if(pcache != 0)
+		{
+			pcache->Put(rContext.GetClientID(), mObjectID,
+				revisionID, *from);
+			from->Seek(0, IOStream::SeekType_Absolute);
+		}
+
 		// Now, from contains a nice file to send to the client. Reorder it
 		{
 			// Write nastily to allow this to work with gcc 2.x
@@ -902,22 +954,44 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolGetBlockIndexByName::DoComman
 {
 	CHECK_PHASE(Phase_Commands)
 
+	std::auto_ptr<BackupProtocolMessage> reply(
+		BackupProtocolGetBlockIndexByName2(mInDirectory, mFilename)
+		.DoCommand(rProtocol, rContext));
+
+	// Return the object ID, without the options
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolSuccess(
+		((BackupProtocolBlockIndex *)reply.get())->GetObjectID()));
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupProtocolGetBlockIndexByName2::DoCommand(BackupProtocolReplyable &, BackupStoreContext &)
+//		Purpose: Get the block index from a file, by name within a
+//			 directory, and the options from the file's header
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<BackupProtocolMessage> BackupProtocolGetBlockIndexByName2::DoCommand(BackupProtocolReplyable &rProtocol, BackupStoreContext &rContext) const
+{
+	CHECK_PHASE(Phase_Commands)
+
 	// Get the directory
 	const BackupStoreDirectory &dir(rContext.GetDirectory(mInDirectory));
 
 	// Find the latest object ID within it which has the same name
 	int64_t objectID = 0;
-	BackupStoreDirectory::Iterator i(dir);
-	BackupStoreDirectory::Entry *en = 0;
-	while((en = i.Next(BackupStoreDirectory::Entry::Flags_File)) != 0)
+	std::vector<BackupStoreDirectory::Entry *> sameName;
+	dir.FindEntriesByName(mFilename, sameName,
+		BackupStoreDirectory::Entry::Flags_File);
+	for(std::vector<BackupStoreDirectory::Entry *>::iterator
+		i(sameName.begin()); i != sameName.end(); ++i)
 	{
-		if(en->GetName() == mFilename)
+		// Store the ID, if it's a newer ID than the last one
+		if((*i)->GetObjectID() > objectID)
 		{
-			// Store the ID, if it's a newer ID than the last one
-			if(en->GetObjectID() > objectID)
-			{
-				objectID = en->GetObjectID();
-			}
+			objectID = (*i)->GetObjectID();
 		}
 	}
 
@@ -925,20 +999,21 @@ std::auto_ptr<BackupProtocolMessage> BackupProtocolGetBlockIndexByName::DoComman
 	if(objectID == 0)
 	{
 		// No... return a zero object ID
-		return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolSuccess(0));
+		return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolBlockIndex(0, 0));
 	}
 
 	// Open the file
 	std::auto_ptr<IOStream> stream(rContext.OpenObject(objectID));
 
-	// Move the file pointer to the block index
-	BackupStoreFile::MoveStreamPositionToBlockIndex(*stream);
+	// Move the file pointer to the block index, reading the options
+	int32_t options = 0;
+	BackupStoreFile::MoveStreamPositionToBlockIndex(*stream, &options);
 
 	// Return the stream to the client
 	rProtocol.SendStreamAfterCommand(stream);
 
-	// Return the object ID
-	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolSuccess(objectID));
+	// Return the object ID and options
+	return std::auto_ptr<BackupProtocolMessage>(new BackupProtocolBlockIndex(objectID, options));
 }
 
 
@@ -514,6 +514,8 @@ int BackupStoreAccountsControl::CheckAccount(int32_t ID, bool FixErrors, bool Qu
 
 	// Check it
 	BackupStoreCheck check(rootDir, discSetNum, ID, FixErrors, Quiet);
+	check.SetCompactDirectories(
+		mConfig.GetKeyValueBool("CompactDirectories"));
 	check.Check();
 
 	if(ReturnNumErrorsFound)
@@ -576,6 +578,8 @@ int BackupStoreAccountsControl::HousekeepAccountNow(int32_t ID)
 	}
 
 	HousekeepStoreAccount housekeeping(ID, rootDir, discSetNum, NULL);
+	housekeeping.SetCompactDirectories(
+		mConfig.GetKeyValueBool("CompactDirectories"));
 	bool success = housekeeping.DoHousekeeping();
 
 	if(!success)
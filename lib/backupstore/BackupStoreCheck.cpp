@@ -21,6 +21,7 @@
 #include "BackupStoreCheck.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
+#include "BackupStoreDirectoryJournal.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreObjectMagic.h"
 #include "BackupStoreRefCountDatabase.h"
@@ -49,6 +50,7 @@ BackupStoreCheck::BackupStoreCheck(const std::string &rStoreRoot, int DiscSetNum
 	  mAccountID(AccountID),
 	  mFixErrors(FixErrors),
 	  mQuiet(Quiet),
+	  mCompactDirectories(false),
 	  mNumberErrorsFound(0),
 	  mLastIDInInfo(0),
 	  mpInfoLastBlock(0),
@@ -164,6 +166,7 @@ void BackupStoreCheck::Check()
 	}
 	FixDirsWithWrongContainerID();
 	FixDirsWithLostDirs();
+	FixDirsWithChangedSize();
 
 	// Phase 6, regenerate store info
 	if(!mQuiet)
@@ -530,8 +533,10 @@ bool BackupStoreCheck::CheckAndAddObject(int64_t ObjectID,
 	try
 	{
 		// Open file
+		int64_t revisionID = 0;
 		std::auto_ptr<RaidFileRead> file(
-			RaidFileRead::Open(mDiscSetNumber, rFilename));
+			RaidFileRead::Open(mDiscSetNumber, rFilename,
+				&revisionID));
 		size = file->GetDiscUsageInBlocks();
 
 		// Read in first four bytes -- don't have to worry about
@@ -557,8 +562,10 @@ bool BackupStoreCheck::CheckAndAddObject(int64_t ObjectID,
 			break;
 
 		case OBJECTMAGIC_DIR_MAGIC_VALUE:
+		case OBJECTMAGIC_DIR_COMPACT_MAGIC_VALUE:
 			isFile = false;
-			containerID = CheckDirInitial(ObjectID, *file);
+			containerID = CheckDirInitial(ObjectID, *file, rFilename,
+				revisionID, size);
 			break;
 
 		default:
@@ -671,17 +678,25 @@ int64_t BackupStoreCheck::CheckFile(int64_t ObjectID, IOStream &rStream)
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreCheck::CheckDirInitial(int64_t, IOStream &)
+//		Name:    BackupStoreCheck::CheckDirInitial(int64_t, IOStream &, const std::string &, int64_t, int64_t &)
 //		Purpose: Do initial check on directory, return container ID
-//			 if OK, or -1 on error
+//			 if OK, or -1 on error. Adds the disc usage of the
+//			 directory's journal to its size.
 //		Created: 22/4/04
 //
 // --------------------------------------------------------------------------
-int64_t BackupStoreCheck::CheckDirInitial(int64_t ObjectID, IOStream &rStream)
+int64_t BackupStoreCheck::CheckDirInitial(int64_t ObjectID, IOStream &rStream,
+	const std::string &rFilename, int64_t RevisionID,
+	int64_t &rSizeInBlocks)
 {
-	// Simply attempt to read in the directory
+	// Simply attempt to read in the directory, with its journal, which
+	// may have moved it to another container
 	BackupStoreDirectory dir;
 	dir.ReadFromStream(rStream, IOStream::TimeOutInfinite);
+	int64_t journalSizeInBlocks = 0;
+	BackupStoreDirectoryJournal::Apply(mDiscSetNumber, rFilename,
+		RevisionID, dir, &journalSizeInBlocks);
+	rSizeInBlocks += journalSizeInBlocks;
 
 	// Check object ID
 	if(dir.GetObjectID() != ObjectID)
@@ -732,10 +747,8 @@ void BackupStoreCheck::CheckDirectories()
 				std::string filename;
 				StoreStructure::MakeObjectFilename(pblock->mID[e], mStoreRoot, mDiscSetNumber, filename, false /* no dir creation */);
 				BackupStoreDirectory dir;
-				{
-					std::auto_ptr<RaidFileRead> file(RaidFileRead::Open(mDiscSetNumber, filename));
-					dir.ReadFromStream(*file, IOStream::TimeOutInfinite);
-				}
+				BackupStoreDirectoryJournal::ReadDirectory(mDiscSetNumber,
+					filename, dir);
 				
 				// Flag for modifications
 				bool isModified = CheckDirectory(dir);
@@ -761,10 +774,7 @@ void BackupStoreCheck::CheckDirectories()
 				{
 					BOX_WARNING("Writing modified directory to disk: " <<
 						BOX_FORMAT_OBJECTID(pblock->mID[e]));
-					RaidFileWrite fixed(mDiscSetNumber, filename);
-					fixed.Open(true /* allow overwriting */);
-					dir.WriteToStream(fixed);
-					fixed.Commit(true /* convert to raid representation now */);
+					WriteDirectory(filename, dir);
 				}
 
 				CountDirectoryEntries(dir);
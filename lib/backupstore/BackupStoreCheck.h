@@ -91,6 +91,12 @@ public:
 		return mNumberErrorsFound;
 	}
 
+	// Write the directories fixed in the compact format
+	void SetCompactDirectories(bool Compact)
+	{
+		mCompactDirectories = Compact;
+	}
+
 private:
 	enum
 	{
@@ -122,6 +128,7 @@ private:
 	void CheckUnattachedObjects();
 	void FixDirsWithWrongContainerID();
 	void FixDirsWithLostDirs();
+	void FixDirsWithChangedSize();
 	void WriteNewStoreInfo();
 
 	// Checking functions
@@ -133,13 +140,18 @@ private:
 		int64_t DirectoryID, bool& rIsModified);
 	void CountDirectoryEntries(BackupStoreDirectory& dir);
 	int64_t CheckFile(int64_t ObjectID, IOStream &rStream);
-	int64_t CheckDirInitial(int64_t ObjectID, IOStream &rStream);
+	int64_t CheckDirInitial(int64_t ObjectID, IOStream &rStream,
+		const std::string &rFilename, int64_t RevisionID,
+		int64_t &rSizeInBlocks);
 
 	// Fixing functions
 	bool TryToRecreateDirectory(int64_t MissingDirectoryID);
 	void InsertObjectIntoDirectory(int64_t ObjectID, int64_t DirectoryID, bool IsDirectory);
 	int64_t GetLostAndFoundDirID();
 	void CreateBlankDirectory(int64_t DirectoryID, int64_t ContainingDirID);
+	void WriteDirectory(const std::string &rFilename,
+		const BackupStoreDirectory &rDir);
+	friend class BackupStoreDirectoryFixer;
 
 	// Data handling
 	void FreeInfo();
@@ -176,6 +188,7 @@ private:
 	std::string mAccountName;
 	bool mFixErrors;
 	bool mQuiet;
+	bool mCompactDirectories;
 	
 	int64_t mNumberErrorsFound;
 	
@@ -194,6 +207,9 @@ private:
 	// This is a map of lost dir ID -> existing dir ID
 	std::map<BackupStoreCheck_ID_t, BackupStoreCheck_ID_t>
 		mDirsWhichContainLostDirs;
+	// Directories rewritten at a new size, whose entries in their
+	// containing directories may need to be updated
+	std::set<BackupStoreCheck_ID_t> mDirsWithChangedSize;
 	
 	// Set of extra directories added
 	std::set<BackupStoreCheck_ID_t> mDirsAdded;
@@ -16,6 +16,7 @@
 #include "BackupStoreCheck.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
+#include "BackupStoreDirectoryJournal.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreFileWire.h"
 #include "BackupStoreInfo.h"
@@ -85,7 +86,7 @@ void BackupStoreCheck::CreateBlankDirectory(int64_t DirectoryID, int64_t Contain
 	StoreStructure::MakeObjectFilename(DirectoryID, mStoreRoot, mDiscSetNumber, filename, true /* make sure the dir exists */);
 	RaidFileWrite obj(mDiscSetNumber, filename);
 	obj.Open(false /* don't allow overwriting */);
-	dir.WriteToStream(obj);
+	dir.WriteToStore(obj, mCompactDirectories);
 	int64_t size = obj.GetDiscUsageInBlocks();
 	obj.Commit(true /* convert to raid now */);
 
@@ -97,17 +98,57 @@ void BackupStoreCheck::CreateBlankDirectory(int64_t DirectoryID, int64_t Contain
 	mBlocksInDirectories += size;
 }
 
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::WriteDirectory(const std::string &, const BackupStoreDirectory &)
+//		Purpose: Writes a fixed directory in full, in place of the
+//			 object and any journal that it was read from, and
+//			 counts it at its new size.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::WriteDirectory(const std::string &rFilename,
+	const BackupStoreDirectory &rDir)
+{
+	RaidFileWrite fixed(mDiscSetNumber, rFilename);
+	fixed.Open(true /* allow overwriting */);
+	rDir.WriteToStore(fixed, mCompactDirectories);
+	int64_t size = fixed.GetDiscUsageInBlocks();
+	fixed.Commit(true /* convert to raid now */);
+	BackupStoreDirectoryJournal::Delete(mDiscSetNumber, rFilename);
+
+	// The journal's blocks went with it
+	int32_t index = 0;
+	IDBlock *pblock = LookupID(rDir.GetObjectID(), index);
+	if(pblock != 0)
+	{
+		int64_t adjust = size - pblock->mObjectSizeInBlocks[index];
+		mBlocksUsed += adjust;
+		mBlocksInDirectories += adjust;
+		pblock->mObjectSizeInBlocks[index] = size;
+
+		if(adjust != 0 &&
+			rDir.GetObjectID() != BACKUPSTORE_ROOT_DIRECTORY_ID)
+		{
+			mDirsWithChangedSize.insert(rDir.GetObjectID());
+		}
+	}
+}
+
 class BackupStoreDirectoryFixer
 {
 	private:
+	BackupStoreCheck &mrCheck;
 	BackupStoreDirectory mDirectory;
 	std::string mFilename;
 	std::string mStoreRoot;
 	int mDiscSetNumber;
 
 	public:
-	BackupStoreDirectoryFixer(std::string storeRoot, int discSetNumber,
-		int64_t ID);
+	BackupStoreDirectoryFixer(BackupStoreCheck &rCheck,
+		std::string storeRoot, int discSetNumber, int64_t ID);
 	void InsertObject(int64_t ObjectID, bool IsDirectory,
 		int32_t lostDirNameSerial);
 	~BackupStoreDirectoryFixer();
@@ -239,7 +280,8 @@ void BackupStoreCheck::CheckUnattachedObjects()
 				{
 					// no match, create a new one
 					pFixer = new BackupStoreDirectoryFixer(
-						mStoreRoot, mDiscSetNumber,
+						*this, mStoreRoot,
+						mDiscSetNumber,
 						putIntoDirectoryID);
 					fixers.insert(fixer_pair_t(
 						putIntoDirectoryID, pFixer));
@@ -317,7 +359,7 @@ bool BackupStoreCheck::TryToRecreateDirectory(int64_t MissingDirectoryID)
 	StoreStructure::MakeObjectFilename(MissingDirectoryID, mStoreRoot, mDiscSetNumber, filename, true /* make sure the dir exists */);
 	RaidFileWrite root(mDiscSetNumber, filename);
 	root.Open(false /* don't allow overwriting */);
-	dir.WriteToStream(root);
+	dir.WriteToStore(root, mCompactDirectories);
 	root.Commit(true /* convert to raid now */);
 
 	// Record the fact we've done this
@@ -329,19 +371,19 @@ bool BackupStoreCheck::TryToRecreateDirectory(int64_t MissingDirectoryID)
 	return true;
 }
 
-BackupStoreDirectoryFixer::BackupStoreDirectoryFixer(std::string storeRoot,
-	int discSetNumber, int64_t ID)
-: mStoreRoot(storeRoot),
+BackupStoreDirectoryFixer::BackupStoreDirectoryFixer(BackupStoreCheck &rCheck,
+	std::string storeRoot, int discSetNumber, int64_t ID)
+: mrCheck(rCheck),
+  mStoreRoot(storeRoot),
   mDiscSetNumber(discSetNumber)
 {
 	// Generate filename
 	StoreStructure::MakeObjectFilename(ID, mStoreRoot, mDiscSetNumber,
 		mFilename, false /* don't make sure the dir exists */);
 
-	// Read it in
-	std::auto_ptr<RaidFileRead> file(
-		RaidFileRead::Open(mDiscSetNumber, mFilename));
-	mDirectory.ReadFromStream(*file, IOStream::TimeOutInfinite);
+	// Read it in, with the changes in its journal
+	BackupStoreDirectoryJournal::ReadDirectory(mDiscSetNumber, mFilename,
+		mDirectory);
 }
 
 void BackupStoreDirectoryFixer::InsertObject(int64_t ObjectID, bool IsDirectory,
@@ -404,10 +446,7 @@ BackupStoreDirectoryFixer::~BackupStoreDirectoryFixer()
 	mDirectory.CheckAndFix();
 
 	// Write it out
-	RaidFileWrite root(mDiscSetNumber, mFilename);
-	root.Open(true /* allow overwriting */);
-	mDirectory.WriteToStream(root);
-	root.Commit(true /* convert to raid now */);
+	mrCheck.WriteDirectory(mFilename, mDirectory);
 }
 
 // --------------------------------------------------------------------------
@@ -436,10 +475,7 @@ int64_t BackupStoreCheck::GetLostAndFoundDirID()
 	BackupStoreDirectory dir;
 	std::string filename;
 	StoreStructure::MakeObjectFilename(BACKUPSTORE_ROOT_DIRECTORY_ID, mStoreRoot, mDiscSetNumber, filename, false /* don't make sure the dir exists */);
-	{
-		std::auto_ptr<RaidFileRead> file(RaidFileRead::Open(mDiscSetNumber, filename));
-		dir.ReadFromStream(*file, IOStream::TimeOutInfinite);
-	}
+	BackupStoreDirectoryJournal::ReadDirectory(mDiscSetNumber, filename, dir);
 
 	// Find a suitable name
 	BackupStoreFilename lostAndFound;
@@ -467,10 +503,7 @@ int64_t BackupStoreCheck::GetLostAndFoundDirID()
 	dir.AddEntry(lostAndFound, 0, id, 0, BackupStoreDirectory::Entry::Flags_Dir, 0);
 
 	// Write out root dir
-	RaidFileWrite root(mDiscSetNumber, filename);
-	root.Open(true /* allow overwriting */);
-	dir.WriteToStream(root);
-	root.Commit(true /* convert to raid now */);
+	WriteDirectory(filename, dir);
 
 	// Store
 	mLostAndFoundDirectoryID = id;
@@ -508,19 +541,14 @@ void BackupStoreCheck::FixDirsWithWrongContainerID()
 		BackupStoreDirectory dir;
 		std::string filename;
 		StoreStructure::MakeObjectFilename(*i, mStoreRoot, mDiscSetNumber, filename, false /* don't make sure the dir exists */);
-		{
-			std::auto_ptr<RaidFileRead> file(RaidFileRead::Open(mDiscSetNumber, filename));
-			dir.ReadFromStream(*file, IOStream::TimeOutInfinite);
-		}
+		BackupStoreDirectoryJournal::ReadDirectory(mDiscSetNumber,
+			filename, dir);
 
 		// Adjust container ID
 		dir.SetContainerID(pblock->mContainer[index]);
 
 		// Write it out
-		RaidFileWrite root(mDiscSetNumber, filename);
-		root.Open(true /* allow overwriting */);
-		dir.WriteToStream(root);
-		root.Commit(true /* convert to raid now */);
+		WriteDirectory(filename, dir);
 	}
 }
 
@@ -553,10 +581,8 @@ void BackupStoreCheck::FixDirsWithLostDirs()
 		BackupStoreDirectory dir;
 		std::string filename;
 		StoreStructure::MakeObjectFilename(i->second, mStoreRoot, mDiscSetNumber, filename, false /* don't make sure the dir exists */);
-		{
-			std::auto_ptr<RaidFileRead> file(RaidFileRead::Open(mDiscSetNumber, filename));
-			dir.ReadFromStream(*file, IOStream::TimeOutInfinite);
-		}
+		BackupStoreDirectoryJournal::ReadDirectory(mDiscSetNumber,
+			filename, dir);
 
 		// Delete the dodgy entry
 		dir.DeleteEntry(i->first);
@@ -565,10 +591,53 @@ void BackupStoreCheck::FixDirsWithLostDirs()
 		dir.CheckAndFix();
 
 		// Write it out
-		RaidFileWrite root(mDiscSetNumber, filename);
-		root.Open(true /* allow overwriting */);
-		dir.WriteToStream(root);
-		root.Commit(true /* convert to raid now */);
+		WriteDirectory(filename, dir);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCheck::FixDirsWithChangedSize()
+//		Purpose: Updates the entries for directories which have been
+//			 rewritten at a new size, such as when their journals
+//			 were removed, in the directories which contain them
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCheck::FixDirsWithChangedSize()
+{
+	// Rewriting a containing directory may change its size too, so
+	// carry on until there are none left
+	while(!mDirsWithChangedSize.empty())
+	{
+		BackupStoreCheck_ID_t id = *mDirsWithChangedSize.begin();
+		mDirsWithChangedSize.erase(mDirsWithChangedSize.begin());
+
+		int32_t index = 0;
+		IDBlock *pblock = LookupID(id, index);
+		if(pblock == 0) continue;
+
+		// Load in the containing directory
+		BackupStoreDirectory dir;
+		std::string filename;
+		StoreStructure::MakeObjectFilename(pblock->mContainer[index],
+			mStoreRoot, mDiscSetNumber, filename,
+			false /* don't make sure the dir exists */);
+		BackupStoreDirectoryJournal::ReadDirectory(mDiscSetNumber,
+			filename, dir);
+
+		BackupStoreDirectory::Entry *en = dir.FindEntryByID(id);
+		if(en == 0 ||
+			en->GetSizeInBlocks() == pblock->mObjectSizeInBlocks[index])
+		{
+			continue;
+		}
+		en->SetSizeInBlocks(pblock->mObjectSizeInBlocks[index]);
+
+		// Write it out
+		WriteDirectory(filename, dir);
 	}
 }
 
@@ -711,6 +780,10 @@ bool BackupStoreDirectory::CheckAndFix()
 {
 	bool changed = false;
 
+	// Entries are removed from the list below, so the slots of the ones
+	// which were deleted earlier must be gone first
+	RemoveDeletedSlots();
+
 	// Check that if a file depends on a new version, that version is in this directory
 	bool restart;
 
@@ -737,6 +810,7 @@ bool BackupStoreDirectory::CheckAndFix()
 					// Remove
 					delete *i;
 					mEntries.erase(i);
+					ClearIndexes();
 
 					// Mark as changed
 					changed = true;
@@ -888,6 +962,7 @@ bool BackupStoreDirectory::CheckAndFix()
 				// erase the thing from the list
 				Entry *pentry = (*i);
 				mEntries.erase(i);
+				ClearIndexes();
 
 				// And delete the entry object
 				delete pentry;
@@ -937,6 +1012,7 @@ void BackupStoreDirectory::AddUnattachedObject(const BackupStoreFilename &rName,
 		{
 			mEntries.insert(i, 1 /* just the one copy */, pnew);
 		}
+		ClearIndexes();
 	}
 	catch(...)
 	{
@@ -956,15 +1032,8 @@ void BackupStoreDirectory::AddUnattachedObject(const BackupStoreFilename &rName,
 // --------------------------------------------------------------------------
 bool BackupStoreDirectory::NameInUse(const BackupStoreFilename &rName)
 {
-	for(std::vector<Entry*>::iterator i(mEntries.begin()); i != mEntries.end(); ++i)
-	{
-		if((*i)->GetName() == rName)
-		{
-			return true;
-		}
-	}
-
-	return false;
+	BuildNameIndex();
+	return mNameIndex.find(rName.GetEncodedFilename()) != mNameIndex.end();
 }
 
 
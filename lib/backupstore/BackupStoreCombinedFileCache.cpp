@@ -0,0 +1,344 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreCombinedFileCache.cpp
+//		Purpose: On-disc cache of old versions of files, rebuilt from
+//			 chains of patches
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <sstream>
+
+#include "BackupStoreCombinedFileCache.h"
+#include "BoxException.h"
+#include "BoxTimeToUnix.h"
+#include "FileModificationTime.h"
+#include "FileStream.h"
+#include "Logging.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+// Length of the names of entries: account ID, object ID and revision ID,
+// in hex, separated by dashes
+#define COMBINEDFILECACHE_NAME_LENGTH	(8 + 1 + 16 + 1 + 16)
+
+// Temporary files left by a process which died while adding an entry are
+// removed once they're this old
+#define COMBINEDFILECACHE_STALE_TEMP_AGE	SecondsToBoxTime(3600)
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::BackupStoreCombinedFileCache(const std::string &, int64_t)
+//		Purpose: Constructor. Uses the cache in the directory given,
+//			 creating it if necessary, and limits the total size
+//			 of the files in it to MaxSize bytes.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreCombinedFileCache::BackupStoreCombinedFileCache(
+	const std::string &rDirectory, int64_t MaxSize)
+: mDirectory(rDirectory),
+  mMaxSize(MaxSize)
+{
+	if(ObjectExists(mDirectory) == ObjectExists_NoObject &&
+		::mkdir(mDirectory.c_str(), S_IRWXU) != 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to create combined file cache "
+			"directory: " << mDirectory);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::~BackupStoreCombinedFileCache()
+//		Purpose: Destructor. The cached files stay on disc.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreCombinedFileCache::~BackupStoreCombinedFileCache()
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::GetFilename(int32_t, int64_t, int64_t)
+//		Purpose: Private. The name of the file caching a version.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::string BackupStoreCombinedFileCache::GetFilename(int32_t AccountID,
+	int64_t ObjectID, int64_t RevisionID) const
+{
+	char leaf[COMBINEDFILECACHE_NAME_LENGTH + 1];
+	::snprintf(leaf, sizeof(leaf), "%08x-%016llx-%016llx",
+		(unsigned int)AccountID, (unsigned long long)ObjectID,
+		(unsigned long long)RevisionID);
+	return mDirectory + DIRECTORY_SEPARATOR + leaf;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::Get(int32_t, int64_t, int64_t)
+//		Purpose: Returns a stream of the cached combined file of a
+//			 version, in file order, or a null pointer if it isn't
+//			 cached. The entry is marked as just used.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<IOStream> BackupStoreCombinedFileCache::Get(int32_t AccountID,
+	int64_t ObjectID, int64_t RevisionID)
+{
+	std::auto_ptr<IOStream> apFile;
+	std::string filename(GetFilename(AccountID, ObjectID, RevisionID));
+	if(ObjectExists(filename) != ObjectExists_File)
+	{
+		return apFile;
+	}
+
+	try
+	{
+		apFile.reset(new FileStream(filename, O_RDONLY | O_BINARY));
+	}
+	catch(BoxException &e)
+	{
+		// Another process may have just removed it
+		BOX_TRACE("Failed to open cached combined file " <<
+			filename << ": " << e.what());
+		return apFile;
+	}
+
+	struct timeval times[2];
+	BoxTimeToTimeval(GetCurrentBoxTime(), times[1]);
+	times[0] = times[1];
+	if(::utimes(filename.c_str(), times) != 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to change times of cached "
+			"combined file: " << filename);
+	}
+
+	return apFile;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::Put(int32_t, int64_t, int64_t, IOStream &)
+//		Purpose: Caches the combined file of a version, read from the
+//			 stream to its end, making space by removing the least
+//			 recently used entries if necessary. Failing to cache
+//			 it isn't an error, as it can be combined again.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCombinedFileCache::Put(int32_t AccountID, int64_t ObjectID,
+	int64_t RevisionID, IOStream &rCombined)
+{
+	IOStream::pos_type bytesLeft = rCombined.BytesLeftToRead();
+	if(bytesLeft != IOStream::SizeOfStreamUnknown && bytesLeft > mMaxSize)
+	{
+		return;
+	}
+
+	// Write to a temporary file, and rename it into place when it's
+	// complete, so that no process ever finds it half written.
+	std::string filename(GetFilename(AccountID, ObjectID, RevisionID));
+	std::ostringstream tempFilename;
+	tempFilename << filename << ".tmp." << getpid();
+	try
+	{
+		int64_t size;
+		{
+			FileStream file(tempFilename.str(),
+				O_WRONLY | O_CREAT | O_TRUNC | O_BINARY);
+			rCombined.CopyStreamTo(file);
+			size = file.GetPosition();
+		}
+
+		if(size > mMaxSize)
+		{
+			::unlink(tempFilename.str().c_str());
+			return;
+		}
+		MakeSpace(size);
+
+		if(::rename(tempFilename.str().c_str(), filename.c_str()) != 0)
+		{
+			BOX_LOG_SYS_WARNING("Failed to rename cached combined "
+				"file: " << tempFilename.str() << " to " <<
+				filename);
+			::unlink(tempFilename.str().c_str());
+		}
+	}
+	catch(BoxException &e)
+	{
+		BOX_WARNING("Failed to cache combined file " << filename <<
+			": " << e.what());
+		::unlink(tempFilename.str().c_str());
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::GetSize()
+//		Purpose: Returns the total size of the cached files.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreCombinedFileCache::GetSize()
+{
+	std::vector<Entry> entries;
+	int64_t size;
+	Scan(entries, size);
+	return size;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::GetNumberOfEntries()
+//		Purpose: Returns the number of cached files.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStoreCombinedFileCache::GetNumberOfEntries()
+{
+	std::vector<Entry> entries;
+	int64_t size;
+	Scan(entries, size);
+	return entries.size();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::UsedEarlier(const Entry &, const Entry &)
+//		Purpose: Private. Static. Orders entries by when they were
+//			 last used, and then by name.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreCombinedFileCache::UsedEarlier(const Entry &rA,
+	const Entry &rB)
+{
+	if(rA.mLastUsed != rB.mLastUsed)
+	{
+		return rA.mLastUsed < rB.mLastUsed;
+	}
+	return rA.mFilename < rB.mFilename;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::Scan(std::vector<Entry> &, int64_t &)
+//		Purpose: Private. Finds the entries in the cache directory,
+//			 least recently used first, and their total size.
+//			 Removes temporary files which have been abandoned.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCombinedFileCache::Scan(std::vector<Entry> &rEntries,
+	int64_t &rTotalSize)
+{
+	rEntries.clear();
+	rTotalSize = 0;
+
+	DIR *dirHandle = ::opendir(mDirectory.c_str());
+	if(dirHandle == 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to open combined file cache "
+			"directory: " << mDirectory);
+		return;
+	}
+
+	box_time_t staleTime = GetCurrentBoxTime() -
+		COMBINEDFILECACHE_STALE_TEMP_AGE;
+
+	struct dirent *en;
+	while((en = ::readdir(dirHandle)) != 0)
+	{
+		std::string leaf(en->d_name);
+		std::string filename(mDirectory + DIRECTORY_SEPARATOR + leaf);
+		EMU_STRUCT_STAT st;
+		if(leaf == "." || leaf == ".." ||
+			EMU_STAT(filename.c_str(), &st) != 0 ||
+			!S_ISREG(st.st_mode))
+		{
+			continue;
+		}
+
+		if(leaf.size() != COMBINEDFILECACHE_NAME_LENGTH ||
+			leaf.find_first_not_of("0123456789abcdef-") !=
+				std::string::npos)
+		{
+			// Probably being added by another process
+			if(FileModificationTime(st) < staleTime)
+			{
+				BOX_TRACE("Removing abandoned file from "
+					"combined file cache: " << filename);
+				::unlink(filename.c_str());
+			}
+			continue;
+		}
+
+		Entry entry;
+		entry.mLastUsed = FileModificationTime(st);
+		entry.mFilename = filename;
+		entry.mSize = st.st_size;
+		rEntries.push_back(entry);
+		rTotalSize += entry.mSize;
+	}
+	::closedir(dirHandle);
+
+	std::sort(rEntries.begin(), rEntries.end(), UsedEarlier);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreCombinedFileCache::MakeSpace(int64_t)
+//		Purpose: Private. Removes the least recently used entries
+//			 until there's space to add Size bytes.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreCombinedFileCache::MakeSpace(int64_t Size)
+{
+	std::vector<Entry> entries;
+	int64_t totalSize;
+	Scan(entries, totalSize);
+
+	for(std::vector<Entry>::const_iterator i(entries.begin());
+		i != entries.end() && totalSize + Size > mMaxSize; ++i)
+	{
+		if(::unlink(i->mFilename.c_str()) != 0 && errno != ENOENT)
+		{
+			BOX_LOG_SYS_WARNING("Failed to remove cached combined "
+				"file: " << i->mFilename);
+			continue;
+		}
+		totalSize -= i->mSize;
+	}
+}
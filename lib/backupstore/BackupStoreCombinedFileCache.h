@@ -0,0 +1,86 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreCombinedFileCache.h
+//		Purpose: On-disc cache of old versions of files, rebuilt from
+//			 chains of patches
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTORECOMBINEDFILECACHE__H
+#define BACKUPSTORECOMBINEDFILECACHE__H
+
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "BoxTime.h"
+
+class IOStream;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreCombinedFileCache
+//		Purpose: Keeps the results of combining the patches which store
+//			 old versions of files, in files in a directory, so that
+//			 fetching the same version again doesn't have to combine
+//			 the whole chain again.
+//
+//			 Entries are keyed by the account, the object ID and the
+//			 revision ID of the object's file in the store. Nothing
+//			 in the store changes the contents of a version, only
+//			 the way it's stored, so the revision ID is only there to
+//			 avoid using an entry for an object in an account which
+//			 has been deleted and created again.
+//
+//			 The cache may be shared by several processes, so there
+//			 is no index in memory: the entries are the files in the
+//			 directory, and using one sets its modification time, so
+//			 the least recently used are discarded first to keep the
+//			 total size of the entries under the maximum.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreCombinedFileCache
+{
+public:
+	BackupStoreCombinedFileCache(const std::string &rDirectory,
+		int64_t MaxSize);
+	~BackupStoreCombinedFileCache();
+private:
+	// No copying
+	BackupStoreCombinedFileCache(const BackupStoreCombinedFileCache &);
+	BackupStoreCombinedFileCache &operator=(const BackupStoreCombinedFileCache &);
+
+public:
+	std::auto_ptr<IOStream> Get(int32_t AccountID, int64_t ObjectID,
+		int64_t RevisionID);
+	void Put(int32_t AccountID, int64_t ObjectID, int64_t RevisionID,
+		IOStream &rCombined);
+
+	const std::string &GetDirectory() const { return mDirectory; }
+	int64_t GetMaxSize() const { return mMaxSize; }
+	int64_t GetSize();
+	int GetNumberOfEntries();
+
+private:
+	typedef struct
+	{
+		box_time_t mLastUsed;
+		std::string mFilename;
+		int64_t mSize;
+	} Entry;
+
+	static bool UsedEarlier(const Entry &rA, const Entry &rB);
+	std::string GetFilename(int32_t AccountID, int64_t ObjectID,
+		int64_t RevisionID) const;
+	void Scan(std::vector<Entry> &rEntries, int64_t &rTotalSize);
+	void MakeSpace(int64_t Size);
+
+	std::string mDirectory;
+	int64_t mMaxSize;
+};
+
+#endif // BACKUPSTORECOMBINEDFILECACHE__H
@@ -38,6 +38,16 @@ static const ConfigurationVerifyKey verifyrootkeys[] =
 		ConfigTest_Exists | ConfigTest_IsInt),
 	ConfigurationVerifyKey("ExtendedLogging", ConfigTest_IsBool, false),
 	// make value "yes" to enable in config file
+	ConfigurationVerifyKey("CombinedFileCacheDirectory", 0),
+	// the cache of old versions of files is only used if this is set
+	ConfigurationVerifyKey("CombinedFileCacheSize", ConfigTest_IsInt, 256),
+	// in megabytes
+	ConfigurationVerifyKey("DirectoryCacheSize", ConfigTest_IsInt),
+	// in megabytes, for each connection
+	ConfigurationVerifyKey("CompactDirectories", ConfigTest_IsBool, false),
+	// make value "yes" to write directories in the compact format
+	ConfigurationVerifyKey("DirectoryJournalSize", ConfigTest_IsInt, 0),
+	// in kilobytes, 0 to write directories in full every time
 	ConfigurationVerifyKey("RaidFileConf", ConfigTest_LastEntry)
 };
 
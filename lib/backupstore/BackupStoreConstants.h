@@ -12,11 +12,20 @@
 
 #define BACKUPSTORE_ROOT_DIRECTORY_ID	1
 
-#define BACKUP_STORE_SERVER_VERSION		1
+// Version 2 adds block indexes with fast strong checksums
+// (OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2), and version 3 the
+// GetBlockIndexByName2 command, which returns the file's header options.
+// The server still accepts clients which only speak the oldest version.
+#define BACKUP_STORE_SERVER_VERSION		3
+#define BACKUP_STORE_SERVER_MIN_VERSION	1
 
 // Minimum size for a chunk to be compressed
 #define BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE	256
 
+// Stop compressing a file if this many of its blocks, which looked
+// compressible, have been compressed without saving much space
+#define BACKUP_FILE_COMPRESSION_PROBE_BLOCKS	4
+
 // min and max sizes for blocks
 #define BACKUP_FILE_MIN_BLOCK_SIZE				4096
 #define BACKUP_FILE_MAX_BLOCK_SIZE				(512*1024)
@@ -24,6 +33,12 @@
 // Increase the block size if there are more than this number of blocks
 #define BACKUP_FILE_INCREASE_BLOCK_SIZE_AFTER 	4096
 
+// If large blocks are enabled, keep increasing the block size beyond the
+// maximum above, up to this, if there are still more than this number of
+// blocks, so that the block indexes of huge files stay a reasonable size
+#define BACKUP_FILE_MAX_LARGE_BLOCK_SIZE			(16*1024*1024)
+#define BACKUP_FILE_INCREASE_LARGE_BLOCK_SIZE_AFTER	32768
+
 // Avoid creating blocks smaller than this
 #define	BACKUP_FILE_AVOID_BLOCKS_LESS_THAN		128
 
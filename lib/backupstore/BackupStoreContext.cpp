@@ -14,6 +14,7 @@
 #include "BackupConstants.h"
 #include "BackupStoreContext.h"
 #include "BackupStoreDirectory.h"
+#include "BackupStoreDirectoryJournal.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreInfo.h"
@@ -30,12 +31,12 @@
 #include "MemLeakFindOn.h"
 
 
-// Maximum number of directories to keep in the cache When the cache is bigger
-// than this, everything gets deleted. In tests, we set the cache size to zero
-// to ensure that it's always flushed, which is very inefficient but helps to
-// catch programming errors (use of freed data).
+// Default maximum size of the directories in the cache, in bytes of memory.
+// The least recently used are removed when it's bigger than this. In tests,
+// we set the cache size to zero to ensure that it's always flushed, which is
+// very inefficient but helps to catch programming errors (use of freed data).
 #ifdef BOX_RELEASE_BUILD
-	#define	MAX_CACHE_SIZE	32
+	#define	MAX_CACHE_SIZE	(16*1024*1024)
 #else
 	#define	MAX_CACHE_SIZE	0
 #endif
@@ -64,6 +65,15 @@ BackupStoreContext::BackupStoreContext(int32_t ClientID,
   mStoreDiscSet(-1),
   mReadOnly(true),
   mSaveStoreInfoDelay(STORE_INFO_SAVE_DELAY),
+  mDirectoryCacheSize(0),
+  mDirectoryCacheMaxSize(MAX_CACHE_SIZE),
+  mNextDirectoryCacheUse(0),
+  mDirectoryCacheHits(0),
+  mDirectoryCacheMisses(0),
+  mDirectoryCacheEvictions(0),
+  mDirectoryJournalMaxSize(0),
+  mCompactDirectories(false),
+  mpCombinedFileCache(NULL),
   mpTestHook(NULL)
 // If you change the initialisers, be sure to update
 // BackupStoreContext::ReceivedFinishCommand as well!
@@ -88,12 +98,79 @@ BackupStoreContext::~BackupStoreContext()
 void BackupStoreContext::ClearDirectoryCache()
 {
 	// Delete the objects in the cache
-	for(std::map<int64_t, BackupStoreDirectory*>::iterator i(mDirectoryCache.begin());
+	for(std::map<int64_t, CachedDirectory>::iterator i(mDirectoryCache.begin());
 		i != mDirectoryCache.end(); ++i)
 	{
-		delete (i->second);
+		delete (i->second.mpDirectory);
 	}
 	mDirectoryCache.clear();
+	mDirectoryCacheAge.clear();
+	mDirectoryCacheSize = 0;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::TrimDirectoryCache(int64_t)
+//		Purpose: Removes the least recently used directories from
+//			 the cache, apart from KeepObjectID, until it's no
+//			 bigger than the maximum. In debug builds they're
+//			 left in the cache and invalidated instead, so that
+//			 any attempt to access them will cause an assertion
+//			 failure that helps to track down the error.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::TrimDirectoryCache(int64_t KeepObjectID)
+{
+	std::set<std::pair<int64_t, int64_t> >::iterator
+		oldest(mDirectoryCacheAge.begin());
+	while(mDirectoryCacheSize > mDirectoryCacheMaxSize &&
+		oldest != mDirectoryCacheAge.end())
+	{
+		int64_t ObjectID = oldest->second;
+		if(ObjectID == KeepObjectID)
+		{
+			++oldest;
+			continue;
+		}
+
+		std::map<int64_t, CachedDirectory>::iterator
+			item(mDirectoryCache.find(ObjectID));
+		ASSERT(item != mDirectoryCache.end());
+		mDirectoryCacheSize -= item->second.mSize;
+		mDirectoryCacheAge.erase(oldest++);
+		++mDirectoryCacheEvictions;
+
+#ifdef BOX_RELEASE_BUILD
+		delete item->second.mpDirectory;
+		mDirectoryCache.erase(item);
+#else
+		item->second.mpDirectory->Invalidate();
+		item->second.mSize = 0;
+#endif
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::LogDirectoryCacheStats()
+//		Purpose: Logs how well the directory cache worked during
+//			 the connection.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreContext::LogDirectoryCacheStats() const
+{
+	BOX_INFO("Directory cache: " << mDirectoryCacheHits << " hits, " <<
+		mDirectoryCacheMisses << " misses, " <<
+		mDirectoryCacheEvictions << " evictions, " <<
+		mDirectoryCacheAge.size() << " directories (" <<
+		mDirectoryCacheSize << " bytes) cached, limit " <<
+		mDirectoryCacheMaxSize << " bytes");
 }
 
 
@@ -137,7 +214,10 @@ void BackupStoreContext::ReceivedFinishCommand()
 	mProtocolPhase = BackupStoreContext::Phase_Version;
 
 	// Avoid the need to check version again, by not resetting
-	// mClientHasAccount, mAccountRootDir or mStoreDiscSet
+	// mClientHasAccount, mAccountRootDir or mStoreDiscSet. The combined
+	// file cache is configuration too, so mpCombinedFileCache is kept,
+	// as are the size and statistics of the directory cache, and the
+	// maximum size of directory journals.
 
 	mReadOnly = true;
 	mSaveStoreInfoDelay = STORE_INFO_SAVE_DELAY;
@@ -145,6 +225,7 @@ void BackupStoreContext::ReceivedFinishCommand()
 	mapStoreInfo.reset();
 	mapRefCount.reset();
 	ClearDirectoryCache();
+	mDirectoryJournalSizes.clear();
 }
 
 
@@ -319,19 +400,22 @@ BackupStoreDirectory &BackupStoreContext::GetDirectoryInternal(int64_t ObjectID,
 	int64_t oldRevID = 0, newRevID = 0;
 
 	// Already in cache?
-	std::map<int64_t, BackupStoreDirectory*>::iterator item(mDirectoryCache.find(ObjectID));
+	std::map<int64_t, CachedDirectory>::iterator item(mDirectoryCache.find(ObjectID));
 	if(item != mDirectoryCache.end()) {
 #ifndef BOX_RELEASE_BUILD // it might be in the cache, but invalidated
 		// in which case, delete it instead of returning it.
-		if(!item->second->IsInvalidated())
+		if(!item->second.mpDirectory->IsInvalidated())
 #else
 		if(true)
 #endif
 		{
-			oldRevID = item->second->GetRevisionID();
+			CachedDirectory &rCached(item->second);
+			oldRevID = rCached.mpDirectory->GetRevisionID();
 
-			// Check the revision ID of the file -- does it need refreshing?
-			if(!RaidFileRead::FileExists(mStoreDiscSet, filename, &newRevID))
+			// Check the revision ID of the file and its journal --
+			// does it need refreshing?
+			if(!BackupStoreDirectoryJournal::GetRevisionID(mStoreDiscSet,
+				filename, newRevID))
 			{
 				THROW_EXCEPTION(BackupStoreException, DirectoryHasBeenDeleted)
 			}
@@ -342,78 +426,87 @@ BackupStoreDirectory &BackupStoreContext::GetDirectoryInternal(int64_t ObjectID,
 				BOX_TRACE("Returning object " <<
 					BOX_FORMAT_OBJECTID(ObjectID) <<
 					" from cache, modtime = " << newRevID)
-				return *(item->second);
+				++mDirectoryCacheHits;
+
+				// Now the most recently used
+				mDirectoryCacheAge.erase(std::make_pair(
+					rCached.mLastUsed, ObjectID));
+				rCached.mLastUsed = mNextDirectoryCacheUse++;
+				mDirectoryCacheAge.insert(std::make_pair(
+					rCached.mLastUsed, ObjectID));
+				return *(rCached.mpDirectory);
 			}
 		}
 
 		// Delete this cached object
-		delete item->second;
-		mDirectoryCache.erase(item);
+		RemoveDirectoryFromCache(ObjectID);
 	}
 
 	// Need to load it up
-
-	// First check to see if the cache is too big
-	if(mDirectoryCache.size() > MAX_CACHE_SIZE && AllowFlushCache)
-	{
-		// Very simple. Just delete everything! But in debug builds,
-		// leave the entries in the cache and invalidate them instead,
-		// so that any attempt to access them will cause an assertion
-		// failure that helps to track down the error.
-#ifdef BOX_RELEASE_BUILD
-		ClearDirectoryCache();
-#else
-		for(std::map<int64_t, BackupStoreDirectory*>::iterator
-			i = mDirectoryCache.begin();
-			i != mDirectoryCache.end(); i++)
-		{
-			i->second->Invalidate();
-		}
-#endif
-	}
+	++mDirectoryCacheMisses;
 
 	// Get a RaidFileRead to read it
+	int64_t objectRevID = 0;
 	std::auto_ptr<RaidFileRead> objectFile(RaidFileRead::Open(mStoreDiscSet,
-		filename, &newRevID));
+		filename, &objectRevID));
 
-	ASSERT(newRevID != 0);
+	ASSERT(objectRevID != 0);
 
 	if (oldRevID == 0)
 	{
 		BOX_TRACE("Loading object " << BOX_FORMAT_OBJECTID(ObjectID) <<
-			" with modtime " << newRevID);
+			" with modtime " << objectRevID);
 	}
 	else
 	{
 		BOX_TRACE("Refreshing object " << BOX_FORMAT_OBJECTID(ObjectID) <<
 			" in cache, modtime changed from " << oldRevID <<
-			" to " << newRevID);
+			" to " << objectRevID);
 	}
 
-	// Read it from the stream, then set it's revision ID
+	// Read it from the stream, make the changes in its journal, then set
+	// its revision ID
 	BufferedStream buf(*objectFile);
 	std::auto_ptr<BackupStoreDirectory> dir(new BackupStoreDirectory(buf));
+	int64_t journalSize = 0;
+	newRevID = BackupStoreDirectoryJournal::Apply(mStoreDiscSet, filename,
+		objectRevID, *dir, &journalSize);
 	dir->SetRevisionID(newRevID);
 
-	// Make sure the size of the directory is available for writing the dir back
-	int64_t dirSize = objectFile->GetDiscUsageInBlocks();
+	// Make sure the size of the directory, including its journal, is
+	// available for writing the dir back
+	int64_t dirSize = objectFile->GetDiscUsageInBlocks() + journalSize;
 	ASSERT(dirSize > 0);
 	dir->SetUserInfo1_SizeInBlocks(dirSize);
 
 	// Store in cache
-	BackupStoreDirectory *pdir = dir.release();
+	CachedDirectory cached;
+	cached.mpDirectory = dir.get();
+	cached.mSize = dir->GetMemoryUsage();
+	cached.mLastUsed = mNextDirectoryCacheUse++;
+	mDirectoryCache[ObjectID] = cached;
 	try
 	{
-		mDirectoryCache[ObjectID] = pdir;
+		mDirectoryCacheAge.insert(std::make_pair(cached.mLastUsed,
+			ObjectID));
 	}
 	catch(...)
 	{
-		delete pdir;
+		mDirectoryCache.erase(ObjectID);
 		throw;
 	}
+	dir.release();
+	mDirectoryCacheSize += cached.mSize;
+
+	// Make space for it if possible, which invalidates references to
+	// any others which are removed
+	if(AllowFlushCache)
+	{
+		TrimDirectoryCache(ObjectID);
+	}
 
 	// Return it
-	return *pdir;
+	return *(cached.mpDirectory);
 }
 
 
@@ -695,28 +788,23 @@ int64_t BackupStoreContext::AddFile(IOStream &rFile, int64_t InDirectory,
 
 		if(MarkFileWithSameNameAsOldVersions)
 		{
-			BackupStoreDirectory::Iterator i(dir);
-			BackupStoreDirectory::Entry *e = 0;
-			while((e = i.Next()) != 0)
+			// Only look at the ones which aren't old versions already
+			std::vector<BackupStoreDirectory::Entry *> sameName;
+			dir.FindEntriesByName(rFilename, sameName,
+				BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
+				BackupStoreDirectory::Entry::Flags_OldVersion);
+			for(std::vector<BackupStoreDirectory::Entry *>::iterator
+				i(sameName.begin()); i != sameName.end(); ++i)
 			{
-				// First, check it's not an old version (cheaper comparison)
-				if(! e->IsOld())
-				{
-					// Compare name
-					if(e->GetName() == rFilename)
-					{
-						// Check that it's definately not an old version
-						ASSERT((e->GetFlags() & BackupStoreDirectory::Entry::Flags_OldVersion) == 0);
-						// Set old version flag
-						e->AddFlags(BackupStoreDirectory::Entry::Flags_OldVersion);
-						// Can safely do this, because we know we won't be here if it's already 
-						// an old version
-						adjustment.mBlocksInOldFiles += e->GetSizeInBlocks();
-						adjustment.mBlocksInCurrentFiles -= e->GetSizeInBlocks();
-						adjustment.mNumOldFiles++;
-						adjustment.mNumCurrentFiles--;
-					}
-				}
+				BackupStoreDirectory::Entry *e = *i;
+				// Set old version flag
+				e->AddFlags(BackupStoreDirectory::Entry::Flags_OldVersion);
+				// Can safely do this, because we know we won't be here if it's already 
+				// an old version
+				adjustment.mBlocksInOldFiles += e->GetSizeInBlocks();
+				adjustment.mBlocksInCurrentFiles -= e->GetSizeInBlocks();
+				adjustment.mNumOldFiles++;
+				adjustment.mNumCurrentFiles--;
 			}
 		}
 
@@ -826,45 +914,44 @@ bool BackupStoreContext::DeleteFile(const BackupStoreFilename &rFilename, int64_
 
 	try
 	{
-		// Iterate through directory, only looking at files which haven't been deleted
-		BackupStoreDirectory::Iterator i(dir);
-		BackupStoreDirectory::Entry *e = 0;
-		while((e = i.Next(BackupStoreDirectory::Entry::Flags_File,
-			BackupStoreDirectory::Entry::Flags_Deleted)) != 0)
+		// Find the files with this name which haven't been deleted
+		std::vector<BackupStoreDirectory::Entry *> sameName;
+		dir.FindEntriesByName(rFilename, sameName,
+			BackupStoreDirectory::Entry::Flags_File,
+			BackupStoreDirectory::Entry::Flags_Deleted);
+		for(std::vector<BackupStoreDirectory::Entry *>::iterator
+			i(sameName.begin()); i != sameName.end(); ++i)
 		{
-			// Compare name
-			if(e->GetName() == rFilename)
+			BackupStoreDirectory::Entry *e = *i;
+			// Check that it's definately not already deleted
+			ASSERT(!e->IsDeleted());
+			// Set deleted flag
+			e->AddFlags(BackupStoreDirectory::Entry::Flags_Deleted);
+			// Mark as made a change
+			madeChanges = true;
+
+			int64_t blocks = e->GetSizeInBlocks();
+			mapStoreInfo->AdjustNumDeletedFiles(1);
+			mapStoreInfo->ChangeBlocksInDeletedFiles(blocks);
+
+			// We're marking all old versions as deleted.
+			// This is how a file can be old and deleted
+			// at the same time. So we don't subtract from
+			// number or size of old files. But if it was
+			// a current file, then it's not any more, so
+			// we do need to adjust the current counts.
+			if(!e->IsOld())
 			{
-				// Check that it's definately not already deleted
-				ASSERT(!e->IsDeleted());
-				// Set deleted flag
-				e->AddFlags(BackupStoreDirectory::Entry::Flags_Deleted);
-				// Mark as made a change
-				madeChanges = true;
-
-				int64_t blocks = e->GetSizeInBlocks();
-				mapStoreInfo->AdjustNumDeletedFiles(1);
-				mapStoreInfo->ChangeBlocksInDeletedFiles(blocks);
-
-				// We're marking all old versions as deleted.
-				// This is how a file can be old and deleted
-				// at the same time. So we don't subtract from
-				// number or size of old files. But if it was
-				// a current file, then it's not any more, so
-				// we do need to adjust the current counts.
-				if(!e->IsOld())
-				{
-					mapStoreInfo->AdjustNumCurrentFiles(-1);
-					mapStoreInfo->ChangeBlocksInCurrentFiles(-blocks);
-				}
+				mapStoreInfo->AdjustNumCurrentFiles(-1);
+				mapStoreInfo->ChangeBlocksInCurrentFiles(-blocks);
+			}
 
-				// Is this the last version?
-				if((e->GetFlags() & BackupStoreDirectory::Entry::Flags_OldVersion) == 0)
-				{
-					// Yes. It's been found.
-					rObjectIDOut = e->GetObjectID();
-					fileExisted = true;
-				}
+			// Is this the last version?
+			if((e->GetFlags() & BackupStoreDirectory::Entry::Flags_OldVersion) == 0)
+			{
+				// Yes. It's been found.
+				rObjectIDOut = e->GetObjectID();
+				fileExisted = true;
 			}
 		}
 
@@ -979,11 +1066,15 @@ bool BackupStoreContext::UndeleteFile(int64_t ObjectID, int64_t InDirectory)
 // --------------------------------------------------------------------------
 void BackupStoreContext::RemoveDirectoryFromCache(int64_t ObjectID)
 {
-	std::map<int64_t, BackupStoreDirectory*>::iterator item(mDirectoryCache.find(ObjectID));
+	std::map<int64_t, CachedDirectory>::iterator item(mDirectoryCache.find(ObjectID));
 	if(item != mDirectoryCache.end())
 	{
 		// Delete this cached object
-		delete item->second;
+		delete item->second.mpDirectory;
+		// Invalidated ones have already been removed from these
+		mDirectoryCacheAge.erase(std::make_pair(item->second.mLastUsed,
+			ObjectID));
+		mDirectoryCacheSize -= item->second.mSize;
 		// Erase the entry form the map
 		mDirectoryCache.erase(item);
 	}
@@ -994,7 +1085,10 @@ void BackupStoreContext::RemoveDirectoryFromCache(int64_t ObjectID)
 //
 // Function
 //		Name:    BackupStoreContext::SaveDirectory(BackupStoreDirectory &)
-//		Purpose: Save directory back to disc, update time in cache
+//		Purpose: Save directory back to disc, update time in cache.
+//			 The changes are appended to the directory's journal
+//			 unless it's too big, when the directory is written in
+//			 full and the journal deleted.
 //		Created: 2003/09/04
 //
 // --------------------------------------------------------------------------
@@ -1014,33 +1108,43 @@ void BackupStoreContext::SaveDirectory(BackupStoreDirectory &rDir)
 		MakeObjectFilename(ObjectID, dirfn);
 		int64_t old_dir_size = rDir.GetUserInfo1_SizeInBlocks();
 
+		// The size of the directory includes its journal, so it's
+		// counted in the blocks used like the object
+		int64_t dirSize = 0;
+		if(!AppendToDirectoryJournal(rDir, dirfn, dirSize))
 		{
 			RaidFileWrite writeDir(mStoreDiscSet, dirfn);
 			writeDir.Open(true /* allow overwriting */);
 
 			BufferedWriteStream buffer(writeDir);
-			rDir.WriteToStream(buffer);
+			rDir.WriteToStore(buffer, mCompactDirectories);
 			buffer.Flush();
 
 			// get the disc usage (must do this before commiting it)
-			int64_t dirSize = writeDir.GetDiscUsageInBlocks();
+			dirSize = writeDir.GetDiscUsageInBlocks();
 
 			// Commit directory
 			writeDir.Commit(BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY);
 
-			// Make sure the size of the directory is available for writing the dir back
-			ASSERT(dirSize > 0);
-			int64_t sizeAdjustment = dirSize - rDir.GetUserInfo1_SizeInBlocks();
-			mapStoreInfo->ChangeBlocksUsed(sizeAdjustment);
-			mapStoreInfo->ChangeBlocksInDirectories(sizeAdjustment);
-			// Update size stored in directory
-			rDir.SetUserInfo1_SizeInBlocks(dirSize);
+			// The journal's changes are in the directory now
+			BackupStoreDirectoryJournal::Delete(mStoreDiscSet, dirfn);
+			mDirectoryJournalSizes.erase(ObjectID);
 		}
+		rDir.ClearChanges();
+
+		// Make sure the size of the directory is available for writing the dir back
+		ASSERT(dirSize > 0);
+		int64_t sizeAdjustment = dirSize - old_dir_size;
+		mapStoreInfo->ChangeBlocksUsed(sizeAdjustment);
+		mapStoreInfo->ChangeBlocksInDirectories(sizeAdjustment);
+		// Update size stored in directory
+		rDir.SetUserInfo1_SizeInBlocks(dirSize);
 
 		// Refresh revision ID in cache
 		{
 			int64_t revid = 0;
-			if(!RaidFileRead::FileExists(mStoreDiscSet, dirfn, &revid))
+			if(!BackupStoreDirectoryJournal::GetRevisionID(mStoreDiscSet,
+				dirfn, revid))
 			{
 				THROW_EXCEPTION(BackupStoreException, Internal)
 			}
@@ -1052,6 +1156,17 @@ void BackupStoreContext::SaveDirectory(BackupStoreDirectory &rDir)
 			rDir.SetRevisionID(revid);
 		}
 
+		// It may have changed size in memory too
+		std::map<int64_t, CachedDirectory>::iterator
+			item(mDirectoryCache.find(ObjectID));
+		if(item != mDirectoryCache.end() &&
+			item->second.mpDirectory == &rDir)
+		{
+			int64_t newSize = rDir.GetMemoryUsage();
+			mDirectoryCacheSize += newSize - item->second.mSize;
+			item->second.mSize = newSize;
+		}
+
 		// Update the directory entry in the grandparent, to ensure
 		// that it reflects the current size of the parent directory.
 		int64_t new_dir_size = rDir.GetUserInfo1_SizeInBlocks();
@@ -1082,13 +1197,77 @@ void BackupStoreContext::SaveDirectory(BackupStoreDirectory &rDir)
 	}
 	catch(...)
 	{
-		// Remove it from the cache if anything went wrong
+		// Remove it from the cache if anything went wrong, and don't
+		// append to a journal which may have been partly written
 		RemoveDirectoryFromCache(ObjectID);
+		mDirectoryJournalSizes.erase(ObjectID);
 		throw;
 	}
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::AppendToDirectoryJournal(BackupStoreDirectory &, const std::string &, int64_t &)
+//		Purpose: Private. Appends the changes made to a directory to
+//			 its journal, carrying on with one left by an earlier
+//			 session, or starting a new one, and returns the new
+//			 size of the directory with its journal. Returns false
+//			 if the directory should be written in full instead,
+//			 because the journal is too big.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreContext::AppendToDirectoryJournal(BackupStoreDirectory &rDir,
+	const std::string &rFilename, int64_t &rSizeInBlocksOut)
+{
+	if(mDirectoryJournalMaxSize <= 0)
+	{
+		return false;
+	}
+
+	int64_t ObjectID = rDir.GetObjectID();
+	int64_t oldJournalSize = 0, baseRevID = 0;
+	std::map<int64_t, int64_t>::iterator
+		size(mDirectoryJournalSizes.find(ObjectID));
+	if(size != mDirectoryJournalSizes.end())
+	{
+		oldJournalSize = size->second;
+	}
+	else
+	{
+		if(!RaidFileRead::FileExists(mStoreDiscSet, rFilename,
+			&baseRevID))
+		{
+			THROW_EXCEPTION(BackupStoreException, Internal)
+		}
+
+		// The directory was read with any existing journal applied,
+		// and its size included
+		oldJournalSize = BackupStoreDirectoryJournal::Resume(
+			mStoreDiscSet, rFilename, ObjectID, baseRevID);
+	}
+
+	if(oldJournalSize >= mDirectoryJournalMaxSize)
+	{
+		return false;
+	}
+
+	int64_t newJournalSize = BackupStoreDirectoryJournal::Append(
+		mStoreDiscSet, rFilename, rDir,
+		(oldJournalSize == 0) ? baseRevID : 0);
+	mDirectoryJournalSizes[ObjectID] = newJournalSize;
+
+	rSizeInBlocksOut = rDir.GetUserInfo1_SizeInBlocks() -
+		BackupStoreDirectoryJournal::GetSizeInBlocks(mStoreDiscSet,
+			oldJournalSize) +
+		BackupStoreDirectoryJournal::GetSizeInBlocks(mStoreDiscSet,
+			newJournalSize);
+	return true;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1122,19 +1301,17 @@ int64_t BackupStoreContext::AddDirectory(int64_t InDirectory,
 	// Get the directory we want to modify
 	BackupStoreDirectory &dir(GetDirectoryInternal(InDirectory));
 
-	// Scan the directory for the name (only looking for directories which already exist)
+	// Look for the name (only looking for directories which already exist)
 	{
-		BackupStoreDirectory::Iterator i(dir);
-		BackupStoreDirectory::Entry *en = 0;
-		while((en = i.Next(BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
-			BackupStoreDirectory::Entry::Flags_Deleted | BackupStoreDirectory::Entry::Flags_OldVersion)) != 0)	// Ignore deleted and old directories
+		std::vector<BackupStoreDirectory::Entry *> sameName;
+		dir.FindEntriesByName(rFilename, sameName,
+			BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
+			BackupStoreDirectory::Entry::Flags_Deleted | BackupStoreDirectory::Entry::Flags_OldVersion);	// Ignore deleted and old directories
+		if(!sameName.empty())
 		{
-			if(en->GetName() == rFilename)
-			{
-				// Already exists
-				rAlreadyExists = true;
-				return en->GetObjectID();
-			}
+			// Already exists
+			rAlreadyExists = true;
+			return sameName.front()->GetObjectID();
 		}
 	}
 
@@ -1154,7 +1331,7 @@ int64_t BackupStoreContext::AddDirectory(int64_t InDirectory,
 		// Write...
 		RaidFileWrite dirFile(mStoreDiscSet, fn);
 		dirFile.Open(false /* no overwriting */);
-		emptyDir.WriteToStream(dirFile);
+		emptyDir.WriteToStore(dirFile, mCompactDirectories);
 		// Get disc usage, before it's commited
 		dirSize = dirFile.GetDiscUsageInBlocks();
 
@@ -1461,33 +1638,24 @@ bool BackupStoreContext::ChangeFileAttributes(const BackupStoreFilename &rFilena
 		// Get the directory we want to modify
 		BackupStoreDirectory &dir(GetDirectoryInternal(InDirectory));
 
-		// Find the file entry
-		BackupStoreDirectory::Entry *en = 0;
-		// Iterate through current versions of files, only
-		BackupStoreDirectory::Iterator i(dir);
-		while((en = i.Next(
+		// Find the file entry, looking at current versions of files only
+		std::vector<BackupStoreDirectory::Entry *> sameName;
+		dir.FindEntriesByName(rFilename, sameName,
 			BackupStoreDirectory::Entry::Flags_File,
-			BackupStoreDirectory::Entry::Flags_Deleted | BackupStoreDirectory::Entry::Flags_OldVersion)
-			) != 0)
-		{
-			if(en->GetName() == rFilename)
-			{
-				// Set attributes
-				en->SetAttributes(Attributes, AttributesHash);
-
-				// Tell caller the object ID
-				rObjectIDOut = en->GetObjectID();
-
-				// Done
-				break;
-			}
-		}
-		if(en == 0)
+			BackupStoreDirectory::Entry::Flags_Deleted | BackupStoreDirectory::Entry::Flags_OldVersion);
+		if(sameName.empty())
 		{
 			// Didn't find it
 			return false;
 		}
 
+		BackupStoreDirectory::Entry *en = sameName.front();
+		// Set attributes
+		en->SetAttributes(Attributes, AttributesHash);
+
+		// Tell caller the object ID
+		rObjectIDOut = en->GetObjectID();
+
 		// Save back
 		SaveDirectory(dir);
 	}
@@ -1558,10 +1726,9 @@ bool BackupStoreContext::ObjectExists(int64_t ObjectID, int MustBe)
 #endif
 
 		// Right one?
-		uint32_t requiredMagic = (MustBe == ObjectExists_File)?OBJECTMAGIC_FILE_MAGIC_VALUE_V1:OBJECTMAGIC_DIR_MAGIC_VALUE;
-
-		// Check
-		if(ntohl(magic) != requiredMagic)
+		if(MustBe == ObjectExists_File
+			? (ntohl(magic) != OBJECTMAGIC_FILE_MAGIC_VALUE_V1)
+			: !OBJECTMAGIC_IS_DIR_MAGIC_VALUE(ntohl(magic)))
 		{
 			return false;
 		}
@@ -1595,6 +1762,28 @@ std::auto_ptr<IOStream> BackupStoreContext::OpenObject(int64_t ObjectID)
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreContext::GetObjectRevisionID(int64_t)
+//		Purpose: Returns the revision ID of the file storing an
+//			 object, which changes whenever the file is rewritten
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreContext::GetObjectRevisionID(int64_t ObjectID)
+{
+	std::string fn;
+	MakeObjectFilename(ObjectID, fn);
+	int64_t revisionID = 0;
+	if(!RaidFileRead::FileExists(mStoreDiscSet, fn, &revisionID))
+	{
+		THROW_EXCEPTION(BackupStoreException, ObjectDoesNotExist)
+	}
+	return revisionID;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1718,37 +1907,30 @@ void BackupStoreContext::MoveObject(int64_t ObjectID, int64_t MoveFromDirectory,
 			}
 
 			// Check the new name doens't already exist (optionally ignoring deleted files)
+			std::vector<BackupStoreDirectory::Entry *> sameName;
+			dir.FindEntriesByName(rNewFilename, sameName,
+				BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
+				targetSearchExcludeFlags);
+			if(!sameName.empty())
 			{
-				BackupStoreDirectory::Iterator i(dir);
-				BackupStoreDirectory::Entry *c = 0;
-				while((c = i.Next(BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING, targetSearchExcludeFlags)) != 0)
-				{
-					if(c->GetName() == rNewFilename)
-					{
-						THROW_EXCEPTION(BackupStoreException, NameAlreadyExistsInDirectory)
-					}
-				}
+				THROW_EXCEPTION(BackupStoreException, NameAlreadyExistsInDirectory)
 			}
 
 			// Need to get all the entries with the same name?
 			if(MoveAllWithSameName)
 			{
-				// Iterate through the directory, copying all with matching names
-				BackupStoreDirectory::Iterator i(dir);
-				BackupStoreDirectory::Entry *c = 0;
-				while((c = i.Next()) != 0)
+				// Rename all the entries with matching names
+				dir.FindEntriesByName(en->GetName(), sameName);
+				for(std::vector<BackupStoreDirectory::Entry *>::iterator
+					i(sameName.begin()); i != sameName.end(); ++i)
 				{
-					if(c->GetName() == en->GetName())
-					{
-						// Rename this one
-						c->SetName(rNewFilename);
-					}
+					dir.RenameEntry(*i, rNewFilename);
 				}
 			}
 			else
 			{
-				// Just copy this one
-				en->SetName(rNewFilename);
+				// Just rename this one
+				dir.RenameEntry(en, rNewFilename);
 			}
 
 			// Save the directory back
@@ -1793,7 +1975,8 @@ void BackupStoreContext::MoveObject(int64_t ObjectID, int64_t MoveFromDirectory,
 			// Need to get all the entries with the same name?
 			if(MoveAllWithSameName)
 			{
-				// Iterate through the directory, copying all with matching names
+				// Copy all the entries with matching names, in the
+				// order they're in the directory
 				BackupStoreDirectory::Iterator i(from);
 				BackupStoreDirectory::Entry *c = 0;
 				while((c = i.Next()) != 0)
@@ -1827,14 +2010,13 @@ void BackupStoreContext::MoveObject(int64_t ObjectID, int64_t MoveFromDirectory,
 
 			// Check the new name doens't already exist
 			{
-				BackupStoreDirectory::Iterator i(to);
-				BackupStoreDirectory::Entry *c = 0;
-				while((c = i.Next(BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING, targetSearchExcludeFlags)) != 0)
+				std::vector<BackupStoreDirectory::Entry *> sameName;
+				to.FindEntriesByName(rNewFilename, sameName,
+					BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING,
+					targetSearchExcludeFlags);
+				if(!sameName.empty())
 				{
-					if(c->GetName() == rNewFilename)
-					{
-						THROW_EXCEPTION(BackupStoreException, NameAlreadyExistsInDirectory)
-					}
+					THROW_EXCEPTION(BackupStoreException, NameAlreadyExistsInDirectory)
 				}
 			}
 
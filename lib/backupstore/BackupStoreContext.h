@@ -13,6 +13,8 @@
 #include <string>
 #include <map>
 #include <memory>
+#include <set>
+#include <utility>
 
 #include "autogen_BackupProtocol.h"
 #include "BackupStoreInfo.h"
@@ -21,6 +23,7 @@
 #include "Message.h"
 #include "Utils.h"
 
+class BackupStoreCombinedFileCache;
 class BackupStoreDirectory;
 class BackupStoreFilename;
 class IOStream;
@@ -169,6 +172,58 @@ public:
 	};
 	bool ObjectExists(int64_t ObjectID, int MustBe = ObjectExists_Anything);
 	std::auto_ptr<IOStream> OpenObject(int64_t ObjectID);
+	int64_t GetObjectRevisionID(int64_t ObjectID);
+
+	// Cache of old versions of files rebuilt from patches, if any
+	void SetCombinedFileCache(BackupStoreCombinedFileCache &rCache)
+	{
+		mpCombinedFileCache = &rCache;
+	}
+	BackupStoreCombinedFileCache *GetCombinedFileCache()
+	{
+		return mpCombinedFileCache;
+	}
+
+	// Cache of directories read from the store, in bytes of memory
+	void SetDirectoryCacheSize(int64_t MaxSize)
+	{
+		mDirectoryCacheMaxSize = MaxSize;
+	}
+	int64_t GetDirectoryCacheSize() const { return mDirectoryCacheSize; }
+	int GetNumberOfCachedDirectories() const
+	{
+		return mDirectoryCacheAge.size();
+	}
+	int64_t GetDirectoryCacheHits() const { return mDirectoryCacheHits; }
+	int64_t GetDirectoryCacheMisses() const
+	{
+		return mDirectoryCacheMisses;
+	}
+	int64_t GetDirectoryCacheEvictions() const
+	{
+		return mDirectoryCacheEvictions;
+	}
+	void LogDirectoryCacheStats() const;
+
+	// Changes to directories are appended to journals until they reach
+	// this size in bytes, when the directory is written in full instead.
+	// Zero, the default, writes directories in full every time, as
+	// servers older than this one ignore journals.
+	void SetDirectoryJournalMaxSize(int64_t MaxSize)
+	{
+		mDirectoryJournalMaxSize = MaxSize;
+	}
+	int64_t GetDirectoryJournalMaxSize() const
+	{
+		return mDirectoryJournalMaxSize;
+	}
+
+	// Directories are written in the compact format if this is set,
+	// which servers older than this one can't read
+	void SetCompactDirectories(bool Compact)
+	{
+		mCompactDirectories = Compact;
+	}
 	
 	// Info
 	int32_t GetClientID() const {return mClientID;}
@@ -179,8 +234,11 @@ private:
 	BackupStoreDirectory &GetDirectoryInternal(int64_t ObjectID,
 		bool AllowFlushCache = true);
 	void SaveDirectory(BackupStoreDirectory &rDir);
+	bool AppendToDirectoryJournal(BackupStoreDirectory &rDir,
+		const std::string &rFilename, int64_t &rSizeInBlocksOut);
 	void RemoveDirectoryFromCache(int64_t ObjectID);
 	void ClearDirectoryCache();
+	void TrimDirectoryCache(int64_t KeepObjectID);
 	void DeleteDirectoryRecurse(int64_t ObjectID, bool Undelete);
 	int64_t AllocateObjectID();
 
@@ -202,8 +260,30 @@ private:
 	// Refcount database
 	std::auto_ptr<BackupStoreRefCountDatabase> mapRefCount;
 
-	// Directory cache
-	std::map<int64_t, BackupStoreDirectory*> mDirectoryCache;
+	// Directory cache, and the directories in it in the order they
+	// were last used, with their approximate sizes in memory
+	typedef struct
+	{
+		BackupStoreDirectory *mpDirectory;
+		int64_t mSize;
+		int64_t mLastUsed;
+	} CachedDirectory;
+	std::map<int64_t, CachedDirectory> mDirectoryCache;
+	std::set<std::pair<int64_t, int64_t> > mDirectoryCacheAge;
+	int64_t mDirectoryCacheSize;
+	int64_t mDirectoryCacheMaxSize;
+	int64_t mNextDirectoryCacheUse;
+	int64_t mDirectoryCacheHits;
+	int64_t mDirectoryCacheMisses;
+	int64_t mDirectoryCacheEvictions;
+
+	// Sizes of the journals of directories which this session has
+	// appended to, so it knows when to compact them
+	std::map<int64_t, int64_t> mDirectoryJournalSizes;
+	int64_t mDirectoryJournalMaxSize;
+	bool mCompactDirectories;
+
+	BackupStoreCombinedFileCache *mpCombinedFileCache;
 
 public:
 	class TestHook
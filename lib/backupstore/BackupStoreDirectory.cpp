@@ -11,10 +11,13 @@
 
 #include <sys/types.h>
 
+#include <algorithm>
+
 #include "BackupStoreDirectory.h"
 #include "IOStream.h"
 #include "BackupStoreException.h"
 #include "BackupStoreObjectMagic.h"
+#include "MemBlockStream.h"
 
 #include "MemLeakFindOn.h"
 
@@ -53,6 +56,47 @@ typedef struct
 	int64_t mDependsOlder;
 } en_StreamFormatDepends;
 
+// The compact format is this header, then a table of en_CompactFormat
+// structures, then the data: the directory's attributes, then the name
+// and attributes of each entry.
+typedef struct
+{
+	int32_t mMagicValue;
+	int32_t mNumEntries;
+	int64_t mObjectID;
+	int64_t mContainerID;
+	uint64_t mAttributesModTime;
+	int32_t mAttributesSize;
+	uint32_t mDataSize;
+} dir_CompactFormat;
+
+typedef struct
+{
+	uint64_t mModificationTime;
+	int64_t mObjectID;
+	int64_t mSizeInBlocks;
+	uint64_t mAttributesHash;
+	int64_t mDependsNewer;
+	int64_t mDependsOlder;
+	uint32_t mDataOffset;	// of the name, followed by the attributes
+	int32_t mAttributesSize;
+	int16_t mFlags;
+} en_CompactFormat;
+
+// Changes written by WriteChangesToStream() are each a type, then the
+// container ID and attributes of the directory, an entry followed by its
+// dependency info, or the ID of an entry which has been deleted.
+#define DIRECTORY_CHANGE_HEADER		1
+#define DIRECTORY_CHANGE_ENTRY		2
+#define DIRECTORY_CHANGE_DELETE		3
+
+typedef struct
+{
+	int64_t mContainerID;
+	uint64_t mAttributesModTime;
+	// Then a StreamableMemBlock for attributes
+} dir_ChangeHeaderFormat;
+
 // Use default packing
 #ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
 #include "EndStructPackForWire.h"
@@ -77,8 +121,13 @@ BackupStoreDirectory::BackupStoreDirectory()
   mRevisionID(0),
   mObjectID(0),
   mContainerID(0),
+  mNumDeletedSlots(0),
   mAttributesModTime(0),
-  mUserInfo1(0)
+  mUserInfo1(0),
+  mIDIndexBuilt(false),
+  mNameIndexBuilt(false),
+  mHasDuplicateIDs(false),
+  mHeaderChanged(false)
 {
 	ASSERT(sizeof(uint64_t) == sizeof(box_time_t));
 }
@@ -100,8 +149,13 @@ BackupStoreDirectory::BackupStoreDirectory(int64_t ObjectID, int64_t ContainerID
   mRevisionID(0),
   mObjectID(ObjectID),
   mContainerID(ContainerID),
+  mNumDeletedSlots(0),
   mAttributesModTime(0),
-  mUserInfo1(0)
+  mUserInfo1(0),
+  mIDIndexBuilt(false),
+  mNameIndexBuilt(false),
+  mHasDuplicateIDs(false),
+  mHeaderChanged(false)
 {
 }
 
@@ -134,9 +188,24 @@ BackupStoreDirectory::~BackupStoreDirectory()
 void BackupStoreDirectory::ReadFromStream(IOStream &rStream, int Timeout)
 {
 	ASSERT(!mInvalidated); // Compiled out of release builds
-	// Get the header
+	// Get the magic value, which says which format the rest is in
 	dir_StreamFormat hdr;
-	if(!rStream.ReadFullBuffer(&hdr, sizeof(hdr), 0 /* not interested in bytes read if this fails */, Timeout))
+	if(!rStream.ReadFullBuffer(&hdr.mMagicValue, sizeof(hdr.mMagicValue),
+		0 /* not interested in bytes read if this fails */, Timeout))
+	{
+		THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
+	}
+
+	if(ntohl(hdr.mMagicValue) == OBJECTMAGIC_DIR_COMPACT_MAGIC_VALUE)
+	{
+		ReadCompactFromStream(rStream, Timeout);
+		return;
+	}
+
+	// Get the rest of the header
+	if(!rStream.ReadFullBuffer(((uint8_t *)&hdr) + sizeof(hdr.mMagicValue),
+		sizeof(hdr) - sizeof(hdr.mMagicValue),
+		0 /* not interested in bytes read if this fails */, Timeout))
 	{
 		THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 	}
@@ -173,6 +242,11 @@ void BackupStoreDirectory::ReadFromStream(IOStream &rStream, int Timeout)
 		delete (*i);
 	}
 	mEntries.clear();
+	mNumDeletedSlots = 0;
+	mEncodedData.clear();
+	ClearIndexes();
+	mHeaderChanged = false;
+	mDeletedEntryIDs.clear();
 
 	// Read them in!
 	for(int c = 0; c < count; ++c)
@@ -216,7 +290,7 @@ void BackupStoreDirectory::WriteToStream(IOStream &rStream, int16_t FlagsMustBeS
 {
 	ASSERT(!mInvalidated); // Compiled out of release builds
 	// Get count of entries
-	int32_t count = mEntries.size();
+	int32_t count = GetNumberOfEntries();
 	if(FlagsMustBeSet != Entry::Flags_INCLUDE_EVERYTHING || FlagsNotToBeSet != Entry::Flags_EXCLUDE_NOTHING)
 	{
 		// Need to count the entries
@@ -294,6 +368,459 @@ void BackupStoreDirectory::WriteToStream(IOStream &rStream, int16_t FlagsMustBeS
 	}
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::ReadCompactFromStream(IOStream &, int)
+//		Purpose: Private. Reads the rest of a directory in the
+//			 compact format, after its magic value. The table of
+//			 entries is decoded, but their names and attributes
+//			 are left in a buffer until they're used.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::ReadCompactFromStream(IOStream &rStream, int Timeout)
+{
+	dir_CompactFormat hdr;
+	if(!rStream.ReadFullBuffer(((uint8_t *)&hdr) + sizeof(hdr.mMagicValue),
+		sizeof(hdr) - sizeof(hdr.mMagicValue),
+		0 /* not interested in bytes read if this fails */, Timeout))
+	{
+		THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
+	}
+
+	int32_t count = ntohl(hdr.mNumEntries);
+	int32_t attributesSize = ntohl(hdr.mAttributesSize);
+	uint32_t dataSize = ntohl(hdr.mDataSize);
+	if(count < 0 || count > (0x7fffffff / (int)sizeof(en_CompactFormat)) ||
+		attributesSize < 0 || (uint32_t)attributesSize > dataSize ||
+		dataSize > 0x7fffffff)
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException, BadDirectoryFormat,
+			"Bad sizes in header of directory in " <<
+			rStream.ToString());
+	}
+
+	// Read the table and the data in one go each
+	std::vector<uint8_t> table(count * sizeof(en_CompactFormat));
+	std::vector<uint8_t> data(dataSize);
+	if((count > 0 && !rStream.ReadFullBuffer(&table[0], table.size(),
+		0 /* not interested in bytes read if this fails */, Timeout)) ||
+		(dataSize > 0 && !rStream.ReadFullBuffer(&data[0], data.size(),
+		0 /* not interested in bytes read if this fails */, Timeout)))
+	{
+		THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
+	}
+
+	mObjectID = box_ntoh64(hdr.mObjectID);
+	mContainerID = box_ntoh64(hdr.mContainerID);
+	mAttributesModTime = box_ntoh64(hdr.mAttributesModTime);
+	if(attributesSize > 0)
+	{
+		mAttributes.Set(&data[0], attributesSize);
+	}
+	else
+	{
+		mAttributes.Set(StreamableMemBlock());
+	}
+
+	// Clear existing list
+	for(std::vector<Entry*>::iterator i = mEntries.begin();
+		i != mEntries.end(); i++)
+	{
+		delete (*i);
+	}
+	mEntries.clear();
+	mNumDeletedSlots = 0;
+	ClearIndexes();
+	mHeaderChanged = false;
+	mDeletedEntryIDs.clear();
+	// The entries will point into the data, so it mustn't move again
+	mEncodedData.swap(data);
+	mEntries.reserve(count);
+
+	for(int32_t c = 0; c < count; ++c)
+	{
+		en_CompactFormat entry;
+		::memcpy(&entry, &table[c * sizeof(entry)], sizeof(entry));
+
+		// Check the name and attributes are in the data, so
+		// that they can be decoded without any more checks
+		uint32_t offset = ntohl(entry.mDataOffset);
+		int32_t entryAttributesSize = ntohl(entry.mAttributesSize);
+		unsigned int nameSize = 0;
+		if(dataSize >= 2 && offset <= dataSize - 2)
+		{
+			nameSize = BACKUPSTOREFILENAME_GET_SIZE(
+				&mEncodedData[offset]);
+		}
+		if(nameSize < 2 || nameSize > dataSize - offset ||
+			entryAttributesSize < 0 ||
+			(uint32_t)entryAttributesSize >
+				dataSize - offset - nameSize)
+		{
+			THROW_EXCEPTION_MESSAGE(BackupStoreException,
+				BadDirectoryFormat, "Bad name or attributes of "
+				"entry " << c << " of directory in " <<
+				rStream.ToString());
+		}
+		int encoding = BACKUPSTOREFILENAME_GET_ENCODING(
+			&mEncodedData[offset]);
+		if(encoding < BackupStoreFilename::Encoding_Min ||
+			encoding > BackupStoreFilename::Encoding_Max)
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				InvalidBackupStoreFilename)
+		}
+
+		Entry *pen = new Entry;
+		pen->mModificationTime = box_ntoh64(entry.mModificationTime);
+		pen->mObjectID = box_ntoh64(entry.mObjectID);
+		pen->mSizeInBlocks = box_ntoh64(entry.mSizeInBlocks);
+		pen->mAttributesHash = box_ntoh64(entry.mAttributesHash);
+		pen->mDependsNewer = box_ntoh64(entry.mDependsNewer);
+		pen->mDependsOlder = box_ntoh64(entry.mDependsOlder);
+		pen->mFlags = ntohs(entry.mFlags);
+		pen->mpEncodedName = &mEncodedData[offset];
+		pen->mEncodedNameSize = nameSize;
+		pen->mpEncodedAttributes = &mEncodedData[offset] + nameSize;
+		pen->mEncodedAttributesSize = entryAttributesSize;
+
+		// Can't fail, as there's space reserved
+		mEntries.push_back(pen);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::WriteToStore(IOStream &, bool)
+//		Purpose: Writes the whole directory to be stored on disc, in
+//			 the compact format if the store uses it, or else in
+//			 the standard format which older servers can read.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::WriteToStore(IOStream &rStream, bool Compact) const
+{
+	if(Compact)
+	{
+		WriteCompactToStream(rStream);
+	}
+	else
+	{
+		WriteToStream(rStream);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::WriteCompactToStream(IOStream &)
+//		Purpose: Writes the whole directory in the compact format,
+//			 which may be used for directories stored on disc,
+//			 with the dependency info of all the entries.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::WriteCompactToStream(IOStream &rStream) const
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+	// Check that sensible IDs have been set
+	ASSERT(mObjectID != 0);
+	ASSERT(mContainerID != 0);
+
+	// Build the table and the data in memory, to write them in one go
+	std::string table;
+	table.reserve(sizeof(dir_CompactFormat) +
+		GetNumberOfEntries() * sizeof(en_CompactFormat));
+	table.resize(sizeof(dir_CompactFormat));
+	std::string data((const char *)mAttributes.GetBuffer(),
+		mAttributes.GetSize());
+
+	Iterator i(*this);
+	const Entry *pentry = 0;
+	while((pentry = i.Next()) != 0)
+	{
+		const Entry &rEntry(*pentry);
+		if(data.size() > 0x7fffffff)
+		{
+			break;
+		}
+
+		en_CompactFormat entry;
+		entry.mModificationTime = box_hton64(rEntry.mModificationTime);
+		entry.mObjectID = box_hton64(rEntry.mObjectID);
+		entry.mSizeInBlocks = box_hton64(rEntry.mSizeInBlocks);
+		entry.mAttributesHash = box_hton64(rEntry.mAttributesHash);
+		entry.mDependsNewer = box_hton64(rEntry.mDependsNewer);
+		entry.mDependsOlder = box_hton64(rEntry.mDependsOlder);
+		entry.mDataOffset = htonl(data.size());
+		entry.mFlags = htons(rEntry.mFlags);
+
+		// Copy the name and attributes without decoding them
+		if(rEntry.mpEncodedName != 0)
+		{
+			data.append((const char *)rEntry.mpEncodedName,
+				rEntry.mEncodedNameSize);
+		}
+		else
+		{
+			data.append(rEntry.mName.GetEncodedFilename());
+		}
+		if(rEntry.mpEncodedAttributes != 0)
+		{
+			entry.mAttributesSize =
+				htonl(rEntry.mEncodedAttributesSize);
+			data.append((const char *)rEntry.mpEncodedAttributes,
+				rEntry.mEncodedAttributesSize);
+		}
+		else
+		{
+			entry.mAttributesSize =
+				htonl(rEntry.mAttributes.GetSize());
+			data.append((const char *)rEntry.mAttributes.GetBuffer(),
+				rEntry.mAttributes.GetSize());
+		}
+
+		table.append((const char *)&entry, sizeof(entry));
+	}
+
+	if(data.size() > 0x7fffffff)
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			DirectoryTooBigToStore, "Directory " <<
+			BOX_FORMAT_OBJECTID(mObjectID) << " has " <<
+			GetNumberOfEntries() << " entries");
+	}
+
+	dir_CompactFormat hdr;
+	hdr.mMagicValue = htonl(OBJECTMAGIC_DIR_COMPACT_MAGIC_VALUE);
+	hdr.mNumEntries = htonl(GetNumberOfEntries());
+	hdr.mObjectID = box_hton64(mObjectID);
+	hdr.mContainerID = box_hton64(mContainerID);
+	hdr.mAttributesModTime = box_hton64(mAttributesModTime);
+	hdr.mAttributesSize = htonl(mAttributes.GetSize());
+	hdr.mDataSize = htonl(data.size());
+	table.replace(0, sizeof(hdr), (const char *)&hdr, sizeof(hdr));
+
+	rStream.Write(table.c_str(), table.size());
+	rStream.Write(data.c_str(), data.size());
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::WriteChangesToStream(IOStream &)
+//		Purpose: Writes the changes made to the directory since they
+//			 were last cleared, which ReadChangesFromStream() can
+//			 make to the directory as it was then: the container
+//			 ID and attributes if they changed, the IDs of deleted
+//			 entries, and the entries which were added or changed,
+//			 in the order they are in the directory.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::WriteChangesToStream(IOStream &rStream) const
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+	if(mHeaderChanged)
+	{
+		int32_t type = htonl(DIRECTORY_CHANGE_HEADER);
+		rStream.Write(&type, sizeof(type));
+		dir_ChangeHeaderFormat hdr;
+		hdr.mContainerID = box_hton64(mContainerID);
+		hdr.mAttributesModTime = box_hton64(mAttributesModTime);
+		rStream.Write(&hdr, sizeof(hdr));
+		mAttributes.WriteToStream(rStream);
+	}
+
+	// Deletions first, so that an entry which was deleted and then added
+	// again ends up at the end of the directory, as it is now
+	for(std::vector<int64_t>::const_iterator i(mDeletedEntryIDs.begin());
+		i != mDeletedEntryIDs.end(); ++i)
+	{
+		int32_t type = htonl(DIRECTORY_CHANGE_DELETE);
+		rStream.Write(&type, sizeof(type));
+		int64_t id = box_hton64(*i);
+		rStream.Write(&id, sizeof(id));
+	}
+
+	Iterator i(*this);
+	Entry *pentry = 0;
+	while((pentry = i.Next()) != 0)
+	{
+		if(pentry->mChanged)
+		{
+			int32_t type = htonl(DIRECTORY_CHANGE_ENTRY);
+			rStream.Write(&type, sizeof(type));
+			pentry->WriteToStream(rStream);
+			pentry->WriteToStreamDependencyInfo(rStream);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::ReadChangesFromStream(IOStream &, int)
+//		Purpose: Reads changes written by WriteChangesToStream() up
+//			 to the end of the stream, and makes them. Changed
+//			 entries replace the ones with the same ID, and new
+//			 ones are added to the end. If the changes can't be
+//			 read, an exception is thrown before any are made.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::ReadChangesFromStream(IOStream &rStream, int Timeout)
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+	bool headerChanged = false;
+	dir_ChangeHeaderFormat hdr;
+	StreamableMemBlock attributes;
+	std::vector<int64_t> deleted;
+	std::vector<Entry*> changed;
+
+	try
+	{
+		while(true)
+		{
+			int32_t type;
+			int bytesRead = 0;
+			if(!rStream.ReadFullBuffer(&type, sizeof(type),
+				&bytesRead, Timeout))
+			{
+				if(bytesRead == 0)
+				{
+					// End of the changes
+					break;
+				}
+				THROW_EXCEPTION(BackupStoreException,
+					CouldntReadEntireStructureFromStream)
+			}
+
+			switch(ntohl(type))
+			{
+			case DIRECTORY_CHANGE_HEADER:
+				if(!rStream.ReadFullBuffer(&hdr, sizeof(hdr),
+					0 /* not interested in bytes read if this fails */,
+					Timeout))
+				{
+					THROW_EXCEPTION(BackupStoreException,
+						CouldntReadEntireStructureFromStream)
+				}
+				attributes.ReadFromStream(rStream, Timeout);
+				headerChanged = true;
+				break;
+
+			case DIRECTORY_CHANGE_ENTRY:
+				{
+					std::auto_ptr<Entry> apEntry(new Entry);
+					apEntry->ReadFromStream(rStream, Timeout);
+					apEntry->ReadFromStreamDependencyInfo(rStream,
+						Timeout);
+					changed.push_back(apEntry.get());
+					apEntry.release();
+				}
+				break;
+
+			case DIRECTORY_CHANGE_DELETE:
+				{
+					int64_t id;
+					if(!rStream.ReadFullBuffer(&id, sizeof(id),
+						0 /* not interested in bytes read if this fails */,
+						Timeout))
+					{
+						THROW_EXCEPTION(BackupStoreException,
+							CouldntReadEntireStructureFromStream)
+					}
+					deleted.push_back(box_ntoh64(id));
+				}
+				break;
+
+			default:
+				THROW_EXCEPTION_MESSAGE(BackupStoreException,
+					BadDirectoryFormat, "Unknown type of change " <<
+					ntohl(type) << " to directory " <<
+					BOX_FORMAT_OBJECTID(mObjectID) << " in " <<
+					rStream.ToString());
+			}
+		}
+	}
+	catch(...)
+	{
+		for(std::vector<Entry*>::iterator i(changed.begin());
+			i != changed.end(); ++i)
+		{
+			delete *i;
+		}
+		throw;
+	}
+
+	if(headerChanged)
+	{
+		mContainerID = box_ntoh64(hdr.mContainerID);
+		mAttributesModTime = box_ntoh64(hdr.mAttributesModTime);
+		mAttributes.Set(attributes);
+	}
+
+	for(std::vector<int64_t>::const_iterator i(deleted.begin());
+		i != deleted.end(); ++i)
+	{
+		if(FindEntryByID(*i) != 0)
+		{
+			DeleteEntry(*i);
+		}
+	}
+
+	// Changed entries are copied over the existing ones, which may
+	// change their names, so the name index must be built again
+	bool replaced = false;
+	for(std::vector<Entry*>::iterator i(changed.begin());
+		i != changed.end(); ++i)
+	{
+		Entry *pexisting = FindEntryByID((*i)->mObjectID);
+		if(pexisting != 0)
+		{
+			*pexisting = **i;
+			delete *i;
+			replaced = true;
+		}
+		else
+		{
+			mEntries.push_back(*i);
+			AddToIndexes(*i);
+		}
+	}
+
+	if(replaced)
+	{
+		ClearIndexes();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::ClearChanges()
+//		Purpose: Forgets the changes made to the directory, once
+//			 they have been saved.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::ClearChanges()
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+	mHeaderChanged = false;
+	mDeletedEntryIDs.clear();
+	Iterator i(*this);
+	Entry *pentry = 0;
+	while((pentry = i.Next()) != 0)
+	{
+		pentry->mChanged = false;
+	}
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -306,12 +833,19 @@ BackupStoreDirectory::Entry *BackupStoreDirectory::AddEntry(const Entry &rEntryT
 {
 	ASSERT(!mInvalidated); // Compiled out of release builds
 	Entry *pnew = new Entry(rEntryToCopy);
+	pnew->mChanged = true;
 	try
 	{
 		mEntries.push_back(pnew);
+		AddToIndexes(pnew);
 	}
 	catch(...)
 	{
+		if(!mEntries.empty() && mEntries.back() == pnew)
+		{
+			mEntries.pop_back();
+		}
+		ClearIndexes();
 		delete pnew;
 		throw;
 	}
@@ -335,12 +869,19 @@ BackupStoreDirectory::AddEntry(const BackupStoreFilename &rName,
 	ASSERT(!mInvalidated); // Compiled out of release builds
 	Entry *pnew = new Entry(rName, ModificationTime, ObjectID,
 		SizeInBlocks, Flags, AttributesHash);
+	pnew->mChanged = true;
 	try
 	{
 		mEntries.push_back(pnew);
+		AddToIndexes(pnew);
 	}
 	catch(...)
 	{
+		if(!mEntries.empty() && mEntries.back() == pnew)
+		{
+			mEntries.pop_back();
+		}
+		ClearIndexes();
 		delete pnew;
 		throw;
 	}
@@ -352,31 +893,63 @@ BackupStoreDirectory::AddEntry(const BackupStoreFilename &rName,
 //
 // Function
 //		Name:    BackupStoreDirectory::DeleteEntry(int64_t)
-//		Purpose: Deletes entry with given object ID (uses linear search, maybe a little inefficient)
+//		Purpose: Deletes entry with given object ID. Its slot is
+//			 found through the ID index, and left empty, so that
+//			 the entries after it keep their order and don't have
+//			 to move, until half the slots are empty.
 //		Created: 2003/08/27
 //
 // --------------------------------------------------------------------------
 void BackupStoreDirectory::DeleteEntry(int64_t ObjectID)
 {
 	ASSERT(!mInvalidated); // Compiled out of release builds
-	for(std::vector<Entry*>::iterator i(mEntries.begin());
-		i != mEntries.end(); ++i)
+	BuildIDIndex();
+	std::map<int64_t, size_t>::iterator i(mIDIndex.find(ObjectID));
+	if(i == mIDIndex.end())
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException,
+			CouldNotFindEntryInDirectory,
+			"Failed to find entry " << BOX_FORMAT_OBJECTID(ObjectID) <<
+			" in directory " << BOX_FORMAT_OBJECTID(mObjectID));
+	}
+	size_t slot = i->second;
+	Entry *pentry = mEntries[slot];
+	ASSERT(pentry->mObjectID == ObjectID);
+	mDeletedEntryIDs.push_back(ObjectID);
+
+	// Remove from the indexes
+	if(mHasDuplicateIDs)
+	{
+		ClearIndexes();
+	}
+	else
 	{
-		if((*i)->mObjectID == ObjectID)
+		mIDIndex.erase(i);
+		if(mNameIndexBuilt)
 		{
-			// Delete
-			delete (*i);
-			// Remove from list
-			mEntries.erase(i);
-			// Done
-			return;
+			std::map<std::string, std::vector<Entry*> >::iterator
+				n(mNameIndex.find(pentry->GetName().GetEncodedFilename()));
+			ASSERT(n != mNameIndex.end());
+			std::vector<Entry*> &rnamed(n->second);
+			rnamed.erase(std::find(rnamed.begin(), rnamed.end(),
+				pentry));
+			if(rnamed.empty())
+			{
+				mNameIndex.erase(n);
+			}
 		}
 	}
 
-	// Not found
-	THROW_EXCEPTION_MESSAGE(BackupStoreException, CouldNotFindEntryInDirectory,
-		"Failed to find entry " << BOX_FORMAT_OBJECTID(ObjectID) <<
-		" in directory " << BOX_FORMAT_OBJECTID(mObjectID));
+	// Remove from list
+	mEntries[slot] = 0;
+	++mNumDeletedSlots;
+	// Delete
+	delete pentry;
+
+	if(mNumDeletedSlots * 2 > mEntries.size())
+	{
+		RemoveDeletedSlots();
+	}
 }
 
 
@@ -391,18 +964,271 @@ void BackupStoreDirectory::DeleteEntry(int64_t ObjectID)
 BackupStoreDirectory::Entry *BackupStoreDirectory::FindEntryByID(int64_t ObjectID) const
 {
 	ASSERT(!mInvalidated); // Compiled out of release builds
+	BuildIDIndex();
+	std::map<int64_t, size_t>::const_iterator i(mIDIndex.find(ObjectID));
+	if(i == mIDIndex.end())
+	{
+		// Not found
+		return 0;
+	}
+
+	// Found
+	Entry *pentry = mEntries[i->second];
+	ASSERT(pentry->mObjectID == ObjectID);
+	return pentry;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::FindEntriesByName(const BackupStoreFilename &, std::vector<Entry*> &, int16_t, int16_t)
+//		Purpose: Finds all the entries with the given name which
+//			 match the flags, not necessarily in the order they
+//			 are in the directory. Clears the vector first.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::FindEntriesByName(const BackupStoreFilename &rName,
+	std::vector<Entry*> &rEntriesOut, int16_t FlagsMustBeSet,
+	int16_t FlagsNotToBeSet) const
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+	rEntriesOut.clear();
+	BuildNameIndex();
+	std::map<std::string, std::vector<Entry*> >::const_iterator
+		n(mNameIndex.find(rName.GetEncodedFilename()));
+	if(n == mNameIndex.end())
+	{
+		return;
+	}
+
+	for(std::vector<Entry*>::const_iterator i(n->second.begin());
+		i != n->second.end(); ++i)
+	{
+		// Catch entries renamed with Entry::SetName()
+		ASSERT((*i)->GetName() == rName);
+		if((*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet))
+		{
+			rEntriesOut.push_back(*i);
+		}
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::RenameEntry(Entry *, const BackupStoreFilename &)
+//		Purpose: Changes the name of an entry in this directory.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::RenameEntry(Entry *pEntry,
+	const BackupStoreFilename &rNewName)
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+	if(!mNameIndexBuilt)
+	{
+		pEntry->SetName(rNewName);
+		return;
+	}
+
+	std::map<std::string, std::vector<Entry*> >::iterator
+		n(mNameIndex.find(pEntry->GetName().GetEncodedFilename()));
+	ASSERT(n != mNameIndex.end());
+	std::vector<Entry*> &rnamed(n->second);
+	rnamed.erase(std::find(rnamed.begin(), rnamed.end(), pEntry));
+	if(rnamed.empty())
+	{
+		mNameIndex.erase(n);
+	}
+
+	pEntry->SetName(rNewName);
+	try
+	{
+		mNameIndex[rNewName.GetEncodedFilename()].push_back(pEntry);
+	}
+	catch(...)
+	{
+		ClearIndexes();
+		throw;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::BuildIDIndex()
+//		Purpose: Private. Builds the index of the slots of the
+//			 entries by ID, if it hasn't been built already.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::BuildIDIndex() const
+{
+	if(mIDIndexBuilt)
+	{
+		return;
+	}
+
+	mIDIndex.clear();
+	mHasDuplicateIDs = false;
+	for(size_t s = 0; s < mEntries.size(); ++s)
+	{
+		// Skip the slots of deleted entries, and the null entries
+		// CheckAndFix() may find in a damaged directory
+		if(mEntries[s] == 0)
+		{
+			continue;
+		}
+		if(!mIDIndex.insert(std::make_pair(mEntries[s]->mObjectID,
+			s)).second)
+		{
+			mHasDuplicateIDs = true;
+		}
+	}
+	mIDIndexBuilt = true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::BuildNameIndex()
+//		Purpose: Private. Builds the index of the entries by name,
+//			 if it hasn't been built already. This decodes the
+//			 names of all the entries.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::BuildNameIndex() const
+{
+	if(mNameIndexBuilt)
+	{
+		return;
+	}
+
+	mNameIndex.clear();
 	for(std::vector<Entry*>::const_iterator i(mEntries.begin());
 		i != mEntries.end(); ++i)
 	{
-		if((*i)->mObjectID == ObjectID)
+		if(*i != 0)
 		{
-			// Found
-			return (*i);
+			mNameIndex[(*i)->GetName().GetEncodedFilename()].push_back(*i);
 		}
 	}
+	mNameIndexBuilt = true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::ClearIndexes()
+//		Purpose: Private. Throws away the indexes, so that they're
+//			 built again when they're next needed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::ClearIndexes()
+{
+	mIDIndex.clear();
+	mNameIndex.clear();
+	mIDIndexBuilt = false;
+	mNameIndexBuilt = false;
+	mHasDuplicateIDs = false;
+}
+
 
-	// Not found
-	return 0;
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::AddToIndexes(Entry *)
+//		Purpose: Private. Adds an entry which has just been added
+//			 to the end of the directory to the indexes which
+//			 have been built.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::AddToIndexes(Entry *pEntry)
+{
+	ASSERT(!mEntries.empty() && mEntries.back() == pEntry);
+	if(mIDIndexBuilt && !mIDIndex.insert(std::make_pair(pEntry->mObjectID,
+		mEntries.size() - 1)).second)
+	{
+		mHasDuplicateIDs = true;
+	}
+	if(mNameIndexBuilt)
+	{
+		mNameIndex[pEntry->GetName().GetEncodedFilename()].push_back(pEntry);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::RemoveDeletedSlots()
+//		Purpose: Private. Removes the empty slots left by deleted
+//			 entries, in one pass over the list, and throws away
+//			 the ID index, as the entries have moved.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::RemoveDeletedSlots()
+{
+	if(mNumDeletedSlots == 0)
+	{
+		return;
+	}
+
+	mEntries.erase(std::remove(mEntries.begin(), mEntries.end(),
+		(Entry *)0), mEntries.end());
+	mNumDeletedSlots = 0;
+	mIDIndex.clear();
+	mIDIndexBuilt = false;
+	mHasDuplicateIDs = false;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::GetMemoryUsage()
+//		Purpose: Returns roughly how many bytes of memory the
+//			 directory and its entries use.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDirectory::GetMemoryUsage() const
+{
+	ASSERT(!mInvalidated); // Compiled out of release builds
+	int64_t size = sizeof(BackupStoreDirectory) + mAttributes.GetSize() +
+		mEntries.capacity() * sizeof(Entry *) + mEncodedData.capacity();
+	Iterator i(*this);
+	const Entry *pentry = 0;
+	while((pentry = i.Next()) != 0)
+	{
+		size += sizeof(Entry) +
+			pentry->mName.GetEncodedFilename().size() +
+			pentry->mAttributes.GetSize();
+	}
+	// Roughly, as the allocator adds some overhead to each node of the
+	// maps too
+	size += mIDIndex.size() * (sizeof(std::pair<int64_t, size_t>) +
+		4 * sizeof(void *));
+	if(mNameIndexBuilt)
+	{
+		for(std::map<std::string, std::vector<Entry*> >::const_iterator
+			n(mNameIndex.begin()); n != mNameIndex.end(); ++n)
+		{
+			size += sizeof(*n) + 4 * sizeof(void *) + n->first.size() +
+				n->second.capacity() * sizeof(Entry *);
+		}
+	}
+	return size;
 }
 
 
@@ -427,7 +1253,12 @@ BackupStoreDirectory::Entry::Entry()
   mMinMarkNumber(0),
   mMarkNumber(0),
   mDependsNewer(0),
-  mDependsOlder(0)
+  mDependsOlder(0),
+  mpEncodedName(0),
+  mpEncodedAttributes(0),
+  mEncodedNameSize(0),
+  mEncodedAttributesSize(0),
+  mChanged(false)
 {
 }
 
@@ -447,7 +1278,9 @@ BackupStoreDirectory::Entry::~Entry()
 //
 // Function
 //		Name:    BackupStoreDirectory::Entry::Entry(const Entry &)
-//		Purpose: Copy constructor
+//		Purpose: Copy constructor. The copy doesn't depend on
+//			 the directory the original is in, so the name and
+//			 attributes are decoded first if necessary.
 //		Created: 2003/08/26
 //
 // --------------------------------------------------------------------------
@@ -456,18 +1289,31 @@ BackupStoreDirectory::Entry::Entry(const Entry &rToCopy)
 #ifndef BOX_RELEASE_BUILD
   mInvalidated(false),
 #endif
-  mName(rToCopy.mName),
   mModificationTime(rToCopy.mModificationTime),
   mObjectID(rToCopy.mObjectID),
   mSizeInBlocks(rToCopy.mSizeInBlocks),
   mFlags(rToCopy.mFlags),
   mAttributesHash(rToCopy.mAttributesHash),
-  mAttributes(rToCopy.mAttributes),
   mMinMarkNumber(rToCopy.mMinMarkNumber),
   mMarkNumber(rToCopy.mMarkNumber),
   mDependsNewer(rToCopy.mDependsNewer),
-  mDependsOlder(rToCopy.mDependsOlder)
+  mDependsOlder(rToCopy.mDependsOlder),
+  mpEncodedName(0),
+  mpEncodedAttributes(0),
+  mEncodedNameSize(0),
+  mEncodedAttributesSize(0),
+  mChanged(rToCopy.mChanged)
 {
+	if(rToCopy.mpEncodedName != 0)
+	{
+		rToCopy.DecodeName();
+	}
+	if(rToCopy.mpEncodedAttributes != 0)
+	{
+		rToCopy.DecodeAttributes();
+	}
+	mName = rToCopy.mName;
+	mAttributes.Set(rToCopy.mAttributes);
 }
 
 
@@ -493,7 +1339,12 @@ BackupStoreDirectory::Entry::Entry(const BackupStoreFilename &rName, box_time_t
   mMinMarkNumber(0),
   mMarkNumber(0),
   mDependsNewer(0),
-  mDependsOlder(0)
+  mDependsOlder(0),
+  mpEncodedName(0),
+  mpEncodedAttributes(0),
+  mEncodedNameSize(0),
+  mEncodedAttributesSize(0),
+  mChanged(false)
 {
 }
 
@@ -526,6 +1377,7 @@ void BackupStoreDirectory::Entry::ReadFromStream(IOStream &rStream, int Timeout)
 
 	// Get the attributes
 	mAttributes.ReadFromStream(rStream, Timeout);
+	mpEncodedAttributes = 0;
 
 	// Store the rest of the bits
 	mModificationTime =		box_ntoh64(entry.mModificationTime);
@@ -534,6 +1386,7 @@ void BackupStoreDirectory::Entry::ReadFromStream(IOStream &rStream, int Timeout)
 	mAttributesHash =		box_ntoh64(entry.mAttributesHash);
 	mFlags = 				ntohs(entry.mFlags);
 	mName =					name;
+	mpEncodedName = 0;
 }
 
 
@@ -560,10 +1413,66 @@ void BackupStoreDirectory::Entry::WriteToStream(IOStream &rStream) const
 	rStream.Write(&entry, sizeof(entry));
 
 	// Write the filename
-	mName.WriteToStream(rStream);
+	if(mpEncodedName != 0)
+	{
+		// The encoded name is already in the same format
+		rStream.Write(mpEncodedName, mEncodedNameSize);
+	}
+	else
+	{
+		mName.WriteToStream(rStream);
+	}
 
 	// Write any attributes
-	mAttributes.WriteToStream(rStream);
+	if(mpEncodedAttributes != 0)
+	{
+		int32_t sizenbo = htonl(mEncodedAttributesSize);
+		rStream.Write(&sizenbo, sizeof(sizenbo));
+		if(mEncodedAttributesSize > 0)
+		{
+			rStream.Write(mpEncodedAttributes,
+				mEncodedAttributesSize);
+		}
+	}
+	else
+	{
+		mAttributes.WriteToStream(rStream);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::Entry::DecodeName()
+//		Purpose: Private. Decodes the name of an entry read from the
+//			 compact format, which was checked when it was read.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::Entry::DecodeName() const
+{
+	ASSERT(mpEncodedName != 0);
+	MemBlockStream stream(mpEncodedName, mEncodedNameSize);
+	mName.ReadFromStream(stream, IOStream::TimeOutInfinite);
+	mpEncodedName = 0;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectory::Entry::DecodeAttributes()
+//		Purpose: Private. Decodes the attributes of an entry read
+//			 from the compact format.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectory::Entry::DecodeAttributes() const
+{
+	ASSERT(mpEncodedAttributes != 0);
+	mAttributes.Set((void *)mpEncodedAttributes, mEncodedAttributesSize);
+	mpEncodedAttributes = 0;
 }
 
 
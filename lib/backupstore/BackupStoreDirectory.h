@@ -10,6 +10,7 @@
 #ifndef BACKUPSTOREDIRECTORY__H
 #define BACKUPSTOREDIRECTORY__H
 
+#include <map>
 #include <string>
 #include <vector>
 
@@ -42,7 +43,10 @@ public:
 		for (std::vector<Entry*>::iterator i = mEntries.begin();
 			i != mEntries.end(); i++)
 		{
-			(*i)->Invalidate();
+			if(*i != 0)
+			{
+				(*i)->Invalidate();
+			}
 		}
 	}
 #endif
@@ -57,17 +61,29 @@ public:
 	// Convenience constructor from a stream
 	BackupStoreDirectory(IOStream& rStream,
 		int Timeout = IOStream::TimeOutInfinite)
+	:
 #ifndef BOX_RELEASE_BUILD
-	: mInvalidated(false)
+	  mInvalidated(false),
 #endif
+	  mNumDeletedSlots(0),
+	  mIDIndexBuilt(false),
+	  mNameIndexBuilt(false),
+	  mHasDuplicateIDs(false),
+	  mHeaderChanged(false)
 	{
 		ReadFromStream(rStream, Timeout);
 	}
 	BackupStoreDirectory(std::auto_ptr<IOStream> apStream,
 		int Timeout = IOStream::TimeOutInfinite)
+	:
 #ifndef BOX_RELEASE_BUILD
-	: mInvalidated(false)
+	  mInvalidated(false),
 #endif
+	  mNumDeletedSlots(0),
+	  mIDIndexBuilt(false),
+	  mNameIndexBuilt(false),
+	  mHasDuplicateIDs(false),
+	  mHeaderChanged(false)
 	{
 		ReadFromStream(*apStream, Timeout);
 	}
@@ -102,6 +118,10 @@ public:
 		const BackupStoreFilename &GetName() const
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
+			if(mpEncodedName != 0)
+			{
+				DecodeName();
+			}
 			return mName;
 		}
 		box_time_t GetModificationTime() const
@@ -115,11 +135,13 @@ public:
 			return mObjectID;
 		}
 		// SetObjectID is dangerous! It should only be used when
-		// creating a snapshot.
+		// creating a snapshot, and never on an entry which is in a
+		// directory, as the directory's index wouldn't be updated.
 		void SetObjectID(int64_t NewObjectID)
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mObjectID = NewObjectID;
+			mChanged = true;
 		}
 		int64_t GetSizeInBlocks() const
 		{
@@ -135,40 +157,57 @@ public:
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mFlags |= Flags;
+			mChanged = true;
 		}
 		void RemoveFlags(int16_t Flags)
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mFlags &= ~Flags;
+			mChanged = true;
 		}
 
-		// Some things can be changed
+		// Some things can be changed. Rename entries which are in a
+		// directory with BackupStoreDirectory::RenameEntry() instead,
+		// which keeps the directory's index up to date.
 		void SetName(const BackupStoreFilename &rNewName)
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mName = rNewName;
+			mpEncodedName = 0;
+			mChanged = true;
 		}
 		void SetSizeInBlocks(int64_t SizeInBlocks)
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mSizeInBlocks = SizeInBlocks;
+			mChanged = true;
 		}
 
 		// Attributes
 		bool HasAttributes() const
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
+			if(mpEncodedAttributes != 0)
+			{
+				return mEncodedAttributesSize > 0;
+			}
 			return !mAttributes.IsEmpty();
 		}
 		void SetAttributes(const StreamableMemBlock &rAttr, uint64_t AttributesHash)
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mAttributes.Set(rAttr);
+			mpEncodedAttributes = 0;
 			mAttributesHash = AttributesHash;
+			mChanged = true;
 		}
 		const StreamableMemBlock &GetAttributes() const
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
+			if(mpEncodedAttributes != 0)
+			{
+				DecodeAttributes();
+			}
 			return mAttributes;
 		}
 		uint64_t GetAttributesHash() const
@@ -246,6 +285,7 @@ public:
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mDependsNewer = ObjectID;
+			mChanged = true;
 		}
 		// older version which depends on this
 		int64_t GetDependsOlder() const
@@ -257,6 +297,7 @@ public:
 		{
 			ASSERT(!mInvalidated); // Compiled out of release builds
 			mDependsOlder = ObjectID;
+			mChanged = true;
 		}
 
 		// Dependency info saving
@@ -269,18 +310,31 @@ public:
 		void WriteToStreamDependencyInfo(IOStream &rStream) const;
 
 	private:
-		BackupStoreFilename mName;
+		void DecodeName() const;
+		void DecodeAttributes() const;
+
+		mutable BackupStoreFilename mName;
 		box_time_t mModificationTime;
 		int64_t mObjectID;
 		int64_t mSizeInBlocks;
 		int16_t mFlags;
 		uint64_t mAttributesHash;
-		StreamableMemBlock mAttributes;
+		mutable StreamableMemBlock mAttributes;
 		uint32_t mMinMarkNumber;
 		uint32_t mMarkNumber;
 
 		uint64_t mDependsNewer;	// new version this depends on
 		uint64_t mDependsOlder;	// older version which depends on this
+
+		// Entries read from the compact format leave their name and
+		// attributes in the directory's buffer until they're used
+		mutable const uint8_t *mpEncodedName;
+		mutable const uint8_t *mpEncodedAttributes;
+		int mEncodedNameSize;
+		int mEncodedAttributesSize;
+
+		// Changed since the directory's changes were last cleared
+		bool mChanged;
 	};
 
 #ifndef BOX_RELEASE_BUILD
@@ -295,7 +349,14 @@ public:
 			int16_t FlagsMustBeSet = Entry::Flags_INCLUDE_EVERYTHING,
 			int16_t FlagsNotToBeSet = Entry::Flags_EXCLUDE_NOTHING,
 			bool StreamAttributes = true, bool StreamDependencyInfo = true) const;
-			
+	void WriteCompactToStream(IOStream &rStream) const;
+	void WriteToStore(IOStream &rStream, bool Compact) const;
+
+	// Changes since they were last cleared, for journals of directories
+	void WriteChangesToStream(IOStream &rStream) const;
+	void ReadChangesFromStream(IOStream &rStream, int Timeout);
+	void ClearChanges();
+
 	Entry *AddEntry(const Entry &rEntryToCopy);
 	Entry *AddEntry(const BackupStoreFilename &rName,
 		box_time_t ModificationTime, int64_t ObjectID,
@@ -303,6 +364,11 @@ public:
 		uint64_t AttributesHash);
 	void DeleteEntry(int64_t ObjectID);
 	Entry *FindEntryByID(int64_t ObjectID) const;
+	void FindEntriesByName(const BackupStoreFilename &rName,
+		std::vector<Entry*> &rEntriesOut,
+		int16_t FlagsMustBeSet = Entry::Flags_INCLUDE_EVERYTHING,
+		int16_t FlagsNotToBeSet = Entry::Flags_EXCLUDE_NOTHING) const;
+	void RenameEntry(Entry *pEntry, const BackupStoreFilename &rNewName);
 
 	int64_t GetObjectID() const
 	{
@@ -320,6 +386,7 @@ public:
 	{
 		ASSERT(!mInvalidated); // Compiled out of release builds
 		mContainerID = ContainerID;
+		mHeaderChanged = true;
 	}
 
 	// Purely for use of server -- not serialised into streams
@@ -337,8 +404,9 @@ public:
 	unsigned int GetNumberOfEntries() const
 	{
 		ASSERT(!mInvalidated); // Compiled out of release builds
-		return mEntries.size();
+		return mEntries.size() - mNumDeletedSlots;
 	}
+	int64_t GetMemoryUsage() const;
 
 	// User info -- not serialised into streams
 	int64_t GetUserInfo1_SizeInBlocks() const
@@ -364,6 +432,7 @@ public:
 		ASSERT(!mInvalidated); // Compiled out of release builds
 		mAttributes.Set(rAttr);
 		mAttributesModTime = AttributesModTime;
+		mHeaderChanged = true;
 	}
 	const StreamableMemBlock &GetAttributes() const
 	{
@@ -388,8 +457,9 @@ public:
 		BackupStoreDirectory::Entry *Next(int16_t FlagsMustBeSet = Entry::Flags_INCLUDE_EVERYTHING, int16_t FlagsNotToBeSet = Entry::Flags_EXCLUDE_NOTHING)
 		{
 			ASSERT(!mrDir.mInvalidated); // Compiled out of release builds
-			// Skip over things which don't match the required flags
-			while(i != mrDir.mEntries.end() && !(*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet))
+			// Skip over things which don't match the required flags,
+			// and the slots of deleted entries
+			while(i != mrDir.mEntries.end() && (*i == 0 || !(*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet)))
 			{
 				++i;
 			}
@@ -410,7 +480,8 @@ public:
 			ASSERT(!mrDir.mInvalidated); // Compiled out of release builds
 			// Skip over things which don't match the required flags or filename
 			while( (i != mrDir.mEntries.end())
-				&& ( (!(*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet))
+				&& ( *i == 0
+					|| (!(*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet))
 					|| (BackupStoreFilenameClear((*i)->GetName()).GetClearFilename() != rFilename.GetClearFilename()) ) )
 			{
 				++i;
@@ -443,8 +514,9 @@ public:
 		BackupStoreDirectory::Entry *Next(int16_t FlagsMustBeSet = Entry::Flags_INCLUDE_EVERYTHING, int16_t FlagsNotToBeSet = Entry::Flags_EXCLUDE_NOTHING)
 		{
 			ASSERT(!mrDir.mInvalidated); // Compiled out of release builds
-			// Skip over things which don't match the required flags
-			while(i != mrDir.mEntries.rend() && !(*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet))
+			// Skip over things which don't match the required flags,
+			// and the slots of deleted entries
+			while(i != mrDir.mEntries.rend() && (*i == 0 || !(*i)->MatchesFlags(FlagsMustBeSet, FlagsNotToBeSet)))
 			{
 				++i;
 			}
@@ -479,13 +551,45 @@ public:
 	void Dump(void *clibFileHandle, bool ToTrace); // first arg is FILE *, but avoid including stdio.h everywhere
 
 private:
+	void ReadCompactFromStream(IOStream &rStream, int Timeout);
+	void BuildIDIndex() const;
+	void BuildNameIndex() const;
+	void ClearIndexes();
+	void AddToIndexes(Entry *pEntry);
+	void RemoveDeletedSlots();
+
 	int64_t mRevisionID;
 	int64_t mObjectID;
 	int64_t mContainerID;
 	std::vector<Entry*> mEntries;
+	// Deleted entries leave a null pointer in their slot, so that the
+	// others don't move, until there are enough to remove in one go
+	size_t mNumDeletedSlots;
 	box_time_t mAttributesModTime;
 	StreamableMemBlock mAttributes;
 	int64_t mUserInfo1;
+
+	// The names and attributes of the entries, if the directory was read
+	// from the compact format, which are decoded when they're first used
+	std::vector<uint8_t> mEncodedData;
+
+	// Indexes of the entries by object ID, to their slots in mEntries,
+	// and by encoded name. Each is built the first time it's needed,
+	// so that finding entries by ID doesn't decode their names, and
+	// then kept up to date as entries are added, removed and renamed.
+	// Only the first entry with each ID is indexed, so if there are
+	// others (which only happens in a damaged directory) the indexes
+	// are thrown away whenever an entry is deleted, and built again.
+	mutable bool mIDIndexBuilt;
+	mutable bool mNameIndexBuilt;
+	mutable bool mHasDuplicateIDs;
+	mutable std::map<int64_t, size_t> mIDIndex;
+	mutable std::map<std::string, std::vector<Entry*> > mNameIndex;
+
+	// What has changed since the changes were last cleared, apart from
+	// the entries which say that they have changed themselves
+	bool mHeaderChanged;
+	std::vector<int64_t> mDeletedEntryIDs;
 };
 
 #endif // BACKUPSTOREDIRECTORY__H
@@ -0,0 +1,600 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreDirectoryJournal.cpp
+//		Purpose: Journals of changes to directories in the store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#include <map>
+#include <memory>
+
+#include "BackupStoreDirectory.h"
+#include "BackupStoreDirectoryJournal.h"
+#include "BackupStoreObjectMagic.h"
+#include "BufferedStream.h"
+#include "CollectInBufferStream.h"
+#include "CommonException.h"
+#include "FileStream.h"
+#include "Logging.h"
+#include "MemBlockStream.h"
+#include "RaidFileController.h"
+#include "RaidFileRead.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+// Not listed by RaidFileRead::ReadDirectoryContents(), so that checks of
+// the store don't take journals for spurious files
+#define DIRECTORY_JOURNAL_EXTENSION	".rfj"
+
+// set packing to one byte
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "BeginStructPackForWire.h"
+#else
+BEGIN_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+typedef struct
+{
+	int32_t mMagicValue;
+	int64_t mObjectID;
+	int64_t mBaseRevisionID;	// of the object the changes apply to
+	// Then each save, as a uint32_t size and the changes written
+	// by BackupStoreDirectory::WriteChangesToStream()
+} dirj_FileHeader;
+
+// Use default packing
+#ifdef STRUCTURE_PACKING_FOR_WIRE_USE_HEADERS
+#include "EndStructPackForWire.h"
+#else
+END_STRUCTURE_PACKING_FOR_WIRE
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::GetNumberOfCopies(int)
+//		Purpose: Returns the number of copies of each journal kept,
+//			 one on each disc of the disc set.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStoreDirectoryJournal::GetNumberOfCopies(int DiscSet)
+{
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	return rcontroller.GetDiscSet(DiscSet).size();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::GetFilename(int, const std::string &, int)
+//		Purpose: Returns the OS filename of the copy of the journal of
+//			 a directory object on the disc given.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::string BackupStoreDirectoryJournal::GetFilename(int DiscSet,
+	const std::string &rObjectFilename, int Disc)
+{
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	RaidFileDiscSet &rdiscSet(rcontroller.GetDiscSet(DiscSet));
+	return rdiscSet[Disc] + DIRECTORY_SEPARATOR + rObjectFilename +
+		DIRECTORY_JOURNAL_EXTENSION;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::Exists(int, const std::string &)
+//		Purpose: Returns whether a directory object has a journal,
+//			 which may be out of date, on any disc.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreDirectoryJournal::Exists(int DiscSet,
+	const std::string &rObjectFilename)
+{
+	for(int disc = 0; disc < GetNumberOfCopies(DiscSet); disc++)
+	{
+		if(ObjectExists(GetFilename(DiscSet, rObjectFilename, disc)) ==
+			ObjectExists_File)
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::GetSizeInBlocks(int, int64_t)
+//		Purpose: Returns the disc space used by all the copies of a
+//			 journal of the size given, in blocks, which counts
+//			 towards the size of its directory.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDirectoryJournal::GetSizeInBlocks(int DiscSet,
+	int64_t JournalSize)
+{
+	RaidFileController &rcontroller(RaidFileController::GetController());
+	RaidFileDiscSet &rdiscSet(rcontroller.GetDiscSet(DiscSet));
+	int64_t blockSize = rdiscSet.GetBlockSize();
+	return ((JournalSize + blockSize - 1) / blockSize) * rdiscSet.size();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::MakeRevisionID(int64_t, int64_t)
+//		Purpose: Private. The revision ID of a directory with its
+//			 journal applied. The object's revision ID only
+//			 changes when it's rewritten, so the size of the
+//			 journal, which changes with every save, is mixed in.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDirectoryJournal::MakeRevisionID(int64_t BaseRevisionID,
+	int64_t JournalSize)
+{
+	return BaseRevisionID ^ (JournalSize << 32);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::GetRevisionID(int, const std::string &, int64_t &)
+//		Purpose: Gets the revision ID of a directory with its journal
+//			 applied, as returned by Apply(), without reading
+//			 either. Returns false if the object doesn't exist.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreDirectoryJournal::GetRevisionID(int DiscSet,
+	const std::string &rObjectFilename, int64_t &rRevisionIDOut)
+{
+	int64_t revisionID = 0;
+	if(!RaidFileRead::FileExists(DiscSet, rObjectFilename, &revisionID))
+	{
+		return false;
+	}
+
+	// The largest copy is the one read, unless it's damaged
+	int64_t journalSize = 0;
+	for(int disc = 0; disc < GetNumberOfCopies(DiscSet); disc++)
+	{
+		std::string filename(GetFilename(DiscSet, rObjectFilename,
+			disc));
+		EMU_STRUCT_STAT st;
+		if(EMU_STAT(filename.c_str(), &st) == 0 &&
+			st.st_size > journalSize)
+		{
+			journalSize = st.st_size;
+		}
+	}
+
+	rRevisionIDOut = MakeRevisionID(revisionID, journalSize);
+	return true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::GetCompleteSize(const CollectInBufferStream &, const std::string &, int64_t, int64_t)
+//		Purpose: Private. Returns the size of a copy of a journal up
+//			 to the end of the last save which was completely
+//			 written, or 0 if it doesn't apply to the object with
+//			 the revision ID given.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDirectoryJournal::GetCompleteSize(
+	const CollectInBufferStream &rJournal, const std::string &rFilename,
+	int64_t ObjectID, int64_t BaseRevisionID)
+{
+	const uint8_t *pdata = (const uint8_t *)rJournal.GetBuffer();
+	int64_t size = rJournal.GetSize();
+
+	dirj_FileHeader hdr;
+	if(size < (int64_t)sizeof(hdr))
+	{
+		BOX_WARNING("Ignoring truncated journal of directory " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << ": " << rFilename);
+		return 0;
+	}
+
+	::memcpy(&hdr, pdata, sizeof(hdr));
+	if(ntohl(hdr.mMagicValue) != OBJECTMAGIC_DIR_JOURNAL_MAGIC_VALUE ||
+		(int64_t)box_ntoh64(hdr.mObjectID) != ObjectID)
+	{
+		BOX_WARNING("Ignoring bad journal of directory " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << ": " << rFilename);
+		return 0;
+	}
+
+	if((int64_t)box_ntoh64(hdr.mBaseRevisionID) != BaseRevisionID)
+	{
+		// The directory has been rewritten since, with the changes
+		BOX_TRACE("Ignoring out of date journal of directory " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << ": " << rFilename);
+		return 0;
+	}
+
+	// A save which isn't complete is still being written, or the
+	// connection writing it died, in which case its client got no reply.
+	int64_t complete = sizeof(hdr);
+	while(complete + (int64_t)sizeof(uint32_t) <= size)
+	{
+		uint32_t changesSize;
+		::memcpy(&changesSize, pdata + complete, sizeof(changesSize));
+		int64_t end = complete + sizeof(changesSize) + ntohl(changesSize);
+		if(end > size)
+		{
+			break;
+		}
+		complete = end;
+	}
+
+	return complete;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::Read(int, const std::string &, int64_t, int64_t, int64_t &, int64_t &)
+//		Purpose: Private. Reads the copy of the journal of a
+//			 directory with the most complete saves for the
+//			 object with the revision ID given, and returns it
+//			 with the size of those saves, which is 0 if none of
+//			 the copies apply. Also returns the size of the
+//			 largest copy, for the revision ID.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<CollectInBufferStream> BackupStoreDirectoryJournal::Read(
+	int DiscSet, const std::string &rObjectFilename, int64_t ObjectID,
+	int64_t BaseRevisionID, int64_t &rCompleteSizeOut,
+	int64_t &rLargestSizeOut)
+{
+	std::auto_ptr<CollectInBufferStream> best;
+	rCompleteSizeOut = 0;
+	rLargestSizeOut = 0;
+
+	// Usually the copies are all the same, so read the largest first,
+	// and only read the others if it's damaged or incomplete
+	std::multimap<int64_t, int> copies;
+	for(int disc = 0; disc < GetNumberOfCopies(DiscSet); disc++)
+	{
+		std::string filename(GetFilename(DiscSet, rObjectFilename,
+			disc));
+		EMU_STRUCT_STAT st;
+		if(EMU_STAT(filename.c_str(), &st) == 0)
+		{
+			copies.insert(std::make_pair((int64_t)st.st_size, disc));
+		}
+	}
+
+	for(std::multimap<int64_t, int>::reverse_iterator
+		i(copies.rbegin()); i != copies.rend(); i++)
+	{
+		if(i->first <= rCompleteSizeOut)
+		{
+			// Can't have more complete saves than the best so far
+			if(i->first > rLargestSizeOut)
+			{
+				rLargestSizeOut = i->first;
+			}
+			continue;
+		}
+
+		// Read it all at once, as it's compacted long before it
+		// gets big
+		std::string filename(GetFilename(DiscSet, rObjectFilename,
+			i->second));
+		std::auto_ptr<CollectInBufferStream> journal(
+			new CollectInBufferStream);
+		try
+		{
+			FileStream file(filename);
+			file.CopyStreamTo(*journal);
+		}
+		catch(BoxException &e)
+		{
+			// The connection which wrote it may have just deleted
+			// it, having rewritten the whole directory
+			BOX_TRACE("Failed to read journal of directory " <<
+				BOX_FORMAT_OBJECTID(ObjectID) << ": " <<
+				e.what());
+			continue;
+		}
+		journal->SetForReading();
+
+		if(journal->GetSize() > rLargestSizeOut)
+		{
+			rLargestSizeOut = journal->GetSize();
+		}
+
+		int64_t complete = GetCompleteSize(*journal, filename,
+			ObjectID, BaseRevisionID);
+		if(complete > rCompleteSizeOut)
+		{
+			rCompleteSizeOut = complete;
+			best = journal;
+		}
+	}
+
+	return best;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::Apply(int, const std::string &, int64_t, BackupStoreDirectory &, int64_t *)
+//		Purpose: Makes the changes in the journal of a directory to
+//			 the directory, just read from the object with the
+//			 revision ID given, if the journal applies to it.
+//			 Returns the revision ID of the directory with its
+//			 journal applied, and clears its changes. Optionally
+//			 returns the disc usage of the journal applied.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDirectoryJournal::Apply(int DiscSet,
+	const std::string &rObjectFilename, int64_t BaseRevisionID,
+	BackupStoreDirectory &rDir, int64_t *pSizeInBlocksOut)
+{
+	int64_t completeSize = 0, largestSize = 0;
+	std::auto_ptr<CollectInBufferStream> journal(Read(DiscSet,
+		rObjectFilename, rDir.GetObjectID(), BaseRevisionID,
+		completeSize, largestSize));
+	int64_t revisionID = MakeRevisionID(BaseRevisionID, largestSize);
+	if(pSizeInBlocksOut != 0)
+	{
+		*pSizeInBlocksOut = GetSizeInBlocks(DiscSet, completeSize);
+	}
+	if(completeSize == 0)
+	{
+		return revisionID;
+	}
+
+	journal->Seek(sizeof(dirj_FileHeader), IOStream::SeekType_Absolute);
+	while(journal->GetPosition() < completeSize)
+	{
+		uint32_t size;
+		journal->Read(&size, sizeof(size));
+		size = ntohl(size);
+
+		MemBlockStream changes((const char *)journal->GetBuffer() +
+			journal->GetPosition(), size);
+		journal->Seek(size, IOStream::SeekType_Relative);
+		try
+		{
+			rDir.ReadChangesFromStream(changes,
+				IOStream::TimeOutInfinite);
+		}
+		catch(BoxException &e)
+		{
+			BOX_ERROR("Ignoring the rest of the damaged journal "
+				"of directory " <<
+				BOX_FORMAT_OBJECTID(rDir.GetObjectID()) <<
+				": " << e.what());
+			break;
+		}
+	}
+
+	rDir.ClearChanges();
+	return revisionID;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::Resume(int, const std::string &, int64_t, int64_t)
+//		Purpose: Prepares to append to a journal left by an earlier
+//			 session, which has been applied to the directory,
+//			 by making every copy of it the same as the one read,
+//			 without any incomplete save at the end. Returns its
+//			 size, or 0 if there isn't one for the object with the
+//			 revision ID given, so a new one must be started.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDirectoryJournal::Resume(int DiscSet,
+	const std::string &rObjectFilename, int64_t ObjectID,
+	int64_t BaseRevisionID)
+{
+	int64_t completeSize = 0, largestSize = 0;
+	std::auto_ptr<CollectInBufferStream> journal(Read(DiscSet,
+		rObjectFilename, ObjectID, BaseRevisionID, completeSize,
+		largestSize));
+	if(completeSize == 0)
+	{
+		return 0;
+	}
+
+	// Copies which are the same size as the one read are assumed to
+	// be the same, but any others were damaged, or not completely
+	// written when a session ended.
+	for(int disc = 0; disc < GetNumberOfCopies(DiscSet); disc++)
+	{
+		std::string filename(GetFilename(DiscSet, rObjectFilename,
+			disc));
+		EMU_STRUCT_STAT st;
+		if(EMU_STAT(filename.c_str(), &st) == 0 &&
+			st.st_size == completeSize)
+		{
+			continue;
+		}
+
+		BOX_INFO("Repairing journal of directory " <<
+			BOX_FORMAT_OBJECTID(ObjectID) << ": " << filename);
+		FileStream file(filename, O_WRONLY | O_CREAT | O_TRUNC |
+			O_BINARY);
+		file.Write(journal->GetBuffer(), completeSize);
+		Sync(file, filename);
+	}
+
+	return completeSize;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::Append(int, const std::string &, const BackupStoreDirectory &, int64_t)
+//		Purpose: Appends the changes made to a directory since they
+//			 were last cleared to every copy of its journal, or if
+//			 a revision ID is given, replaces the journal with a
+//			 new one for the object with that revision ID. The
+//			 changes are flushed to the discs before returning the
+//			 new size of the journal.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t BackupStoreDirectoryJournal::Append(int DiscSet,
+	const std::string &rObjectFilename, const BackupStoreDirectory &rDir,
+	int64_t BaseRevisionID)
+{
+	CollectInBufferStream buffer;
+	if(BaseRevisionID != 0)
+	{
+		dirj_FileHeader hdr;
+		hdr.mMagicValue = htonl(OBJECTMAGIC_DIR_JOURNAL_MAGIC_VALUE);
+		hdr.mObjectID = box_hton64(rDir.GetObjectID());
+		hdr.mBaseRevisionID = box_hton64(BaseRevisionID);
+		buffer.Write(&hdr, sizeof(hdr));
+	}
+
+	// Leave space for the size, and fill it in afterwards
+	uint32_t size = 0;
+	buffer.Write(&size, sizeof(size));
+	int start = buffer.GetSize();
+	rDir.WriteChangesToStream(buffer);
+	size = htonl(buffer.GetSize() - start);
+	::memcpy((char *)buffer.GetBuffer() + start - sizeof(size), &size,
+		sizeof(size));
+
+	// Each copy is written in one go, so that it's unlikely to be seen
+	// by a reader before it's complete, although it would be ignored
+	// if it was. The directory object is RAID, so the journal mustn't
+	// be lost with any one disc either.
+	int64_t journalSize = 0;
+	for(int disc = 0; disc < GetNumberOfCopies(DiscSet); disc++)
+	{
+		std::string filename(GetFilename(DiscSet, rObjectFilename,
+			disc));
+		FileStream file(filename, O_WRONLY | O_CREAT | O_BINARY |
+			((BaseRevisionID != 0) ? O_TRUNC : O_APPEND));
+		file.Write(buffer.GetBuffer(), buffer.GetSize());
+		Sync(file, filename);
+		journalSize = file.GetPosition();
+	}
+
+	return journalSize;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::Sync(FileStream &, const std::string &)
+//		Purpose: Private. Flushes a copy of a journal to the disc,
+//			 so that the changes in it aren't lost if the server
+//			 crashes after the client is told they're saved.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectoryJournal::Sync(FileStream &rFile,
+	const std::string &rFilename)
+{
+#ifdef WIN32
+	if(!::FlushFileBuffers(rFile.GetFileHandle()))
+	{
+		THROW_WIN_FILE_ERROR("Failed to flush journal", rFilename,
+			CommonException, OSFileError);
+	}
+#else
+	if(::fsync(rFile.GetFileHandle()) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to flush journal", rFilename,
+			CommonException, OSFileError);
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::Delete(int, const std::string &)
+//		Purpose: Deletes every copy of the journal of a directory
+//			 object, after the object has been rewritten. A
+//			 journal which can't be deleted is out of date, so
+//			 it's ignored anyway.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreDirectoryJournal::Delete(int DiscSet,
+	const std::string &rObjectFilename)
+{
+	for(int disc = 0; disc < GetNumberOfCopies(DiscSet); disc++)
+	{
+		std::string filename(GetFilename(DiscSet, rObjectFilename,
+			disc));
+		if(::unlink(filename.c_str()) != 0 && errno != ENOENT)
+		{
+			BOX_LOG_SYS_WARNING("Failed to delete journal of "
+				"directory: " << filename);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreDirectoryJournal::ReadDirectory(int, const std::string &, BackupStoreDirectory &, int64_t *)
+//		Purpose: Reads a directory object from the store and applies
+//			 its journal, optionally returning the disc usage of
+//			 the object and the journal. Returns true if the
+//			 object has a journal, so writing it in full would
+//			 compact the journal.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreDirectoryJournal::ReadDirectory(int DiscSet,
+	const std::string &rObjectFilename, BackupStoreDirectory &rDirOut,
+	int64_t *pSizeInBlocksOut)
+{
+	int64_t baseRevisionID = 0;
+	{
+		std::auto_ptr<RaidFileRead> file(RaidFileRead::Open(DiscSet,
+			rObjectFilename, &baseRevisionID));
+		if(pSizeInBlocksOut != 0)
+		{
+			*pSizeInBlocksOut = file->GetDiscUsageInBlocks();
+		}
+		BufferedStream buf(*file);
+		rDirOut.ReadFromStream(buf, IOStream::TimeOutInfinite);
+	}
+
+	int64_t journalSizeInBlocks = 0;
+	int64_t revisionID = Apply(DiscSet, rObjectFilename, baseRevisionID,
+		rDirOut, &journalSizeInBlocks);
+	rDirOut.SetRevisionID(revisionID);
+	if(pSizeInBlocksOut != 0)
+	{
+		*pSizeInBlocksOut += journalSizeInBlocks;
+	}
+	return revisionID != baseRevisionID;
+}
@@ -0,0 +1,85 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreDirectoryJournal.h
+//		Purpose: Journals of changes to directories in the store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREDIRECTORYJOURNAL__H
+#define BACKUPSTOREDIRECTORYJOURNAL__H
+
+#include <memory>
+#include <string>
+
+class BackupStoreDirectory;
+class CollectInBufferStream;
+class FileStream;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreDirectoryJournal
+//		Purpose: Journals of the changes made to directories in the
+//			 store, so that saving a change to a directory only
+//			 appends it to a file, instead of rewriting the whole
+//			 directory object and its RAID parity.
+//
+//			 The journal of a directory is a plain file, with a
+//			 copy on every disc of the disc set, so that it's as
+//			 safe as the RAID directory object. It starts with the
+//			 revision ID of the object it applies to, and is
+//			 ignored if the object has been rewritten since. Then
+//			 there are the changes written by each save, preceded
+//			 by their size, so that a save which hasn't been
+//			 completely written is ignored too. Readers use the
+//			 copy with the most complete saves. The disc space
+//			 used by the copies is counted in the size of the
+//			 directory, like its object.
+//
+//			 Journals are kept between sessions, and only
+//			 compacted, by rewriting the directory object in full,
+//			 when they get too big, or by housekeeping. Anything
+//			 which rewrites a directory object in full must have
+//			 read it with its journal applied, and then delete the
+//			 journal.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreDirectoryJournal
+{
+public:
+	static int GetNumberOfCopies(int DiscSet);
+	static std::string GetFilename(int DiscSet,
+		const std::string &rObjectFilename, int Disc);
+	static bool Exists(int DiscSet, const std::string &rObjectFilename);
+	static bool GetRevisionID(int DiscSet,
+		const std::string &rObjectFilename, int64_t &rRevisionIDOut);
+	static int64_t GetSizeInBlocks(int DiscSet, int64_t JournalSize);
+	static int64_t Apply(int DiscSet, const std::string &rObjectFilename,
+		int64_t BaseRevisionID, BackupStoreDirectory &rDir,
+		int64_t *pSizeInBlocksOut = 0);
+	static int64_t Resume(int DiscSet, const std::string &rObjectFilename,
+		int64_t ObjectID, int64_t BaseRevisionID);
+	static int64_t Append(int DiscSet, const std::string &rObjectFilename,
+		const BackupStoreDirectory &rDir, int64_t BaseRevisionID = 0);
+	static void Delete(int DiscSet, const std::string &rObjectFilename);
+	static bool ReadDirectory(int DiscSet,
+		const std::string &rObjectFilename,
+		BackupStoreDirectory &rDirOut, int64_t *pSizeInBlocksOut = 0);
+
+private:
+	static int64_t MakeRevisionID(int64_t BaseRevisionID,
+		int64_t JournalSize);
+	static int64_t GetCompleteSize(const CollectInBufferStream &rJournal,
+		const std::string &rFilename, int64_t ObjectID,
+		int64_t BaseRevisionID);
+	static std::auto_ptr<CollectInBufferStream> Read(int DiscSet,
+		const std::string &rObjectFilename, int64_t ObjectID,
+		int64_t BaseRevisionID, int64_t &rCompleteSizeOut,
+		int64_t &rLargestSizeOut);
+	static void Sync(FileStream &rFile, const std::string &rFilename);
+};
+
+#endif // BACKUPSTOREDIRECTORYJOURNAL__H
@@ -13,6 +13,7 @@
 	#include <unistd.h>
 #endif
 
+#include <ctype.h>
 #include <sys/stat.h>
 #include <string.h>
 #include <new>
@@ -25,8 +26,11 @@
 #include "BackupClientFileAttributes.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreException.h"
+#include "BackupStoreFileChecksum.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreFileCryptVar.h"
+#include "BackupStoreFileDecodePipeline.h"
+#include "BackupStoreFileDecryptContexts.h"
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreFileWire.h"
 #include "BackupStoreFilename.h"
@@ -37,15 +41,18 @@
 #include "CipherContext.h"
 #include "CollectInBufferStream.h"
 #include "Compress.h"
+#include "CompressCodec.h"
+#include "CryptoUtils.h"
+#include "FileHoles.h"
 #include "FileModificationTime.h"
 #include "FileStream.h"
 #include "Guards.h"
 #include "IOStream.h"
 #include "Logging.h"
-#include "MD5Digest.h"
 #include "Random.h"
 #include "ReadGatherStream.h"
 #include "RollingChecksum.h"
+#include "SparseFileStream.h"
 
 #include "MemLeakFindOn.h"
 
@@ -71,6 +78,8 @@ BackupStoreFileStats BackupStoreFile::msStats = {0,0,0};
 //			 Returns a stream. Most of the work is done by the stream
 //			 when data is actually requested -- the file will be held
 //			 open until the stream is deleted or the file finished.
+//			 Blocks are compressed with the given CompressCodec and
+//			 level.
 //		Created: 2003/08/28
 //
 // --------------------------------------------------------------------------
@@ -80,7 +89,8 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFile(
 	int64_t *pModificationTime,
 	ReadLoggingStream::Logger* pLogger,
 	RunStatusProvider* pRunStatusProvider,
-	BackgroundTask* pBackgroundTask)
+	BackgroundTask* pBackgroundTask, int CompressionCodec,
+	int CompressionLevel)
 {
 	// Create the stream
 	std::auto_ptr<BackupStoreFileEncodeStream> stream(
@@ -89,7 +99,7 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFile(
 	// Do the initial setup
 	stream->Setup(Filename, 0 /* no recipe, just encode */, ContainerID,
 		rStoreFilename, pModificationTime, pLogger, pRunStatusProvider,
-		pBackgroundTask);
+		pBackgroundTask, CompressionCodec, CompressionLevel);
 
 	// Return the stream for the caller
 	return stream;
@@ -197,6 +207,7 @@ bool BackupStoreFile::VerifyEncodedFileFormat(IOStream &rFile, int64_t *pDiffFro
 
 	// Check header
 	if((ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+		&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -531,6 +542,7 @@ void BackupStoreFile::VerifyStream::Close(bool CloseCopyStream)
 	memcpy(&blkhdr, finished.GetBuffer(), sizeof(blkhdr));
 
 	if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+		&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -539,6 +551,8 @@ void BackupStoreFile::VerifyStream::Close(bool CloseCopyStream)
 		THROW_EXCEPTION_MESSAGE(BackupStoreException, BadBackupStoreFile,
 			"Invalid block index magic in stream: expected " <<
 			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1) <<
+			", " <<
+			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2) <<
 			" or " <<
 			BOX_FORMAT_HEX32(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0) <<
 			" but found " <<
@@ -618,12 +632,15 @@ void BackupStoreFile::VerifyStream::Close(bool CloseCopyStream)
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::DecodeFile(IOStream &, const char *)
+//		Name:    BackupStoreFile::DecodeFile(IOStream &, const char *, int, const BackupClientFileAttributes *, BackupStoreFileDecryptContexts *)
 //		Purpose: Decode a file. Will set file attributes. File must not exist.
+//				 Pass private decryption contexts to decode on a
+//				 thread other than the main one.
 //		Created: 2003/08/28
 //
 // --------------------------------------------------------------------------
-void BackupStoreFile::DecodeFile(IOStream &rEncodedFile, const char *DecodedFilename, int Timeout, const BackupClientFileAttributes *pAlterativeAttr)
+void BackupStoreFile::DecodeFile(IOStream &rEncodedFile, const char *DecodedFilename, int Timeout, const BackupClientFileAttributes *pAlterativeAttr,
+	BackupStoreFileDecryptContexts *pDecryptContexts)
 {
 	// Does file exist?
 	EMU_STRUCT_STAT st;
@@ -635,17 +652,27 @@ void BackupStoreFile::DecodeFile(IOStream &rEncodedFile, const char *DecodedFile
 	// Try, delete output file if error
 	try
 	{
-		// Make a stream for outputting this file
-		FileStream out(DecodedFilename, O_WRONLY | O_CREAT | O_EXCL);
+		// Make a stream for outputting this file, which can leave
+		// runs of zeros as holes, so that sparse files are restored
+		// sparse
+		SparseFileStream out(DecodedFilename, O_WRONLY | O_CREAT | O_EXCL);
 
 		// Get the decoding stream
-		std::auto_ptr<DecodedStream> stream(DecodeFileStream(rEncodedFile, Timeout, pAlterativeAttr));
+		std::auto_ptr<DecodedStream> stream(DecodeFileStream(rEncodedFile, Timeout, pAlterativeAttr,
+			pDecryptContexts));
 
 		// Is it a symlink?
 		if(!stream->IsSymLink())
 		{
-			// Copy it out to the file
-			stream->CopyStreamTo(out);
+			// Only leave holes where the file had them
+			FileHoles holes;
+			stream->FindHoles(holes);
+			out.SetHoles(holes);
+
+			// Copy it out to the file, in pieces big enough to
+			// contain whole holes
+			stream->CopyStreamTo(out, IOStream::TimeOutInfinite,
+				16 * SPARSEFILESTREAM_MIN_HOLE);
 		}
 
 		out.Close();
@@ -686,7 +713,7 @@ void BackupStoreFile::DecodeFile(IOStream &rEncodedFile, const char *DecodedFile
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::DecodeFileStream(IOStream &, int, const BackupClientFileAttributes *)
+//		Name:    BackupStoreFile::DecodeFileStream(IOStream &, int, const BackupClientFileAttributes *, BackupStoreFileDecryptContexts *)
 //		Purpose: Return a stream which will decode the encrypted file data on the fly.
 //				 Accepts streams in block index first, or main header first, order. In the latter case,
 //				 the stream must be Seek()able.
@@ -696,10 +723,12 @@ void BackupStoreFile::DecodeFile(IOStream &rEncodedFile, const char *DecodedFile
 //		Created: 9/12/03
 //
 // --------------------------------------------------------------------------
-std::auto_ptr<BackupStoreFile::DecodedStream> BackupStoreFile::DecodeFileStream(IOStream &rEncodedFile, int Timeout, const BackupClientFileAttributes *pAlterativeAttr)
+std::auto_ptr<BackupStoreFile::DecodedStream> BackupStoreFile::DecodeFileStream(IOStream &rEncodedFile, int Timeout, const BackupClientFileAttributes *pAlterativeAttr,
+	BackupStoreFileDecryptContexts *pDecryptContexts)
 {
 	// Create stream
-	std::auto_ptr<DecodedStream> stream(new DecodedStream(rEncodedFile, Timeout));
+	std::auto_ptr<DecodedStream> stream(new DecodedStream(rEncodedFile, Timeout,
+		pDecryptContexts));
 
 	// Get it ready
 	stream->Setup(pAlterativeAttr);
@@ -712,12 +741,14 @@ std::auto_ptr<BackupStoreFile::DecodedStream> BackupStoreFile::DecodeFileStream(
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::DecodedStream::DecodedStream(IOStream &, int)
-//		Purpose: Constructor
+//		Name:    BackupStoreFile::DecodedStream::DecodedStream(IOStream &, int, BackupStoreFileDecryptContexts *)
+//		Purpose: Constructor. Decrypts with the shared contexts
+//				 unless others are given.
 //		Created: 9/12/03
 //
 // --------------------------------------------------------------------------
-BackupStoreFile::DecodedStream::DecodedStream(IOStream &rEncodedFile, int Timeout)
+BackupStoreFile::DecodedStream::DecodedStream(IOStream &rEncodedFile, int Timeout,
+	BackupStoreFileDecryptContexts *pDecryptContexts)
 	: mrEncodedFile(rEncodedFile),
 	  mTimeout(Timeout),
 	  mNumBlocks(0),
@@ -728,7 +759,11 @@ BackupStoreFile::DecodedStream::DecodedStream(IOStream &rEncodedFile, int Timeou
 	  mCurrentBlock(-1),
 	  mCurrentBlockClearSize(0),
 	  mPositionInCurrentBlock(0),
-	  mEntryIVBase(42)	// different to default value in the encoded stream!
+	  mEntryIVBase(42),	// different to default value in the encoded stream!
+	  mFastChecksums(false),
+	  mpDecryptContexts(pDecryptContexts),
+	  mpPipeline(0),
+	  mNextBlockToAdd(0)
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 	  , mIsOldVersion(false)
 #endif
@@ -746,6 +781,12 @@ BackupStoreFile::DecodedStream::DecodedStream(IOStream &rEncodedFile, int Timeou
 // --------------------------------------------------------------------------
 BackupStoreFile::DecodedStream::~DecodedStream()
 {
+	// Stop the threads before freeing the index they use
+	if(mpPipeline)
+	{
+		delete mpPipeline;
+	}
+
 	// Free any allocated memory
 	if(mpBlockIndex)
 	{
@@ -757,7 +798,7 @@ BackupStoreFile::DecodedStream::~DecodedStream()
 	}
 	if(mpClearData)
 	{
-		::free(mpClearData);
+		BackupStoreFile::CodingChunkFree(mpClearData);
 	}
 }
 
@@ -804,6 +845,11 @@ void BackupStoreFile::DecodedStream::Setup(const BackupClientFileAttributes *pAl
 		inFileOrder = false;
 		break;
 
+	case OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2:
+		mFastChecksums = true;
+		inFileOrder = false;
+		break;
+
 	default:
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -910,8 +956,9 @@ void BackupStoreFile::DecodedStream::Setup(const BackupClientFileAttributes *pAl
 		for(int64_t e = 0; e < mNumBlocks; e++)
 		{
 			// Get the clear and encoded size
+			// (Blocks in other files, which diffs refer to, have
+			// no size here, and are rejected when they're read.)
 			int32_t encodedSize = box_ntoh64(entry[e].mEncodedSize);
-			ASSERT(encodedSize > 0);
 
 			// Larger?
 			if(encodedSize > maxEncodedDataSize) maxEncodedDataSize = encodedSize;
@@ -924,7 +971,18 @@ void BackupStoreFile::DecodedStream::Setup(const BackupClientFileAttributes *pAl
 		// If this is wrong, things will exception neatly later on, so it can't be used
 		// to do anything more than cause an error on downloading.
 		mClearDataSize = OutputBufferSizeForKnownOutputSize(ntohl(hdr.mMaxBlockClearSize)) + 32;
-		mpClearData = (uint8_t*)::malloc(mClearDataSize);
+		mpClearData = (uint8_t*)BackupStoreFile::CodingChunkAlloc(mClearDataSize);
+
+		// Decode the blocks ahead of the one being read on other
+		// threads, if asked to. Streams with their own contexts are
+		// already being decoded alongside others, on a thread of
+		// their own, so they aren't split up any further.
+		if(sDecodingThreads > 1 && mNumBlocks > 1 && mpDecryptContexts == 0)
+		{
+			mpPipeline = new BackupStoreFileDecodePipeline(*this,
+				sDecodingThreads, maxEncodedDataSize + 32,
+				mClearDataSize);
+		}
 	}
 }
 
@@ -964,6 +1022,7 @@ void BackupStoreFile::DecodedStream::ReadBlockIndex(bool MagicAlreadyRead)
 
 		// Check magic value
 		if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+			&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 			&& ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0
 #endif
@@ -971,6 +1030,9 @@ void BackupStoreFile::DecodedStream::ReadBlockIndex(bool MagicAlreadyRead)
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 		}
+
+		mFastChecksums = (ntohl(blkhdr.mMagicValue) ==
+			OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2);
 	}
 
 	// Get the number of blocks out of the header
@@ -1058,87 +1120,41 @@ int BackupStoreFile::DecodedStream::Read(void *pBuffer, int NBytes, int Timeout)
 				break;
 			}
 
-			// Get the size from the block index
-			const file_BlockIndexEntry *entry = (file_BlockIndexEntry *)mpBlockIndex;
-			int32_t encodedSize = box_ntoh64(entry[mCurrentBlock].mEncodedSize);
-			if(encodedSize <= 0)
-			{
-				// The caller is attempting to decode a file which is the direct result of a diff
-				// operation, and so does not contain all the data.
-				// It needs to be combined with the previous version first.
-				THROW_EXCEPTION(BackupStoreException, CannotDecodeDiffedFilesWithoutCombining)
-			}
-
-			// Load in next block
-			if(!mrEncodedFile.ReadFullBuffer(mpEncodedData, encodedSize, 0 /* not interested in bytes read if this fails */, mTimeout))
+			if(mpPipeline != 0)
 			{
-				// Couldn't read header
-				THROW_EXCEPTION(BackupStoreException, WhenDecodingExpectedToReadButCouldnt)
+				FillPipeline();
 			}
 
-			// Decode the data
-			mCurrentBlockClearSize = BackupStoreFile::DecodeChunk(mpEncodedData, encodedSize, mpClearData, mClearDataSize);
-
-			// Calculate IV for this entry
-			uint64_t iv = mEntryIVBase;
-			iv += mCurrentBlock;
-			// Convert to network byte order before encrypting with it, so that restores work on
-			// platforms with different endiannesses.
-			iv = box_hton64(iv);
-			sBlowfishDecryptBlockEntry.SetIV(&iv);
-
-			// Decrypt the encrypted section
-			file_BlockIndexEntryEnc entryEnc;
-			int sectionSize = sBlowfishDecryptBlockEntry.TransformBlock(&entryEnc, sizeof(entryEnc),
-					entry[mCurrentBlock].mEnEnc, sizeof(entry[mCurrentBlock].mEnEnc));
-			if(sectionSize != sizeof(entryEnc))
+			if(mpPipeline != 0 && mpPipeline->GetNumberOfBlocks() > 0)
 			{
-				THROW_EXCEPTION(BackupStoreException, BlockEntryEncodingDidntGiveExpectedLength)
+				// Decoded by another thread, while the blocks
+				// before it were being read
+				mCurrentBlockClearSize = mpPipeline->GetNext(mpClearData);
 			}
-
-			// Make sure this is the right size
-			if(mCurrentBlockClearSize != (int32_t)ntohl(entryEnc.mSize))
+			else
 			{
-#ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
-				if(!mIsOldVersion)
-				{
-					THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
-				}
-				// Versions 0.05 and previous of Box Backup didn't properly handle endianess of the
-				// IV for the encrypted section. Try again, with the thing the other way round
-				iv = box_swap64(iv);
-				sBlowfishDecryptBlockEntry.SetIV(&iv);
-				int sectionSize = sBlowfishDecryptBlockEntry.TransformBlock(&entryEnc, sizeof(entryEnc),
-						entry[mCurrentBlock].mEnEnc, sizeof(entry[mCurrentBlock].mEnEnc));
-				if(sectionSize != sizeof(entryEnc))
+				// Get the size from the block index
+				const file_BlockIndexEntry *entry = (file_BlockIndexEntry *)mpBlockIndex;
+				int32_t encodedSize = box_ntoh64(entry[mCurrentBlock].mEncodedSize);
+				if(encodedSize <= 0)
 				{
-					THROW_EXCEPTION(BackupStoreException, BlockEntryEncodingDidntGiveExpectedLength)
+					// The caller is attempting to decode a file which is the direct result of a diff
+					// operation, and so does not contain all the data.
+					// It needs to be combined with the previous version first.
+					THROW_EXCEPTION(BackupStoreException, CannotDecodeDiffedFilesWithoutCombining)
 				}
-				if(mCurrentBlockClearSize != (int32_t)ntohl(entryEnc.mSize))
+
+				// Load in next block
+				if(!mrEncodedFile.ReadFullBuffer(mpEncodedData, encodedSize, 0 /* not interested in bytes read if this fails */, mTimeout))
 				{
-					THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+					// Couldn't read header
+					THROW_EXCEPTION(BackupStoreException, WhenDecodingExpectedToReadButCouldnt)
 				}
-				else
-				{
-					// Warn and log this issue
-					if(!sWarnedAboutBackwardsCompatiblity)
-					{
-						BOX_WARNING("WARNING: Decoded one or more files using backwards compatibility mode for block index.");
-						sWarnedAboutBackwardsCompatiblity = true;
-					}
-				}
-#else
-				THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
-#endif
-			}
 
-			// Check the digest
-			MD5Digest md5;
-			md5.Add(mpClearData, mCurrentBlockClearSize);
-			md5.Finish();
-			if(!md5.DigestMatches((uint8_t*)entryEnc.mStrongChecksum))
-			{
-				THROW_EXCEPTION(BackupStoreException, BackupStoreFileFailedIntegrityCheck)
+				mCurrentBlockClearSize = DecodeBlock(mCurrentBlock,
+					mpEncodedData, encodedSize, mpClearData,
+					mClearDataSize, mpDecryptContexts);
+				mNextBlockToAdd = mCurrentBlock + 1;
 			}
 
 			// Set vars to say what's happening
@@ -1153,6 +1169,174 @@ int BackupStoreFile::DecodedStream::Read(void *pBuffer, int NBytes, int Timeout)
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::DecodedStream::DecodeBlock(int64_t, const uint8_t *, int32_t, uint8_t *, int, BackupStoreFileDecryptContexts *)
+//		Purpose: Private. Decodes the given block of the file into
+//				 pClear, checks it against the block index, and
+//				 returns its size. Called by the threads of the
+//				 pipeline too, with their own contexts.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::DecodedStream::DecodeBlock(int64_t Block,
+	const uint8_t *pEncoded, int32_t EncodedSize, uint8_t *pClear,
+	int ClearSize, BackupStoreFileDecryptContexts *pDecryptContexts)
+{
+	const file_BlockIndexEntry *entry = (file_BlockIndexEntry *)mpBlockIndex;
+
+	// Decode the data
+	int clearSize = BackupStoreFile::DecodeChunk(pEncoded, EncodedSize, pClear, ClearSize,
+		pDecryptContexts);
+
+	// Calculate IV for this entry
+	uint64_t iv = mEntryIVBase;
+	iv += Block;
+	// Convert to network byte order before encrypting with it, so that restores work on
+	// platforms with different endiannesses.
+	iv = box_hton64(iv);
+	CipherContext &blockEntryDecrypt(pDecryptContexts ?
+		pDecryptContexts->mBlockEntry : sBlowfishDecryptBlockEntry);
+	blockEntryDecrypt.SetIV(&iv);
+
+	// Decrypt the encrypted section
+	file_BlockIndexEntryEnc entryEnc;
+	int sectionSize = blockEntryDecrypt.TransformBlock(&entryEnc, sizeof(entryEnc),
+			entry[Block].mEnEnc, sizeof(entry[Block].mEnEnc));
+	if(sectionSize != sizeof(entryEnc))
+	{
+		THROW_EXCEPTION(BackupStoreException, BlockEntryEncodingDidntGiveExpectedLength)
+	}
+
+	// Make sure this is the right size
+	if(clearSize != (int32_t)ntohl(entryEnc.mSize))
+	{
+#ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
+		if(!mIsOldVersion)
+		{
+			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+		}
+		// Versions 0.05 and previous of Box Backup didn't properly handle endianess of the
+		// IV for the encrypted section. Try again, with the thing the other way round
+		iv = box_swap64(iv);
+		blockEntryDecrypt.SetIV(&iv);
+		int sectionSize = blockEntryDecrypt.TransformBlock(&entryEnc, sizeof(entryEnc),
+				entry[Block].mEnEnc, sizeof(entry[Block].mEnEnc));
+		if(sectionSize != sizeof(entryEnc))
+		{
+			THROW_EXCEPTION(BackupStoreException, BlockEntryEncodingDidntGiveExpectedLength)
+		}
+		if(clearSize != (int32_t)ntohl(entryEnc.mSize))
+		{
+			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+		}
+		else
+		{
+			// Warn and log this issue
+			if(!sWarnedAboutBackwardsCompatiblity)
+			{
+				BOX_WARNING("WARNING: Decoded one or more files using backwards compatibility mode for block index.");
+				sWarnedAboutBackwardsCompatiblity = true;
+			}
+		}
+#else
+		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
+#endif
+	}
+
+	// Check the digest
+	BackupStoreFileStrongChecksum strong(mFastChecksums);
+	strong.Add(pClear, clearSize);
+	strong.Finish();
+	if(!strong.DigestMatches((uint8_t*)entryEnc.mStrongChecksum))
+	{
+		THROW_EXCEPTION(BackupStoreException, BackupStoreFileFailedIntegrityCheck)
+	}
+
+	return clearSize;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::DecodedStream::FillPipeline()
+//		Purpose: Private. Reads blocks after the current one from the
+//				 encoded stream into the pipeline, until it's full.
+//				 Stops at blocks which aren't in this file, leaving
+//				 them to be read (and rejected) one at a time.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::DecodedStream::FillPipeline()
+{
+	const file_BlockIndexEntry *entry = (file_BlockIndexEntry *)mpBlockIndex;
+	while(!mpPipeline->IsFull() && mNextBlockToAdd < mNumBlocks)
+	{
+		int32_t encodedSize = box_ntoh64(entry[mNextBlockToAdd].mEncodedSize);
+		if(encodedSize <= 0)
+		{
+			break;
+		}
+
+		mpPipeline->Add(mNextBlockToAdd, mrEncodedFile, encodedSize,
+			mTimeout);
+		++mNextBlockToAdd;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::DecodedStream::FindHoles(FileHoles &)
+//		Purpose: Finds the blocks of the file which were in holes when
+//				 it was encoded, which are marked in the block index.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::DecodedStream::FindHoles(FileHoles &rHoles)
+{
+	rHoles.Clear();
+
+#ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
+	if(mIsOldVersion)
+	{
+		// Blocks weren't marked when these were made
+		return;
+	}
+#endif
+
+	const file_BlockIndexEntry *entry = (file_BlockIndexEntry *)mpBlockIndex;
+	CipherContext &blockEntryDecrypt(mpDecryptContexts ?
+		mpDecryptContexts->mBlockEntry : sBlowfishDecryptBlockEntry);
+	int64_t offset = 0;
+	for(int64_t b = 0; b < mNumBlocks; ++b)
+	{
+		// Decrypt the encrypted section, as DecodeBlock() does
+		uint64_t iv = mEntryIVBase;
+		iv += b;
+		iv = box_hton64(iv);
+		blockEntryDecrypt.SetIV(&iv);
+		file_BlockIndexEntryEnc entryEnc;
+		int sectionSize = blockEntryDecrypt.TransformBlock(&entryEnc, sizeof(entryEnc),
+				entry[b].mEnEnc, sizeof(entry[b].mEnEnc));
+		if(sectionSize != sizeof(entryEnc))
+		{
+			THROW_EXCEPTION(BackupStoreException, BlockEntryEncodingDidntGiveExpectedLength)
+		}
+
+		int32_t size = ntohl(entryEnc.mSize);
+		if(ntohl(entryEnc.mWeakChecksum) == BLOCK_INDEX_HOLE_WEAK_CHECKSUM)
+		{
+			rHoles.Add(offset, size);
+		}
+		offset += size;
+	}
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1273,10 +1457,105 @@ void BackupStoreFile::SetAESKey(const void *pKey, int KeyLength)
 	// Set encryption to use this key, instead of the "default" blowfish key
 	spEncrypt = &sAESEncrypt;
 	sEncryptCipherType = HEADER_AES_ENCODING;
+
+	BOX_TRACE("Encrypting file data with AES, " <<
+		(CryptoUtils::HasHardwareAES() ? "with" : "without") <<
+		" hardware acceleration");
 }
 #endif
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetFastBlockChecksums(bool)
+//		Purpose: Sets whether new files are encoded with fast (XXH3)
+//				 strong checksums in their block index, instead of MD5.
+//				 Only enable this if the server has agreed to protocol
+//				 version 2, as older servers reject these files. Diffs
+//				 always use the same checksums as the file they are
+//				 diffed from, as the block indexes are combined later.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetFastBlockChecksums(bool Enabled)
+{
+	sFastBlockChecksums = Enabled;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetContentDefinedChunking(bool)
+//		Purpose: Sets whether new data in files is split into content
+//				 defined chunks, instead of fixed size blocks, so that
+//				 diffs of later versions can find unchanged chunks
+//				 by looking them up in the block index, without
+//				 the rolling checksum search. Any server can store
+//				 these files.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetContentDefinedChunking(bool Enabled)
+{
+	sContentDefinedChunking = Enabled;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetLargeBlocks(bool)
+//		Purpose: Sets whether new data in huge files is split into
+//				 blocks bigger than BACKUP_FILE_MAX_BLOCK_SIZE, up to
+//				 BACKUP_FILE_MAX_LARGE_BLOCK_SIZE, so that their block
+//				 indexes are smaller, and quicker to download, decrypt
+//				 and search when diffing. Any server can store these
+//				 files, but older clients can't diff against them or
+//				 compare them.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetLargeBlocks(bool Enabled)
+{
+	sLargeBlocks = Enabled;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetEncodingThreads(int)
+//		Purpose: Sets how many threads new data in files is compressed
+//				 and encrypted with, while it's being uploaded. With
+//				 more than one, several blocks are encoded at once.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetEncodingThreads(int Threads)
+{
+	sEncodingThreads = (Threads > 1) ? Threads : 1;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::SetDecodingThreads(int)
+//		Purpose: Sets how many threads blocks of files are decrypted
+//				 and decompressed with, while they're being restored.
+//				 With more than one, the blocks after the one being
+//				 read are decoded at the same time.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::SetDecodingThreads(int Threads)
+{
+	sDecodingThreads = (Threads > 1) ? Threads : 1;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1291,7 +1570,17 @@ int BackupStoreFile::MaxBlockSizeForChunkSize(int ChunkSize)
 	// which is encrypted, and has a 1 bytes header and the IV added, plus 1 byte for luck
 	// And then on top, add 128 bytes just to make sure. (Belts and braces approach to fixing
 	// an problem where a rather non-compressable file didn't fit in a block buffer.)
-	return sBlowfishEncrypt.MaxOutSizeForInBufferSize(Compress_MaxSizeForCompressedData(ChunkSize)) + 1 + 1
+	// Blocks may be compressed with any codec which could be chosen.
+	int compressedSize = Compress_MaxSizeForCompressedData(ChunkSize);
+	for(int c = 0; c < CompressCodec::NumCodecs; ++c)
+	{
+		if(CompressCodec::IsSupported(c) &&
+			CompressCodec::MaxCompressedSize(c, ChunkSize) > compressedSize)
+		{
+			compressedSize = CompressCodec::MaxCompressedSize(c, ChunkSize);
+		}
+	}
+	return sBlowfishEncrypt.MaxOutSizeForInBufferSize(compressedSize) + 1 + 1
 		+ sBlowfishEncrypt.GetIVLength() + 128;
 }
 
@@ -1300,14 +1589,42 @@ int BackupStoreFile::MaxBlockSizeForChunkSize(int ChunkSize)
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::EncodeChunk(const void *, int, BackupStoreFile::EncodingBuffer &)
+//		Name:    BackupStoreFile::EncodeChunk(const void *, int, BackupStoreFile::EncodingBuffer &, bool, int, int)
 //		Purpose: Encodes a chunk (encryption, possible compressed beforehand)
+//				 If TryCompressing is false, or a sample of the
+//				 chunk doesn't look compressible, it's stored
+//				 without being compressed. Otherwise it's compressed
+//				 with the given CompressCodec and level, which must
+//				 be supported by this build. Any client with the
+//				 codec can decode it; servers don't need the codec.
 //		Created: 8/12/03
 //
 // --------------------------------------------------------------------------
-int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput)
+int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput,
+	bool TryCompressing, int CompressionCodec, int CompressionLevel)
 {
 	ASSERT(spEncrypt != 0);
+	return EncodeChunk(Chunk, ChunkSize, rOutput, *spEncrypt, TryCompressing,
+		CompressionCodec, CompressionLevel);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::EncodeChunk(const void *, int, BackupStoreFile::EncodingBuffer &, CipherContext &, bool, int, int)
+//		Purpose: As above, encrypting with the given context, which must
+//				 be a copy of the one selected by the keys (see
+//				 CipherContext::Init(const CipherContext &)). Each
+//				 thread encoding chunks needs its own.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput,
+	CipherContext &rEncrypt, bool TryCompressing, int CompressionCodec,
+	int CompressionLevel)
+{
+	ASSERT(CompressCodec::IsValidLevel(CompressionCodec, CompressionLevel));
 
 	// Check there's some space in the output block
 	if(rOutput.mBufferSize < 256)
@@ -1318,90 +1635,257 @@ int BackupStoreFile::EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFi
 	// Check alignment of the block
 	ASSERT((((uint64_t)rOutput.mpBuffer) % BACKUPSTOREFILE_CODING_BLOCKSIZE) == BACKUPSTOREFILE_CODING_OFFSET);
 
-	// Want to compress it?
-	bool compressChunk = (ChunkSize >= BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE);
+	// Want to compress it? Don't bother if it looks like it's already
+	// compressed.
+	bool compressChunk = TryCompressing
+		&& (ChunkSize >= BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE)
+		&& CompressCodec::LooksCompressible(Chunk, ChunkSize);
+
+	int codec = compressChunk ? CompressionCodec : CompressCodec::Zlib;
 
 	// Build header
 	uint8_t header = sEncryptCipherType << HEADER_ENCODING_SHIFT;
 	if(compressChunk) header |= HEADER_CHUNK_IS_COMPRESSED;
+	header |= codec << HEADER_CODEC_SHIFT;
 
 	// Store header
 	rOutput.mpBuffer[0] = header;
 	int outOffset = 1;
 
-	// Setup cipher, and store the IV
-	int ivLen = 0;
-	const void *iv = spEncrypt->SetRandomIV(ivLen);
-	::memcpy(rOutput.mpBuffer + outOffset, iv, ivLen);
+	// Store a random IV, which the cipher starts from
+	int ivLen = rEncrypt.GetIVLength();
+	Random::Generate(rOutput.mpBuffer + outOffset, ivLen);
 	outOffset += ivLen;
 
-	// Start encryption process
-	spEncrypt->Begin();
+	// Compress the chunk straight into the output buffer, after the IV,
+	// to be encrypted in place
+	int compressedSize = 0;
+	if(compressChunk)
+	{
+		compressedSize = CompressChunk(Chunk, ChunkSize, rOutput, outOffset,
+			codec, CompressionLevel);
+	}
+
+	if(compressChunk && compressedSize >= ChunkSize)
+	{
+		// The sample was wrong, and compressing it made it bigger,
+		// so store it as it is instead.
+		return EncodeChunk(Chunk, ChunkSize, rOutput, rEncrypt,
+			false /* don't try compressing */);
+	}
+
+	// Encrypt it all in one go
+	if(compressChunk)
+	{
+		outOffset += rEncrypt.TransformWithIV(rOutput.mpBuffer + outOffset,
+			rOutput.mBufferSize - outOffset, rOutput.mpBuffer + 1,
+			rOutput.mpBuffer + outOffset, compressedSize);
+	}
+	else
+	{
+		// Straight encryption
+		if((rOutput.mBufferSize - outOffset) < (ChunkSize + 128))
+		{
+			rOutput.Reallocate(rOutput.mBufferSize + ChunkSize + 128);
+		}
+		outOffset += rEncrypt.TransformWithIV(rOutput.mpBuffer + outOffset,
+			rOutput.mBufferSize - outOffset, rOutput.mpBuffer + 1,
+			Chunk, ChunkSize);
+	}
+
+	ASSERT(outOffset < rOutput.mBufferSize);		// first check should have sorted this -- merely logic check
+
+	return outOffset;
+}
+
 
-	#define ENCODECHUNK_CHECK_SPACE(ToEncryptSize)									\
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CompressChunk(const void *, int, BackupStoreFile::EncodingBuffer &, int, int, int)
+//		Purpose: Compresses a chunk into rOutput at OutputOffset,
+//				 making it bigger if need be, and returns the
+//				 compressed size. If that's ChunkSize or more, the
+//				 chunk didn't compress and should be stored as it
+//				 is instead.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::CompressChunk(const void *Chunk, int ChunkSize,
+	BackupStoreFile::EncodingBuffer &rOutput, int OutputOffset,
+	int CompressionCodec, int CompressionLevel)
+{
+	ASSERT(CompressCodec::IsValidLevel(CompressionCodec, CompressionLevel));
+
+	#define COMPRESSCHUNK_CHECK_SPACE(ToCompressSize)								\
 		{																			\
-			if((rOutput.mBufferSize - outOffset) < ((ToEncryptSize) + 128))			\
+			if((rOutput.mBufferSize - OutputOffset) < ((ToCompressSize) + 128))		\
 			{																		\
-				rOutput.Reallocate(rOutput.mBufferSize + (ToEncryptSize) + 128);	\
+				rOutput.Reallocate(rOutput.mBufferSize + (ToCompressSize) + 128);	\
 			}																		\
 		}
 
-	// Encode the chunk
-	if(compressChunk)
+	int compressedSize = 0;
+	if(CompressionCodec != CompressCodec::Zlib)
+	{
+		// Compress the whole chunk in one go
+		int maxSize = CompressCodec::MaxCompressedSize(CompressionCodec, ChunkSize);
+		COMPRESSCHUNK_CHECK_SPACE(maxSize)
+		compressedSize = CompressCodec::CompressBlock(CompressionCodec,
+			CompressionLevel, Chunk, ChunkSize,
+			rOutput.mpBuffer + OutputOffset, maxSize);
+	}
+	else
 	{
-		// buffer to compress into
-		uint8_t buffer[2048];
-
 		// Set compressor with all the chunk as an input
-		Compress<true> compress;
+		COMPRESSCHUNK_CHECK_SPACE(ChunkSize)
+		Compress<true> compress((CompressionLevel == 0)
+			? Z_DEFAULT_COMPRESSION : CompressionLevel);
 		compress.Input(Chunk, ChunkSize);
 		compress.FinishInput();
 
-		// Get and encrypt output
-		while(!compress.OutputHasFinished())
+		// Get the output, giving up if it's no smaller than the chunk
+		while(!compress.OutputHasFinished() && compressedSize < ChunkSize)
 		{
-			int s = compress.Output(buffer, sizeof(buffer));
-			if(s > 0)
-			{
-				ENCODECHUNK_CHECK_SPACE(s)
-				outOffset += spEncrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset, buffer, s);
-			}
-			else
+			int s = compress.Output(rOutput.mpBuffer + OutputOffset + compressedSize,
+				ChunkSize - compressedSize);
+			if(s <= 0)
 			{
 				// Should never happen, as we put all the input in in one go.
 				// So if this happens, it means there's a logical problem somewhere
 				THROW_EXCEPTION(BackupStoreException, Internal)
 			}
+			compressedSize += s;
+		}
+		if(!compress.OutputHasFinished())
+		{
+			compressedSize = ChunkSize;
 		}
-		ENCODECHUNK_CHECK_SPACE(16)
-		outOffset += spEncrypt->Final(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset);
 	}
-	else
+
+	return compressedSize;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::EncodeCompressedChunk(const void *, int, int, BackupStoreFile::EncodingBuffer &)
+//		Purpose: Encodes a chunk which was compressed by
+//				 CompressChunk() with the given codec, encrypting it
+//				 with a new IV, as EncodeChunk() does. Lets the same
+//				 data be compressed once but encoded many times,
+//				 without the encoded chunks being the same.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStoreFile::EncodeCompressedChunk(const void *pCompressed,
+	int CompressedSize, int CompressionCodec,
+	BackupStoreFile::EncodingBuffer &rOutput)
+{
+	ASSERT(spEncrypt != 0);
+	CipherContext &rEncrypt(*spEncrypt);
+
+	int ivLen = rEncrypt.GetIVLength();
+	int maxSize = 1 + ivLen + CompressedSize + 128;
+	if(rOutput.mBufferSize < maxSize)
 	{
-		// Straight encryption
-		ENCODECHUNK_CHECK_SPACE(ChunkSize)
-		outOffset += spEncrypt->Transform(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset, Chunk, ChunkSize);
-		ENCODECHUNK_CHECK_SPACE(16)
-		outOffset += spEncrypt->Final(rOutput.mpBuffer + outOffset, rOutput.mBufferSize - outOffset);
+		rOutput.Reallocate(maxSize);
 	}
 
-	ASSERT(outOffset < rOutput.mBufferSize);		// first check should have sorted this -- merely logic check
+	// Build and store header
+	uint8_t header = sEncryptCipherType << HEADER_ENCODING_SHIFT;
+	header |= HEADER_CHUNK_IS_COMPRESSED;
+	header |= CompressionCodec << HEADER_CODEC_SHIFT;
+	rOutput.mpBuffer[0] = header;
+	int outOffset = 1;
+
+	// Store a random IV, which the cipher starts from
+	Random::Generate(rOutput.mpBuffer + outOffset, ivLen);
+	outOffset += ivLen;
+
+	outOffset += rEncrypt.TransformWithIV(rOutput.mpBuffer + outOffset,
+		rOutput.mBufferSize - outOffset, rOutput.mpBuffer + 1,
+		pCompressed, CompressedSize);
+
+	ASSERT(outOffset < rOutput.mBufferSize);
 
 	return outOffset;
 }
 
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::ChunkIsCompressed(const BackupStoreFile::EncodingBuffer &)
+//		Purpose: Whether a chunk encoded by EncodeChunk() was compressed
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFile::ChunkIsCompressed(const BackupStoreFile::EncodingBuffer &rEncoded)
+{
+	return (rEncoded.mpBuffer[0] & HEADER_CHUNK_IS_COMPRESSED) != 0;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::DecodeChunk(const void *, int, void *, int)
+//		Name:    BackupStoreFile::IsCompressedFileType(const std::string &)
+//		Purpose: Whether the name of a file says that it's of a type
+//				 which is compressed already (media files and
+//				 archives), so its blocks aren't worth compressing.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFile::IsCompressedFileType(const std::string &rFilename)
+{
+	static const char *compressedExtensions[] =
+	{
+		"7z", "aac", "apk", "avi", "bz2", "deb", "docx", "epub",
+		"flac", "gif", "gz", "heic", "jar", "jpeg", "jpg", "lz4",
+		"m4a", "m4v", "mkv", "mov", "mp3", "mp4", "odp", "ods", "odt",
+		"ogg", "opus", "png", "pptx", "rar", "rpm", "tgz", "webm",
+		"webp", "wmv", "xlsx", "xz", "zip", "zst", 0
+	};
+
+	std::string::size_type dot = rFilename.find_last_of('.');
+	if(dot == std::string::npos ||
+		rFilename.find_first_of("/" DIRECTORY_SEPARATOR, dot) != std::string::npos)
+	{
+		return false;
+	}
+
+	std::string extension(rFilename.substr(dot + 1));
+	for(std::string::size_type c = 0; c < extension.size(); ++c)
+	{
+		extension[c] = ::tolower(extension[c]);
+	}
+
+	for(int e = 0; compressedExtensions[e] != 0; ++e)
+	{
+		if(extension == compressedExtensions[e])
+		{
+			return true;
+		}
+	}
+	return false;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::DecodeChunk(const void *, int, void *, int, BackupStoreFileDecryptContexts *)
 //		Purpose: Decode an encoded chunk -- use OutputBufferSizeForKnownOutputSize() to find
 //				 the extra output buffer size needed before calling.
 //				 See notes in EncodeChunk() for notes re alignment of the 
-//				 encoded data.
+//				 encoded data. Decrypts with the shared contexts
+//				 unless others are given.
 //		Created: 8/12/03
 //
 // --------------------------------------------------------------------------
-int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Output, int OutputSize)
+int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Output, int OutputSize,
+	BackupStoreFileDecryptContexts *pDecryptContexts)
 {
 	// Check alignment of the encoded block
 	ASSERT((((uint64_t)Encoded) % BACKUPSTOREFILE_CODING_BLOCKSIZE) == BACKUPSTOREFILE_CODING_OFFSET);
@@ -1417,22 +1901,33 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 	// Get header, make checks, etc
 	uint8_t header = input[0];
 	bool chunkCompressed = (header & HEADER_CHUNK_IS_COMPRESSED) == HEADER_CHUNK_IS_COMPRESSED;
-	uint8_t encodingType = (header >> HEADER_ENCODING_SHIFT);
-	if(encodingType != HEADER_BLOWFISH_ENCODING && encodingType != HEADER_AES_ENCODING)
+	uint8_t encodingType = (header >> HEADER_ENCODING_SHIFT) & HEADER_ENCODING_MASK;
+	int codec = (header >> HEADER_CODEC_SHIFT) & HEADER_CODEC_MASK;
+	if((encodingType != HEADER_BLOWFISH_ENCODING && encodingType != HEADER_AES_ENCODING)
+		|| (header & HEADER_RESERVED_BITS) != 0
+		|| (!chunkCompressed && codec != CompressCodec::Zlib))
 	{
 		THROW_EXCEPTION(BackupStoreException, ChunkHasUnknownEncoding)
 	}
+	if(!CompressCodec::IsSupported(codec))
+	{
+		THROW_EXCEPTION_MESSAGE(BackupStoreException, ChunkHasUnknownEncoding,
+			"Compressed with " << CompressCodec::GetName(codec) <<
+			", which isn't supported by this build");
+	}
 
 #ifndef HAVE_OLD_SSL
 	// Choose cipher
-	CipherContext &cipher((encodingType == HEADER_AES_ENCODING)?sAESDecrypt:sBlowfishDecrypt);
+	CipherContext &cipher((encodingType == HEADER_AES_ENCODING)
+		? (pDecryptContexts ? pDecryptContexts->mAES : sAESDecrypt)
+		: (pDecryptContexts ? pDecryptContexts->mBlowfish : sBlowfishDecrypt));
 #else
 	// AES not supported with this version of OpenSSL
 	if(encodingType == HEADER_AES_ENCODING)
 	{
 		THROW_EXCEPTION(BackupStoreException, AEScipherNotSupportedByInstalledOpenSSL)
 	}
-	CipherContext &cipher(sBlowfishDecrypt);
+	CipherContext &cipher(pDecryptContexts ? pDecryptContexts->mBlowfish : sBlowfishDecrypt);
 #endif
 
 	// Check enough space for header, an IV and one byte of input
@@ -1442,17 +1937,29 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 		THROW_EXCEPTION(BackupStoreException, BadEncodedChunk)
 	}
 
-	// Set IV in decrypt context, and start
-	cipher.SetIV(input + 1);
-	cipher.Begin();
-
 	// Setup vars for code
 	int inOffset = 1 + ivLen;
 	uint8_t *output = (uint8_t*)Output;
 	int outOffset = 0;
 
 	// Do action
-	if(chunkCompressed)
+	if(chunkCompressed && codec != CompressCodec::Zlib)
+	{
+		// Decrypt the whole chunk, then decompress it in one go
+		int bufferSize = EncodedSize - inOffset + cipher.GetIVLength() + 64;
+		EncodingBuffer buffer;
+		buffer.Allocate(bufferSize);
+		int s = cipher.TransformWithIV(buffer.mpBuffer, bufferSize, input + 1,
+			input + inOffset, EncodedSize - inOffset);
+		outOffset = CompressCodec::DecompressBlock(codec, buffer.mpBuffer, s, output, OutputSize);
+
+		// Check that there's space left in the output buffer -- there always should be
+		if(outOffset >= OutputSize)
+		{
+			THROW_EXCEPTION(BackupStoreException, NotEnoughSpaceToDecodeChunk)
+		}
+	}
+	else if(chunkCompressed)
 	{
 		// Do things in chunks
 		uint8_t buffer[2048];
@@ -1461,6 +1968,9 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 		// Decompressor
 		Compress<false> decompress;
 
+		// Start decrypting from the IV
+		cipher.Begin(input + 1);
+
 		while(inOffset < EncodedSize)
 		{
 			// Decrypt a block
@@ -1507,8 +2017,8 @@ int BackupStoreFile::DecodeChunk(const void *Encoded, int EncodedSize, void *Out
 	else
 	{
 		// Easy decryption
-		outOffset += cipher.Transform(output + outOffset, OutputSize - outOffset, input + inOffset, EncodedSize - inOffset);
-		outOffset += cipher.Final(output + outOffset, OutputSize - outOffset);
+		outOffset = cipher.TransformWithIV(output, OutputSize, input + 1,
+			input + inOffset, EncodedSize - inOffset);
 	}
 
 	return outOffset;
@@ -1611,14 +2121,16 @@ void BackupStoreFile::ResetStats()
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *, IOStream &)
+//		Name:    BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *, IOStream &, int, BackupStoreFileDecryptContexts *)
 //		Purpose: Compares the contents of a file against the checksums contained in the
 //				 block index. Returns true if the checksums match, meaning the file is
 //				 extremely likely to match the original. Will always consume the entire index.
+//				 Threads comparing at the same time must each pass their own decrypt contexts.
 //		Created: 21/1/04
 //
 // --------------------------------------------------------------------------
-bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename, IOStream &rBlockIndex, int Timeout)
+bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename, IOStream &rBlockIndex, int Timeout,
+	BackupStoreFileDecryptContexts *pDecryptContexts)
 {
 	// is it a symlink?
 	bool sourceIsSymlink = false;
@@ -1651,6 +2163,7 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 
 	// Check magic
 	if(hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+		&& hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2)
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		&& hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0)
 #endif
@@ -1659,6 +2172,9 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
 
+	bool fastChecksums = (hdr.mMagicValue ==
+		(int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2));
+
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 	bool isOldVersion = hdr.mMagicValue == (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0);
 #endif
@@ -1674,6 +2190,8 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 	int32_t dataSize = -1;
 	bool matches = true;
 	int64_t totalSizeInBlockIndex = 0;
+	CipherContext &blockEntryDecrypt(pDecryptContexts ?
+		pDecryptContexts->mBlockEntry : sBlowfishDecryptBlockEntry);
 
 	try
 	{
@@ -1698,11 +2216,11 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 				iv = box_swap64(iv);
 			}
 #endif
-			sBlowfishDecryptBlockEntry.SetIV(&iv);
+			blockEntryDecrypt.SetIV(&iv);
 
 			// Decrypt the encrypted section
 			file_BlockIndexEntryEnc entryEnc;
-			int sectionSize = sBlowfishDecryptBlockEntry.TransformBlock(&entryEnc, sizeof(entryEnc),
+			int sectionSize = blockEntryDecrypt.TransformBlock(&entryEnc, sizeof(entryEnc),
 					entry.mEnEnc, sizeof(entry.mEnEnc));
 			if(sectionSize != sizeof(entryEnc))
 			{
@@ -1711,7 +2229,7 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 
 			// Size of block
 			int32_t blockClearSize = ntohl(entryEnc.mSize);
-			if(blockClearSize < 0 || blockClearSize > (BACKUP_FILE_MAX_BLOCK_SIZE + 1024))
+			if(blockClearSize < 0 || blockClearSize > (BACKUP_FILE_MAX_LARGE_BLOCK_SIZE + 1024))
 			{
 				THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 			}
@@ -1723,11 +2241,11 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 				// Too small, free the block if it's already allocated
 				if(data != 0)
 				{
-					::free(data);
+					BackupStoreFile::CodingChunkFree(data);
 					data = 0;
 				}
 				// Allocate a block
-				data = ::malloc(blockClearSize + 128);
+				data = BackupStoreFile::CodingChunkAlloc(blockClearSize + 128);
 				if(data == 0)
 				{
 					throw std::bad_alloc();
@@ -1746,10 +2264,10 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 				else
 				{
 					// Check the checksum
-					MD5Digest md5;
-					md5.Add(data, blockClearSize);
-					md5.Finish();
-					if(!md5.DigestMatches(entryEnc.mStrongChecksum))
+					BackupStoreFileStrongChecksum strong(fastChecksums);
+					strong.Add(data, blockClearSize);
+					strong.Finish();
+					if(!strong.DigestMatches(entryEnc.mStrongChecksum))
 					{
 						// Checksum didn't match
 						matches = false;
@@ -1766,7 +2284,7 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 		// clean up in case of errors
 		if(data != 0)
 		{
-			::free(data);
+			BackupStoreFile::CodingChunkFree(data);
 			data = 0;
 		}
 		throw;
@@ -1775,7 +2293,7 @@ bool BackupStoreFile::CompareFileContentsAgainstBlockIndex(const char *Filename,
 	// free block
 	if(data != 0)
 	{
-		::free(data);
+		BackupStoreFile::CodingChunkFree(data);
 		data = 0;
 	}
 
@@ -1885,6 +2403,26 @@ void BackupStoreFile::EncodingBuffer::Reallocate(int NewSize)
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::EncodingBuffer::Swap(EncodingBuffer &)
+//		Purpose: Exchange blocks with another buffer, to hand over
+//				 encoded data without copying it
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::EncodingBuffer::Swap(EncodingBuffer &rOther)
+{
+	uint8_t *buffer = mpBuffer;
+	int size = mBufferSize;
+	mpBuffer = rOther.mpBuffer;
+	mBufferSize = rOther.mBufferSize;
+	rOther.mpBuffer = buffer;
+	rOther.mBufferSize = size;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -19,6 +19,7 @@
 #include "BackupStoreFileWire.h"
 #include "BackupStoreFilename.h"
 #include "CollectInBufferStream.h"
+#include "CompressCodec.h"
 #include "IOStream.h"
 #include "ReadLoggingStream.h"
 
@@ -29,6 +30,15 @@ typedef struct
 	int64_t mTotalFileStreamSize;
 } BackupStoreFileStats;
 
+// Counters for the pool of coding chunks (see CodingChunkAlloc)
+typedef struct
+{
+	int64_t mRequests;		// calls to CodingChunkAlloc()
+	int64_t mReused;		// requests satisfied from the pool
+	int64_t mDiscarded;		// chunks freed because the pool was full
+	int64_t mBytesRetained;	// size of the chunks in the pool now
+} BackupStoreFileCodingPoolStats;
+
 class BackgroundTask;
 class RunStatusProvider;
 
@@ -44,7 +54,11 @@ class RunStatusProvider;
 // Have some memory allocation commands, note closing "Off" at end of file.
 #include "MemLeakFindOn.h"
 
+class BackupStoreFileDecodePipeline;
+class BackupStoreFileDecryptContexts;
 class BackupStoreFileEncodeStream;
+class CipherContext;
+class FileHoles;
 
 // --------------------------------------------------------------------------
 //
@@ -80,8 +94,10 @@ public:
 	class DecodedStream : public IOStream
 	{
 		friend class BackupStoreFile;
+		friend class BackupStoreFileDecodePipeline;
 	private:
-		DecodedStream(IOStream &rEncodedFile, int Timeout);
+		DecodedStream(IOStream &rEncodedFile, int Timeout,
+			BackupStoreFileDecryptContexts *pDecryptContexts);
 		DecodedStream(const DecodedStream &); // not allowed
 		DecodedStream &operator=(const DecodedStream &); // not allowed
 	public:
@@ -100,10 +116,15 @@ public:
 		int64_t GetNumBlocks() {return mNumBlocks;}	// primarily for tests
 		
 		bool IsSymLink();
+		void FindHoles(FileHoles &rHoles);
 		
 	private:
 		void Setup(const BackupClientFileAttributes *pAlterativeAttr);
 		void ReadBlockIndex(bool MagicAlreadyRead);
+		int DecodeBlock(int64_t Block, const uint8_t *pEncoded,
+			int32_t EncodedSize, uint8_t *pClear, int ClearSize,
+			BackupStoreFileDecryptContexts *pDecryptContexts);
+		void FillPipeline();
 			
 	private:
 		IOStream &mrEncodedFile;
@@ -119,6 +140,10 @@ public:
 		int mCurrentBlockClearSize;
 		int mPositionInCurrentBlock;
 		uint64_t mEntryIVBase;
+		bool mFastChecksums;
+		BackupStoreFileDecryptContexts *mpDecryptContexts;
+		BackupStoreFileDecodePipeline *mpPipeline;
+		int64_t mNextBlockToAdd;
 #ifndef BOX_DISABLE_BACKWARDS_COMPATIBILITY_BACKUPSTOREFILE
 		bool mIsOldVersion;
 #endif
@@ -191,7 +216,9 @@ public:
 		int64_t *pModificationTime = 0,
 		ReadLoggingStream::Logger* pLogger = NULL,
 		RunStatusProvider* pRunStatusProvider = NULL,
-		BackgroundTask* pBackgroundTask = NULL
+		BackgroundTask* pBackgroundTask = NULL,
+		int CompressionCodec = CompressCodec::Zlib,
+		int CompressionLevel = 0
 	);
 	static std::auto_ptr<BackupStoreFileEncodeStream> EncodeFileDiff
 	(
@@ -202,7 +229,11 @@ public:
 		DiffTimer *pDiffTimer,
 		int64_t *pModificationTime = 0, 
 		bool *pIsCompletelyDifferent = 0,
-		BackgroundTask* pBackgroundTask = NULL
+		BackgroundTask* pBackgroundTask = NULL,
+		int DiffingThreads = 1,
+		int CompressionCodec = CompressCodec::Zlib,
+		int CompressionLevel = 0,
+		const int32_t *pDiffFromFileOptions = 0
 	);
 	// Shortcut interface
 	static int64_t QueryStoreFileDiff(BackupProtocolCallable& protocol,
@@ -218,47 +249,38 @@ public:
 	static void CombineFile(IOStream &rDiff, IOStream &rDiff2, IOStream &rFrom, IOStream &rOut);
 	static void CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream &rDiff2b, IOStream &rOut);
 	static void ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream &rFrom2, IOStream &rOut, int64_t ObjectIDOfFrom, bool *pIsCompletelyDifferent = 0);
-	static void DecodeFile(IOStream &rEncodedFile, const char *DecodedFilename, int Timeout, const BackupClientFileAttributes *pAlterativeAttr = 0);
-	static std::auto_ptr<BackupStoreFile::DecodedStream> DecodeFileStream(IOStream &rEncodedFile, int Timeout, const BackupClientFileAttributes *pAlterativeAttr = 0);
-	static bool CompareFileContentsAgainstBlockIndex(const char *Filename, IOStream &rBlockIndex, int Timeout);
+	static void DecodeFile(IOStream &rEncodedFile, const char *DecodedFilename, int Timeout, const BackupClientFileAttributes *pAlterativeAttr = 0,
+		BackupStoreFileDecryptContexts *pDecryptContexts = 0);
+	static std::auto_ptr<BackupStoreFile::DecodedStream> DecodeFileStream(IOStream &rEncodedFile, int Timeout, const BackupClientFileAttributes *pAlterativeAttr = 0,
+		BackupStoreFileDecryptContexts *pDecryptContexts = 0);
+	static bool CompareFileContentsAgainstBlockIndex(const char *Filename, IOStream &rBlockIndex, int Timeout,
+		BackupStoreFileDecryptContexts *pDecryptContexts = 0);
 	static std::auto_ptr<IOStream> CombineFileIndices(IOStream &rDiff, IOStream &rFrom, bool DiffIsIndexOnly = false, bool FromIsIndexOnly = false);
 
 	// Stream manipulation
 	static std::auto_ptr<IOStream> ReorderFileToStreamOrder(IOStream *pStream, bool TakeOwnership);
-	static void MoveStreamPositionToBlockIndex(IOStream &rStream);
+	static void MoveStreamPositionToBlockIndex(IOStream &rStream,
+		int32_t *pFileOptionsOut = 0);
 
 	// Crypto setup
 	static void SetBlowfishKeys(const void *pKey, int KeyLength, const void *pBlockEntryKey, int BlockEntryKeyLength);
 #ifndef HAVE_OLD_SSL
 	static void SetAESKey(const void *pKey, int KeyLength);
 #endif
+	static void SetFastBlockChecksums(bool Enabled);
+	static void SetContentDefinedChunking(bool Enabled);
+	static void SetLargeBlocks(bool Enabled);
+	static void SetEncodingThreads(int Threads);
+	static void SetDecodingThreads(int Threads);
 
-	// Allocation of properly aligning chunks for decoding and encoding chunks
-	inline static void *CodingChunkAlloc(int Size)
-	{
-		uint8_t *a = (uint8_t*)malloc((Size) + (BACKUPSTOREFILE_CODING_BLOCKSIZE * 3));
-		if(a == 0) return 0;
-		// Align to main block size
-		ASSERT(sizeof(uint64_t) >= sizeof(void*));	// make sure casting the right pointer size
-		uint8_t adjustment = BACKUPSTOREFILE_CODING_BLOCKSIZE
-			  - (uint8_t)(((uint64_t)a) % BACKUPSTOREFILE_CODING_BLOCKSIZE);
-		uint8_t *b = (a + adjustment);
-		// Store adjustment
-		*b = adjustment;
-		// Return offset
-		return b + BACKUPSTOREFILE_CODING_OFFSET;
-	}
-	inline static void CodingChunkFree(void *Block)
-	{
-		// Check alignment is as expected
-		ASSERT(sizeof(uint64_t) >= sizeof(void*));	// make sure casting the right pointer size
-		ASSERT((uint8_t)(((uint64_t)Block) % BACKUPSTOREFILE_CODING_BLOCKSIZE) == BACKUPSTOREFILE_CODING_OFFSET);
-		uint8_t *a = (uint8_t*)Block;
-		a -= BACKUPSTOREFILE_CODING_OFFSET;
-		// Adjust downwards...
-		a -= *a;
-		free(a);
-	}
+	// Allocation of properly aligning chunks for decoding and encoding
+	// chunks. Freed chunks are kept in a pool, shared by all threads,
+	// to be reused for chunks of a similar size.
+	static void *CodingChunkAlloc(int Size);
+	static void CodingChunkFree(void *Block);
+	static BackupStoreFileCodingPoolStats GetCodingPoolStats();
+	static void LogCodingPoolStats();
+	static void ReleaseCodingPool();
 
 	static void DiffTimerExpired();
 
@@ -275,12 +297,25 @@ public:
 	public:
 		void Allocate(int Size);
 		void Reallocate(int NewSize);
+		void Swap(EncodingBuffer &rOther);
 		
 		uint8_t *mpBuffer;
 		int mBufferSize;
 	};
 	static int MaxBlockSizeForChunkSize(int ChunkSize);
-	static int EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput);
+	static int EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput,
+		bool TryCompressing = true, int CompressionCodec = CompressCodec::Zlib,
+		int CompressionLevel = 0);
+	static int EncodeChunk(const void *Chunk, int ChunkSize, BackupStoreFile::EncodingBuffer &rOutput,
+		CipherContext &rEncrypt, bool TryCompressing = true,
+		int CompressionCodec = CompressCodec::Zlib, int CompressionLevel = 0);
+	static int CompressChunk(const void *Chunk, int ChunkSize,
+		BackupStoreFile::EncodingBuffer &rOutput, int OutputOffset,
+		int CompressionCodec, int CompressionLevel);
+	static int EncodeCompressedChunk(const void *pCompressed, int CompressedSize,
+		int CompressionCodec, BackupStoreFile::EncodingBuffer &rOutput);
+	static bool ChunkIsCompressed(const BackupStoreFile::EncodingBuffer &rEncoded);
+	static bool IsCompressedFileType(const std::string &rFilename);
 
 	// Caller should know how big the output size is, but also allocate a bit more memory to cover various
 	// overheads allowed for in checks
@@ -289,11 +324,13 @@ public:
 		// Plenty big enough
 		return KnownChunkSize + 256;
 	}
-	static int DecodeChunk(const void *Encoded, int EncodedSize, void *Output, int OutputSize);
+	static int DecodeChunk(const void *Encoded, int EncodedSize, void *Output, int OutputSize,
+		BackupStoreFileDecryptContexts *pDecryptContexts = 0);
 
 	// Statisitics, not designed to be completely reliable	
 	static void ResetStats();
 	static BackupStoreFileStats msStats;
+
 	
 	// For debug
 #ifndef BOX_RELEASE_BUILD
@@ -0,0 +1,80 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileChecksum.h
+//		Purpose: Strong checksums of blocks in backup store files
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREFILECHECKSUM__H
+#define BACKUPSTOREFILECHECKSUM__H
+
+#include "MD5Digest.h"
+#include "XXH128Digest.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreFileStrongChecksum
+//		Purpose: Calculates the strong checksum of a block, using the
+//			 digest which the block index it belongs to uses: MD5
+//			 for OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1 indexes, or
+//			 XXH3-128 for OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+class BackupStoreFileStrongChecksum
+{
+public:
+	BackupStoreFileStrongChecksum(bool Fast)
+	: mFast(Fast)
+	{ }
+
+	void Add(const void *pData, int Length)
+	{
+		if(mFast)
+		{
+			mFastDigest.Add(pData, Length);
+		}
+		else
+		{
+			mMD5.Add(pData, Length);
+		}
+	}
+
+	void Finish()
+	{
+		if(mFast)
+		{
+			mFastDigest.Finish();
+		}
+		else
+		{
+			mMD5.Finish();
+		}
+	}
+
+	uint8_t *DigestAsData()
+	{
+		return mFast ? mFastDigest.DigestAsData() : mMD5.DigestAsData();
+	}
+
+	bool DigestMatches(uint8_t *pCompareWith) const
+	{
+		return mFast ? mFastDigest.DigestMatches(pCompareWith)
+			: mMD5.DigestMatches(pCompareWith);
+	}
+
+	enum
+	{
+		DigestLength = MD5Digest::DigestLength
+	};
+
+private:
+	bool mFast;
+	MD5Digest mMD5;
+	XXH128Digest mFastDigest;
+};
+
+#endif // BACKUPSTOREFILECHECKSUM__H
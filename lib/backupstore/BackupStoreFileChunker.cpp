@@ -0,0 +1,336 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileChunker.cpp
+//		Purpose: Content defined chunking of files for the backup store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "BackupStoreConstants.h"
+#include "BackupStoreFileChunker.h"
+#include "BackupStoreFileWire.h"
+#include "IOStream.h"
+
+#include "MemLeakFindOn.h"
+
+namespace
+{
+	// The gear table maps each byte value to a random 64 bit number.
+	// It's generated from a fixed seed (with SplitMix64) rather than
+	// being written out, but must never change, as the chunk boundaries
+	// of every file uploaded depend on it.
+	uint64_t sGearTable[256];
+
+	struct GearTableInitialiser
+	{
+		GearTableInitialiser()
+		{
+			uint64_t state = 0x426f784261636b75ULL;
+			for(int i = 0; i < 256; ++i)
+			{
+				state += 0x9e3779b97f4a7c15ULL;
+				uint64_t z = state;
+				z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+				z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+				sGearTable[i] = z ^ (z >> 31);
+			}
+		}
+	};
+
+	GearTableInitialiser sGearTableInitialiser;
+
+	// The hash is shifted left for each byte, so its top bits depend
+	// on the most bytes, and are the ones tested for a boundary.
+	uint64_t TopBitsMask(int Bits)
+	{
+		return ~(uint64_t)0 << (64 - Bits);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::BackupStoreFileChunker(int32_t)
+//		Purpose: Constructor, for chunks of the given average size
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileChunker::BackupStoreFileChunker(int32_t AverageSize)
+: mAverageSize(MinAverageSize),
+  mAverageSizeBits(0)
+{
+	while(mAverageSize < AverageSize && mAverageSize < MaxAverageSize)
+	{
+		mAverageSize *= 2;
+	}
+	for(int32_t s = mAverageSize; s > 1; s /= 2)
+	{
+		++mAverageSizeBits;
+	}
+	ASSERT(mAverageSize == AverageSize);
+
+	mMinimumSize = mAverageSize / 4;
+	mMaximumSize = mAverageSize * 4;
+	ASSERT(mMaximumSize <= BACKUP_FILE_MAX_BLOCK_SIZE);
+
+	// Normalised chunking: boundaries are four times less likely than
+	// average before the average size, and four times more likely after
+	// it, which keeps most chunks close to the average size.
+	mMaskBeforeAverage = TopBitsMask(mAverageSizeBits + 2);
+	mMaskAfterAverage = TopBitsMask(mAverageSizeBits - 2);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::FindChunkLength(const uint8_t *, int32_t)
+//		Purpose: Returns the length of the chunk at the start of the
+//			 data. There must be at least the maximum chunk size of
+//			 data, unless it's the end of the region being chunked.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int32_t BackupStoreFileChunker::FindChunkLength(const uint8_t *pData,
+	int32_t Length) const
+{
+	if(Length <= mMinimumSize)
+	{
+		return Length;
+	}
+
+	int32_t limit = (Length > mMaximumSize) ? mMaximumSize : Length;
+	int32_t average = (mAverageSize < limit) ? mAverageSize : limit;
+
+	// No boundaries are allowed before the minimum size, so don't
+	// bother hashing the data there.
+	uint64_t hash = 0;
+	int32_t i = mMinimumSize;
+	for(; i < average; ++i)
+	{
+		hash = (hash << 1) + sGearTable[pData[i]];
+		if((hash & mMaskBeforeAverage) == 0)
+		{
+			return i + 1;
+		}
+	}
+	for(; i < limit; ++i)
+	{
+		hash = (hash << 1) + sGearTable[pData[i]];
+		if((hash & mMaskAfterAverage) == 0)
+		{
+			return i + 1;
+		}
+	}
+
+	return limit;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::AverageSizeForFileSize(int64_t)
+//		Purpose: Static. The average chunk size to use for a new file
+//			 of the given size, chosen like the fixed block sizes so
+//			 that big files don't have huge numbers of chunks.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int32_t BackupStoreFileChunker::AverageSizeForFileSize(int64_t FileSize)
+{
+	int32_t size = MinAverageSize;
+	while(size < MaxAverageSize &&
+		(FileSize / size) > BACKUP_FILE_INCREASE_BLOCK_SIZE_AFTER)
+	{
+		size *= 2;
+	}
+	return size;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunker::AverageSizeForFileOptions(int32_t)
+//		Purpose: Static. The average chunk size recorded in the options
+//			 from the header of an encoded file, so that a new
+//			 version can be chunked the same way, or 0 if the file
+//			 wasn't split into content defined chunks, or the size
+//			 isn't one which would have been used.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int32_t BackupStoreFileChunker::AverageSizeForFileOptions(int32_t Options)
+{
+	if((Options & FILE_OPTION_CONTENT_DEFINED_CHUNKS) == 0)
+	{
+		return 0;
+	}
+
+	int bits = (Options >> FILE_OPTION_CHUNK_SIZE_SHIFT) & 0xff;
+	if(bits >= 31 || (1 << bits) < MinAverageSize ||
+		(1 << bits) > MaxAverageSize)
+	{
+		return 0;
+	}
+	return 1 << bits;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunkReader::BackupStoreFileChunkReader(const BackupStoreFileChunker &, const uint8_t *, int64_t)
+//		Purpose: Constructor, to chunk data in memory
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileChunkReader::BackupStoreFileChunkReader(
+	const BackupStoreFileChunker &rChunker, const uint8_t *pData,
+	int64_t Length)
+: mrChunker(rChunker),
+  mpData(pData),
+  mpStream(0),
+  mLength(Length),
+  mPosition(0),
+  mStreamLeft(0),
+  mpBuffer(0),
+  mBufferSize(0),
+  mBufferStart(0),
+  mBufferEnd(0)
+{
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunkReader::BackupStoreFileChunkReader(const BackupStoreFileChunker &, IOStream &, int64_t)
+//		Purpose: Constructor, to chunk the next Length bytes of a stream
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileChunkReader::BackupStoreFileChunkReader(
+	const BackupStoreFileChunker &rChunker, IOStream &rStream,
+	int64_t Length)
+: mrChunker(rChunker),
+  mpData(0),
+  mpStream(&rStream),
+  mLength(Length),
+  mPosition(0),
+  mStreamLeft(Length),
+  mpBuffer(0),
+  mBufferSize(rChunker.GetMaximumSize() * 2),
+  mBufferStart(0),
+  mBufferEnd(0)
+{
+	mpBuffer = (uint8_t *)::malloc(mBufferSize);
+	if(mpBuffer == 0)
+	{
+		throw std::bad_alloc();
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunkReader::~BackupStoreFileChunkReader()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileChunkReader::~BackupStoreFileChunkReader()
+{
+	if(mpBuffer != 0)
+	{
+		::free(mpBuffer);
+		mpBuffer = 0;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileChunkReader::NextChunk(const uint8_t *&, int32_t &)
+//		Purpose: Finds the next chunk, returning false if there are
+//			 no more.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFileChunkReader::NextChunk(const uint8_t *&rpChunkOut,
+	int32_t &rSizeOut)
+{
+	if(mPosition >= mLength)
+	{
+		return false;
+	}
+
+	if(mpData != 0)
+	{
+		int64_t left = mLength - mPosition;
+		int32_t available = (left > mrChunker.GetMaximumSize())
+			? mrChunker.GetMaximumSize() : (int32_t)left;
+		rpChunkOut = mpData + mPosition;
+		rSizeOut = mrChunker.FindChunkLength(rpChunkOut, available);
+		mPosition += rSizeOut;
+		return true;
+	}
+
+	// Make sure there's a maximum sized chunk in the buffer, or the
+	// rest of the data if there's less than that.
+	if(mBufferEnd - mBufferStart < mrChunker.GetMaximumSize() &&
+		mStreamLeft > 0)
+	{
+		::memmove(mpBuffer, mpBuffer + mBufferStart,
+			mBufferEnd - mBufferStart);
+		mBufferEnd -= mBufferStart;
+		mBufferStart = 0;
+
+		while(mBufferEnd < mBufferSize && mStreamLeft > 0)
+		{
+			int32_t want = mBufferSize - mBufferEnd;
+			if(want > mStreamLeft)
+			{
+				want = (int32_t)mStreamLeft;
+			}
+			int got = mpStream->Read(mpBuffer + mBufferEnd, want);
+			if(got <= 0)
+			{
+				// The stream is shorter than expected
+				mStreamLeft = 0;
+				mLength = mPosition + mBufferEnd;
+				break;
+			}
+			mBufferEnd += got;
+			mStreamLeft -= got;
+		}
+	}
+
+	if(mBufferEnd == mBufferStart)
+	{
+		return false;
+	}
+
+	int32_t available = mBufferEnd - mBufferStart;
+	if(available > mrChunker.GetMaximumSize())
+	{
+		available = mrChunker.GetMaximumSize();
+	}
+	rpChunkOut = mpBuffer + mBufferStart;
+	rSizeOut = mrChunker.FindChunkLength(rpChunkOut, available);
+	mBufferStart += rSizeOut;
+	mPosition += rSizeOut;
+	return true;
+}
@@ -0,0 +1,106 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileChunker.h
+//		Purpose: Content defined chunking of files for the backup store
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREFILECHUNKER__H
+#define BACKUPSTOREFILECHUNKER__H
+
+class IOStream;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreFileChunker
+//		Purpose: Splits data into chunks at points chosen by its content
+//			 (FastCDC, using a gear hash with normalised chunking),
+//			 so that inserting or deleting data only changes the
+//			 chunks around the edit, instead of moving the boundaries
+//			 of every block after it.
+//
+//			 The boundaries depend only on the data and the average
+//			 chunk size, which is a power of two between
+//			 MinAverageSize and MaxAverageSize. Chunks are between a
+//			 quarter of and four times the average size, apart from
+//			 the last one. Changing the hash or the sizes would stop
+//			 new versions of files matching old ones, so don't.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreFileChunker
+{
+public:
+	BackupStoreFileChunker(int32_t AverageSize);
+
+	enum
+	{
+		MinAverageSize = 4096,
+		MaxAverageSize = 128*1024
+	};
+
+	int32_t GetAverageSize() const {return mAverageSize;}
+	int32_t GetMinimumSize() const {return mMinimumSize;}
+	int32_t GetMaximumSize() const {return mMaximumSize;}
+	int GetAverageSizeBits() const {return mAverageSizeBits;}
+
+	int32_t FindChunkLength(const uint8_t *pData, int32_t Length) const;
+
+	static int32_t AverageSizeForFileSize(int64_t FileSize);
+	static int32_t AverageSizeForFileOptions(int32_t Options);
+
+private:
+	int32_t mAverageSize;
+	int32_t mMinimumSize;
+	int32_t mMaximumSize;
+	int mAverageSizeBits;
+	uint64_t mMaskBeforeAverage;
+	uint64_t mMaskAfterAverage;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreFileChunkReader
+//		Purpose: Splits a region of a file into chunks, one at a time,
+//			 from a buffer in memory or from a stream.
+//			 Chunks read from a stream are only valid until the next
+//			 call to NextChunk(). If the stream ends early, the region
+//			 ends with it; check GetPosition() against its length.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreFileChunkReader
+{
+public:
+	BackupStoreFileChunkReader(const BackupStoreFileChunker &rChunker,
+		const uint8_t *pData, int64_t Length);
+	BackupStoreFileChunkReader(const BackupStoreFileChunker &rChunker,
+		IOStream &rStream, int64_t Length);
+	~BackupStoreFileChunkReader();
+private:
+	// No copying allowed
+	BackupStoreFileChunkReader(const BackupStoreFileChunkReader &);
+	BackupStoreFileChunkReader &operator=(const BackupStoreFileChunkReader &);
+
+public:
+	bool NextChunk(const uint8_t *&rpChunkOut, int32_t &rSizeOut);
+	int64_t GetPosition() const {return mPosition;}
+
+private:
+	const BackupStoreFileChunker &mrChunker;
+	const uint8_t *mpData;
+	IOStream *mpStream;
+	int64_t mLength;
+	int64_t mPosition;
+	int64_t mStreamLeft;
+	uint8_t *mpBuffer;
+	int32_t mBufferSize;
+	int32_t mBufferStart;
+	int32_t mBufferEnd;
+};
+
+#endif // BACKUPSTOREFILECHUNKER__H
@@ -73,7 +73,7 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 	{
 		THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 	}
-	if(ntohl(diff1IdxHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diff1IdxHdr.mMagicValue)))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -153,7 +153,8 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 		{
 			THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 		}
-		if(ntohl(diff2IdxHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+		// Both diffs must use the same kind of strong checksums
+		if(diff2IdxHdr.mMagicValue != diff1IdxHdr.mMagicValue)
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 		}
@@ -223,12 +224,12 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 					// Free old block
 					if(buffer != 0)
 					{
-						::free(buffer);
+						BackupStoreFile::CodingChunkFree(buffer);
 						buffer = 0;
 						bufferSize = 0;
 					}
 					// Allocate new block
-					buffer = ::malloc(copySize);
+					buffer = BackupStoreFile::CodingChunkAlloc(copySize);
 					if(buffer == 0)
 					{
 						throw std::bad_alloc();
@@ -311,7 +312,7 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 		::free(diff1BlockStartPositions);
 		if(buffer != 0)
 		{
-			::free(buffer);
+			BackupStoreFile::CodingChunkFree(buffer);
 		}
 		throw;
 	}
@@ -320,7 +321,7 @@ void BackupStoreFile::CombineDiffs(IOStream &rDiff1, IOStream &rDiff2, IOStream
 	::free(diff1BlockStartPositions);
 	if(buffer != 0)
 	{
-		::free(buffer);
+		BackupStoreFile::CodingChunkFree(buffer);
 	}
 }
 
@@ -0,0 +1,210 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileCodingPool.cpp
+//		Purpose: Pool of aligned chunks for encoding and decoding
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "BackupStoreFile.h"
+#include "Logging.h"
+#include "Thread.h"
+
+#include "MemLeakFindOn.h"
+
+// Chunks are pooled in size classes, four for each doubling of size
+// from 4 KB, so that no more than a quarter of a chunk is wasted. Chunks
+// bigger than the largest class aren't pooled.
+#define CODING_POOL_SMALLEST_CHUNK	4096
+#define CODING_POOL_NUM_CLASSES		52
+#define CODING_POOL_UNPOOLED		0xff
+
+// The most memory the pool will hold on to
+#define CODING_POOL_MAX_BYTES		(32*1024*1024)
+
+namespace
+{
+	// Free chunks in each class, linked through the first bytes of
+	// the chunks themselves, so that the pool needs no other memory
+	Mutex sPoolMutex;
+	uint8_t *sPool[CODING_POOL_NUM_CLASSES];
+	BackupStoreFileCodingPoolStats sPoolStats = {0, 0, 0, 0};
+
+	int CapacityOfClass(int Class)
+	{
+		return (CODING_POOL_SMALLEST_CHUNK << (Class / 4))
+			/ 4 * (4 + (Class % 4));
+	}
+
+	int ClassForSize(int Size)
+	{
+		for(int c = 0; c < CODING_POOL_NUM_CLASSES; ++c)
+		{
+			if(CapacityOfClass(c) >= Size)
+			{
+				return c;
+			}
+		}
+		return CODING_POOL_UNPOOLED;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CodingChunkAlloc(int)
+//		Purpose: Allocates a chunk of at least Size bytes, aligned for
+//				 EncodeChunk() and DecodeChunk(), from the pool if
+//				 there's one of the right size. Returns 0 if there's
+//				 no memory. Free with CodingChunkFree().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void *BackupStoreFile::CodingChunkAlloc(int Size)
+{
+	int chunkClass = ClassForSize(Size);
+	uint8_t *a = 0;
+
+	{
+		MutexLock lock(sPoolMutex);
+		sPoolStats.mRequests++;
+		if(chunkClass != CODING_POOL_UNPOOLED &&
+			sPool[chunkClass] != 0)
+		{
+			a = sPool[chunkClass];
+			::memcpy(&sPool[chunkClass], a, sizeof(uint8_t *));
+			sPoolStats.mReused++;
+			sPoolStats.mBytesRetained -= CapacityOfClass(chunkClass);
+		}
+	}
+
+	if(a == 0)
+	{
+		int capacity = (chunkClass == CODING_POOL_UNPOOLED)
+			? Size : CapacityOfClass(chunkClass);
+		a = (uint8_t*)malloc(capacity + (BACKUPSTOREFILE_CODING_BLOCKSIZE * 3));
+		if(a == 0) return 0;
+	}
+
+	// Align to main block size
+	ASSERT(sizeof(uint64_t) >= sizeof(void*));	// make sure casting the right pointer size
+	uint8_t adjustment = BACKUPSTOREFILE_CODING_BLOCKSIZE
+		  - (uint8_t)(((uint64_t)a) % BACKUPSTOREFILE_CODING_BLOCKSIZE);
+	uint8_t *b = (a + adjustment);
+	// Store adjustment, and the class to return it to
+	b[0] = adjustment;
+	b[1] = chunkClass;
+	// Return offset
+	return b + BACKUPSTOREFILE_CODING_OFFSET;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::CodingChunkFree(void *)
+//		Purpose: Returns a chunk allocated by CodingChunkAlloc() to the
+//				 pool, or frees it if the pool is full.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::CodingChunkFree(void *Block)
+{
+	// Check alignment is as expected
+	ASSERT(sizeof(uint64_t) >= sizeof(void*));	// make sure casting the right pointer size
+	ASSERT((uint8_t)(((uint64_t)Block) % BACKUPSTOREFILE_CODING_BLOCKSIZE) == BACKUPSTOREFILE_CODING_OFFSET);
+	uint8_t *b = (uint8_t*)Block;
+	b -= BACKUPSTOREFILE_CODING_OFFSET;
+	int chunkClass = b[1];
+	// Adjust downwards...
+	uint8_t *a = b - b[0];
+
+	if(chunkClass != CODING_POOL_UNPOOLED)
+	{
+		MutexLock lock(sPoolMutex);
+		int capacity = CapacityOfClass(chunkClass);
+		if(sPoolStats.mBytesRetained + capacity <= CODING_POOL_MAX_BYTES)
+		{
+			::memcpy(a, &sPool[chunkClass], sizeof(uint8_t *));
+			sPool[chunkClass] = a;
+			sPoolStats.mBytesRetained += capacity;
+			// Chunks in the pool are deliberately kept
+			MEMLEAKFINDER_NOT_A_LEAK(a);
+			return;
+		}
+		sPoolStats.mDiscarded++;
+	}
+
+	free(a);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::GetCodingPoolStats()
+//		Purpose: Returns the counters for the pool since the process
+//				 started, to see how often chunks are reused.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileCodingPoolStats BackupStoreFile::GetCodingPoolStats()
+{
+	MutexLock lock(sPoolMutex);
+	return sPoolStats;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::LogCodingPoolStats()
+//		Purpose: Logs how many chunks have been allocated, and how many
+//				 of them were reused from the pool.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::LogCodingPoolStats()
+{
+	BackupStoreFileCodingPoolStats stats(GetCodingPoolStats());
+	BOX_INFO("Coding buffer statistics: " << stats.mRequests <<
+		" allocated, " << stats.mReused << " (" <<
+		((stats.mRequests == 0) ? 0 : (stats.mReused * 100 / stats.mRequests)) <<
+		"%) reused, " << stats.mDiscarded << " discarded, " <<
+		stats.mBytesRetained << " bytes kept");
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFile::ReleaseCodingPool()
+//		Purpose: Frees all the chunks in the pool, for when none will
+//				 be needed for a while, and starts counting afresh.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFile::ReleaseCodingPool()
+{
+	MutexLock lock(sPoolMutex);
+	for(int c = 0; c < CODING_POOL_NUM_CLASSES; ++c)
+	{
+		while(sPool[c] != 0)
+		{
+			uint8_t *a = sPool[c];
+			::memcpy(&sPool[c], a, sizeof(uint8_t *));
+			free(a);
+		}
+	}
+	sPoolStats.mRequests = 0;
+	sPoolStats.mReused = 0;
+	sPoolStats.mDiscarded = 0;
+	sPoolStats.mBytesRetained = 0;
+}
@@ -26,8 +26,8 @@ typedef struct
 	int64_t mFilePosition;
 } FromIndexEntry;
 
-static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEntries);
-static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumBlocks, IOStream &rFrom, FromIndexEntry *pFromIndex, int64_t FromNumBlocks, IOStream &rOut);
+static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEntries, int32_t &rIndexMagicOut);
+static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumBlocks, IOStream &rFrom, FromIndexEntry *pFromIndex, int64_t FromNumBlocks, int32_t FromIndexMagic, IOStream &rOut);
 static void WriteNewIndex(IOStream &rDiff, int64_t DiffNumBlocks, FromIndexEntry *pFromIndex, int64_t FromNumBlocks, IOStream &rOut);
 
 // --------------------------------------------------------------------------
@@ -106,12 +106,13 @@ void BackupStoreFile::CombineFile(IOStream &rDiff, IOStream &rDiff2, IOStream &r
 	{
 		// Load the index from the From file, calculating the offsets in the
 		// file as we go along, and enforce that everything should be present.
-		LoadFromIndex(rFrom, pFromIndex, fromNumBlocks);
+		int32_t fromIndexMagic = 0;
+		LoadFromIndex(rFrom, pFromIndex, fromNumBlocks, fromIndexMagic);
 		
 		// Read in the block index of the Diff file in small chunks, and output data
 		// for each block, either from this file, or the other file.
 		int64_t diffNumBlocks = box_ntoh64(hdr.mNumBlocks);
-		CopyData(rDiff /* positioned at start of data */, rDiff2, diffNumBlocks, rFrom, pFromIndex, fromNumBlocks, rOut);
+		CopyData(rDiff /* positioned at start of data */, rDiff2, diffNumBlocks, rFrom, pFromIndex, fromNumBlocks, fromIndexMagic, rOut);
 		
 		// Read in the block index again, and output the new block index, simply
 		// filling in the sizes of blocks from the old file.
@@ -137,12 +138,13 @@ void BackupStoreFile::CombineFile(IOStream &rDiff, IOStream &rDiff2, IOStream &r
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static LoadFromIndex(IOStream &, FromIndexEntry *, int64_t)
-//		Purpose: Static. Load the index from the From file
+//		Name:    static LoadFromIndex(IOStream &, FromIndexEntry *, int64_t, int32_t &)
+//		Purpose: Static. Load the index from the From file, returning
+//				 the magic value of its header in network byte order.
 //		Created: 16/1/04
 //
 // --------------------------------------------------------------------------
-static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEntries)
+static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEntries, int32_t &rIndexMagicOut)
 {
 	ASSERT(pIndex != 0);
 	ASSERT(NumEntries >= 0);
@@ -159,11 +161,12 @@ static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEn
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(blkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(blkhdr.mMagicValue))
 		|| (int64_t)box_ntoh64(blkhdr.mNumBlocks) != NumEntries)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
+	rIndexMagicOut = blkhdr.mMagicValue;
 	
 	// And then the block entries
 	for(int64_t b = 0; b < NumEntries; ++b)
@@ -198,7 +201,7 @@ static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEn
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static CopyData(IOStream &, IOStream &, int64_t, IOStream &, FromIndexEntry *, int64_t, IOStream &)
+//		Name:    static CopyData(IOStream &, IOStream &, int64_t, IOStream &, FromIndexEntry *, int64_t, int32_t, IOStream &)
 //		Purpose: Static. Copy data from the Diff and From file to the out file.
 //				 rDiffData is at beginning of data.
 //				 rDiffIndex at any position.
@@ -208,7 +211,8 @@ static void LoadFromIndex(IOStream &rFrom, FromIndexEntry *pIndex, int64_t NumEn
 //
 // --------------------------------------------------------------------------
 static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumBlocks,
-	IOStream &rFrom, FromIndexEntry *pFromIndex, int64_t FromNumBlocks, IOStream &rOut)
+	IOStream &rFrom, FromIndexEntry *pFromIndex, int64_t FromNumBlocks,
+	int32_t FromIndexMagic, IOStream &rOut)
 {
 	// Jump to the end of the diff file to read the index
 	rDiffIndex.Seek(0 - ((DiffNumBlocks * sizeof(file_BlockIndexEntry)) + sizeof(file_BlockIndexHeader)), IOStream::SeekType_End);
@@ -219,7 +223,9 @@ static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumB
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(diffBlkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	// The diff must use the same kind of strong checksums as the From file,
+	// as the new index will contain entries from both.
+	if(diffBlkhdr.mMagicValue != FromIndexMagic
 		|| (int64_t)box_ntoh64(diffBlkhdr.mNumBlocks) != DiffNumBlocks)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
@@ -274,12 +280,12 @@ static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumB
 				// Free old block
 				if(buffer != 0)
 				{
-					::free(buffer);
+					BackupStoreFile::CodingChunkFree(buffer);
 					buffer = 0;
 					bufferSize = 0;
 				}
 				// Allocate new block
-				buffer = ::malloc(blockSize);
+				buffer = BackupStoreFile::CodingChunkAlloc(blockSize);
 				if(buffer == 0)
 				{
 					throw std::bad_alloc();
@@ -324,7 +330,7 @@ static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumB
 		// Free buffer, if allocated
 		if(buffer != 0)
 		{
-			::free(buffer);
+			BackupStoreFile::CodingChunkFree(buffer);
 			buffer = 0;
 		}
 	}
@@ -332,7 +338,7 @@ static void CopyData(IOStream &rDiffData, IOStream &rDiffIndex, int64_t DiffNumB
 	{
 		if(buffer != 0)
 		{
-			::free(buffer);
+			BackupStoreFile::CodingChunkFree(buffer);
 			buffer = 0;
 		}
 		throw;
@@ -361,7 +367,7 @@ static void WriteNewIndex(IOStream &rDiff, int64_t DiffNumBlocks, FromIndexEntry
 	{
 		THROW_EXCEPTION(BackupStoreException, FailedToReadBlockOnCombine)
 	}
-	if(ntohl(diffBlkhdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+	if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diffBlkhdr.mMagicValue))
 		|| (int64_t)box_ntoh64(diffBlkhdr.mNumBlocks) != DiffNumBlocks)
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
@@ -26,6 +26,15 @@ CipherContext BackupStoreFileCryptVar::sBlowfishDecrypt;
 CipherContext *BackupStoreFileCryptVar::spEncrypt = &BackupStoreFileCryptVar::sBlowfishEncrypt;
 uint8_t BackupStoreFileCryptVar::sEncryptCipherType = HEADER_BLOWFISH_ENCODING;
 
+// Default to MD5, which all servers understand
+bool BackupStoreFileCryptVar::sFastBlockChecksums = false;
+
+// Default to fixed size blocks, of sizes any client can diff
+bool BackupStoreFileCryptVar::sContentDefinedChunking = false;
+bool BackupStoreFileCryptVar::sLargeBlocks = false;
+int BackupStoreFileCryptVar::sEncodingThreads = 1;
+int BackupStoreFileCryptVar::sDecodingThreads = 1;
+
 CipherContext BackupStoreFileCryptVar::sBlowfishEncryptBlockEntry;
 CipherContext BackupStoreFileCryptVar::sBlowfishDecryptBlockEntry;
 
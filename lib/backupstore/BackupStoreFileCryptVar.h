@@ -29,6 +29,16 @@ namespace BackupStoreFileCryptVar
 	// How encoding will be done
 	extern CipherContext *spEncrypt;
 	extern uint8_t sEncryptCipherType;
+	// Whether new files use fast strong checksums in their block index
+	extern bool sFastBlockChecksums;
+	// Whether new data is split into content defined chunks
+	extern bool sContentDefinedChunking;
+	// Whether huge files may have blocks bigger than BACKUP_FILE_MAX_BLOCK_SIZE
+	extern bool sLargeBlocks;
+	// How many threads to encode blocks of new data with
+	extern int sEncodingThreads;
+	// How many threads to decode blocks of big files with
+	extern int sDecodingThreads;
 
 	// Keys for the block indicies
 	extern CipherContext sBlowfishEncryptBlockEntry;
@@ -0,0 +1,321 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileDecodePipeline.cpp
+//		Purpose: Decode blocks of files in parallel, in order
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <new>
+
+#include "BackupStoreException.h"
+#include "BackupStoreFileDecodePipeline.h"
+#include "CommonException.h"
+
+#include "MemLeakFindOn.h"
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecodePipeline::BackupStoreFileDecodePipeline(BackupStoreFile::DecodedStream &, int, int32_t, int)
+//		Purpose: Constructor. Starts the given number of threads, to
+//			 decode blocks of the stream of up to MaxEncodedSize
+//			 bytes into buffers of ClearBufferSize bytes, allocated
+//			 with BackupStoreFile::CodingChunkAlloc().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileDecodePipeline::BackupStoreFileDecodePipeline(
+	BackupStoreFile::DecodedStream &rStream, int Threads,
+	int32_t MaxEncodedSize, int ClearBufferSize)
+: mrStream(rStream),
+  mMaxEncodedSize(MaxEncodedSize),
+  mClearBufferSize(ClearBufferSize),
+  mMaxBlocks(Threads * 2),
+  mStopping(false)
+{
+	try
+	{
+		for(int t = 0; t < Threads; ++t)
+		{
+			mWorkers.push_back(new Worker(*this));
+			mWorkers.back()->Start();
+		}
+	}
+	catch(...)
+	{
+		StopWorkers();
+		throw;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecodePipeline::~BackupStoreFileDecodePipeline()
+//		Purpose: Destructor. Waits for any blocks being decoded.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileDecodePipeline::~BackupStoreFileDecodePipeline()
+{
+	StopWorkers();
+
+	for(size_t b = 0; b < mBlocks.size(); ++b)
+	{
+		FreeBlock(mBlocks[b]);
+	}
+	for(size_t b = 0; b < mSpare.size(); ++b)
+	{
+		FreeBlock(mSpare[b]);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecodePipeline::StopWorkers()
+//		Purpose: Private. Tells the threads to finish, and waits for
+//			 them.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileDecodePipeline::StopWorkers()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mBlockAdded.Broadcast();
+	}
+
+	for(size_t w = 0; w < mWorkers.size(); ++w)
+	{
+		if(mWorkers[w]->IsStarted())
+		{
+			try
+			{
+				mWorkers[w]->Join();
+			}
+			catch(...)
+			{
+				// Failures of blocks were recorded in them
+			}
+		}
+		delete mWorkers[w];
+	}
+	mWorkers.clear();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecodePipeline::Add(int64_t, IOStream &, int32_t, int)
+//		Purpose: Reads the given block of the file from the encoded
+//			 stream, and adds it to be decoded.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileDecodePipeline::Add(int64_t BlockNumber,
+	IOStream &rEncoded, int32_t EncodedSize, int Timeout)
+{
+	ASSERT(EncodedSize > 0 && EncodedSize <= mMaxEncodedSize);
+
+	Block *pblock = 0;
+	{
+		MutexLock lock(mMutex);
+		if(!mSpare.empty())
+		{
+			pblock = mSpare.back();
+			mSpare.pop_back();
+		}
+	}
+
+	if(pblock == 0)
+	{
+		pblock = new Block;
+		pblock->mpEncoded = 0;
+		pblock->mpClear = 0;
+	}
+
+	try
+	{
+		if(pblock->mpEncoded == 0)
+		{
+			pblock->mpEncoded = (uint8_t *)BackupStoreFile::CodingChunkAlloc(mMaxEncodedSize);
+		}
+		if(pblock->mpClear == 0)
+		{
+			pblock->mpClear = (uint8_t *)BackupStoreFile::CodingChunkAlloc(mClearBufferSize);
+		}
+		if(pblock->mpEncoded == 0 || pblock->mpClear == 0)
+		{
+			throw std::bad_alloc();
+		}
+
+		if(!rEncoded.ReadFullBuffer(pblock->mpEncoded, EncodedSize,
+			0 /* not interested in bytes read if this fails */,
+			Timeout))
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				WhenDecodingExpectedToReadButCouldnt)
+		}
+	}
+	catch(...)
+	{
+		Recycle(pblock);
+		throw;
+	}
+
+	pblock->mNumber = BlockNumber;
+	pblock->mEncodedSize = EncodedSize;
+	pblock->mClearSize = 0;
+	pblock->mDone = false;
+	pblock->mFailed = false;
+	pblock->mFailureMessage.clear();
+
+	MutexLock lock(mMutex);
+	mBlocks.push_back(pblock);
+	mWaiting.push_back(pblock);
+	mBlockAdded.Signal();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecodePipeline::GetNext(uint8_t *&)
+//		Purpose: Waits for the oldest block to be decoded, and returns
+//			 its clear size. The clear data buffer is swapped with
+//			 rpClearData, which must have been allocated the same
+//			 way. Exceptions thrown while it was being decoded are
+//			 rethrown as CommonException ThreadFailed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int BackupStoreFileDecodePipeline::GetNext(uint8_t *&rpClearData)
+{
+	Block *pblock = 0;
+	{
+		MutexLock lock(mMutex);
+		ASSERT(!mBlocks.empty());
+		pblock = mBlocks.front();
+		while(!pblock->mDone)
+		{
+			mBlockDone.Wait(mMutex);
+		}
+		mBlocks.pop_front();
+	}
+
+	if(pblock->mFailed)
+	{
+		std::string message(pblock->mFailureMessage);
+		Recycle(pblock);
+		THROW_EXCEPTION_MESSAGE(CommonException, ThreadFailed, message);
+	}
+
+	int clearSize = pblock->mClearSize;
+	uint8_t *pclear = pblock->mpClear;
+	pblock->mpClear = rpClearData;
+	rpClearData = pclear;
+	Recycle(pblock);
+
+	return clearSize;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecodePipeline::Recycle(Block *)
+//		Purpose: Private. Keeps a block which has been taken out of
+//			 the pipeline, to reuse its buffers.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileDecodePipeline::Recycle(Block *pBlock)
+{
+	MutexLock lock(mMutex);
+	mSpare.push_back(pBlock);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecodePipeline::FreeBlock(Block *)
+//		Purpose: Private. Frees a block and its buffers.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileDecodePipeline::FreeBlock(Block *pBlock)
+{
+	if(pBlock->mpEncoded != 0)
+	{
+		BackupStoreFile::CodingChunkFree(pBlock->mpEncoded);
+	}
+	if(pBlock->mpClear != 0)
+	{
+		BackupStoreFile::CodingChunkFree(pBlock->mpClear);
+	}
+	delete pBlock;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecodePipeline::RunWorker(BackupStoreFileDecryptContexts &)
+//		Purpose: Private. Decodes blocks as they're added, until the
+//			 pipeline is stopped.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileDecodePipeline::RunWorker(
+	BackupStoreFileDecryptContexts &rDecrypt)
+{
+	MutexLock lock(mMutex);
+	while(true)
+	{
+		while(mWaiting.empty() && !mStopping)
+		{
+			mBlockAdded.Wait(mMutex);
+		}
+		if(mStopping)
+		{
+			return;
+		}
+
+		Block *pblock = mWaiting.front();
+		mWaiting.pop_front();
+
+		// Decode without holding the lock
+		mMutex.Unlock();
+		try
+		{
+			pblock->mClearSize = mrStream.DecodeBlock(pblock->mNumber,
+				pblock->mpEncoded, pblock->mEncodedSize,
+				pblock->mpClear, mClearBufferSize, &rDecrypt);
+		}
+		catch(std::exception &e)
+		{
+			pblock->mFailed = true;
+			pblock->mFailureMessage = e.what();
+		}
+		catch(...)
+		{
+			pblock->mFailed = true;
+			pblock->mFailureMessage = "unknown error";
+		}
+		mMutex.Lock();
+
+		pblock->mDone = true;
+		mBlockDone.Broadcast();
+	}
+}
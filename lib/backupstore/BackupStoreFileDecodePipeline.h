@@ -0,0 +1,105 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileDecodePipeline.h
+//		Purpose: Decode blocks of files in parallel, in order
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREFILEDECODEPIPELINE__H
+#define BACKUPSTOREFILEDECODEPIPELINE__H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "BackupStoreFile.h"
+#include "BackupStoreFileDecryptContexts.h"
+#include "Thread.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreFileDecodePipeline
+//		Purpose: Decrypts and decompresses blocks of a file, and checks
+//			 them against the block index, on a pool of worker
+//			 threads, so that the blocks after the one being read
+//			 from a DecodedStream are decoded at the same time.
+//			 Encoded blocks are read from the stream on the calling
+//			 thread, and taken out in the same order, whichever
+//			 thread finishes first.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreFileDecodePipeline
+{
+public:
+	BackupStoreFileDecodePipeline(BackupStoreFile::DecodedStream &rStream,
+		int Threads, int32_t MaxEncodedSize, int ClearBufferSize);
+	~BackupStoreFileDecodePipeline();
+private:
+	// No copying allowed
+	BackupStoreFileDecodePipeline(const BackupStoreFileDecodePipeline &);
+	BackupStoreFileDecodePipeline &operator=(const BackupStoreFileDecodePipeline &);
+
+public:
+	void Add(int64_t BlockNumber, IOStream &rEncoded, int32_t EncodedSize,
+		int Timeout);
+	int GetNext(uint8_t *&rpClearData);
+
+	// Number of blocks added and not taken out yet, and whether as
+	// many are being decoded as memory is allowed for
+	int GetNumberOfBlocks() const { return mBlocks.size(); }
+	bool IsFull() const { return (int)mBlocks.size() >= mMaxBlocks; }
+
+private:
+	typedef struct
+	{
+		int64_t mNumber;
+		uint8_t *mpEncoded;
+		int32_t mEncodedSize;
+		uint8_t *mpClear;
+		int mClearSize;
+		bool mDone;
+		bool mFailed;
+		std::string mFailureMessage;
+	} Block;
+
+	class Worker : public Thread
+	{
+	public:
+		Worker(BackupStoreFileDecodePipeline &rPipeline)
+		: mrPipeline(rPipeline)
+		{ }
+	protected:
+		virtual void Run() { mrPipeline.RunWorker(mDecrypt); }
+	private:
+		BackupStoreFileDecodePipeline &mrPipeline;
+		BackupStoreFileDecryptContexts mDecrypt;
+	};
+
+	void RunWorker(BackupStoreFileDecryptContexts &rDecrypt);
+	void StopWorkers();
+	void Recycle(Block *pBlock);
+	void FreeBlock(Block *pBlock);
+
+	BackupStoreFile::DecodedStream &mrStream;
+	int32_t mMaxEncodedSize;
+	int mClearBufferSize;
+	int mMaxBlocks;
+
+	// Everything below is protected by mMutex
+	Mutex mMutex;
+	ConditionVariable mBlockAdded;
+	ConditionVariable mBlockDone;
+	// Blocks in the order they were added, and those not started yet
+	std::deque<Block *> mBlocks;
+	std::deque<Block *> mWaiting;
+	std::vector<Block *> mSpare;
+	bool mStopping;
+
+	std::vector<Worker *> mWorkers;
+};
+
+#endif // BACKUPSTOREFILEDECODEPIPELINE__H
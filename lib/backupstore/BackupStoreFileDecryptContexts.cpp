@@ -0,0 +1,40 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileDecryptContexts.cpp
+//		Purpose: Private copies of the contexts for decrypting backup
+//			 store files, for decoding on several threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include "BackupStoreFileDecryptContexts.h"
+#include "BackupStoreFileCryptVar.h"
+
+#include "MemLeakFindOn.h"
+
+using namespace BackupStoreFileCryptVar;
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileDecryptContexts::BackupStoreFileDecryptContexts()
+//		Purpose: Constructor, copies the contexts for the keys which
+//			 are set now.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileDecryptContexts::BackupStoreFileDecryptContexts()
+{
+	mBlowfish.Init(sBlowfishDecrypt);
+#ifndef HAVE_OLD_SSL
+	if(sAESDecrypt.IsInitialised())
+	{
+		mAES.Init(sAESDecrypt);
+	}
+#endif
+	mBlockEntry.Init(sBlowfishDecryptBlockEntry);
+}
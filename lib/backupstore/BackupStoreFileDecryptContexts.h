@@ -0,0 +1,48 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileDecryptContexts.h
+//		Purpose: Private copies of the contexts for decrypting backup
+//			 store files, for decoding on several threads
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREFILEDECRYPTCONTEXTS__H
+#define BACKUPSTOREFILEDECRYPTCONTEXTS__H
+
+#include "CipherContext.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreFileDecryptContexts
+//		Purpose: Copies of the contexts which decrypt file data and block
+//			 indexes, as set up by BackupStoreFile::SetBlowfishKeys()
+//			 and SetAESKey(). Contexts can't be shared between
+//			 threads, so each thread decoding files at the same
+//			 time as others needs its own, and passes them to
+//			 BackupStoreFile::DecodeFile(). Create them after the
+//			 keys have been set.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreFileDecryptContexts
+{
+public:
+	BackupStoreFileDecryptContexts();
+private:
+	// No copying allowed
+	BackupStoreFileDecryptContexts(const BackupStoreFileDecryptContexts &);
+	BackupStoreFileDecryptContexts &operator=(const BackupStoreFileDecryptContexts &);
+
+public:
+	CipherContext mBlowfish;
+#ifndef HAVE_OLD_SSL
+	// Only initialised if the AES key has been set
+	CipherContext mAES;
+#endif
+	CipherContext mBlockEntry;
+};
+
+#endif // BACKUPSTOREFILEDECRYPTCONTEXTS__H
@@ -13,6 +13,7 @@
 
 #include <new>
 #include <map>
+#include <vector>
 
 #ifdef HAVE_TIME_H
 	#include <time.h>
@@ -23,14 +24,19 @@
 #include "BackupStoreConstants.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileChecksum.h"
+#include "BackupStoreFileChunker.h"
 #include "BackupStoreFileCryptVar.h"
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreFileWire.h"
 #include "BackupStoreObjectMagic.h"
+#include "BoxTime.h"
 #include "CommonException.h"
+#include "FileHoles.h"
 #include "FileStream.h"
-#include "MD5Digest.h"
 #include "RollingChecksum.h"
+#include "SparseFileStream.h"
+#include "Thread.h"
 #include "Timer.h"
 
 #include "MemLeakFindOn.h"
@@ -40,34 +46,96 @@
 using namespace BackupStoreFileCryptVar;
 using namespace BackupStoreFileCreation;
 
+namespace
+{
+	// --------------------------------------------------------------------------
+	//
+	// Class
+	//		Name:    DiffSearchState
+	//		Purpose: State shared between the threads searching for
+	//			 matching blocks, so that any one of them (or the main
+	//			 thread) can stop the whole search.
+	//		Created: 2026/10/17
+	//
+	// --------------------------------------------------------------------------
+	class DiffSearchState
+	{
+	public:
+		DiffSearchState() : mAborted(false), mThreadsFinished(0) { }
+		void Abort()
+		{
+			MutexLock lock(mMutex);
+			mAborted = true;
+		}
+		bool IsAborted()
+		{
+			MutexLock lock(mMutex);
+			return mAborted;
+		}
+		void ThreadFinished()
+		{
+			MutexLock lock(mMutex);
+			mThreadsFinished++;
+		}
+		int GetThreadsFinished()
+		{
+			MutexLock lock(mMutex);
+			return mThreadsFinished;
+		}
+	private:
+		Mutex mMutex;
+		bool mAborted;
+		int mThreadsFinished;
+	};
+}
+
+
 // By default, don't trace out details of the diff as we go along -- would fill up logs significantly.
 // But it's useful for the test.
 #ifndef BOX_RELEASE_BUILD
 	bool BackupStoreFile::TraceDetailsOfDiffProcess = false;
 #endif
 
-static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis);
+static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis, bool &rFastChecksums);
 static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES]);
-static void SearchForMatchingBlocks(IOStream &rFile, 
+static void SearchForMatchingBlocks(IOStream &rFile,
 	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex, 
 	int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES],
+	bool FastChecksums, DiffTimer *pDiffTimer, DiffSearchState *pSharedState);
+static void SearchForMatchingBlocksInParallel(const std::string& Filename,
+	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES],
+	bool FastChecksums, DiffTimer *pDiffTimer, int Threads);
+static bool SearchFileForMatchingBlocks(const std::string& Filename,
+	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES],
+	bool FastChecksums, DiffTimer *pDiffTimer, int Threads,
+	int32_t ChunkAverageSize);
+static bool SearchForMatchingChunks(const std::string& Filename,
+	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, int32_t ChunkAverageSize, bool FastChecksums,
 	DiffTimer *pDiffTimer);
+static bool SearchForAppendedData(const std::string& Filename,
+	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, bool FastChecksums, DiffTimer *pDiffTimer);
 static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int32_t BlockSize, BlocksAvailableEntry **pHashTable);
-static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, uint8_t *pBeginnings, uint8_t *pEndings, int Offset, int32_t BlockSize, int64_t FileBlockNumber,
-BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks);
+static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, const uint8_t *pBeginnings, const uint8_t *pEndings, int Offset, int32_t BlockSize, int64_t FileBlockNumber,
+BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks, bool FastChecksums);
 static void GenerateRecipe(BackupStoreFileEncodeStream::Recipe &rRecipe, BlocksAvailableEntry *pIndex, int64_t NumBlocks, std::map<int64_t, int64_t> &rFoundBlocks, int64_t SizeOfInputFile);
 
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::MoveStreamPositionToBlockIndex(IOStream &)
+//		Name:    BackupStoreFile::MoveStreamPositionToBlockIndex(IOStream &, int32_t *)
 //		Purpose: Move the file pointer in this stream to just before the block index.
 //				 Assumes that the stream is at the beginning, seekable, and
-//				 reading from the stream is OK.
+//				 reading from the stream is OK. If pFileOptionsOut != 0,
+//				 it's set to the options from the file's header.
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
-void BackupStoreFile::MoveStreamPositionToBlockIndex(IOStream &rStream)
+void BackupStoreFile::MoveStreamPositionToBlockIndex(IOStream &rStream,
+	int32_t *pFileOptionsOut)
 {
 	// Size of file
 	int64_t fileSize = rStream.BytesLeftToRead();
@@ -102,6 +170,11 @@ void BackupStoreFile::MoveStreamPositionToBlockIndex(IOStream &rStream)
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
 	
+	if(pFileOptionsOut != 0)
+	{
+		*pFileOptionsOut = ntohl(hdr.mOptions);
+	}
+
 	// Seek to that position
 	rStream.Seek(0 - blockHeaderPosFromEnd, IOStream::SeekType_End);
 	
@@ -112,13 +185,20 @@ void BackupStoreFile::MoveStreamPositionToBlockIndex(IOStream &rStream)
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFile::EncodeFileDiff(const char *, int64_t, const BackupStoreFilename &, int64_t, IOStream &, int64_t *)
+//		Name:    BackupStoreFile::EncodeFileDiff(const char *, int64_t, const BackupStoreFilename &, int64_t, IOStream &, int64_t *, ..., const int32_t *)
 //		Purpose: Similar to EncodeFile, but takes the object ID of the file it's
 //			 diffing from, and the index of the blocks in a stream. It'll then
 //			 calculate which blocks can be reused from that old file.
 //			 The timeout is the timeout value for reading the diff block index.
 //			 If pIsCompletelyDifferent != 0, it will be set to true if the
 //			 the two files are completely different (do not share any block), false otherwise.
+//			 If DiffingThreads > 1, the block sizes are searched for
+//			 in parallel, using up to that many threads. New data is
+//			 compressed with the given CompressCodec and level.
+//			 pDiffFromFileOptions points to the options from the
+//			 header of the file diffed from, if they're known. If
+//			 it was split into content defined chunks, and new data
+//			 is too, its chunks are looked up before searching.
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
@@ -128,7 +208,9 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 	const BackupStoreFilename &rStoreFilename, int64_t DiffFromObjectID,
 	IOStream &rDiffFromBlockIndex, int Timeout, DiffTimer *pDiffTimer,
 	int64_t *pModificationTime, bool *pIsCompletelyDifferent,
-	BackgroundTask* pBackgroundTask)
+	BackgroundTask* pBackgroundTask, int DiffingThreads,
+	int CompressionCodec, int CompressionLevel,
+	const int32_t *pDiffFromFileOptions)
 {
 	// Is it a symlink?
 	{
@@ -148,7 +230,8 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 				pModificationTime,
 				NULL, // ReadLoggingStream::Logger
 				NULL, // RunStatusProvider
-				pBackgroundTask); // BackgroundTask
+				pBackgroundTask, // BackgroundTask
+				CompressionCodec, CompressionLevel);
 		}
 	}
 
@@ -156,7 +239,8 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 	BlocksAvailableEntry *pindex = 0;
 	int64_t blocksInIndex = 0;
 	bool canDiffFromThis = false;
-	LoadIndex(rDiffFromBlockIndex, DiffFromObjectID, &pindex, blocksInIndex, Timeout, canDiffFromThis);
+	bool fastChecksums = false;
+	LoadIndex(rDiffFromBlockIndex, DiffFromObjectID, &pindex, blocksInIndex, Timeout, canDiffFromThis, fastChecksums);
 	// BOX_TRACE("Diff: Blocks in index: " << blocksInIndex);
 	
 	if(!canDiffFromThis)
@@ -170,7 +254,8 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 			pModificationTime,
 			NULL, // ReadLoggingStream::Logger
 			NULL, // RunStatusProvider
-			pBackgroundTask); // BackgroundTask
+			pBackgroundTask, // BackgroundTask
+			CompressionCodec, CompressionLevel);
 	}
 	
 	// Pointer to recipe we're going to create
@@ -190,21 +275,48 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 			// Search the file to find matching blocks
 			std::map<int64_t, int64_t> foundBlocks; // map of offset in file to index in block index
 			int64_t sizeOfInputFile = 0;
+
+			// If new data is split into content defined chunks, first
+			// look up this file's chunks in the index, if the header
+			// of the old version says it was chunked the same way.
+			int32_t chunkAverageSize = 0;
+			bool matchedChunks = false;
+			if(sContentDefinedChunking && pDiffFromFileOptions != 0)
+			{
+				chunkAverageSize = BackupStoreFileChunker::AverageSizeForFileOptions(
+					*pDiffFromFileOptions);
+			}
+
 			// BLOCK
 			{
-				FileStream file(Filename);
 				// Get size of file
-				sizeOfInputFile = file.BytesLeftToRead();
+				sizeOfInputFile = FileStream(Filename).BytesLeftToRead();
+
 				// Find all those lovely matching blocks
-				SearchForMatchingBlocks(file, foundBlocks, pindex, 
-					blocksInIndex, sizesToScan, pDiffTimer);
+				matchedChunks = SearchFileForMatchingBlocks(
+					Filename, foundBlocks, pindex,
+					blocksInIndex, sizesToScan, fastChecksums,
+					pDiffTimer, DiffingThreads,
+					chunkAverageSize);
 				
 				// Is it completely different?
 				completelyDifferent = (foundBlocks.size() == 0);
 			}
 			
+			// Chunk new data the same way as the old version if its
+			// chunks matched, so that the next version will match too.
+			if(sContentDefinedChunking && !matchedChunks)
+			{
+				chunkAverageSize = BackupStoreFileChunker::AverageSizeForFileSize(
+					sizeOfInputFile);
+			}
+
 			// Create a recipe -- if the two files are completely different, don't put the from file ID in the recipe.
-			precipe = new BackupStoreFileEncodeStream::Recipe(pindex, blocksInIndex, completelyDifferent?(0):(DiffFromObjectID));
+			// If it's not completely different, it must use the same kind of strong checksums as the
+			// file it's diffed from, so that the block indexes can be combined.
+			precipe = new BackupStoreFileEncodeStream::Recipe(pindex, blocksInIndex, completelyDifferent?(0):(DiffFromObjectID),
+				completelyDifferent?(sFastBlockChecksums):(fastChecksums),
+				chunkAverageSize);
 			BlocksAvailableEntry *pindexKeptRef = pindex;	// we need this later, but must set pindex == 0 now, because of exceptions
 			pindex = 0;		// Recipe now has ownership
 			
@@ -222,7 +334,7 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 			pModificationTime,
 			NULL, // ReadLoggingStream::Logger
 			NULL, // RunStatusProvider
-			pBackgroundTask);
+			pBackgroundTask, CompressionCodec, CompressionLevel);
 		precipe = 0;	// Stream has taken ownership of this
 		
 		// Tell user about completely different status?
@@ -254,17 +366,19 @@ std::auto_ptr<BackupStoreFileEncodeStream> BackupStoreFile::EncodeFileDiff
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static LoadIndex(IOStream &, int64_t, BlocksAvailableEntry **, int64_t, bool &)
+//		Name:    static LoadIndex(IOStream &, int64_t, BlocksAvailableEntry **, int64_t, bool &, bool &)
 //		Purpose: Read in an index, and decrypt, and store in the in memory block format.
 //				 rCanDiffFromThis is set to false if the version of the from file is too old.
+//				 rFastChecksums is set to true if the index uses fast strong checksums.
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
-static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis)
+static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntry **ppIndex, int64_t &rNumBlocksOut, int Timeout, bool &rCanDiffFromThis, bool &rFastChecksums)
 {
 	// Reset
 	rNumBlocksOut = 0;
 	rCanDiffFromThis = false;
+	rFastChecksums = false;
 	
 	// Read header
 	file_BlockIndexHeader hdr;
@@ -294,10 +408,12 @@ static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntr
 #endif
 
 	// Check magic
-	if(hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1))
+	if(hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+		&& hdr.mMagicValue != (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
+	rFastChecksums = (hdr.mMagicValue == (int32_t)htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2));
 	
 	// Check that we're not trying to diff against a file which references blocks from another file
 	if(((int64_t)box_ntoh64(hdr.mOtherFileID)) != 0)
@@ -359,7 +475,14 @@ static void LoadIndex(IOStream &rBlockIndex, int64_t ThisID, BlocksAvailableEntr
 			pindex[b].mpNextInHashList = 0;	// hash list not set up yet
 			pindex[b].mSize = ntohl(entryEnc.mSize);
 			pindex[b].mWeakChecksum = ntohl(entryEnc.mWeakChecksum);
+			if(pindex[b].mWeakChecksum == BLOCK_INDEX_HOLE_WEAK_CHECKSUM)
+			{
+				// Blocks which were in holes are zeros, which
+				// really have a weak checksum of 0
+				pindex[b].mWeakChecksum = 0;
+			}
 			::memcpy(pindex[b].mStrongChecksum, entryEnc.mStrongChecksum, sizeof(pindex[b].mStrongChecksum));
+			pindex[b].mEncodedSize = box_ntoh64(entry.mEncodedSize);
 		}
 		
 		// Store index pointer for called
@@ -433,8 +556,9 @@ static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, i
 			// take the file area covered by this block size.
 			if(i->second * i->first > sizeCounts[t] * Sizes[t])
 			{
-				// Then this size belong before this entry -- shuffle them up
-				for(int s = (BACKUP_FILE_DIFF_MAX_BLOCK_SIZES - 1); s >= t; --s)
+				// Then this size belong before this entry -- shuffle them up,
+				// stopping at t, so that Sizes[-1] isn't read when t is 0
+				for(int s = (BACKUP_FILE_DIFF_MAX_BLOCK_SIZES - 1); s > t; --s)
 				{
 					Sizes[s] = Sizes[s-1];
 					sizeCounts[s] = sizeCounts[s-1];
@@ -469,17 +593,26 @@ static void FindMostUsedSizes(BlocksAvailableEntry *pIndex, int64_t NumBlocks, i
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    static SearchForMatchingBlocks(IOStream &, std::map<int64_t, int64_t> &, BlocksAvailableEntry *, int64_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES])
+//		Name:    static SearchForMatchingBlocks(IOStream &, std::map<int64_t, int64_t> &, BlocksAvailableEntry *, int64_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], bool, DiffTimer *, DiffSearchState *)
 //		Purpose: Find the matching blocks within the file.
+//			 If pSharedState is not NULL, this is one of several
+//			 threads searching the file, and it stops when the
+//			 shared state is aborted instead of checking the time.
 //		Created: 12/1/04
 //
 // --------------------------------------------------------------------------
-static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t> &rFoundBlocks,
+static void SearchForMatchingBlocks(IOStream &rFile,
+	std::map<int64_t, int64_t> &rFoundBlocks,
 	BlocksAvailableEntry *pIndex, int64_t NumBlocks, 
-	int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], DiffTimer *pDiffTimer)
+	int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], bool FastChecksums,
+	DiffTimer *pDiffTimer, DiffSearchState *pSharedState)
 {
 	Timer maximumDiffingTime(0, "MaximumDiffingTime");
 
+	// Timers are not thread-safe, so only the main thread (which is the
+	// only one given a DiffTimer) may check whether this one has expired.
+	bool checkTimer = (pSharedState == NULL || pDiffTimer != NULL);
+
 	if(pDiffTimer && pDiffTimer->IsManaged())
 	{
 		maximumDiffingTime = Timer(pDiffTimer->GetMaximumDiffingTime() *
@@ -500,7 +633,7 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 	bufSize += 4;
 	ASSERT(bufSize > Sizes[0]);
 	ASSERT(bufSize > 0);
-	if(bufSize > (BACKUP_FILE_MAX_BLOCK_SIZE + 1024))
+	if(bufSize > (BACKUP_FILE_MAX_LARGE_BLOCK_SIZE + 1024))
 	{
 		THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 	}
@@ -509,7 +642,7 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 	// it is likely to be inefficient. Probably will be much better to
 	// calculate checksums for all block sizes in a single pass.
 
-	// Allocate the buffers.
+	// Allocate the buffers
 	uint8_t *pbuffer0 = (uint8_t *)::malloc(bufSize);
 	uint8_t *pbuffer1 = (uint8_t *)::malloc(bufSize);
 	try
@@ -545,9 +678,15 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 			// Set up the hash table entries
 			SetupHashTable(pIndex, NumBlocks, Sizes[s], phashTable);
 		
+			// Setup block pointers
+			const uint8_t *beginnings = pbuffer0;
+			const uint8_t *endings = pbuffer1;
+			uint8_t *pnextBuffer = pbuffer1;
+			int offset = 0;
+
 			// Shift file position to beginning
 			rFile.Seek(0, IOStream::SeekType_Absolute);
-			
+
 			// Read first block
 			if(rFile.Read(pbuffer0, Sizes[s]) != Sizes[s])
 			{
@@ -555,11 +694,6 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 				continue;
 			}
 			
-			// Setup block pointers
-			uint8_t *beginnings = pbuffer0;
-			uint8_t *endings = pbuffer1;
-			int offset = 0;
-			
 			// Calculate the first checksum, ready for rolling
 			RollingChecksum rolling(beginnings, Sizes[s]);
 			
@@ -569,11 +703,21 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 			int rollOverInitialBytes = 0;
 			while(true)
 			{
-				if(maximumDiffingTime.HasExpired())
+				if(pSharedState != NULL && pSharedState->IsAborted())
+				{
+					abortSearch = true;
+					break;
+				}
+
+				if(checkTimer && maximumDiffingTime.HasExpired())
 				{
 					ASSERT(pDiffTimer != NULL);
 					BOX_INFO("MaximumDiffingTime reached - "
 						"suspending file diff");
+					if(pSharedState != NULL)
+					{
+						pSharedState->Abort();
+					}
 					abortSearch = true;
 					break;
 				}
@@ -584,7 +728,8 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 				}
 				
 				// Load in another block of data, and record how big it is
-				int bytesInEndings = rFile.Read(endings, Sizes[s]);
+				int bytesInEndings = rFile.Read(pnextBuffer, Sizes[s]);
+				endings = pnextBuffer;
 				int tmp;
 
 				// Skip any bytes from a previous matched block
@@ -639,7 +784,7 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 					uint16_t hash = rolling.GetComponentForHashing();
 					if(phashTable[hash] != 0 && (goodnessOfFit.count(fileOffset) == 0 || goodnessOfFit[fileOffset] < Sizes[s]))
 					{
-						if(SecondStageMatch(phashTable[hash], rolling, beginnings, endings, offset, Sizes[s], fileBlockNumber, pIndex, rFoundBlocks))
+						if(SecondStageMatch(phashTable[hash], rolling, beginnings, endings, offset, Sizes[s], fileBlockNumber, pIndex, rFoundBlocks, FastChecksums))
 						{
 							BOX_TRACE("Found block match of " << Sizes[s] << " bytes with hash " << hash << " at offset " << fileOffset);
 							goodnessOfFit[fileOffset] = Sizes[s];
@@ -681,6 +826,10 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 						if(NumBlocksFound > MaxBlocksFound)
 						{
 							abortSearch = true;
+							if(pSharedState != NULL)
+							{
+								pSharedState->Abort();
+							}
 							break;
 						}
 					}
@@ -705,7 +854,7 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 					uint16_t hash = rolling.GetComponentForHashing();
 					if(phashTable[hash] != 0 && (goodnessOfFit.count(fileOffset) == 0 || goodnessOfFit[fileOffset] < Sizes[s]))
 					{
-						if(SecondStageMatch(phashTable[hash], rolling, beginnings, endings, offset, Sizes[s], fileBlockNumber, pIndex, rFoundBlocks))
+						if(SecondStageMatch(phashTable[hash], rolling, beginnings, endings, offset, Sizes[s], fileBlockNumber, pIndex, rFoundBlocks, FastChecksums))
 						{
 							goodnessOfFit[fileOffset] = Sizes[s];
 						}
@@ -717,7 +866,7 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 				
 				// Switch buffers, reset offset
 				beginnings = endings;
-				endings = (beginnings == pbuffer0)?(pbuffer1):(pbuffer0);	// ie the other buffer
+				pnextBuffer = (beginnings == pbuffer0)?(pbuffer1):(pbuffer0);	// ie the other buffer
 				offset = 0;
 
 				// And count the blocks which have been done
@@ -728,9 +877,9 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 		}
 		
 		// Free buffers and hash table
-		::free(pbuffer1);
+		if(pbuffer1 != 0) ::free(pbuffer1);
 		pbuffer1 = 0;
-		::free(pbuffer0);
+		if(pbuffer0 != 0) ::free(pbuffer0);
 		pbuffer0 = 0;
 		::free(phashTable);
 		phashTable = 0;
@@ -770,6 +919,560 @@ static void SearchForMatchingBlocks(IOStream &rFile, std::map<int64_t, int64_t>
 }
 
 
+namespace
+{
+	// --------------------------------------------------------------------------
+	//
+	// Class
+	//		Name:    DiffSearchThread
+	//		Purpose: Searches a file for blocks of some of the sizes in
+	//			 the index, in a thread of its own.
+	//		Created: 2026/10/17
+	//
+	// --------------------------------------------------------------------------
+	class DiffSearchThread : public Thread
+	{
+	public:
+		DiffSearchThread(const std::string& rFilename,
+			BlocksAvailableEntry *pIndex, int64_t NumBlocks,
+			bool FastChecksums, DiffSearchState &rState)
+		: mFilename(rFilename),
+		  mpIndex(pIndex),
+		  mNumBlocks(NumBlocks),
+		  mFastChecksums(FastChecksums),
+		  mrState(rState)
+		{
+			for(int s = 0; s < BACKUP_FILE_DIFF_MAX_BLOCK_SIZES; ++s)
+			{
+				mSizes[s] = 0;
+			}
+		}
+		~DiffSearchThread()
+		{
+			if(IsStarted())
+			{
+				// Don't leave it running while its members are
+				// destroyed. Errors were already reported by Run().
+				mrState.Abort();
+				try
+				{
+					Join();
+				}
+				catch(...)
+				{
+				}
+			}
+		}
+
+		// Sizes keep their position in the array, with the
+		// sizes searched by other threads left as zero.
+		void AddSize(int Position, int32_t Size) { mSizes[Position] = Size; }
+		int32_t *GetSizes() { return mSizes; }
+		std::map<int64_t, int64_t> &GetFoundBlocks() { return mFoundBlocks; }
+
+	protected:
+		void Run()
+		{
+			try
+			{
+				SparseFileStream file(mFilename);
+				file.AdviseSequential();
+				SearchForMatchingBlocks(file, mFoundBlocks,
+					mpIndex, mNumBlocks, mSizes,
+					mFastChecksums, NULL, &mrState);
+			}
+			catch(...)
+			{
+				// Stop the other threads too
+				mrState.Abort();
+				mrState.ThreadFinished();
+				throw;
+			}
+			mrState.ThreadFinished();
+		}
+
+	private:
+		std::string mFilename;
+		BlocksAvailableEntry *mpIndex;
+		int64_t mNumBlocks;
+		bool mFastChecksums;
+		DiffSearchState &mrState;
+		int32_t mSizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
+		std::map<int64_t, int64_t> mFoundBlocks;
+	};
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SearchForMatchingBlocksInParallel(const std::string &, std::map<int64_t, int64_t> &, BlocksAvailableEntry *, int64_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], bool, DiffTimer *, int)
+//		Purpose: Find the matching blocks within the file, sharing
+//			 out the block sizes between up to the given number of
+//			 threads. Each pass reads the whole file, so they can
+//			 run independently; the calling thread does one share
+//			 itself, and then looks after keepalives and the
+//			 maximum diffing time until the others finish.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+static void SearchForMatchingBlocksInParallel(const std::string& Filename,
+	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES],
+	bool FastChecksums, DiffTimer *pDiffTimer, int Threads)
+{
+	int sizesToScan = 0;
+	for(int s = 0; s < BACKUP_FILE_DIFF_MAX_BLOCK_SIZES; ++s)
+	{
+		if(Sizes[s] != 0)
+		{
+			++sizesToScan;
+		}
+	}
+	if(Threads > sizesToScan)
+	{
+		Threads = sizesToScan;
+	}
+	if(Threads <= 1)
+	{
+		SearchFileForMatchingBlocks(Filename, rFoundBlocks,
+			pIndex, NumBlocks, Sizes, FastChecksums, pDiffTimer, 1, 0);
+		return;
+	}
+
+	DiffSearchState state;
+
+	// Deal out the sizes between the threads, including this one
+	int32_t ownSizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES];
+	std::vector<DiffSearchThread *> workers;
+	try
+	{
+		for(int t = 1; t < Threads; ++t)
+		{
+			workers.push_back(new DiffSearchThread(Filename,
+				pIndex, NumBlocks, FastChecksums, state));
+		}
+
+		int next = 0;
+		for(int s = 0; s < BACKUP_FILE_DIFF_MAX_BLOCK_SIZES; ++s)
+		{
+			ownSizes[s] = 0;
+			if(Sizes[s] == 0)
+			{
+				continue;
+			}
+			if(next == 0)
+			{
+				ownSizes[s] = Sizes[s];
+			}
+			else
+			{
+				workers[next - 1]->AddSize(s, Sizes[s]);
+			}
+			next = (next + 1) % Threads;
+		}
+
+		for(std::vector<DiffSearchThread *>::iterator
+			i = workers.begin(); i != workers.end(); ++i)
+		{
+			(*i)->Start();
+		}
+
+		// Do our own share, while the others do theirs
+		box_time_t started = GetCurrentBoxTime();
+		{
+			SparseFileStream file(Filename);
+			file.AdviseSequential();
+			SearchForMatchingBlocks(file, rFoundBlocks, pIndex,
+				NumBlocks, ownSizes, FastChecksums, pDiffTimer,
+				&state);
+		}
+
+		if(pDiffTimer != NULL)
+		{
+			// Keep the connection alive while waiting for the
+			// others to finish, and stop them if they run out
+			// of time (counted from when they all started).
+			int maximumDiffingTime = pDiffTimer->IsManaged() ?
+				pDiffTimer->GetMaximumDiffingTime() : 0;
+
+			while(state.GetThreadsFinished() <
+				(int)workers.size())
+			{
+				if(maximumDiffingTime > 0 && !state.IsAborted() &&
+					GetCurrentBoxTime() - started >
+					SecondsToBoxTime(maximumDiffingTime))
+				{
+					BOX_INFO("MaximumDiffingTime reached - "
+						"suspending file diff");
+					state.Abort();
+				}
+				pDiffTimer->DoKeepAlive();
+				ShortSleep(MilliSecondsToBoxTime(10), false);
+			}
+		}
+
+		// Collect the results. Where two threads found blocks at
+		// the same offset, keep the bigger one, as a single thread
+		// would have done.
+		for(std::vector<DiffSearchThread *>::iterator
+			i = workers.begin(); i != workers.end(); ++i)
+		{
+			(*i)->Join();
+
+			std::map<int64_t, int64_t> &found((*i)->GetFoundBlocks());
+			for(std::map<int64_t, int64_t>::const_iterator
+				f(found.begin()); f != found.end(); ++f)
+			{
+				std::map<int64_t, int64_t>::iterator
+					existing(rFoundBlocks.find(f->first));
+				if(existing == rFoundBlocks.end())
+				{
+					rFoundBlocks[f->first] = f->second;
+				}
+				else if(pIndex[f->second].mSize >
+					pIndex[existing->second].mSize)
+				{
+					existing->second = f->second;
+				}
+			}
+		}
+	}
+	catch(...)
+	{
+		// Stop and clean up all the threads before passing on the
+		// exception (their destructors join them)
+		state.Abort();
+		for(std::vector<DiffSearchThread *>::iterator
+			i = workers.begin(); i != workers.end(); ++i)
+		{
+			delete *i;
+		}
+		throw;
+	}
+
+	for(std::vector<DiffSearchThread *>::iterator
+		i = workers.begin(); i != workers.end(); ++i)
+	{
+		delete *i;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SearchFileForMatchingBlocks(const std::string &, std::map<int64_t, int64_t> &, BlocksAvailableEntry *, int64_t, int32_t[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES], bool, DiffTimer *, int, int32_t)
+//		Purpose: Find the matching blocks within the file, in
+//			 parallel if Threads > 1.
+//			 If the file is just the old version with data added
+//			 to the end, all the old blocks are used, and there's
+//			 no need to search.
+//			 If ChunkAverageSize is not 0, first look up content
+//			 defined chunks of that average size in the index, and
+//			 only do the rolling checksum search if none of them
+//			 match. Returns true if chunks were matched, or if
+//			 the old version was chunked and data was appended.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool SearchFileForMatchingBlocks(const std::string& Filename,
+	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, int32_t Sizes[BACKUP_FILE_DIFF_MAX_BLOCK_SIZES],
+	bool FastChecksums, DiffTimer *pDiffTimer, int Threads,
+	int32_t ChunkAverageSize)
+{
+	if(SearchForAppendedData(Filename, rFoundBlocks, pIndex,
+		NumBlocks, FastChecksums, pDiffTimer))
+	{
+		return ChunkAverageSize != 0;
+	}
+
+	if(ChunkAverageSize != 0 && SearchForMatchingChunks(Filename,
+		rFoundBlocks, pIndex, NumBlocks, ChunkAverageSize,
+		FastChecksums, pDiffTimer))
+	{
+		return true;
+	}
+
+	if(Threads > 1)
+	{
+		SearchForMatchingBlocksInParallel(Filename, rFoundBlocks,
+			pIndex, NumBlocks, Sizes, FastChecksums, pDiffTimer,
+			Threads);
+	}
+	else
+	{
+		SparseFileStream file(Filename);
+		file.AdviseSequential();
+		SearchForMatchingBlocks(file, rFoundBlocks, pIndex, NumBlocks,
+			Sizes, FastChecksums, pDiffTimer, NULL);
+	}
+
+	return false;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SearchForAppendedData(const std::string &, std::map<int64_t, int64_t> &, BlocksAvailableEntry *, int64_t, bool, DiffTimer *)
+//		Purpose: Check whether the file starts with the old version,
+//			 as log files and mailboxes which are only ever added
+//			 to do, by comparing the checksums of each block in the
+//			 index with the data at its offset in the file. If so,
+//			 all the old blocks are found, and returns true, so
+//			 only the data added has to be encoded.
+//
+//			 This reads the file once from the start, which is far
+//			 less work than the rolling checksum search. The first
+//			 and last blocks are checked first, as they're the
+//			 ones most likely to differ if it isn't the case.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool SearchForAppendedData(const std::string& Filename,
+	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, bool FastChecksums, DiffTimer *pDiffTimer)
+{
+	if(NumBlocks <= 0)
+	{
+		return false;
+	}
+
+	// Where each block starts in the old version
+	std::vector<int64_t> offsets(NumBlocks);
+	int64_t sizeOfIndexedFile = 0;
+	for(int64_t b = 0; b < NumBlocks; ++b)
+	{
+		if(pIndex[b].mSize <= 0 ||
+			pIndex[b].mSize > BACKUP_FILE_MAX_LARGE_BLOCK_SIZE)
+		{
+			return false;
+		}
+		offsets[b] = sizeOfIndexedFile;
+		sizeOfIndexedFile += pIndex[b].mSize;
+	}
+
+	SparseFileStream file(Filename);
+	int64_t sizeOfInputFile = file.BytesLeftToRead();
+
+	if(sizeOfInputFile < sizeOfIndexedFile)
+	{
+		return false;
+	}
+
+	Timer maximumDiffingTime(0, "MaximumDiffingTime");
+	if(pDiffTimer && pDiffTimer->IsManaged())
+	{
+		maximumDiffingTime = Timer(pDiffTimer->GetMaximumDiffingTime() *
+			MILLI_SEC_IN_SEC, "MaximumDiffingTime");
+	}
+
+	// Order to check the blocks in: first, last, then the rest
+	std::vector<int64_t> order;
+	order.reserve(NumBlocks);
+	order.push_back(0);
+	if(NumBlocks > 1)
+	{
+		order.push_back(NumBlocks - 1);
+	}
+	for(int64_t b = 1; b < NumBlocks - 1; ++b)
+	{
+		order.push_back(b);
+	}
+
+	std::vector<uint8_t> buffer;
+	std::map<int64_t, int64_t> found;
+	for(size_t o = 0; o < order.size(); ++o)
+	{
+		if(maximumDiffingTime.HasExpired())
+		{
+			BOX_INFO("MaximumDiffingTime reached - "
+				"suspending file diff");
+			return false;
+		}
+
+		if(pDiffTimer)
+		{
+			pDiffTimer->DoKeepAlive();
+		}
+
+		int64_t b = order[o];
+		int32_t size = pIndex[b].mSize;
+		if(buffer.size() < (size_t)size)
+		{
+			buffer.resize(size);
+		}
+		file.Seek(offsets[b], IOStream::SeekType_Absolute);
+		if(!file.ReadFullBuffer(&buffer[0], size, 0))
+		{
+			return false;
+		}
+		const uint8_t *pdata = &buffer[0];
+
+		if(RollingChecksum(pdata, size).GetChecksum() !=
+			pIndex[b].mWeakChecksum)
+		{
+			return false;
+		}
+
+		BackupStoreFileStrongChecksum strong(FastChecksums);
+		strong.Add(pdata, size);
+		strong.Finish();
+		if(!strong.DigestMatches((uint8_t *)pIndex[b].mStrongChecksum))
+		{
+			return false;
+		}
+
+		found[offsets[b]] = b;
+	}
+
+	#ifndef BOX_RELEASE_BUILD
+	if(BackupStoreFile::TraceDetailsOfDiffProcess)
+	{
+		BOX_TRACE("Diff: file is the old version with " <<
+			(sizeOfInputFile - sizeOfIndexedFile) <<
+			" bytes added to the end");
+	}
+	#endif
+
+	rFoundBlocks.swap(found);
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static ChunkMatchesBlock(const BlocksAvailableEntry &, const uint8_t *, int32_t, uint32_t, BackupStoreFileStrongChecksum &, bool &)
+//		Purpose: Whether a chunk of the file is the same as a block in
+//			 the index. The strong checksum of the chunk is only
+//			 calculated (into rStrong) if the size and weak checksum
+//			 match, and then only once.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool ChunkMatchesBlock(const BlocksAvailableEntry &rBlock,
+	const uint8_t *pChunk, int32_t Size, uint32_t WeakChecksum,
+	BackupStoreFileStrongChecksum &rStrong, bool &rStrongCalculated)
+{
+	if(rBlock.mSize != Size || rBlock.mWeakChecksum != WeakChecksum)
+	{
+		return false;
+	}
+
+	if(!rStrongCalculated)
+	{
+		rStrong.Add(pChunk, Size);
+		rStrong.Finish();
+		rStrongCalculated = true;
+	}
+
+	return rStrong.DigestMatches((uint8_t *)rBlock.mStrongChecksum);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    static SearchForMatchingChunks(const std::string &, std::map<int64_t, int64_t> &, BlocksAvailableEntry *, int64_t, int32_t, bool, DiffTimer *)
+//		Purpose: Split the file into content defined chunks, and look
+//			 each one up in the index by its size and checksums.
+//			 If the old version of the file was chunked the same
+//			 way, this finds the unchanged parts with a single
+//			 pass over the file, instead of checking the rolling
+//			 checksum at every offset for every block size.
+//			 Returns true if any chunks matched.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+static bool SearchForMatchingChunks(const std::string& Filename,
+	std::map<int64_t, int64_t> &rFoundBlocks, BlocksAvailableEntry *pIndex,
+	int64_t NumBlocks, int32_t ChunkAverageSize, bool FastChecksums,
+	DiffTimer *pDiffTimer)
+{
+	Timer maximumDiffingTime(0, "MaximumDiffingTime");
+	if(pDiffTimer && pDiffTimer->IsManaged())
+	{
+		maximumDiffingTime = Timer(pDiffTimer->GetMaximumDiffingTime() *
+			MILLI_SEC_IN_SEC, "MaximumDiffingTime");
+	}
+
+	// Hash the index by weak checksum. The hash list pointers in the
+	// index belong to the rolling checksum search, so use a table of
+	// our own, with the earliest block first in each list.
+	std::vector<int64_t> hashTable(64*1024, -1);
+	std::vector<int64_t> nextInHashList(NumBlocks, -1);
+	for(int64_t b = NumBlocks - 1; b >= 0; --b)
+	{
+		uint16_t hash = RollingChecksum::ExtractHashingComponent(
+			pIndex[b].mWeakChecksum);
+		nextInHashList[b] = hashTable[hash];
+		hashTable[hash] = b;
+	}
+
+	BackupStoreFileChunker chunker(ChunkAverageSize);
+	SparseFileStream file(Filename);
+	file.AdviseSequential();
+	BackupStoreFileChunkReader reader(chunker, file,
+		file.BytesLeftToRead());
+
+	int64_t fileOffset = 0;
+	int64_t lastMatch = -1;
+	const uint8_t *pchunk;
+	int32_t size;
+	while(reader.NextChunk(pchunk, size))
+	{
+		if(maximumDiffingTime.HasExpired())
+		{
+			BOX_INFO("MaximumDiffingTime reached - "
+				"suspending file diff");
+			break;
+		}
+
+		if(pDiffTimer)
+		{
+			pDiffTimer->DoKeepAlive();
+		}
+
+		uint32_t weakChecksum = RollingChecksum(pchunk, size).GetChecksum();
+		BackupStoreFileStrongChecksum strong(FastChecksums);
+		bool strongCalculated = false;
+		int64_t match = -1;
+
+		// Try the block after the last one matched first, as runs of
+		// consecutive blocks make for a shorter recipe.
+		if(lastMatch >= 0 && lastMatch + 1 < NumBlocks &&
+			ChunkMatchesBlock(pIndex[lastMatch + 1], pchunk, size,
+				weakChecksum, strong, strongCalculated))
+		{
+			match = lastMatch + 1;
+		}
+
+		for(int64_t b = hashTable[RollingChecksum::ExtractHashingComponent(weakChecksum)];
+			match == -1 && b != -1; b = nextInHashList[b])
+		{
+			if(ChunkMatchesBlock(pIndex[b], pchunk, size,
+				weakChecksum, strong, strongCalculated))
+			{
+				match = b;
+			}
+		}
+
+		if(match != -1)
+		{
+			rFoundBlocks[fileOffset] = match;
+		}
+		lastMatch = match;
+
+		fileOffset += size;
+	}
+
+	return !rFoundBlocks.empty();
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -815,8 +1518,9 @@ static void SetupHashTable(BlocksAvailableEntry *pIndex, int64_t NumBlocks, int3
 //		Created: 14/1/04
 //
 // --------------------------------------------------------------------------
-static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, uint8_t *pBeginnings, uint8_t *pEndings,
-	int Offset, int32_t BlockSize, int64_t FileBlockNumber, BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks)
+static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChecksum &fastSum, const uint8_t *pBeginnings, const uint8_t *pEndings,
+	int Offset, int32_t BlockSize, int64_t FileBlockNumber, BlocksAvailableEntry *pIndex, std::map<int64_t, int64_t> &rFoundBlocks,
+	bool FastChecksums)
 {
 	// Check parameters
 	ASSERT(pBeginnings != 0);
@@ -848,8 +1552,8 @@ static bool SecondStageMatch(BlocksAvailableEntry *pFirstInHashList, RollingChec
 		return false;
 	}
 
-	// Calculate the strong MD5 digest for this block
-	MD5Digest strong;
+	// Calculate the strong digest for this block
+	BackupStoreFileStrongChecksum strong(FastChecksums);
 	// Add the data from the beginnings
 	strong.Add(pBeginnings + Offset, BlockSize - Offset);
 	// Add any data from the endings
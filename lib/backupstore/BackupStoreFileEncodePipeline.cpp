@@ -0,0 +1,389 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileEncodePipeline.cpp
+//		Purpose: Encode blocks of files in parallel, in order
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <new>
+
+#include "BackupStoreFileChecksum.h"
+#include "BackupStoreFileCryptVar.h"
+#include "BackupStoreFileEncodePipeline.h"
+#include "CommonException.h"
+#include "RollingChecksum.h"
+
+#include "MemLeakFindOn.h"
+
+using namespace BackupStoreFileCryptVar;
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::Worker::Worker(BackupStoreFileEncodePipeline &)
+//		Purpose: Constructor. Each worker encrypts with its own copy of
+//			 the file data cipher, as contexts can't be shared.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileEncodePipeline::Worker::Worker(
+	BackupStoreFileEncodePipeline &rPipeline)
+: mrPipeline(rPipeline)
+{
+	ASSERT(spEncrypt != 0);
+	mEncrypt.Init(*spEncrypt);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::BackupStoreFileEncodePipeline(int, int32_t, bool, int, int)
+//		Purpose: Constructor. Starts the given number of threads, to
+//			 encode blocks of up to MaxBlockSize bytes, with fast
+//			 or MD5 strong checksums, compressing them with the
+//			 given CompressCodec and level.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileEncodePipeline::BackupStoreFileEncodePipeline(int Threads,
+	int32_t MaxBlockSize, bool FastChecksums, int CompressionCodec,
+	int CompressionLevel)
+: mMaxBlockSize(MaxBlockSize),
+  mMaxEncodedSize(BackupStoreFile::MaxBlockSizeForChunkSize(MaxBlockSize)),
+  mMaxBlocks(Threads * 2),
+  mFastChecksums(FastChecksums),
+  mCompressionCodec(CompressionCodec),
+  mCompressionLevel(CompressionLevel),
+  mStopping(false)
+{
+	try
+	{
+		for(int t = 0; t < Threads; ++t)
+		{
+			mWorkers.push_back(new Worker(*this));
+			mWorkers.back()->Start();
+		}
+	}
+	catch(...)
+	{
+		StopWorkers();
+		throw;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::~BackupStoreFileEncodePipeline()
+//		Purpose: Destructor. Waits for any blocks being encoded.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupStoreFileEncodePipeline::~BackupStoreFileEncodePipeline()
+{
+	StopWorkers();
+	Clear();
+
+	for(size_t b = 0; b < mSpare.size(); ++b)
+	{
+		if(mSpare[b]->mpCopy != 0)
+		{
+			BackupStoreFile::CodingChunkFree(mSpare[b]->mpCopy);
+		}
+		delete mSpare[b];
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::StopWorkers()
+//		Purpose: Private. Tells the threads to finish, and waits for
+//			 them.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodePipeline::StopWorkers()
+{
+	{
+		MutexLock lock(mMutex);
+		mStopping = true;
+		mBlockAdded.Broadcast();
+	}
+
+	for(size_t w = 0; w < mWorkers.size(); ++w)
+	{
+		if(mWorkers[w]->IsStarted())
+		{
+			try
+			{
+				mWorkers[w]->Join();
+			}
+			catch(...)
+			{
+				// Failures of blocks were recorded in them
+			}
+		}
+		delete mWorkers[w];
+	}
+	mWorkers.clear();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::Add(const uint8_t *, int32_t, bool, bool)
+//		Purpose: Adds the next block of the file to be encoded. If Copy
+//			 is false, the data is used in place. TryCompressing is
+//			 passed on to BackupStoreFile::EncodeChunk().
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodePipeline::Add(const uint8_t *pData, int32_t Size,
+	bool Copy, bool TryCompressing)
+{
+	ASSERT(Size <= mMaxBlockSize);
+
+	Block *pblock = 0;
+	{
+		MutexLock lock(mMutex);
+		if(!mSpare.empty())
+		{
+			pblock = mSpare.back();
+			mSpare.pop_back();
+		}
+	}
+
+	if(pblock == 0)
+	{
+		pblock = new Block;
+		pblock->mpCopy = 0;
+	}
+
+	try
+	{
+		// The encoded data buffer is swapped with the caller's, so
+		// make sure it's big enough that it's never reallocated by
+		// a worker.
+		if(pblock->mEncoded.mBufferSize < mMaxEncodedSize)
+		{
+			BackupStoreFile::EncodingBuffer buffer;
+			buffer.Allocate(mMaxEncodedSize);
+			pblock->mEncoded.Swap(buffer);
+		}
+
+		if(Copy)
+		{
+			if(pblock->mpCopy == 0)
+			{
+				pblock->mpCopy = (uint8_t *)BackupStoreFile::CodingChunkAlloc(mMaxBlockSize);
+				if(pblock->mpCopy == 0)
+				{
+					throw std::bad_alloc();
+				}
+			}
+			::memcpy(pblock->mpCopy, pData, Size);
+			pData = pblock->mpCopy;
+		}
+	}
+	catch(...)
+	{
+		Recycle(pblock);
+		throw;
+	}
+
+	pblock->mpData = pData;
+	pblock->mSize = Size;
+	pblock->mTryCompressing = TryCompressing;
+	pblock->mEncodedSize = 0;
+	pblock->mWeakChecksum = 0;
+	pblock->mStarted = false;
+	pblock->mDone = false;
+	pblock->mFailed = false;
+	pblock->mFailureMessage.clear();
+
+	MutexLock lock(mMutex);
+	mBlocks.push_back(pblock);
+	mWaiting.push_back(pblock);
+	mBlockAdded.Signal();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::GetNext(BackupStoreFile::EncodingBuffer &, int32_t &, uint32_t &, uint8_t *)
+//		Purpose: Waits for the oldest block to be encoded, and returns
+//			 its encoded size. The encoded data is swapped into
+//			 rEncodedOut, and its clear size and checksums returned
+//			 in the other arguments. Exceptions thrown while it was
+//			 being encoded are rethrown as CommonException
+//			 ThreadFailed.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int32_t BackupStoreFileEncodePipeline::GetNext(
+	BackupStoreFile::EncodingBuffer &rEncodedOut, int32_t &rSizeOut,
+	uint32_t &rWeakChecksumOut, uint8_t *pStrongChecksumOut)
+{
+	Block *pblock = 0;
+	{
+		MutexLock lock(mMutex);
+		ASSERT(!mBlocks.empty());
+		pblock = mBlocks.front();
+		while(!pblock->mDone)
+		{
+			mBlockDone.Wait(mMutex);
+		}
+		mBlocks.pop_front();
+	}
+
+	if(pblock->mFailed)
+	{
+		std::string message(pblock->mFailureMessage);
+		Recycle(pblock);
+		THROW_EXCEPTION_MESSAGE(CommonException, ThreadFailed, message);
+	}
+
+	int32_t encodedSize = pblock->mEncodedSize;
+	rEncodedOut.Swap(pblock->mEncoded);
+	rSizeOut = pblock->mSize;
+	rWeakChecksumOut = pblock->mWeakChecksum;
+	::memcpy(pStrongChecksumOut, pblock->mStrongChecksum,
+		MD5Digest::DigestLength);
+	Recycle(pblock);
+
+	return encodedSize;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::Clear()
+//		Purpose: Discards all the blocks in the pipeline, waiting for
+//			 any being encoded, after which data added in place
+//			 is no longer used.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodePipeline::Clear()
+{
+	MutexLock lock(mMutex);
+	mWaiting.clear();
+	while(!mBlocks.empty())
+	{
+		Block *pblock = mBlocks.front();
+		while(pblock->mStarted && !pblock->mDone)
+		{
+			mBlockDone.Wait(mMutex);
+		}
+		mBlocks.pop_front();
+		mSpare.push_back(pblock);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::Recycle(Block *)
+//		Purpose: Private. Keeps a block which has been taken out of
+//			 the pipeline, to reuse its buffers.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodePipeline::Recycle(Block *pBlock)
+{
+	MutexLock lock(mMutex);
+	mSpare.push_back(pBlock);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::RunWorker(CipherContext &)
+//		Purpose: Private. Encodes blocks as they're added, until the
+//			 pipeline is stopped.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodePipeline::RunWorker(CipherContext &rEncrypt)
+{
+	MutexLock lock(mMutex);
+	while(true)
+	{
+		while(mWaiting.empty() && !mStopping)
+		{
+			mBlockAdded.Wait(mMutex);
+		}
+		if(mStopping)
+		{
+			return;
+		}
+
+		Block *pblock = mWaiting.front();
+		mWaiting.pop_front();
+		pblock->mStarted = true;
+
+		// Encode without holding the lock
+		mMutex.Unlock();
+		try
+		{
+			Encode(*pblock, rEncrypt);
+		}
+		catch(std::exception &e)
+		{
+			pblock->mFailed = true;
+			pblock->mFailureMessage = e.what();
+		}
+		catch(...)
+		{
+			pblock->mFailed = true;
+			pblock->mFailureMessage = "unknown error";
+		}
+		mMutex.Lock();
+
+		pblock->mDone = true;
+		mBlockDone.Broadcast();
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodePipeline::Encode(Block &, CipherContext &)
+//		Purpose: Private. Encodes a block and works out its checksums.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodePipeline::Encode(Block &rBlock,
+	CipherContext &rEncrypt)
+{
+	rBlock.mEncodedSize = BackupStoreFile::EncodeChunk(rBlock.mpData,
+		rBlock.mSize, rBlock.mEncoded, rEncrypt, rBlock.mTryCompressing,
+		mCompressionCodec, mCompressionLevel);
+
+	RollingChecksum weakChecksum(rBlock.mpData, rBlock.mSize);
+	rBlock.mWeakChecksum = weakChecksum.GetChecksum();
+
+	BackupStoreFileStrongChecksum strongChecksum(mFastChecksums);
+	strongChecksum.Add(rBlock.mpData, rBlock.mSize);
+	strongChecksum.Finish();
+	::memcpy(rBlock.mStrongChecksum, strongChecksum.DigestAsData(),
+		MD5Digest::DigestLength);
+}
@@ -0,0 +1,116 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupStoreFileEncodePipeline.h
+//		Purpose: Encode blocks of files in parallel, in order
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPSTOREFILEENCODEPIPELINE__H
+#define BACKUPSTOREFILEENCODEPIPELINE__H
+
+#include <deque>
+#include <string>
+#include <vector>
+
+#include "BackupStoreFile.h"
+#include "CipherContext.h"
+#include "MD5Digest.h"
+#include "Thread.h"
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupStoreFileEncodePipeline
+//		Purpose: Compresses and encrypts blocks of a file, and works out
+//			 their checksums, on a pool of worker threads, so that
+//			 several blocks are encoded at once while the stream is
+//			 being sent. Blocks are added in file order, and taken
+//			 out in the same order, whichever thread finishes first.
+//
+//			 Blocks are either copied in, or used in place, in
+//			 which case the data must stay valid until the pipeline
+//			 is cleared or destroyed, which wait for the blocks
+//			 being encoded to finish.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupStoreFileEncodePipeline
+{
+public:
+	BackupStoreFileEncodePipeline(int Threads, int32_t MaxBlockSize,
+		bool FastChecksums, int CompressionCodec, int CompressionLevel);
+	~BackupStoreFileEncodePipeline();
+private:
+	// No copying allowed
+	BackupStoreFileEncodePipeline(const BackupStoreFileEncodePipeline &);
+	BackupStoreFileEncodePipeline &operator=(const BackupStoreFileEncodePipeline &);
+
+public:
+	void Add(const uint8_t *pData, int32_t Size, bool Copy,
+		bool TryCompressing);
+	int32_t GetNext(BackupStoreFile::EncodingBuffer &rEncodedOut,
+		int32_t &rSizeOut, uint32_t &rWeakChecksumOut,
+		uint8_t *pStrongChecksumOut);
+	void Clear();
+
+	// Number of blocks added and not taken out yet, and how many
+	// are worth adding to keep all the threads busy
+	int GetNumberOfBlocks() const { return mBlocks.size(); }
+	bool IsFull() const { return (int)mBlocks.size() >= mMaxBlocks; }
+
+private:
+	typedef struct
+	{
+		const uint8_t *mpData;
+		uint8_t *mpCopy;
+		int32_t mSize;
+		bool mTryCompressing;
+		BackupStoreFile::EncodingBuffer mEncoded;
+		int32_t mEncodedSize;
+		uint32_t mWeakChecksum;
+		uint8_t mStrongChecksum[MD5Digest::DigestLength];
+		bool mStarted;
+		bool mDone;
+		bool mFailed;
+		std::string mFailureMessage;
+	} Block;
+
+	class Worker : public Thread
+	{
+	public:
+		Worker(BackupStoreFileEncodePipeline &rPipeline);
+	protected:
+		virtual void Run() { mrPipeline.RunWorker(mEncrypt); }
+	private:
+		BackupStoreFileEncodePipeline &mrPipeline;
+		CipherContext mEncrypt;
+	};
+
+	void RunWorker(CipherContext &rEncrypt);
+	void StopWorkers();
+	void Encode(Block &rBlock, CipherContext &rEncrypt);
+	void Recycle(Block *pBlock);
+
+	int32_t mMaxBlockSize;
+	int32_t mMaxEncodedSize;
+	int mMaxBlocks;
+	bool mFastChecksums;
+	int mCompressionCodec;
+	int mCompressionLevel;
+
+	// Everything below is protected by mMutex
+	Mutex mMutex;
+	ConditionVariable mBlockAdded;
+	ConditionVariable mBlockDone;
+	// Blocks in the order they were added, and those not started yet
+	std::deque<Block *> mBlocks;
+	std::deque<Block *> mWaiting;
+	std::vector<Block *> mSpare;
+	bool mStopping;
+
+	std::vector<Worker *> mWorkers;
+};
+
+#endif // BACKUPSTOREFILEENCODEPIPELINE__H
@@ -16,14 +16,21 @@
 #include "BackupStoreConstants.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
+#include "BackupStoreFileChecksum.h"
+#include "BackupStoreFileChunker.h"
 #include "BackupStoreFileCryptVar.h"
+#include "BackupStoreFileEncodePipeline.h"
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreFileWire.h"
 #include "BackupStoreObjectMagic.h"
 #include "BoxTime.h"
+#include "CompressCodec.h"
+#include "CompressException.h"
 #include "FileStream.h"
+#include "Logging.h"
 #include "Random.h"
 #include "RollingChecksum.h"
+#include "SparseFileStream.h"
 
 #include "MemLeakFindOn.h"
 
@@ -44,6 +51,10 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
 : mpRecipe(0),
   mpFile(0),
   mpLogging(0),
+  mPosition(0),
+  mHoleBlockSize(0),
+  mHoleBlockCompressedSize(0),
+  mpReadLogger(NULL),
   mpRunStatusProvider(NULL),
   mpBackgroundTask(NULL),
   mStatus(Status_Header),
@@ -60,9 +71,27 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
   mBlockSize(BACKUP_FILE_MIN_BLOCK_SIZE),
   mLastBlockSize(0),
   mTotalBytesSent(0),
+  mNextChunk(0),
   mpRawBuffer(0),
   mAllocatedBufferSize(0),
-  mEntryIVBase(0)
+  mEntryIVBase(0),
+  mpPipeline(0),
+  mQueueInstruction(-1),
+  mQueueNumBlocks(0),
+  mQueueBlock(0),
+  mQueueBlockSize(0),
+  mQueueLastBlockSize(0),
+  mQueueChunk(0),
+  mQueueOffset(0),
+  mQueueReadPosition(0),
+  mTryCompressing(true),
+  mCompressionCodec(CompressCodec::Zlib),
+  mCompressionLevel(0),
+  mCompressedBlocksSeen(0),
+  mCompressedBlocksClearSize(0),
+  mCompressedBlocksEncodedSize(0),
+  mKeepCompleteBlockIndex(false),
+  mFileOptions(0)
 {
 }
 
@@ -76,10 +105,13 @@ BackupStoreFileEncodeStream::BackupStoreFileEncodeStream()
 // --------------------------------------------------------------------------
 BackupStoreFileEncodeStream::~BackupStoreFileEncodeStream()
 {
+	// Stop encoding blocks, before the data they're from goes away
+	StopPipeline();
+
 	// Free buffers
 	if(mpRawBuffer)
 	{
-		::free(mpRawBuffer);
+		BackupStoreFile::CodingChunkFree(mpRawBuffer);
 		mpRawBuffer = 0;
 	}
 
@@ -109,9 +141,11 @@ BackupStoreFileEncodeStream::~BackupStoreFileEncodeStream()
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFileEncodeStream::Setup(const char *, Recipe *, int64_t, const BackupStoreFilename &, int64_t *)
+//		Name:    BackupStoreFileEncodeStream::Setup(const char *, Recipe *, int64_t, const BackupStoreFilename &, int64_t *, ReadLoggingStream::Logger *, RunStatusProvider *, BackgroundTask *, int, int)
 //		Purpose: Reads file information, and builds file header reading for sending.
-//				 Takes ownership of the Recipe.
+//				 Takes ownership of the Recipe. Blocks of new data
+//				 are compressed with the given CompressCodec and
+//				 level, which must be supported by this build.
 //		Created: 8/12/03
 //
 // --------------------------------------------------------------------------
@@ -120,8 +154,18 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 	int64_t ContainerID, const BackupStoreFilename &rStoreFilename,
 	int64_t *pModificationTime, ReadLoggingStream::Logger* pLogger,
 	RunStatusProvider* pRunStatusProvider,
-	BackgroundTask* pBackgroundTask)
+	BackgroundTask* pBackgroundTask, int CompressionCodec,
+	int CompressionLevel)
 {
+	if(!CompressCodec::IsSupported(CompressionCodec))
+	{
+		THROW_EXCEPTION_MESSAGE(CompressException, CodecNotSupported,
+			CompressCodec::GetName(CompressionCodec));
+	}
+	ASSERT(CompressCodec::IsValidLevel(CompressionCodec, CompressionLevel));
+	mCompressionCodec = CompressionCodec;
+	mCompressionLevel = CompressionLevel;
+
 	// Pointer to a blank recipe which we might create
 	BackupStoreFileEncodeStream::Recipe *pblankRecipe = 0;
 
@@ -137,7 +181,9 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 		// Might need to create a blank recipe...
 		if(pRecipe == 0)
 		{
-			pblankRecipe = new BackupStoreFileEncodeStream::Recipe(0, 0);
+			pblankRecipe = new BackupStoreFileEncodeStream::Recipe(0, 0,
+				0, sFastBlockChecksums, sContentDefinedChunking ?
+				BackupStoreFileChunker::AverageSizeForFileSize(fileSize) : 0);
 
 			BackupStoreFileEncodeStream::RecipeInstruction instruction;
 			instruction.mSpaceBefore = fileSize; // whole file
@@ -154,12 +200,63 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 			*pModificationTime = modTime;
 		}
 
+		// Send data? (symlinks don't have any data in them)
+		mSendData = !attr.IsSymLink();
+
+		if(mSendData)
+		{
+			mFilename = Filename;
+			mpReadLogger = pLogger;
+
+			// Don't try compressing files which are compressed
+			// already
+			mTryCompressing = !BackupStoreFile::IsCompressedFileType(Filename);
+
+			// Blocks in holes in sparse files are all zeros, so
+			// they needn't be read
+			if(mHoles.Find(Filename) && !mHoles.IsEmpty())
+			{
+				BOX_TRACE(Filename << " is sparse, with " <<
+					mHoles.GetTotalSize() << " bytes in " <<
+					mHoles.GetNumberOfHoles() << " holes");
+			}
+		}
+
+		// If new data is split into content defined chunks, the data
+		// has to be read now to find out how many there are.
+		std::auto_ptr<BackupStoreFileChunker> chunker;
+		std::auto_ptr<SparseFileStream> chunkFile;
+		if(mSendData && pRecipe->GetChunkAverageSize() != 0)
+		{
+			chunker.reset(new BackupStoreFileChunker(
+				pRecipe->GetChunkAverageSize()));
+			chunkFile.reset(new SparseFileStream(Filename));
+			chunkFile->AdviseSequential();
+		}
+
 		// Go through each instruction in the recipe and work out how many blocks
 		// it will add, and the max clear size of these blocks
 		int maxBlockClearSize = 0;
+		int64_t newBlocks = 0;
+		int64_t offset = 0;
 		for(uint64_t inst = 0; inst < pRecipe->size(); ++inst)
 		{
-			if((*pRecipe)[inst].mSpaceBefore > 0)
+			if(chunker.get() != 0)
+			{
+				size_t firstChunk = mChunkSizes.size();
+				FindChunks(*chunker, *chunkFile, offset,
+					(*pRecipe)[inst].mSpaceBefore);
+				// Add to accumulated total
+				mTotalBlocks += mChunksInInstruction.back();
+				newBlocks += mChunksInInstruction.back();
+				mBytesToUpload += (*pRecipe)[inst].mSpaceBefore;
+				// Update maximum clear size
+				for(size_t c = firstChunk; c < mChunkSizes.size(); ++c)
+				{
+					if(mChunkSizes[c] > maxBlockClearSize) maxBlockClearSize = mChunkSizes[c];
+				}
+			}
+			else if((*pRecipe)[inst].mSpaceBefore > 0)
 			{
 				// Calculate the number of blocks the space before requires
 				int64_t numBlocks;
@@ -167,11 +264,13 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 				CalculateBlockSizes((*pRecipe)[inst].mSpaceBefore, numBlocks, blockSize, lastBlockSize);
 				// Add to accumlated total
 				mTotalBlocks += numBlocks;
+				newBlocks += numBlocks;
 				mBytesToUpload += (*pRecipe)[inst].mSpaceBefore;
 				// Update maximum clear size
 				if(blockSize > maxBlockClearSize) maxBlockClearSize = blockSize;
 				if(lastBlockSize > maxBlockClearSize) maxBlockClearSize = lastBlockSize;
 			}
+			offset += (*pRecipe)[inst].mSpaceBefore;
 
 			// Add number of blocks copied from the previous file
 			mTotalBlocks += (*pRecipe)[inst].mBlocks;
@@ -186,11 +285,10 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 			for(int32_t b = 0; b < (*pRecipe)[inst].mBlocks; ++b)
 			{
 				if((*pRecipe)[inst].mpStartBlock[b].mSize > maxBlockClearSize) maxBlockClearSize = (*pRecipe)[inst].mpStartBlock[b].mSize;
+				offset += (*pRecipe)[inst].mpStartBlock[b].mSize;
 			}
 		}
-
-		// Send data? (symlinks don't have any data in them)
-		mSendData = !attr.IsSymLink();
+		chunkFile.reset();
 
 		// If not data is being sent, then the max clear block size is zero
 		if(!mSendData)
@@ -206,7 +304,18 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 		hdr.mModificationTime = box_hton64(modTime);
 		// add a bit to make it harder to tell what's going on -- try not to give away too much info about file size
 		hdr.mMaxBlockClearSize = htonl(maxBlockClearSize + 128);
-		hdr.mOptions = 0;		// no options defined yet
+		uint32_t options = 0;
+		if(chunker.get() != 0)
+		{
+			options |= FILE_OPTION_CONTENT_DEFINED_CHUNKS |
+				(chunker->GetAverageSizeBits() << FILE_OPTION_CHUNK_SIZE_SHIFT);
+		}
+		if(maxBlockClearSize > BACKUP_FILE_MAX_BLOCK_SIZE)
+		{
+			options |= FILE_OPTION_LARGE_BLOCKS;
+		}
+		hdr.mOptions = htonl(options);
+		mFileOptions = options;
 
 		// Write header to stream
 		mData.Write(&hdr, sizeof(hdr));
@@ -220,43 +329,44 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 		// Allocate some buffers for writing data
 		if(mSendData)
 		{
-			// Open the file
-			mpFile = new FileStream(Filename);
-
-			if (pLogger)
-			{
-				// Create logging stream
-				mpLogging = new ReadLoggingStream(*mpFile,
-					*pLogger);
-			}
-			else
-			{
-				// re-use FileStream instead
-				mpLogging = mpFile;
-				mpFile = NULL;
-			}
-
 			// Work out the largest possible block required for the encoded data
 			mAllocatedBufferSize = BackupStoreFile::MaxBlockSizeForChunkSize(maxBlockClearSize);
 
-			// Then allocate two blocks of this size
-			mpRawBuffer = (uint8_t*)::malloc(mAllocatedBufferSize);
+			// Allocate a buffer to read blocks into, and open the
+			// file.
 			if(mpRawBuffer == 0)
 			{
-				throw std::bad_alloc();
+				mpRawBuffer = (uint8_t*)BackupStoreFile::CodingChunkAlloc(mAllocatedBufferSize);
+				if(mpRawBuffer == 0)
+				{
+					throw std::bad_alloc();
+				}
 			}
+			OpenFileStream();
+
 #ifndef BOX_RELEASE_BUILD
 			// In debug builds, make sure that the reallocation code is exercised.
 			mEncodedBuffer.Allocate(mAllocatedBufferSize / 4);
 #else
 			mEncodedBuffer.Allocate(mAllocatedBufferSize);
 #endif
+
+			// Encode blocks in parallel, if there's more than one
+			if(sEncodingThreads > 1 && newBlocks > 1)
+			{
+				mpPipeline = new BackupStoreFileEncodePipeline(
+					sEncodingThreads, maxBlockClearSize,
+					pRecipe->UsesFastChecksums(),
+					mCompressionCodec, mCompressionLevel);
+			}
 		}
 		else
 		{
 			// Write an empty block index for the symlink
 			file_BlockIndexHeader blkhdr;
-			blkhdr.mMagicValue = htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
+			blkhdr.mMagicValue = htonl(pRecipe->UsesFastChecksums() ?
+				OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2 :
+				OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
 			blkhdr.mOtherFileID = box_hton64(0);	// not other file ID
 			blkhdr.mEntryIVBase = box_hton64(0);
 			blkhdr.mNumBlocks = box_hton64(0);
@@ -288,6 +398,46 @@ void BackupStoreFileEncodeStream::Setup(const std::string& Filename,
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::FindChunks(const BackupStoreFileChunker &, IOStream &, int64_t, int64_t)
+//		Purpose: Private. Splits a section of the file into content
+//				 defined chunks, reading it from rFile, and records
+//				 their sizes.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::FindChunks(
+	const BackupStoreFileChunker &rChunker, IOStream &rFile,
+	int64_t Offset, int64_t Length)
+{
+	int64_t numChunks = 0;
+	if(Length > 0)
+	{
+		rFile.Seek(Offset, IOStream::SeekType_Absolute);
+		BackupStoreFileChunkReader reader(rChunker, rFile, Length);
+
+		const uint8_t *pchunk;
+		int32_t size;
+		while(reader.NextChunk(pchunk, size))
+		{
+			mChunkSizes.push_back(size);
+			++numChunks;
+		}
+
+		if(reader.GetPosition() != Length)
+		{
+			// The file has shrunk since its size was read
+			THROW_EXCEPTION(BackupStoreException,
+				Temp_FileEncodeStreamDidntReadBuffer)
+		}
+	}
+
+	mChunksInInstruction.push_back(numChunks);
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -308,6 +458,14 @@ void BackupStoreFileEncodeStream::CalculateBlockSizes(int64_t DataSize, int64_t
 
 	} while(rBlockSizeOut < BACKUP_FILE_MAX_BLOCK_SIZE && rNumBlocksOut > BACKUP_FILE_INCREASE_BLOCK_SIZE_AFTER);
 
+	// Huge files can have even bigger blocks, if enabled
+	while(sLargeBlocks && rBlockSizeOut < BACKUP_FILE_MAX_LARGE_BLOCK_SIZE &&
+		rNumBlocksOut > BACKUP_FILE_INCREASE_LARGE_BLOCK_SIZE_AFTER)
+	{
+		rBlockSizeOut *= 2;
+		rNumBlocksOut = (DataSize + rBlockSizeOut - 1) / rBlockSizeOut;
+	}
+
 	// Last block size
 	rLastBlockSizeOut = DataSize - ((rNumBlocksOut - 1) * rBlockSizeOut);
 
@@ -393,8 +551,11 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 					{
 						// Just finished doing the stream header, create the block index header
 						file_BlockIndexHeader blkhdr;
-						blkhdr.mMagicValue = htonl(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
 						ASSERT(mpRecipe != 0);
+						blkhdr.mMagicValue = htonl(
+							mpRecipe->UsesFastChecksums() ?
+							OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2 :
+							OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1);
 						blkhdr.mOtherFileID = box_hton64(mpRecipe->GetOtherFileID());
 						blkhdr.mNumBlocks = box_hton64(mTotalBlocks);
 
@@ -403,6 +564,13 @@ int BackupStoreFileEncodeStream::Read(void *pBuffer, int NBytes, int Timeout)
 						blkhdr.mEntryIVBase = box_hton64(mEntryIVBase);
 
 						mData.Write(&blkhdr, sizeof(blkhdr));
+
+						if(mKeepCompleteBlockIndex)
+						{
+							// Once combined, it won't depend on another file
+							blkhdr.mOtherFileID = box_hton64(0);
+							mCompleteBlockIndex.Write(&blkhdr, sizeof(blkhdr));
+						}
 					}
 
 					++mStatus;
@@ -518,11 +686,15 @@ void BackupStoreFileEncodeStream::SkipPreviousBlocksInInstruction()
 		// Update stats
 		BackupStoreFile::msStats.mBytesAlreadyOnServer += (*mpRecipe)[mInstructionNumber].mpStartBlock[b].mSize;
 
-		// Store the entry
-		StoreBlockIndexEntry(0 - (firstIndex + b),
-			(*mpRecipe)[mInstructionNumber].mpStartBlock[b].mSize,
-			(*mpRecipe)[mInstructionNumber].mpStartBlock[b].mWeakChecksum,
-			(*mpRecipe)[mInstructionNumber].mpStartBlock[b].mStrongChecksum);
+		// Store the entry. Blocks matched to data in a hole in this
+		// file are zeros, and marked as being in a hole, whether they
+		// were in one in the old file or not.
+		BackupStoreFileCreation::BlocksAvailableEntry &rBlock(
+			(*mpRecipe)[mInstructionNumber].mpStartBlock[b]);
+		bool inHole = mHoles.Contains(mPosition + sizeToSkip, rBlock.mSize);
+		StoreBlockIndexEntry(0 - (firstIndex + b), rBlock.mSize,
+			inHole ? BLOCK_INDEX_HOLE_WEAK_CHECKSUM : rBlock.mWeakChecksum,
+			rBlock.mStrongChecksum, rBlock.mEncodedSize);
 
 		// Increment the absolute block number -- kept encryption IV in sync
 		++mAbsoluteBlockNumber;
@@ -531,8 +703,46 @@ void BackupStoreFileEncodeStream::SkipPreviousBlocksInInstruction()
 		sizeToSkip += (*mpRecipe)[mInstructionNumber].mpStartBlock[b].mSize;
 	}
 
-	// Move forward in the stream
-	mpLogging->Seek(sizeToSkip, IOStream::SeekType_Relative);
+	// Move forward in the file, unless it's being read as blocks are
+	// added to the pipeline
+	mPosition += sizeToSkip;
+	if(mpPipeline == 0)
+	{
+		mpLogging->Seek(sizeToSkip, IOStream::SeekType_Relative);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::OpenFileStream()
+//		Purpose: Private. Opens the file to read blocks through a
+//			 stream. It's read from start to end, so the kernel
+//			 is told to read ahead.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::OpenFileStream()
+{
+	ASSERT(mpFile == 0 && mpLogging == 0);
+
+	// Open the file
+	FileStream *pfile = new FileStream(mFilename);
+	pfile->AdviseSequential();
+	mpFile = pfile;
+
+	if (mpReadLogger)
+	{
+		// Create logging stream
+		mpLogging = new ReadLoggingStream(*mpFile, *mpReadLogger);
+	}
+	else
+	{
+		// re-use FileStream instead
+		mpLogging = mpFile;
+		mpFile = NULL;
+	}
 }
 
 
@@ -546,8 +756,15 @@ void BackupStoreFileEncodeStream::SkipPreviousBlocksInInstruction()
 // --------------------------------------------------------------------------
 void BackupStoreFileEncodeStream::SetForInstruction()
 {
-	// Calculate block sizes
-	CalculateBlockSizes((*mpRecipe)[mInstructionNumber].mSpaceBefore, mNumBlocks, mBlockSize, mLastBlockSize);
+	// Calculate block sizes, unless the data was split into chunks in Setup()
+	if(mpRecipe->GetChunkAverageSize() != 0)
+	{
+		mNumBlocks = mChunksInInstruction[mInstructionNumber];
+	}
+	else
+	{
+		CalculateBlockSizes((*mpRecipe)[mInstructionNumber].mSpaceBefore, mNumBlocks, mBlockSize, mLastBlockSize);
+	}
 
 	// Set variables
 	mCurrentBlock = 0;
@@ -557,6 +774,141 @@ void BackupStoreFileEncodeStream::SetForInstruction()
 
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::NextBlockToEncode(int64_t &, int32_t &)
+//		Purpose: Private. Finds the offset in the file and the size of
+//			 the next block of new data to add to the pipeline,
+//			 stepping over blocks from the old file like Read()
+//			 does. Returns false once there are no more.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupStoreFileEncodeStream::NextBlockToEncode(int64_t &rOffsetOut,
+	int32_t &rSizeOut)
+{
+	const int64_t numInstructions = mpRecipe->size();
+
+	while(mQueueBlock >= mQueueNumBlocks)
+	{
+		if(mQueueInstruction >= numInstructions)
+		{
+			return false;
+		}
+
+		if(mQueueInstruction >= 0)
+		{
+			// Step over the blocks from the old file
+			const RecipeInstruction &inst((*mpRecipe)[mQueueInstruction]);
+			for(int32_t b = 0; b < inst.mBlocks; ++b)
+			{
+				mQueueOffset += inst.mpStartBlock[b].mSize;
+			}
+		}
+
+		if(++mQueueInstruction >= numInstructions)
+		{
+			return false;
+		}
+
+		mQueueBlock = 0;
+		if(mpRecipe->GetChunkAverageSize() != 0)
+		{
+			mQueueNumBlocks = mChunksInInstruction[mQueueInstruction];
+		}
+		else if((*mpRecipe)[mQueueInstruction].mSpaceBefore > 0)
+		{
+			CalculateBlockSizes((*mpRecipe)[mQueueInstruction].mSpaceBefore,
+				mQueueNumBlocks, mQueueBlockSize, mQueueLastBlockSize);
+		}
+		else
+		{
+			mQueueNumBlocks = 0;
+		}
+	}
+
+	if(mpRecipe->GetChunkAverageSize() != 0)
+	{
+		rSizeOut = mChunkSizes[mQueueChunk++];
+	}
+	else
+	{
+		rSizeOut = (mQueueBlock == (mQueueNumBlocks - 1))
+			? mQueueLastBlockSize : mQueueBlockSize;
+	}
+
+	rOffsetOut = mQueueOffset;
+	mQueueOffset += rSizeOut;
+	++mQueueBlock;
+	return true;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::FillPipeline()
+//		Purpose: Private. Adds blocks to the pipeline until it has
+//			 enough to keep all its threads busy, reading them from
+//			 the file stream.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::FillPipeline()
+{
+	int64_t offset = 0;
+	int32_t size = 0;
+
+	while(!mpPipeline->IsFull() &&
+		NextBlockToEncode(offset, size))
+	{
+		if(mHoles.Contains(offset, size))
+		{
+			// EncodeCurrentBlock() does this without reading it
+			continue;
+		}
+
+		if(offset != mQueueReadPosition)
+		{
+			mpLogging->Seek(offset - mQueueReadPosition,
+				IOStream::SeekType_Relative);
+		}
+
+		if(!mpLogging->ReadFullBuffer(mpRawBuffer, size,
+			0 /* not interested in size if failure */))
+		{
+			THROW_EXCEPTION(BackupStoreException,
+				Temp_FileEncodeStreamDidntReadBuffer)
+		}
+		mQueueReadPosition = offset + size;
+
+		mpPipeline->Add(mpRawBuffer, size, true /* copy */,
+			mTryCompressing);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::StopPipeline()
+//		Purpose: Private. Stops encoding blocks in parallel, throwing
+//			 away any in the pipeline, so that the rest of the file
+//			 is encoded a block at a time from the current position.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::StopPipeline()
+{
+	if(mpPipeline != 0)
+	{
+		delete mpPipeline;
+		mpPipeline = 0;
+	}
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -569,46 +921,97 @@ void BackupStoreFileEncodeStream::EncodeCurrentBlock()
 {
 	// How big is the block, raw?
 	int blockRawSize = mBlockSize;
-	if(mCurrentBlock == (mNumBlocks - 1))
+	if(mpRecipe->GetChunkAverageSize() != 0)
+	{
+		blockRawSize = mChunkSizes[mNextChunk];
+	}
+	else if(mCurrentBlock == (mNumBlocks - 1))
 	{
 		blockRawSize = mLastBlockSize;
 	}
 	ASSERT(blockRawSize < mAllocatedBufferSize);
 
-	// Check file open
-	if(mpLogging == 0)
+	// Blocks in holes are all zeros, so they aren't read, and weren't
+	// added to the pipeline
+	bool inHole = mHoles.Contains(mPosition, blockRawSize);
+
+	if(mpPipeline != 0 && !inHole)
 	{
-		// File should be open, but isn't. So logical error.
-		THROW_EXCEPTION(BackupStoreException, Internal)
+		FillPipeline();
 	}
 
-	// Read the data in
-	if(!mpLogging->ReadFullBuffer(mpRawBuffer, blockRawSize,
-		0 /* not interested in size if failure */))
+	uint32_t weakChecksum = 0;
+	uint8_t strongChecksum[MD5Digest::DigestLength];
+
+	if(inHole)
 	{
-		// TODO: Do something more intelligent, and abort
-		// this upload because the file has changed.
-		THROW_EXCEPTION(BackupStoreException,
-			Temp_FileEncodeStreamDidntReadBuffer)
+		EncodeHoleBlock(blockRawSize);
+		weakChecksum = BLOCK_INDEX_HOLE_WEAK_CHECKSUM;
+		::memcpy(strongChecksum, mHoleBlockStrongChecksum,
+			sizeof(strongChecksum));
+		if(mpPipeline == 0)
+		{
+			mpLogging->Seek(blockRawSize, IOStream::SeekType_Relative);
+		}
+	}
+	else if(mpPipeline != 0)
+	{
+		// Take the next block from the pipeline, which was added
+		// in the same order as the blocks are sent.
+		int32_t size = 0;
+		mCurrentBlockEncodedSize = mpPipeline->GetNext(mEncodedBuffer,
+			size, weakChecksum, strongChecksum);
+		ASSERT(size == blockRawSize);
 	}
+	else
+	{
+		// Check file open
+		if(mpLogging == 0)
+		{
+			// File should be open, but isn't. So logical error.
+			THROW_EXCEPTION(BackupStoreException, Internal)
+		}
 
-	// Encode it
-	mCurrentBlockEncodedSize = BackupStoreFile::EncodeChunk(mpRawBuffer,
-		blockRawSize, mEncodedBuffer);
+		// Read the data in
+		if(!mpLogging->ReadFullBuffer(mpRawBuffer, blockRawSize,
+			0 /* not interested in size if failure */))
+		{
+			// TODO: Do something more intelligent, and abort
+			// this upload because the file has changed.
+			THROW_EXCEPTION(BackupStoreException,
+				Temp_FileEncodeStreamDidntReadBuffer)
+		}
 
-	mBytesUploaded += blockRawSize;
+		// Encode it
+		mCurrentBlockEncodedSize = BackupStoreFile::EncodeChunk(mpRawBuffer,
+			blockRawSize, mEncodedBuffer, mTryCompressing,
+			mCompressionCodec, mCompressionLevel);
+
+		//TRACE2("Encode: Encoded size of block %d is %d\n", (int32_t)mCurrentBlock, (int32_t)mCurrentBlockEncodedSize);
+
+		// Create block listing data -- generate checksums
+		RollingChecksum weak(mpRawBuffer, blockRawSize);
+		weakChecksum = weak.GetChecksum();
+		BackupStoreFileStrongChecksum strong(
+			mpRecipe->UsesFastChecksums());
+		strong.Add(mpRawBuffer, blockRawSize);
+		strong.Finish();
+		::memcpy(strongChecksum, strong.DigestAsData(),
+			sizeof(strongChecksum));
+	}
 
-	//TRACE2("Encode: Encoded size of block %d is %d\n", (int32_t)mCurrentBlock, (int32_t)mCurrentBlockEncodedSize);
+	mPosition += blockRawSize;
 
-	// Create block listing data -- generate checksums
-	RollingChecksum weakChecksum(mpRawBuffer, blockRawSize);
-	MD5Digest strongChecksum;
-	strongChecksum.Add(mpRawBuffer, blockRawSize);
-	strongChecksum.Finish();
+	mBytesUploaded += blockRawSize;
+	++mNextChunk;
+	if(!inHole)
+	{
+		LearnCompressibility(blockRawSize);
+	}
 
 	// Add entry to the index
 	StoreBlockIndexEntry(mCurrentBlockEncodedSize, blockRawSize,
-		weakChecksum.GetChecksum(), strongChecksum.DigestAsData());
+		weakChecksum, strongChecksum, mCurrentBlockEncodedSize);
 
 	// Set vars to reading this block
 	mPositionInCurrentBlock = 0;
@@ -617,12 +1020,120 @@ void BackupStoreFileEncodeStream::EncodeCurrentBlock()
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t, int32_t, uint32_t, uint8_t *)
+//		Name:    BackupStoreFileEncodeStream::LearnCompressibility(int32_t)
+//		Purpose: Private. Keeps track of how well the blocks of the file
+//				 which were compressed have compressed, and stops
+//				 trying to compress the rest of the file if the first
+//				 few barely got any smaller, as it's probably a
+//				 compressed file type which wasn't recognised.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::LearnCompressibility(int32_t ClearSize)
+{
+	if(!mTryCompressing ||
+		mCompressedBlocksSeen >= BACKUP_FILE_COMPRESSION_PROBE_BLOCKS ||
+		!BackupStoreFile::ChunkIsCompressed(mEncodedBuffer))
+	{
+		return;
+	}
+
+	++mCompressedBlocksSeen;
+	mCompressedBlocksClearSize += ClearSize;
+	mCompressedBlocksEncodedSize += mCurrentBlockEncodedSize;
+
+	// Less than 1/32 saved?
+	if(mCompressedBlocksSeen == BACKUP_FILE_COMPRESSION_PROBE_BLOCKS &&
+		mCompressedBlocksEncodedSize * 32 >= mCompressedBlocksClearSize * 31)
+	{
+		BOX_TRACE("Not compressing the rest of " << mFilename <<
+			", its blocks don't compress well");
+		mTryCompressing = false;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::EncodeHoleBlock(int32_t)
+//		Purpose: Private. Puts the encoding of a block of zeros of the
+//				 given size in the encoded buffer, for a block in a
+//				 hole in the file. The zeros are only compressed for
+//				 the first block of each size, but each block is
+//				 encrypted with its own IV, like any other, so that
+//				 the store can't see which blocks are the same.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreFileEncodeStream::EncodeHoleBlock(int32_t ClearSize)
+{
+	if(ClearSize != mHoleBlockSize)
+	{
+		// Nothing is cached until it's all done
+		mHoleBlockSize = 0;
+		if(mHoleBlockCompressed.mpBuffer == 0)
+		{
+			mHoleBlockCompressed.Allocate(mAllocatedBufferSize);
+		}
+		if(mHoleBlockCompressed.mBufferSize < ClearSize)
+		{
+			mHoleBlockCompressed.Reallocate(ClearSize);
+		}
+		uint8_t *zeros = mHoleBlockCompressed.mpBuffer;
+		::memset(zeros, 0, ClearSize);
+
+		BackupStoreFileStrongChecksum strong(
+			mpRecipe->UsesFastChecksums());
+		strong.Add(zeros, ClearSize);
+		strong.Finish();
+		::memcpy(mHoleBlockStrongChecksum, strong.DigestAsData(),
+			sizeof(mHoleBlockStrongChecksum));
+
+		// Keep the zeros themselves if they're too few to compress
+		mHoleBlockCompressedSize = 0;
+		if(ClearSize >= BACKUP_FILE_MIN_COMPRESSED_CHUNK_SIZE)
+		{
+			BackupStoreFile::EncodingBuffer compressed;
+			compressed.Allocate(mAllocatedBufferSize);
+			int compressedSize = BackupStoreFile::CompressChunk(zeros,
+				ClearSize, compressed, 0, mCompressionCodec,
+				mCompressionLevel);
+			if(compressedSize < ClearSize)
+			{
+				mHoleBlockCompressed.Swap(compressed);
+				mHoleBlockCompressedSize = compressedSize;
+			}
+		}
+		mHoleBlockSize = ClearSize;
+	}
+
+	if(mHoleBlockCompressedSize != 0)
+	{
+		mCurrentBlockEncodedSize = BackupStoreFile::EncodeCompressedChunk(
+			mHoleBlockCompressed.mpBuffer, mHoleBlockCompressedSize,
+			mCompressionCodec, mEncodedBuffer);
+	}
+	else
+	{
+		mCurrentBlockEncodedSize = BackupStoreFile::EncodeChunk(
+			mHoleBlockCompressed.mpBuffer, ClearSize, mEncodedBuffer,
+			false /* don't try compressing */);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t, int32_t, uint32_t, uint8_t *, int64_t)
 //		Purpose: Private. Adds an entry to the index currently being stored for sending at end of the stream.
+//				 CompleteEncodedSize is the encoded size of the block, wherever it's stored,
+//				 for the complete block index (see KeepCompleteBlockIndex()).
 //		Created: 16/1/04
 //
 // --------------------------------------------------------------------------
-void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, uint8_t *pStrongChecksum)
+void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, uint8_t *pStrongChecksum, int64_t CompleteEncodedSize)
 {
 	// First, the encrypted section
 	file_BlockIndexEntryEnc entryEnc;
@@ -656,6 +1167,42 @@ void BackupStoreFileEncodeStream::StoreBlockIndexEntry(int64_t EncSizeOrBlkIndex
 
 	// Save to data block for sending at the end of the stream
 	mData.Write(&entry, sizeof(entry));
+
+	if(mKeepCompleteBlockIndex)
+	{
+		// The encrypted section is the same, wherever the block is
+		entry.mEncodedSize = box_hton64(((uint64_t)CompleteEncodedSize));
+		mCompleteBlockIndex.Write(&entry, sizeof(entry));
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreFileEncodeStream::GetCompleteBlockIndex()
+//		Purpose: Returns the block index of the file as the store will
+//				 hold it once it has combined it with the file it was
+//				 diffed from, if any, or 0 if KeepCompleteBlockIndex()
+//				 wasn't called, or the stream hasn't been read to the
+//				 end, or the file has no data (symlinks).
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+CollectInBufferStream *BackupStoreFileEncodeStream::GetCompleteBlockIndex()
+{
+	if(!mKeepCompleteBlockIndex || !mSendData ||
+		mStatus != Status_Finished)
+	{
+		return 0;
+	}
+
+	if(!mCompleteBlockIndex.IsSetForReading())
+	{
+		mCompleteBlockIndex.SetForReading();
+	}
+
+	return &mCompleteBlockIndex;
 }
 
 
@@ -704,17 +1251,20 @@ bool BackupStoreFileEncodeStream::StreamClosed()
 // --------------------------------------------------------------------------
 //
 // Function
-//		Name:    BackupStoreFileEncodeStream::Recipe::Recipe(BackupStoreFileCreation::BlocksAvailableEntry *, int64_t)
+//		Name:    BackupStoreFileEncodeStream::Recipe::Recipe(BackupStoreFileCreation::BlocksAvailableEntry *, int64_t, int64_t, bool, int32_t)
 //		Purpose: Constructor. Takes ownership of the block index, and will delete it when it's deleted
 //		Created: 15/1/04
 //
 // --------------------------------------------------------------------------
 BackupStoreFileEncodeStream::Recipe::Recipe(
 	BackupStoreFileCreation::BlocksAvailableEntry *pBlockIndex,
-	int64_t NumBlocksInIndex, int64_t OtherFileID)
+	int64_t NumBlocksInIndex, int64_t OtherFileID, bool FastChecksums,
+	int32_t ChunkAverageSize)
 : mpBlockIndex(pBlockIndex),
   mNumBlocksInIndex(NumBlocksInIndex),
-  mOtherFileID(OtherFileID)
+  mOtherFileID(OtherFileID),
+  mFastChecksums(FastChecksums),
+  mChunkAverageSize(ChunkAverageSize)
 {
 	ASSERT((mpBlockIndex == 0) || (NumBlocksInIndex != 0))
 }
@@ -17,9 +17,13 @@
 #include "CollectInBufferStream.h"
 #include "MD5Digest.h"
 #include "BackupStoreFile.h"
+#include "FileHoles.h"
 #include "ReadLoggingStream.h"
 #include "RunStatusProvider.h"
 
+class BackupStoreFileChunker;
+class BackupStoreFileEncodePipeline;
+
 namespace BackupStoreFileCreation
 {
 	// Diffing and creation of files share some implementation details.
@@ -29,6 +33,7 @@ namespace BackupStoreFileCreation
 		int32_t mSize;			// size in clear
 		uint32_t mWeakChecksum;	// weak, rolling checksum
 		uint8_t mStrongChecksum[MD5Digest::DigestLength];	// strong digest based checksum
+		int64_t mEncodedSize;	// size encoded in the file it's from
 	} BlocksAvailableEntry;
 
 }
@@ -60,10 +65,17 @@ public:
 		// NOTE: This class is rather tied in with the implementation of diffing.
 	public:
 		Recipe(BackupStoreFileCreation::BlocksAvailableEntry *pBlockIndex, int64_t NumBlocksInIndex,
-			int64_t OtherFileID = 0);
+			int64_t OtherFileID = 0, bool FastChecksums = false,
+			int32_t ChunkAverageSize = 0);
 		~Recipe();
 	
 		int64_t GetOtherFileID() {return mOtherFileID;}
+		// Whether the block index uses fast strong checksums (which must
+		// be the same as the index of the other file, if any)
+		bool UsesFastChecksums() {return mFastChecksums;}
+		// Average size of content defined chunks to split new data
+		// into, or 0 to use fixed size blocks
+		int32_t GetChunkAverageSize() {return mChunkAverageSize;}
 		int64_t BlockPtrToIndex(BackupStoreFileCreation::BlocksAvailableEntry *pBlock)
 		{
 			return pBlock - mpBlockIndex;
@@ -73,6 +85,8 @@ public:
 		BackupStoreFileCreation::BlocksAvailableEntry *mpBlockIndex;
 		int64_t mNumBlocksInIndex;
 		int64_t mOtherFileID;
+		bool mFastChecksums;
+		int32_t mChunkAverageSize;
 	};
 	
 	void Setup(const std::string& Filename, Recipe *pRecipe, int64_t ContainerID,
@@ -80,7 +94,9 @@ public:
 		int64_t *pModificationTime,
 		ReadLoggingStream::Logger* pLogger = NULL,
 		RunStatusProvider* pRunStatusProvider = NULL,
-		BackgroundTask* pBackgroundTask = NULL);
+		BackgroundTask* pBackgroundTask = NULL,
+		int CompressionCodec = CompressCodec::Zlib,
+		int CompressionLevel = 0);
 
 	virtual int Read(void *pBuffer, int NBytes, int Timeout);
 	virtual void Write(const void *pBuffer, int NBytes,
@@ -90,6 +106,15 @@ public:
 	int64_t GetBytesToUpload() { return mBytesToUpload; }
 	int64_t GetTotalBytesSent() { return mTotalBytesSent; }
 
+	// Keep a copy of the block index as the store will hold it once
+	// it has combined the file with any it was diffed from, so that
+	// the next version can be diffed without downloading the index.
+	void KeepCompleteBlockIndex() { mKeepCompleteBlockIndex = true; }
+	CollectInBufferStream *GetCompleteBlockIndex();
+	// The options written in the file's header, which a diff of the
+	// next version needs with the block index.
+	int32_t GetFileOptions() { return mFileOptions; }
+
 	static void CalculateBlockSizes(int64_t DataSize, int64_t &rNumBlocksOut,
 		int32_t &rBlockSizeOut, int32_t &rLastBlockSizeOut);
 
@@ -103,14 +128,35 @@ private:
 	};
 
 	void EncodeCurrentBlock();
+	void OpenFileStream();
 	void SkipPreviousBlocksInInstruction();
 	void SetForInstruction();
-	void StoreBlockIndexEntry(int64_t WncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, uint8_t *pStrongChecksum);
+	bool NextBlockToEncode(int64_t &rOffsetOut, int32_t &rSizeOut);
+	void FillPipeline();
+	void StopPipeline();
+	void LearnCompressibility(int32_t ClearSize);
+	void EncodeHoleBlock(int32_t ClearSize);
+	void FindChunks(const BackupStoreFileChunker &rChunker, IOStream &rFile,
+		int64_t Offset, int64_t Length);
+	void StoreBlockIndexEntry(int64_t WncSizeOrBlkIndex, int32_t ClearSize, uint32_t WeakChecksum, uint8_t *pStrongChecksum, int64_t CompleteEncodedSize);
 
 	Recipe *mpRecipe;
 	IOStream *mpFile;					// source file
 	CollectInBufferStream mData;		// buffer for header and index entries
 	IOStream *mpLogging;
+	// The position in the source file of the next block
+	int64_t mPosition;
+	// The holes in the source file, if it's sparse, and a block of
+	// mHoleBlockSize zeros, compressed to mHoleBlockCompressedSize bytes
+	// (0 if it isn't compressed), which is encrypted for every block of
+	// that size in a hole
+	FileHoles mHoles;
+	int32_t mHoleBlockSize;
+	int32_t mHoleBlockCompressedSize;
+	BackupStoreFile::EncodingBuffer mHoleBlockCompressed;
+	uint8_t mHoleBlockStrongChecksum[MD5Digest::DigestLength];
+	std::string mFilename;
+	ReadLoggingStream::Logger *mpReadLogger;
 	RunStatusProvider* mpRunStatusProvider;
 	BackgroundTask* mpBackgroundTask;
 	int mStatus;
@@ -130,12 +176,44 @@ private:
 	int32_t mBlockSize;					// Basic block size of most of the blocks in the file
 	int32_t mLastBlockSize;				// the size (unencoded) of the last block in the file
 	int64_t mTotalBytesSent;
+	// Sizes of the blocks of new data, if it's split into content
+	// defined chunks, and how many there are in each instruction
+	std::vector<int32_t> mChunkSizes;
+	std::vector<int64_t> mChunksInInstruction;
+	int64_t mNextChunk;
 	// Buffers
 	uint8_t *mpRawBuffer;				// buffer for raw data
 	BackupStoreFile::EncodingBuffer mEncodedBuffer;
 										// buffer for encoded data
 	int32_t mAllocatedBufferSize;		// size of above two allocated blocks
 	uint64_t mEntryIVBase;				// base for block entry IV
+	// If more than one thread is used, blocks ahead of the one being
+	// sent are encoded in parallel. The mQueue variables are the
+	// position in the recipe and the file of the next block to add
+	// to the pipeline, and of the file stream, as blocks are read
+	// from it when they're added.
+	BackupStoreFileEncodePipeline *mpPipeline;
+	int64_t mQueueInstruction;
+	int64_t mQueueNumBlocks;
+	int64_t mQueueBlock;
+	int32_t mQueueBlockSize;
+	int32_t mQueueLastBlockSize;
+	int64_t mQueueChunk;
+	int64_t mQueueOffset;
+	int64_t mQueueReadPosition;
+	// Whether to try compressing blocks, which is decided from the
+	// file's name and then from how well its first few compressed
+	// blocks compress
+	bool mTryCompressing;
+	// The CompressCodec and level to compress blocks with
+	int mCompressionCodec;
+	int mCompressionLevel;
+	int mCompressedBlocksSeen;
+	int64_t mCompressedBlocksClearSize;
+	int64_t mCompressedBlocksEncodedSize;
+	bool mKeepCompleteBlockIndex;
+	CollectInBufferStream mCompleteBlockIndex;	// see KeepCompleteBlockIndex()
+	int32_t mFileOptions;
 };
 
 
@@ -90,7 +90,7 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 		{
 			THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 		}
-		if(ntohl(diffIdxHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1)
+		if(!OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(ntohl(diffIdxHdr.mMagicValue)))
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
 		}
@@ -135,7 +135,9 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 		{
 			THROW_EXCEPTION(BackupStoreException, CouldntReadEntireStructureFromStream)
 		}
-		if(ntohl(fromIdxHdr.mMagicValue) != OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1
+		// The reversed diff refers to blocks of the diff, so both must use
+		// the same kind of strong checksums
+		if(fromIdxHdr.mMagicValue != diffIdxHdr.mMagicValue
 			|| box_ntoh64(fromIdxHdr.mOtherFileID) != 0)
 		{
 			THROW_EXCEPTION(BackupStoreException, BadBackupStoreFile)
@@ -171,12 +173,12 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 					// Free old block
 					if(buffer != 0)
 					{
-						::free(buffer);
+						BackupStoreFile::CodingChunkFree(buffer);
 						buffer = 0;
 						bufferSize = 0;
 					}
 					// Allocate new block
-					buffer = ::malloc(blockSize);
+					buffer = BackupStoreFile::CodingChunkAlloc(blockSize);
 					if(buffer == 0)
 					{
 						throw std::bad_alloc();
@@ -235,7 +237,7 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 		::free(pfromIndexInfo);
 		if(buffer != 0)
 		{
-			::free(buffer);
+			BackupStoreFile::CodingChunkFree(buffer);
 		}
 		throw;
 	}
@@ -244,7 +246,7 @@ void BackupStoreFile::ReverseDiffFile(IOStream &rDiff, IOStream &rFrom, IOStream
 	::free(pfromIndexInfo);
 	if(buffer != 0)
 	{
-		::free(buffer);
+		BackupStoreFile::CodingChunkFree(buffer);
 	}
 	
 	// return completely different flag
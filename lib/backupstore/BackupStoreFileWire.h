@@ -66,8 +66,23 @@ END_STRUCTURE_PACKING_FOR_WIRE
 // header for blocks of compressed data in files
 #define HEADER_CHUNK_IS_COMPRESSED		1	// bit
 #define HEADER_ENCODING_SHIFT			1	// shift value
-#define HEADER_BLOWFISH_ENCODING		1	// value stored in bits 1 -- 7
-#define HEADER_AES_ENCODING				2	// value stored in bits 1 -- 7
+#define HEADER_ENCODING_MASK			7	// encoding stored in bits 1 -- 3
+#define HEADER_BLOWFISH_ENCODING		1	// value stored in bits 1 -- 3
+#define HEADER_AES_ENCODING				2	// value stored in bits 1 -- 3
+#define HEADER_CODEC_SHIFT				4	// shift value
+#define HEADER_CODEC_MASK				7	// CompressCodec stored in bits 4 -- 6, 0 (zlib) if not compressed
+#define HEADER_RESERVED_BITS			0x80	// must be zero
+
+// options in the file header
+#define FILE_OPTION_CONTENT_DEFINED_CHUNKS	1	// bit
+#define FILE_OPTION_CHUNK_SIZE_SHIFT		8	// log2 of average chunk size stored in bits 8 -- 15
+#define FILE_OPTION_LARGE_BLOCKS		2	// bit, blocks may be bigger than BACKUP_FILE_MAX_BLOCK_SIZE
+
+// Weak checksum stored in the block index for blocks which were in holes in
+// sparse files, so that only they are left as holes when the file is restored.
+// The zeros in them really have a weak checksum of 0. As it's in the encrypted
+// section, only the client can tell which blocks they are.
+#define BLOCK_INDEX_HOLE_WEAK_CHECKSUM		0xffffffff
 
 
 #endif // BACKUPSTOREFILEWIRE__H
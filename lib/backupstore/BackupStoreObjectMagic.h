@@ -21,11 +21,29 @@
 // Magic for the block index at the file stream -- used to
 // ensure streams are reordered as expected
 #define OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1 0x62696478
+// Same format as v1, but the strong checksums of the blocks are XXH3-128
+// instead of MD5. Only written when the server speaks protocol version 2.
+#define OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2 0x62696433
+// True for the block index magic values which can be read by current code
+#define OBJECTMAGIC_IS_FILE_BLOCKS_MAGIC_VALUE(m) \
+	((m) == OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V1 || \
+	 (m) == OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2)
 // Do not use v0 in any new code!
 #define OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V0 0x46426C6B
 
 // Magic value for directory streams
 #define OBJECTMAGIC_DIR_MAGIC_VALUE 		0x4449525F
+// Directories stored with a table of fixed size entries, so that they
+// can be read without decoding every entry. Only used for objects in the
+// store, never sent to clients.
+#define OBJECTMAGIC_DIR_COMPACT_MAGIC_VALUE	0x44495243
+// True for the directory magic values which can be read by current code
+#define OBJECTMAGIC_IS_DIR_MAGIC_VALUE(m) \
+	((m) == OBJECTMAGIC_DIR_MAGIC_VALUE || \
+	 (m) == OBJECTMAGIC_DIR_COMPACT_MAGIC_VALUE)
+// Magic value for the journals of changes to directories, which are kept
+// next to the directory objects in the store, not in objects themselves
+#define OBJECTMAGIC_DIR_JOURNAL_MAGIC_VALUE	0x4449524A
 
 #endif // BACKUPSTOREOBJECTMAGIC__H
 
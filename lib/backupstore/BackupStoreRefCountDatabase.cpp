@@ -10,6 +10,17 @@
 #include "Box.h"
 
 #include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H && !defined WIN32
+	#define REFCOUNT_USE_MMAP
+	#include <sys/mman.h>
+#endif
 
 #include <algorithm>
 
@@ -27,6 +38,12 @@
 #define REFCOUNT_MAGIC_VALUE	0x52656643 // RefC
 #define REFCOUNT_FILENAME	"refcount"
 
+// The mapping of a database grows in steps of this many bytes, so that it
+// only has to be remapped once for every 256k new objects
+#define REFCOUNT_MAPPING_CHUNK	(1024*1024)
+
+bool BackupStoreRefCountDatabase::UseMappedFiles = true;
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -43,9 +60,111 @@ BackupStoreRefCountDatabase::BackupStoreRefCountDatabase(const
   mReadOnly(ReadOnly),
   mIsModified(false),
   mIsTemporaryFile(Temporary),
-  mapDatabaseFile(apDatabaseFile)
+  mapDatabaseFile(apDatabaseFile),
+  mpMapping(0),
+  mMappingSize(0),
+  mMappedFileSize(0)
 {
 	ASSERT(!(ReadOnly && Temporary)); // being both doesn't make sense
+
+	// Use the stream to read and write the file if it can't be mapped
+	if(UseMappedFiles)
+	{
+		RefreshMapping();
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::Map(int64_t)
+//		Purpose: Private. Maps the file, which is the size given,
+//			 with room for it to grow, replacing any existing
+//			 mapping. If it can't be mapped, leaves it unmapped,
+//			 to be read and written through the stream instead.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::Map(int64_t FileSize) const
+{
+#ifdef REFCOUNT_USE_MMAP
+	int64_t mappingSize = ((FileSize / REFCOUNT_MAPPING_CHUNK) + 1) *
+		REFCOUNT_MAPPING_CHUNK;
+	void *pmapping = MAP_FAILED;
+	if((uint64_t)mappingSize <= (uint64_t)(~(size_t)0) / 4)
+	{
+		// Only the part of the mapping inside the file is ever used
+		pmapping = ::mmap(NULL, mappingSize,
+			mReadOnly ? PROT_READ : (PROT_READ | PROT_WRITE),
+			MAP_SHARED, mapDatabaseFile->GetFileHandle(), 0);
+	}
+
+	// Any changes made through the old mapping are in the file already
+	Unmap();
+
+	if(pmapping == MAP_FAILED)
+	{
+		BOX_WARNING("Failed to map reference count database, "
+			"using the file instead: " << mFilename);
+		return;
+	}
+
+	mpMapping = (uint8_t *)pmapping;
+	mMappingSize = mappingSize;
+	mMappedFileSize = FileSize;
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::Unmap()
+//		Purpose: Private. Unmaps the file, if it's mapped.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::Unmap() const
+{
+#ifdef REFCOUNT_USE_MMAP
+	if(mpMapping != 0)
+	{
+		::munmap(mpMapping, mMappingSize);
+	}
+#endif
+
+	mpMapping = 0;
+	mMappingSize = 0;
+	mMappedFileSize = 0;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupStoreRefCountDatabase::RefreshMapping()
+//		Purpose: Private. Maps the file, or if it's mapped already,
+//			 makes the mapping cover it if it's grown.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupStoreRefCountDatabase::RefreshMapping() const
+{
+#ifdef REFCOUNT_USE_MMAP
+	EMU_STRUCT_STAT st;
+	if(EMU_FSTAT(mapDatabaseFile->GetFileHandle(), &st) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to get size of reference count "
+			"database", mFilename, CommonException, OSFileError);
+	}
+
+	if(mpMapping == 0 || st.st_size > mMappingSize)
+	{
+		Map(st.st_size);
+	}
+	else
+	{
+		mMappedFileSize = st.st_size;
+	}
+#endif
 }
 
 void BackupStoreRefCountDatabase::Commit()
@@ -62,6 +181,16 @@ void BackupStoreRefCountDatabase::Commit()
 			"Reference count database is already closed");
 	}
 
+#ifdef REFCOUNT_USE_MMAP
+	// Write all the changes made through the mapping at once
+	if(mpMapping != 0 && ::msync(mpMapping, mMappedFileSize, MS_SYNC) != 0)
+	{
+		THROW_SYS_FILE_ERROR("Failed to write reference count database",
+			mFilename, CommonException, OSFileError);
+	}
+#endif
+	Unmap();
+
 	mapDatabaseFile->Close();
 	mapDatabaseFile.reset();
 
@@ -100,6 +229,7 @@ void BackupStoreRefCountDatabase::Discard()
 	// open or not, and not Discard it unless it's open. However if the
 	// final rename() fails during Commit(), the file will already be
 	// closed, and we don't want to blow up here in that case.
+	Unmap();
 	if (mapDatabaseFile.get())
 	{
 		mapDatabaseFile->Close();
@@ -142,6 +272,9 @@ BackupStoreRefCountDatabase::~BackupStoreRefCountDatabase()
 				"in destructor: " << e.what());
 		}
 	}
+
+	// The OS writes any changes made through the mapping to the file
+	Unmap();
 }
 
 std::string BackupStoreRefCountDatabase::GetFilename(const
@@ -280,6 +413,13 @@ BackupStoreRefCountDatabase::GetRefCount(int64_t ObjectID) const
 {
 	IOStream::pos_type offset = GetOffset(ObjectID);
 
+	if (mpMapping != 0 && mReadOnly &&
+		GetSize() < offset + GetEntrySize())
+	{
+		// Another process may have added it since it was mapped
+		RefreshMapping();
+	}
+
 	if (GetSize() < offset + GetEntrySize())
 	{
 		THROW_FILE_ERROR("Failed to read refcount database: "
@@ -288,9 +428,15 @@ BackupStoreRefCountDatabase::GetRefCount(int64_t ObjectID) const
 			BackupStoreException, UnknownObjectRefCountRequested);
 	}
 
+	refcount_t refcount;
+	if (mpMapping != 0)
+	{
+		::memcpy(&refcount, mpMapping + offset, sizeof(refcount));
+		return ntohl(refcount);
+	}
+
 	mapDatabaseFile->Seek(offset, SEEK_SET);
 
-	refcount_t refcount;
 	if (mapDatabaseFile->Read(&refcount, sizeof(refcount)) !=
 		sizeof(refcount))
 	{
@@ -304,6 +450,12 @@ BackupStoreRefCountDatabase::GetRefCount(int64_t ObjectID) const
 
 int64_t BackupStoreRefCountDatabase::GetLastObjectIDUsed() const
 {
+	if (mpMapping != 0 && mReadOnly)
+	{
+		// Another process may have made it bigger since it was mapped
+		RefreshMapping();
+	}
+
 	return (GetSize() - sizeof(refcount_StreamFormat)) /
 		sizeof(refcount_t);
 }
@@ -331,9 +483,48 @@ void BackupStoreRefCountDatabase::AddReference(int64_t ObjectID)
 void BackupStoreRefCountDatabase::SetRefCount(int64_t ObjectID,
 	refcount_t NewRefCount)
 {
+	if (mReadOnly)
+	{
+		THROW_FILE_ERROR("Cannot change a read-only reference count "
+			"database", mFilename, CommonException, Internal);
+	}
+
 	IOStream::pos_type offset = GetOffset(ObjectID);
-	mapDatabaseFile->Seek(offset, SEEK_SET);
 	refcount_t RefCountNetOrder = htonl(NewRefCount);
+
+#ifdef REFCOUNT_USE_MMAP
+	IOStream::pos_type newSize = offset + GetEntrySize();
+	if (mpMapping != 0 && newSize > mMappedFileSize)
+	{
+		// Make the file big enough first, with zero refcounts for
+		// any objects in between, as writing past the end would
+		if (::ftruncate(mapDatabaseFile->GetFileHandle(), newSize) != 0)
+		{
+			THROW_SYS_FILE_ERROR("Failed to extend reference count "
+				"database", mFilename, CommonException,
+				OSFileError);
+		}
+
+		if (newSize > mMappingSize)
+		{
+			Map(newSize);
+		}
+		else
+		{
+			mMappedFileSize = newSize;
+		}
+	}
+
+	if (mpMapping != 0)
+	{
+		::memcpy(mpMapping + offset, &RefCountNetOrder,
+			sizeof(RefCountNetOrder));
+		mIsModified = true;
+		return;
+	}
+#endif
+
+	mapDatabaseFile->Seek(offset, SEEK_SET);
 	mapDatabaseFile->Write(&RefCountNetOrder, sizeof(RefCountNetOrder));
 	mIsModified = true;
 }
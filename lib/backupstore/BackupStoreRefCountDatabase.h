@@ -45,7 +45,12 @@ END_STRUCTURE_PACKING_FOR_WIRE
 //
 // Class
 //		Name:    BackupStoreRefCountDatabase
-//		Purpose: Backup store reference count database storage
+//		Purpose: Backup store reference count database storage.
+//
+//			 Where possible, the file is mapped into memory, with
+//			 room for it to grow, so that reference counts can be
+//			 read and changed without a system call each. Changes
+//			 are only flushed to disc by Commit(), or by the OS.
 //		Created: 2009/06/01
 //
 // --------------------------------------------------------------------------
@@ -89,12 +94,20 @@ public:
 	bool RemoveReference(int64_t ObjectID);
 	int ReportChangesTo(BackupStoreRefCountDatabase& rOldRefs);
 
+	// Map databases into memory, where possible. On by default; tests
+	// turn it off to check the other path.
+	static bool UseMappedFiles;
+
 private:
 	static std::string GetFilename(const BackupStoreAccountDatabase::Entry&
 		rAccount, bool Temporary);
 
 	IOStream::pos_type GetSize() const
 	{
+		if(mpMapping != 0)
+		{
+			return mMappedFileSize;
+		}
 		return mapDatabaseFile->GetPosition() +
 			mapDatabaseFile->BytesLeftToRead();
 	}
@@ -108,6 +121,9 @@ private:
 			sizeof(refcount_StreamFormat);
 	}
 	void SetRefCount(int64_t ObjectID, refcount_t NewRefCount);
+	void Map(int64_t FileSize) const;
+	void Unmap() const;
+	void RefreshMapping() const;
 	
 	// Location information
 	BackupStoreAccountDatabase::Entry mAccount;
@@ -117,6 +133,13 @@ private:
 	bool mIsTemporaryFile;
 	std::auto_ptr<FileStream> mapDatabaseFile;
 
+	// The mapping of the whole file, if it's mapped, which is bigger
+	// than the file so that it can grow. Read-only databases may be
+	// remapped when reading, if another process has made them bigger.
+	mutable uint8_t *mpMapping;
+	mutable int64_t mMappingSize;
+	mutable int64_t mMappedFileSize;
+
 	bool NeedsCommitOrDiscard()
 	{
 		return mapDatabaseFile.get() && mIsModified && mIsTemporaryFile;
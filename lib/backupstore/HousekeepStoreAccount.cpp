@@ -18,10 +18,10 @@
 #include "BackupStoreAccountDatabase.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
+#include "BackupStoreDirectoryJournal.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreInfo.h"
 #include "BackupStoreRefCountDatabase.h"
-#include "BufferedStream.h"
 #include "HousekeepStoreAccount.h"
 #include "NamedLock.h"
 #include "RaidFileRead.h"
@@ -60,6 +60,8 @@ HousekeepStoreAccount::HousekeepStoreAccount(int AccountID,
 	  mBlocksInOldFilesDelta(0),
 	  mBlocksInDeletedFilesDelta(0),
 	  mBlocksInDirectoriesDelta(0),
+	  mBlocksUsedCompactionDelta(0),
+	  mCompactDirectories(false),
 	  mFilesDeleted(0),
 	  mEmptyDirectoriesDeleted(0),
 	  mCountUntilNextInterprocessMsgCheck(POLL_INTERPROCESS_MSG_CHECK_FREQUENCY)
@@ -171,6 +173,11 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 		// the new info and adjust the old one instead.
 		info = pOldInfo;
 
+		// Journals compacted so far are gone, so the old counts
+		// still need to lose them.
+		mBlocksUsedDelta += mBlocksUsedCompactionDelta;
+		info->ChangeBlocksInDirectories(mBlocksInDirectoriesDelta);
+
 		// We're about to reset counters and exit, so report what
 		// happened now.
 		BOX_INFO("Housekeeping on account " <<
@@ -256,6 +263,10 @@ bool HousekeepStoreAccount::DoHousekeeping(bool KeepTryingForever)
 			(deleteInterrupted?" and was interrupted":""));
 	}
 
+	// Compacting journals is an expected change, which the recount
+	// didn't include, so apply it with the rest of the deltas.
+	mBlocksUsedDelta += mBlocksUsedCompactionDelta;
+
 	// Make sure the delta's won't cause problems if the counts are
 	// really wrong, and it wasn't fixed because the store was
 	// updated during the scan.
@@ -348,21 +359,44 @@ bool HousekeepStoreAccount::ScanDirectory(int64_t ObjectID,
 	std::string objectFilename;
 	MakeObjectFilename(ObjectID, objectFilename);
 
-	// Open it.
-	std::auto_ptr<RaidFileRead> dirStream(RaidFileRead::Open(mStoreDiscSet,
-		objectFilename));
+	// Read the directory in, with the changes in its journal, if it
+	// has one
+	BackupStoreDirectory dir;
+	int64_t originalDirSizeInBlocks = 0;
+	bool journaled = BackupStoreDirectoryJournal::ReadDirectory(
+		mStoreDiscSet, objectFilename, dir, &originalDirSizeInBlocks);
+	dir.SetUserInfo1_SizeInBlocks(originalDirSizeInBlocks);
 
 	// Add the size of the directory on disc to the size being calculated
-	int64_t originalDirSizeInBlocks = dirStream->GetDiscUsageInBlocks();
 	mBlocksInDirectories += originalDirSizeInBlocks;
 	mBlocksUsed += originalDirSizeInBlocks;
 
-	// Read the directory in
-	BackupStoreDirectory dir;
-	BufferedStream buf(*dirStream);
-	dir.ReadFromStream(buf, IOStream::TimeOutInfinite);
-	dir.SetUserInfo1_SizeInBlocks(originalDirSizeInBlocks);
-	dirStream->Close();
+	// Write it in full with the changes, so that the journal isn't needed
+	if(journaled)
+	{
+		BOX_TRACE("Compacting journal of directory " <<
+			BOX_FORMAT_OBJECTID(ObjectID));
+
+		RaidFileWrite writeDir(mStoreDiscSet, objectFilename,
+			mapNewRefs->GetRefCount(ObjectID));
+		writeDir.Open(true /* allow overwriting */);
+		dir.WriteToStore(writeDir, mCompactDirectories);
+
+		// Get the disc usage (must do this before commiting it)
+		int64_t new_size = writeDir.GetDiscUsageInBlocks();
+
+		// Commit directory
+		writeDir.Commit(BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY);
+		BackupStoreDirectoryJournal::Delete(mStoreDiscSet,
+			objectFilename);
+
+		// Adjust block counts if the directory itself changed in size
+		int64_t adjust = new_size - originalDirSizeInBlocks;
+		mBlocksUsedCompactionDelta += adjust;
+		mBlocksInDirectoriesDelta += adjust;
+
+		UpdateDirectorySize(dir, new_size);
+	}
 
 	// Is it empty?
 	if(dir.GetNumberOfEntries() == 0)
@@ -853,7 +887,7 @@ BackupStoreRefCountDatabase::refcount_t HousekeepStoreAccount::DeleteFile(
 		RaidFileWrite writeDir(mStoreDiscSet, rDirectoryFilename,
 			mapNewRefs->GetRefCount(InDirectory));
 		writeDir.Open(true /* allow overwriting */);
-		rDirectory.WriteToStream(writeDir);
+		rDirectory.WriteToStore(writeDir, mCompactDirectories);
 
 		// Get the disc usage (must do this before commiting it)
 		int64_t new_size = writeDir.GetDiscUsageInBlocks();
@@ -984,7 +1018,7 @@ void HousekeepStoreAccount::UpdateDirectorySize(
 	RaidFileWrite writeDir(mStoreDiscSet, parentFilename,
 		mapNewRefs->GetRefCount(rDirectory.GetContainerID()));
 	writeDir.Open(true /* allow overwriting */);
-	parent.WriteToStream(writeDir);
+	parent.WriteToStore(writeDir, mCompactDirectories);
 	writeDir.Commit(BACKUP_STORE_CONVERT_TO_RAID_IMMEDIATELY);
 }
 
@@ -1105,7 +1139,7 @@ void HousekeepStoreAccount::DeleteEmptyDirectory(int64_t dirId,
 		RaidFileWrite writeDir(mStoreDiscSet, containingDirFilename,
 			mapNewRefs->GetRefCount(containingDir.GetObjectID()));
 		writeDir.Open(true /* allow overwriting */);
-		containingDir.WriteToStream(writeDir);
+		containingDir.WriteToStore(writeDir, mCompactDirectories);
 
 		// get the disc usage (must do this before commiting it)
 		int64_t dirSize = writeDir.GetDiscUsageInBlocks();
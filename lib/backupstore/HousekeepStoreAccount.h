@@ -42,6 +42,12 @@ public:
 	
 	bool DoHousekeeping(bool KeepTryingForever = false);
 	int GetErrorCount() { return mErrorCount; }
+
+	// Write directories in the compact format
+	void SetCompactDirectories(bool Compact)
+	{
+		mCompactDirectories = Compact;
+	}
 	
 private:
 	// utility functions
@@ -103,6 +109,12 @@ private:
 	int64_t mBlocksInOldFilesDelta;
 	int64_t mBlocksInDeletedFilesDelta;
 	int64_t mBlocksInDirectoriesDelta;
+
+	// Delta from compacting directory journals, kept apart because
+	// the recount made during the scan doesn't include it
+	int64_t mBlocksUsedCompactionDelta;
+
+	bool mCompactDirectories;
 	
 	// Deletion count
 	int64_t mFilesDeleted;
@@ -0,0 +1,414 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientBlockIndexCache.cpp
+//		Purpose: Local cache of the block indexes of uploaded files
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <sys/stat.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#ifdef HAVE_DIRENT_H
+	#include <dirent.h>
+#endif
+
+#include <algorithm>
+#include <vector>
+
+#include "Archive.h"
+#include "BackupClientBlockIndexCache.h"
+#include "BoxException.h"
+#include "CollectInBufferStream.h"
+#include "FileModificationTime.h"
+#include "FileStream.h"
+#include "Logging.h"
+#include "MD5Digest.h"
+#include "Utils.h"
+
+#include "MemLeakFindOn.h"
+
+static const int BLOCKINDEXCACHE_MAGIC_VALUE = 0x42494333;	// BIC3
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::BackupClientBlockIndexCache(const std::string &, int64_t)
+//		Purpose: Constructor. Uses the cache in the directory given,
+//			 creating it if necessary, and limits the total size
+//			 of the indexes in it to MaxSize bytes.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientBlockIndexCache::BackupClientBlockIndexCache(
+	const std::string &rDirectory, int64_t MaxSize)
+: mDirectory(rDirectory),
+  mMaxSize(MaxSize),
+  mSize(0),
+  mNextSequence(0)
+{
+	if(ObjectExists(mDirectory) == ObjectExists_NoObject &&
+		::mkdir(mDirectory.c_str(), S_IRWXU) != 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to create block index cache "
+			"directory: " << mDirectory);
+		return;
+	}
+
+	Load();
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::~BackupClientBlockIndexCache()
+//		Purpose: Destructor. The cached indexes stay on disc.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+BackupClientBlockIndexCache::~BackupClientBlockIndexCache()
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::GetKey(int64_t, box_time_t)
+//		Purpose: Private. Static. The key of the entry for a version
+//			 of a file on the server, which is also the name of
+//			 the file caching it: the object ID and modification
+//			 time in hex.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::string BackupClientBlockIndexCache::GetKey(int64_t ObjectID,
+	box_time_t ModificationTime)
+{
+	char key[64];
+	::snprintf(key, sizeof(key), "%016llx-%016llx",
+		(unsigned long long)ObjectID,
+		(unsigned long long)ModificationTime);
+	return key;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::GetFilename(const std::string &)
+//		Purpose: Private. The name of the file caching an entry.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::string BackupClientBlockIndexCache::GetFilename(const std::string &rKey) const
+{
+	return mDirectory + DIRECTORY_SEPARATOR + rKey;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Load()
+//		Purpose: Private. Finds the indexes already in the cache
+//			 directory, oldest first, and gets rid of any which
+//			 were left half written, or don't fit any more.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Load()
+{
+	DIR *dirHandle = ::opendir(mDirectory.c_str());
+	if(dirHandle == 0)
+	{
+		BOX_LOG_SYS_WARNING("Failed to open block index cache "
+			"directory: " << mDirectory);
+		return;
+	}
+
+	// (modification time, (key, size))
+	std::vector<std::pair<box_time_t, std::pair<std::string, int64_t> > > found;
+
+	struct dirent *en;
+	while((en = ::readdir(dirHandle)) != 0)
+	{
+		std::string leaf(en->d_name);
+		if(leaf == "." || leaf == "..")
+		{
+			continue;
+		}
+
+		std::string filename(GetFilename(leaf));
+		EMU_STRUCT_STAT st;
+		if(leaf.size() != 16 + 1 + 16 ||
+			leaf.find_first_not_of("0123456789abcdef-") !=
+				std::string::npos ||
+			EMU_STAT(filename.c_str(), &st) != 0 ||
+			!S_ISREG(st.st_mode))
+		{
+			// Not a complete cached index
+			BOX_TRACE("Removing unexpected file from block index "
+				"cache: " << filename);
+			::unlink(filename.c_str());
+			continue;
+		}
+
+		found.push_back(std::make_pair(FileModificationTime(st),
+			std::make_pair(leaf, (int64_t)st.st_size)));
+	}
+	::closedir(dirHandle);
+
+	std::sort(found.begin(), found.end());
+	for(size_t f = 0; f < found.size(); ++f)
+	{
+		Entry entry;
+		entry.mSize = found[f].second.second;
+		entry.mSequence = mNextSequence++;
+		mEntries[found[f].second.first] = entry;
+		mAge.insert(std::make_pair(entry.mSequence,
+			found[f].second.first));
+		mSize += entry.mSize;
+	}
+
+	MakeSpace(0);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Get(int64_t, box_time_t, int32_t &)
+//		Purpose: Returns a stream of the cached block index of the
+//			 version of a file with the given object ID and
+//			 modification time on the server, setting
+//			 rFileOptionsOut to the options from its header, or a
+//			 null pointer if it isn't cached.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+std::auto_ptr<IOStream> BackupClientBlockIndexCache::Get(int64_t ObjectID,
+	box_time_t ModificationTime, int32_t &rFileOptionsOut)
+{
+	std::auto_ptr<IOStream> apIndex;
+	std::string key(GetKey(ObjectID, ModificationTime));
+	if(mEntries.find(key) == mEntries.end())
+	{
+		return apIndex;
+	}
+
+	try
+	{
+		FileStream file(GetFilename(key));
+		Archive archive(file, 0);
+		int magic;
+		int64_t objectID;
+		int64_t modificationTime;
+		int32_t options;
+		uint8_t digest[MD5Digest::DigestLength];
+		archive.Read(magic);
+		archive.Read(objectID);
+		archive.Read(modificationTime);
+		archive.Read(options);
+		archive.ReadFullBuffer(digest, sizeof(digest));
+
+		if(magic == BLOCKINDEXCACHE_MAGIC_VALUE &&
+			objectID == ObjectID &&
+			modificationTime == (int64_t)ModificationTime)
+		{
+			// The index is read into memory to check that it's
+			// intact, as diffing against a damaged one could
+			// store a damaged file.
+			std::auto_ptr<CollectInBufferStream> apBuffer(
+				new CollectInBufferStream);
+			file.CopyStreamTo(*apBuffer);
+			apBuffer->SetForReading();
+
+			MD5Digest check;
+			check.Add(apBuffer->GetBuffer(), apBuffer->GetSize());
+			check.Finish();
+			if(check.DigestMatches(digest))
+			{
+				rFileOptionsOut = options;
+				apIndex = apBuffer;
+				return apIndex;
+			}
+		}
+
+		BOX_WARNING("Cached block index " << GetFilename(key) <<
+			" is damaged");
+	}
+	catch(BoxException &e)
+	{
+		BOX_WARNING("Failed to read cached block index " <<
+			GetFilename(key) << ": " << e.what());
+	}
+
+	Remove(key);
+	return apIndex;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Put(int64_t, box_time_t, int32_t, IOStream &)
+//		Purpose: Caches the block index of the version of a file just
+//			 uploaded, and the options from its header, under the
+//			 object ID and modification time the server stored it
+//			 with. It's stored with a checksum to detect damage,
+//			 making space by removing the oldest entries if
+//			 necessary. Failing to cache it isn't an error, as the
+//			 index can be fetched from the server.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Put(int64_t ObjectID,
+	box_time_t ModificationTime, int32_t FileOptions,
+	IOStream &rBlockIndex)
+{
+	std::string key(GetKey(ObjectID, ModificationTime));
+	Remove(key);
+
+	// The index is checksummed as it's stored, so it has to be read
+	// into memory first. It normally is anyway.
+	CollectInBufferStream index;
+	rBlockIndex.CopyStreamTo(index);
+	index.SetForReading();
+
+	MD5Digest digest;
+	digest.Add(index.GetBuffer(), index.GetSize());
+	digest.Finish();
+
+	// Write to a temporary file, and rename it into place when
+	// it's complete, so that it's never found half written.
+	std::string filename(GetFilename(key));
+	std::string tempFilename(filename + ".tmp");
+	int64_t size = 0;
+	try
+	{
+		CollectInBufferStream header;
+		Archive archive(header, 0);
+		archive.Write(BLOCKINDEXCACHE_MAGIC_VALUE);
+		archive.Write(ObjectID);
+		archive.Write((int64_t)ModificationTime);
+		archive.Write(FileOptions);
+		header.Write(digest.DigestAsData(), MD5Digest::DigestLength);
+		header.SetForReading();
+
+		size = header.GetSize() + index.GetSize();
+		if(size > mMaxSize)
+		{
+			return;
+		}
+		MakeSpace(size);
+
+		{
+			FileStream file(tempFilename, O_WRONLY | O_CREAT | O_TRUNC);
+			header.CopyStreamTo(file);
+			index.CopyStreamTo(file);
+		}
+
+		if(::rename(tempFilename.c_str(), filename.c_str()) != 0)
+		{
+			BOX_LOG_SYS_WARNING("Failed to rename cached block "
+				"index: " << tempFilename << " to " << filename);
+			::unlink(tempFilename.c_str());
+			return;
+		}
+	}
+	catch(BoxException &e)
+	{
+		BOX_WARNING("Failed to cache block index " << filename <<
+			": " << e.what());
+		::unlink(tempFilename.c_str());
+		return;
+	}
+
+	Entry entry;
+	entry.mSize = size;
+	entry.mSequence = mNextSequence++;
+	mEntries[key] = entry;
+	mAge.insert(std::make_pair(entry.mSequence, key));
+	mSize += size;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Remove(int64_t, box_time_t)
+//		Purpose: Removes the cached index of a version of a file, if
+//			 there is one, when it's no longer the latest version.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Remove(int64_t ObjectID,
+	box_time_t ModificationTime)
+{
+	Remove(GetKey(ObjectID, ModificationTime));
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Remove(const std::string &)
+//		Purpose: Private. Removes an entry and the file caching it.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Remove(const std::string &rKey)
+{
+	std::map<std::string, Entry>::iterator i(mEntries.find(rKey));
+	if(i == mEntries.end())
+	{
+		return;
+	}
+
+	std::string filename(GetFilename(rKey));
+	if(::unlink(filename.c_str()) != 0 && errno != ENOENT)
+	{
+		BOX_LOG_SYS_WARNING("Failed to remove cached block index: " <<
+			filename);
+	}
+
+	mSize -= i->second.mSize;
+	mAge.erase(std::make_pair(i->second.mSequence, rKey));
+	mEntries.erase(i);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::Clear()
+//		Purpose: Removes everything from the cache, for example when
+//			 the store has been changed by something else.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::Clear()
+{
+	while(!mEntries.empty())
+	{
+		Remove(mEntries.begin()->first);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupClientBlockIndexCache::MakeSpace(int64_t)
+//		Purpose: Private. Removes the oldest entries until there's
+//			 space to add Size bytes.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupClientBlockIndexCache::MakeSpace(int64_t Size)
+{
+	while(!mAge.empty() && mSize + Size > mMaxSize)
+	{
+		Remove(mAge.begin()->second);
+	}
+}
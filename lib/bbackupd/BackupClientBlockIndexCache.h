@@ -0,0 +1,94 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    BackupClientBlockIndexCache.h
+//		Purpose: Local cache of the block indexes of uploaded files
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef BACKUPCLIENTBLOCKINDEXCACHE__H
+#define BACKUPCLIENTBLOCKINDEXCACHE__H
+
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+#include <utility>
+
+#include "BoxTime.h"
+
+class IOStream;
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    BackupClientBlockIndexCache
+//		Purpose: Keeps the block indexes of files as they were uploaded,
+//			 in files in a directory, so that the next version of a
+//			 file can be diffed against the last one without asking
+//			 the server for its block index.
+//
+//			 Entries are keyed by the object ID of the version
+//			 uploaded and the modification time the server records
+//			 for it. The server never changes an object once it's
+//			 stored, so an entry is only used when a directory
+//			 listing shows the latest version of the file with the
+//			 same ID and modification time. Otherwise the index must
+//			 be fetched from the server. The options from the
+//			 header of the file are kept with its index, as the
+//			 server returns them too.
+//
+//			 The total size of the cached indexes is kept under the
+//			 maximum by discarding the least recently added ones.
+//			 Each entry is normally used once, to diff the version
+//			 after it, so this is also the least recently used.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class BackupClientBlockIndexCache
+{
+public:
+	BackupClientBlockIndexCache(const std::string &rDirectory,
+		int64_t MaxSize);
+	~BackupClientBlockIndexCache();
+private:
+	// No copying
+	BackupClientBlockIndexCache(const BackupClientBlockIndexCache &);
+	BackupClientBlockIndexCache &operator=(const BackupClientBlockIndexCache &);
+
+public:
+	std::auto_ptr<IOStream> Get(int64_t ObjectID,
+		box_time_t ModificationTime, int32_t &rFileOptionsOut);
+	void Put(int64_t ObjectID, box_time_t ModificationTime,
+		int32_t FileOptions, IOStream &rBlockIndex);
+	void Remove(int64_t ObjectID, box_time_t ModificationTime);
+	void Clear();
+
+	int64_t GetSize() const { return mSize; }
+	int64_t GetNumberOfEntries() const { return mEntries.size(); }
+
+private:
+	static std::string GetKey(int64_t ObjectID,
+		box_time_t ModificationTime);
+	std::string GetFilename(const std::string &rKey) const;
+	void Remove(const std::string &rKey);
+	void Load();
+	void MakeSpace(int64_t Size);
+
+	typedef struct
+	{
+		int64_t mSize;
+		int64_t mSequence;
+	} Entry;
+
+	std::string mDirectory;
+	int64_t mMaxSize;
+	int64_t mSize;
+	int64_t mNextSequence;
+	// Key -> entry, and the keys in the order they were added
+	std::map<std::string, Entry> mEntries;
+	std::set<std::pair<int64_t, std::string> > mAge;
+};
+
+#endif // BACKUPCLIENTBLOCKINDEXCACHE__H
@@ -59,6 +59,7 @@ BackupClientContext::BackupClientContext
   mHostname(rHostname),
   mPort(Port),
   mAccountNumber(AccountNumber),
+  mServerVersion(BACKUP_STORE_SERVER_VERSION),
   mExtendedLogging(ExtendedLogging),
   mExtendedLogToFile(ExtendedLogToFile),
   mExtendedLogFile(ExtendedLogFile),
@@ -70,6 +71,8 @@ BackupClientContext::BackupClientContext
   mStorageLimitExceeded(false),
   mpExcludeFiles(0),
   mpExcludeDirs(0),
+  mCompressionCodec(CompressCodec::Zlib),
+  mCompressionLevel(0),
   mKeepAliveTimer(0, "KeepAliveTime"),
   mbIsManaged(false),
   mrProgressNotifier(rProgressNotifier),
@@ -174,14 +177,46 @@ BackupProtocolCallable &BackupClientContext::GetConnection()
 		// Handshake
 		pClient->Handshake();
 
-		// Check the version of the server
+		// Check the version of the server. Ask for the newest version
+		// first, and fall back to older ones if the server is too old
+		// to understand it.
 		{
-			std::auto_ptr<BackupProtocolVersion> serverVersion(
-				mapConnection->QueryVersion(BACKUP_STORE_SERVER_VERSION));
-			if(serverVersion->GetVersion() != BACKUP_STORE_SERVER_VERSION)
+			int32_t version = BACKUP_STORE_SERVER_VERSION;
+			std::auto_ptr<BackupProtocolVersion> serverVersion;
+			while(serverVersion.get() == 0)
+			{
+				try
+				{
+					serverVersion = mapConnection->QueryVersion(version);
+				}
+				catch(ConnectionException &e)
+				{
+					int type, subtype;
+					mapConnection->GetLastError(type, subtype);
+					if(e.GetSubType() != ConnectionException::Protocol_UnexpectedReply ||
+						type != BackupProtocolError::ErrorType ||
+						subtype != BackupProtocolError::Err_WrongVersion ||
+						version <= BACKUP_STORE_SERVER_MIN_VERSION)
+					{
+						throw;
+					}
+
+					BOX_INFO("Server doesn't support protocol version " <<
+						version << ", falling back to version " <<
+						(version - 1));
+					version--;
+				}
+			}
+
+			if(serverVersion->GetVersion() != version)
 			{
 				THROW_EXCEPTION(BackupStoreException, WrongServerVersion)
 			}
+			mServerVersion = version;
+
+			// Only servers which speak version 2 understand block
+			// indexes with fast checksums.
+			BackupStoreFile::SetFastBlockChecksums(version >= 2);
 		}
 
 		// Login -- if this fails, the Protocol will exception
@@ -149,6 +149,27 @@ public:
 		return false;
 	}
 
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    BackupClientContext::SetCompression(int, int)
+	//		Purpose: Sets the CompressCodec and level that new data in
+	//				 the location being synced is compressed with.
+	//		Created: 2026/10/18
+	//
+	// --------------------------------------------------------------------------
+	void SetCompression(int Codec, int Level)
+	{
+		mCompressionCodec = Codec;
+		mCompressionLevel = Level;
+	}
+	int GetCompressionCodec() const { return mCompressionCodec; }
+	int GetCompressionLevel() const { return mCompressionLevel; }
+
+	// The protocol version agreed with the server when connecting. It's
+	// the latest version until then, as spoken by local connections.
+	int32_t GetServerVersion() const { return mServerVersion; }
+
 	// Utility functions -- may do a lot of work
 	bool FindFilename(int64_t ObjectID, int64_t ContainingDirectory, std::string &rPathOut, bool &rIsDirectoryOut,
 		bool &rIsCurrentVersionOut, box_time_t *pModTimeOnServer = 0, box_time_t *pAttributesHashOnServer = 0,
@@ -229,6 +250,7 @@ private:
 	int mPort;
 	uint32_t mAccountNumber;
 	std::auto_ptr<BackupProtocolCallable> mapConnection;
+	int32_t mServerVersion;
 	bool mExtendedLogging;
 	bool mExtendedLogToFile;
 	std::string mExtendedLogFile;
@@ -240,6 +262,8 @@ private:
 	bool mStorageLimitExceeded;
 	ExcludeList *mpExcludeFiles;
 	ExcludeList *mpExcludeDirs;
+	int mCompressionCodec;
+	int mCompressionLevel;
 	Timer mKeepAliveTimer;
 	bool mbIsManaged;
 	int mKeepAliveTime;
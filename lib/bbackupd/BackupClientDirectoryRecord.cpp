@@ -21,6 +21,7 @@
 #include "autogen_CipherException.h"
 #include "autogen_ClientException.h"
 #include "Archive.h"
+#include "BackupClientBlockIndexCache.h"
 #include "BackupClientContext.h"
 #include "BackupClientDirectoryRecord.h"
 #include "BackupClientInodeToIDMap.h"
@@ -31,6 +32,7 @@
 #include "BufferedStream.h"
 #include "CommonException.h"
 #include "CollectInBufferStream.h"
+#include "CompressCodec.h"
 #include "FileModificationTime.h"
 #include "IOStream.h"
 #include "Logging.h"
@@ -1092,7 +1094,7 @@ bool BackupClientDirectoryRecord::UpdateItems(
 						storeFilename,
 						fileSize, modTime,
 						attributesHash,
-						noPreviousVersionOnServer);
+						noPreviousVersionOnServer, en);
 
 					if (latestObjectID == 0)
 					{
@@ -1692,9 +1694,11 @@ void BackupClientDirectoryRecord::RemoveDirectoryInPlaceOfFile(
 //			 BackupClientDirectoryRecord::SyncParams &,
 //			 const std::string &,
 //			 const BackupStoreFilename &,
-//			 int64_t, box_time_t, box_time_t, bool)
+//			 int64_t, box_time_t, box_time_t, bool,
+//			 const BackupStoreDirectory::Entry *)
 //		Purpose: Private. Upload a file to the server. May send
-//			 a patch instead of the whole thing
+//			 a patch instead of the whole thing. pLatestOnServer
+//			 is the latest version on the server, if known.
 //		Created: 20/1/04
 //
 // --------------------------------------------------------------------------
@@ -1707,7 +1711,8 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 	int64_t FileSize,
 	box_time_t ModificationTime,
 	box_time_t AttributesHash,
-	bool NoPreviousVersionOnServer)
+	bool NoPreviousVersionOnServer,
+	const BackupStoreDirectory::Entry *pLatestOnServer)
 {
 	BackupClientContext& rContext(rParams.mrContext);
 	ProgressNotifier& rNotifier(rContext.GetProgressNotifier());
@@ -1731,16 +1736,61 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 			FileSize >= rParams.mDiffingUploadSizeThreshold)
 		{
 			// YES -- try to do diff, if possible
-			// First, query the server to see if there's an old version available
-			std::auto_ptr<BackupProtocolSuccess> getBlockIndex(connection.QueryGetBlockIndexByName(mObjectID, rStoreFilename));
-			diffFromID = getBlockIndex->GetObjectID();
+			std::auto_ptr<IOStream> blockIndexStream;
+			int32_t diffFromOptions = 0;
+			bool diffFromOptionsKnown = false;
+
+			// If the directory listing shows the latest version on
+			// the server, and its block index is cached, use that
+			if(rParams.mpBlockIndexCache != 0 && pLatestOnServer != 0)
+			{
+				blockIndexStream = rParams.mpBlockIndexCache->Get(
+					pLatestOnServer->GetObjectID(),
+					pLatestOnServer->GetModificationTime(),
+					diffFromOptions);
+				if(blockIndexStream.get() != 0)
+				{
+					diffFromID = pLatestOnServer->GetObjectID();
+					diffFromOptionsKnown = true;
+				}
+			}
+
+			if(blockIndexStream.get() == 0 &&
+				rContext.GetServerVersion() >= 3)
+			{
+				// Query the server to see if there's an old version
+				// available, and how it was encoded
+				std::auto_ptr<BackupProtocolBlockIndex> getBlockIndex(
+					connection.QueryGetBlockIndexByName2(mObjectID,
+						rStoreFilename));
+				diffFromID = getBlockIndex->GetObjectID();
+				diffFromOptions = getBlockIndex->GetFileOptions();
+				diffFromOptionsKnown = true;
+
+				if(diffFromID != 0)
+				{
+					// Get the index
+					blockIndexStream = connection.ReceiveStream();
+				}
+			}
+			else if(blockIndexStream.get() == 0)
+			{
+				// Query the server to see if there's an old version
+				// available. Older servers don't say how it was
+				// encoded.
+				std::auto_ptr<BackupProtocolSuccess> getBlockIndex(connection.QueryGetBlockIndexByName(mObjectID, rStoreFilename));
+				diffFromID = getBlockIndex->GetObjectID();
+
+				if(diffFromID != 0)
+				{
+					// Get the index
+					blockIndexStream = connection.ReceiveStream();
+				}
+			}
 			
 			if(diffFromID != 0)
 			{
 				// Found an old version
-
-				// Get the index
-				std::auto_ptr<IOStream> blockIndexStream(connection.ReceiveStream());
 			
 				//
 				// Diff the file
@@ -1758,7 +1808,11 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 					&rContext, // DiffTimer implementation
 					0 /* not interested in the modification time */, 
 					&isCompletelyDifferent,
-					rParams.mpBackgroundTask);
+					rParams.mpBackgroundTask,
+					rParams.mDiffingThreads,
+					rContext.GetCompressionCodec(),
+					rContext.GetCompressionLevel(),
+					diffFromOptionsKnown ? &diffFromOptions : NULL);
 
 				if(isCompletelyDifferent)
 				{
@@ -1784,7 +1838,25 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 				rLocalPath, mObjectID, /* containing directory */
 				rStoreFilename, NULL, &rParams,
 				&(rParams.mrRunStatusProvider),
-				rParams.mpBackgroundTask);
+				rParams.mpBackgroundTask,
+				rContext.GetCompressionCodec(),
+				rContext.GetCompressionLevel());
+		}
+
+		if(rParams.mpBlockIndexCache != 0)
+		{
+			// Whatever happens, the cached index won't be the
+			// latest version's after the upload
+			if(pLatestOnServer != 0)
+			{
+				rParams.mpBlockIndexCache->Remove(
+					pLatestOnServer->GetObjectID(),
+					pLatestOnServer->GetModificationTime());
+			}
+			if(FileSize >= rParams.mDiffingUploadSizeThreshold)
+			{
+				apStreamToUpload->KeepCompleteBlockIndex();
+			}
 		}
 
 		rContext.SetNiceMode(true);
@@ -1816,6 +1888,19 @@ int64_t BackupClientDirectoryRecord::UploadFile(
 		// Get object ID from the result
 		objID = stored->GetObjectID();
 		uploadedSize = apStreamToUpload->GetTotalBytesSent();
+
+		if(rParams.mpBlockIndexCache != 0)
+		{
+			// The next version will be diffed against this one
+			CollectInBufferStream *pindex =
+				apStreamToUpload->GetCompleteBlockIndex();
+			if(pindex != 0)
+			{
+				rParams.mpBlockIndexCache->Put(objID,
+					ModificationTime,
+					apStreamToUpload->GetFileOptions(), *pindex);
+			}
+		}
 	}
 	catch(BoxException &e)
 	{
@@ -1907,6 +1992,8 @@ BackupClientDirectoryRecord::SyncParams::SyncParams(
   mMaxFileTimeInFuture(99999999999999999LL),
   mFileTrackingSizeThreshold(16*1024),
   mDiffingUploadSizeThreshold(16*1024),
+  mDiffingThreads(1),
+  mpBlockIndexCache(0),
   mpBackgroundTask(pBackgroundTask),
   mrRunStatusProvider(rRunStatusProvider),
   mrSysadminNotifier(rSysadminNotifier),
@@ -2116,7 +2203,9 @@ void BackupClientDirectoryRecord::Serialize(Archive & rArchive) const
 //
 // --------------------------------------------------------------------------
 Location::Location()
-: mIDMapIndex(0)
+: mIDMapIndex(0),
+  mCompressionCodec(CompressCodec::Zlib),
+  mCompressionLevel(0)
 { }
 
 // --------------------------------------------------------------------------
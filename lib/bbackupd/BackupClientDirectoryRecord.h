@@ -31,6 +31,7 @@
 #endif
 
 class Archive;
+class BackupClientBlockIndexCache;
 class BackupClientContext;
 class BackupDaemon;
 class ExcludeList;
@@ -93,6 +94,8 @@ public:
 		box_time_t mMaxFileTimeInFuture;
 		int32_t mFileTrackingSizeThreshold;
 		int32_t mDiffingUploadSizeThreshold;
+		int mDiffingThreads;
+		BackupClientBlockIndexCache *mpBlockIndexCache;
 		BackgroundTask *mpBackgroundTask;
 		RunStatusProvider &mrRunStatusProvider;
 		SysadminNotifier &mrSysadminNotifier;
@@ -185,7 +188,8 @@ private:
 		const std::string &rRemotePath,
 		const BackupStoreFilenameClear &rStoreFilename,
 		int64_t FileSize, box_time_t ModificationTime,
-		box_time_t AttributesHash, bool NoPreviousVersionOnServer);
+		box_time_t AttributesHash, bool NoPreviousVersionOnServer,
+		const BackupStoreDirectory::Entry *pLatestOnServer);
 	void SetErrorWhenReadingFilesystemObject(SyncParams &rParams,
 		const std::string& rFilename);
 	void RemoveDirectoryInPlaceOfFile(SyncParams &rParams,
@@ -231,6 +235,9 @@ public:
 	std::auto_ptr<ExcludeList> mapExcludeFiles;
 	std::auto_ptr<ExcludeList> mapExcludeDirs;
 	int mIDMapIndex;
+	// CompressCodec and level to compress new data with
+	int mCompressionCodec;
+	int mCompressionLevel;
 
 #ifdef ENABLE_VSS
 	bool mIsSnapshotCreated;
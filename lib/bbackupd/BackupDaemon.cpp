@@ -56,6 +56,7 @@
 #include "autogen_CommonException.h"
 #include "autogen_ConversionException.h"
 #include "Archive.h"
+#include "BackupClientBlockIndexCache.h"
 #include "BackupClientContext.h"
 #include "BackupClientCryptoKeys.h"
 #include "BackupClientDirectoryRecord.h"
@@ -71,6 +72,7 @@
 #include "BackupStoreFile.h"
 #include "BackupStoreFilenameClear.h"
 #include "BannerText.h"
+#include "CompressCodec.h"
 #include "Conversion.h"
 #include "ExcludeList.h"
 #include "FileStream.h"
@@ -1065,6 +1067,34 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 		conf.GetKeyValueInt("FileTrackingSizeThreshold");
 	params.mDiffingUploadSizeThreshold =
 		conf.GetKeyValueInt("DiffingUploadSizeThreshold");
+	params.mDiffingThreads = conf.GetKeyValueInt("DiffingThreads");
+	BackupStoreFile::SetContentDefinedChunking(
+		conf.GetKeyValueBool("ContentDefinedChunking"));
+	BackupStoreFile::SetLargeBlocks(conf.GetKeyValueBool("LargeBlocks"));
+	BackupStoreFile::SetEncodingThreads(
+		conf.GetKeyValueInt("EncodingThreads"));
+
+	// Keep the block indexes of files as they're uploaded, so that
+	// the next versions can be diffed without asking the server
+	std::auto_ptr<BackupClientBlockIndexCache> apBlockIndexCache;
+	if(conf.GetKeyValueInt("BlockIndexCacheSize") > 0)
+	{
+		apBlockIndexCache.reset(new BackupClientBlockIndexCache(
+			conf.GetKeyValue("DataDirectory") +
+			DIRECTORY_SEPARATOR "blockindexcache",
+			conf.GetKeyValueInt("BlockIndexCacheSize")));
+
+		// When starting from scratch (after an error, or without
+		// any saved state) there's no knowing whether the store has
+		// changed since the indexes were cached
+		if(mLastSyncTime == 0)
+		{
+			apBlockIndexCache->Clear();
+		}
+
+		params.mpBlockIndexCache = apBlockIndexCache.get();
+	}
+
 	params.mMaxFileTimeInFuture =
 		SecondsToBoxTime(conf.GetKeyValueInt("MaxFileTimeInFuture"));
 	mNumFilesUploaded = 0;
@@ -1145,6 +1175,10 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 			(*i)->mapExcludeFiles.get(),
 			(*i)->mapExcludeDirs.get());
 
+		// Compress new data as configured for this location
+		mapClientContext->SetCompression((*i)->mCompressionCodec,
+			(*i)->mCompressionLevel);
+
 		// Sync the directory
 		std::string locationPath = (*i)->mPath;
 #ifdef ENABLE_VSS
@@ -1158,8 +1192,9 @@ std::auto_ptr<BackupClientContext> BackupDaemon::RunSyncNow()
 			BackupProtocolListDirectory::RootDirectory,
 			locationPath, std::string("/") + (*i)->mName, **i);
 
-		// Unset exclude lists (just in case)
+		// Unset exclude lists and compression (just in case)
 		mapClientContext->SetExcludeLists(0, 0);
+		mapClientContext->SetCompression(CompressCodec::Zlib, 0);
 	}
 
 	// Perform any deletions required -- these are
@@ -1800,6 +1835,11 @@ void BackupDaemon::OnBackupFinish()
 		// Reset statistics again
 		BackupStoreFile::ResetStats();
 
+		// Log how well buffers were reused, and give the memory back
+		// until the next sync
+		BackupStoreFile::LogCodingPoolStats();
+		BackupStoreFile::ReleaseCodingPool();
+
 		// Notify administrator
 		NotifySysadmin(SysadminNotifier::BackupFinish);
 
@@ -2526,6 +2566,39 @@ void BackupDaemon::SetupLocations(BackupClientContext &rClientContext, const Con
 			pLoc->mapExcludeFiles.reset(BackupClientMakeExcludeList_Files(rConfig));
 			pLoc->mapExcludeDirs.reset(BackupClientMakeExcludeList_Dirs(rConfig));
 
+			// Read the compression codec and level
+			pLoc->mCompressionCodec = CompressCodec::Zlib;
+			pLoc->mCompressionLevel = 0;
+			if(rConfig.KeyExists("Compression") &&
+				!CompressCodec::GetCodecFromName(
+					rConfig.GetKeyValue("Compression"),
+					pLoc->mCompressionCodec))
+			{
+				THROW_EXCEPTION_MESSAGE(CommonException,
+					InvalidConfiguration, "Unknown compression "
+					"codec: " << rConfig.GetKeyValue("Compression"));
+			}
+			if(!CompressCodec::IsSupported(pLoc->mCompressionCodec))
+			{
+				THROW_EXCEPTION_MESSAGE(CommonException,
+					InvalidConfiguration, "Compression codec " <<
+					CompressCodec::GetName(pLoc->mCompressionCodec) <<
+					" is not supported by this build");
+			}
+			if(rConfig.KeyExists("CompressionLevel"))
+			{
+				pLoc->mCompressionLevel =
+					rConfig.GetKeyValueInt("CompressionLevel");
+			}
+			if(!CompressCodec::IsValidLevel(pLoc->mCompressionCodec,
+				pLoc->mCompressionLevel))
+			{
+				THROW_EXCEPTION_MESSAGE(CommonException,
+					InvalidConfiguration, "Compression level " <<
+					pLoc->mCompressionLevel << " is not valid for " <<
+					CompressCodec::GetName(pLoc->mCompressionCodec));
+			}
+
 			// Does this exist on the server?
 			// Remove from dir object early, so that if we fail
 			// to stat the local directory, we still don't
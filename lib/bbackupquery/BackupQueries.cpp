@@ -30,7 +30,9 @@
 #include <iostream>
 #include <ostream>
 #include <set>
+#include <stdexcept>
 
+#include "BackupClientCompareQueue.h"
 #include "BackupClientFileAttributes.h"
 #include "BackupClientMakeExcludeList.h"
 #include "BackupClientRestore.h"
@@ -80,7 +82,8 @@ BackupQueries::BackupQueries(BackupProtocolCallable &rConnection,
 	  mQuitNow(false),
 	  mRunningAsRoot(false),
 	  mWarnedAboutOwnerAttributes(false),
-	  mReturnCode(0)		// default return code
+	  mReturnCode(0),		// default return code
+	  mpCompareQueue(0)
 {
 	#ifdef WIN32
 	mRunningAsRoot = TRUE;
@@ -1274,7 +1277,9 @@ BackupQueries::CompareParams::CompareParams(bool QuickCompare,
   mDifferencesExplainedByModTime(0),
   mUncheckedFiles(0),
   mExcludedDirs(0),
-  mExcludedFiles(0)
+  mExcludedFiles(0),
+  mFilesCompared(0),
+  mBytesCompared(0)
 { }
 
 // --------------------------------------------------------------------------
@@ -1285,8 +1290,24 @@ BackupQueries::CompareParams::CompareParams(bool QuickCompare,
 //		Created: 2003/10/12
 //
 // --------------------------------------------------------------------------
-void BackupQueries::CommandCompare(const std::vector<std::string> &args, const bool *opts)
+void BackupQueries::CommandCompare(const std::vector<std::string> &rArgs, const bool *opts)
 {
+	// Number of files to compare at once, given before the names
+	int threads = 1;
+	std::vector<std::string> args(rArgs);
+	if(opts['j'] && !args.empty())
+	{
+		threads = ::atoi(args[0].c_str());
+		args.erase(args.begin());
+	}
+
+	if(threads < 1)
+	{
+		BOX_ERROR("Incorrect usage. Number of threads must be at "
+			"least 1.");
+		return;
+	}
+
 	box_time_t LatestFileUploadTime = GetCurrentBoxTime();
 	
 	// Try and work out the time before which all files should be on the server
@@ -1323,6 +1344,97 @@ void BackupQueries::CommandCompare(const std::vector<std::string> &args, const b
 			"checked.");
 	}
 	
+	// Compare several files at once, on another thread for each?
+	std::auto_ptr<BackupClientCompareQueue> apCompareQueue;
+	if(threads > 1)
+	{
+		apCompareQueue.reset(new BackupClientCompareQueue(mrConnection,
+			threads, params.QuickCompare(),
+			params.IgnoreAttributes(), LatestFileUploadTime));
+		mpCompareQueue = apCompareQueue.get();
+	}
+
+	box_time_t startTime = GetCurrentBoxTime();
+	bool compared;
+
+	try
+	{
+		compared = CompareSelected(args, opts, params);
+	}
+	catch(...)
+	{
+		mpCompareQueue = 0;
+		throw;
+	}
+	mpCompareQueue = 0;
+	apCompareQueue.reset();
+
+	if(!compared)
+	{
+		return;
+	}
+
+	if(!params.mQuietCompare)
+	{
+		box_time_t elapsed = GetCurrentBoxTime() - startTime;
+		double seconds = (double)elapsed / MICRO_SEC_IN_SEC;
+		double megabytes = (double)params.mBytesCompared /
+			(1024 * 1024);
+		std::ostringstream rate;
+		rate.setf(std::ios::fixed);
+		rate.precision(2);
+		rate << megabytes << " MB in " << seconds << " seconds";
+		if(seconds > 0)
+		{
+			rate << " (" << (megabytes / seconds) << " MB/s)";
+		}
+		BOX_INFO("Compared " << params.mFilesCompared << " files, " <<
+			rate.str() << ", using " << threads << " thread" <<
+			((threads == 1) ? "" : "s") << ".");
+
+		BOX_INFO("[ " <<
+			params.mDifferencesExplainedByModTime << " (of " <<
+			params.mDifferences << ") differences probably "
+			"due to file modifications after the last upload ]");
+	}
+
+	BOX_INFO("Differences: " << params.mDifferences << " (" <<
+		params.mExcludedDirs   << " dirs excluded, " <<
+		params.mExcludedFiles  << " files excluded, " <<
+		params.mUncheckedFiles << " files not checked)");
+	
+	// Set return code?
+	if(opts['c'])
+	{
+		if (params.mUncheckedFiles != 0)
+		{
+			SetReturnCode(ReturnCode::Compare_Error);
+		} 
+		else if (params.mDifferences != 0)
+		{
+			SetReturnCode(ReturnCode::Compare_Different);
+		}
+		else
+		{
+			SetReturnCode(ReturnCode::Compare_Same);
+		}
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupQueries::CompareSelected(const std::vector<std::string> &, const bool *, BackupQueries::CompareParams &)
+//		Purpose: Compares the locations or directories chosen by the
+//			 arguments of the compare command. Returns false if
+//			 they're not valid.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool BackupQueries::CompareSelected(const std::vector<std::string> &args,
+	const bool *opts, BackupQueries::CompareParams &params)
+{
 	if(!opts['l'] && opts['a'] && args.size() == 0)
 	{
 		// Compare all locations
@@ -1351,7 +1463,7 @@ void BackupQueries::CommandCompare(const std::vector<std::string> &args, const b
 		if(!params.IgnoreExcludes())
 		{
 			BOX_ERROR("Cannot use excludes on directory to directory comparison -- use -E flag to specify ignored excludes.");
-			return;
+			return false;
 		}
 		else
 		{
@@ -1361,39 +1473,11 @@ void BackupQueries::CommandCompare(const std::vector<std::string> &args, const b
 	}
 	else
 	{
-		BOX_ERROR("Incorrect usage.\ncompare -a\n or compare -l <location-name>\n or compare <store-dir-name> <local-dir-name>");
-		return;
+		BOX_ERROR("Incorrect usage.\ncompare -a\n or compare -l <location-name>\n or compare <store-dir-name> <local-dir-name>\n (with -j <threads> before the names to compare on several threads)");
+		return false;
 	}
 
-	if (!params.mQuietCompare)
-	{	
-		BOX_INFO("[ " <<
-			params.mDifferencesExplainedByModTime << " (of " <<
-			params.mDifferences << ") differences probably "
-			"due to file modifications after the last upload ]");
-	}
-
-	BOX_INFO("Differences: " << params.mDifferences << " (" <<
-		params.mExcludedDirs   << " dirs excluded, " <<
-		params.mExcludedFiles  << " files excluded, " <<
-		params.mUncheckedFiles << " files not checked)");
-	
-	// Set return code?
-	if(opts['c'])
-	{
-		if (params.mUncheckedFiles != 0)
-		{
-			SetReturnCode(ReturnCode::Compare_Error);
-		} 
-		else if (params.mDifferences != 0)
-		{
-			SetReturnCode(ReturnCode::Compare_Different);
-		}
-		else
-		{
-			SetReturnCode(ReturnCode::Compare_Same);
-		}
-	}
+	return true;
 }
 
 
@@ -1488,6 +1572,12 @@ void BackupQueries::Compare(const std::string &rStoreDir,
 	
 	// Go!
 	Compare(dirID, storeDirEncoded, localDirEncoded, rParams);
+
+	if(mpCompareQueue != 0)
+	{
+		// Finish before anything else uses the connection
+		NotifyQueuedFilesCompared(rParams, true);
+	}
 }
 
 void BackupQueries::CompareOneFile(int64_t DirID,
@@ -1644,6 +1734,56 @@ void BackupQueries::CompareOneFile(int64_t DirID,
 	}
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    BackupQueries::NotifyQueuedFilesCompared(BoxBackupCompareParams &, bool)
+//		Purpose: Reports the results of the files compared by the
+//			 compare queue, in the order they were added, in the
+//			 same way as CompareOneFile(). If Wait is true, waits
+//			 for all of them, otherwise only reports those which
+//			 are ready.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void BackupQueries::NotifyQueuedFilesCompared(BoxBackupCompareParams &rParams,
+	bool Wait)
+{
+	BackupClientCompareQueue::Compared compared;
+	while(mpCompareQueue->GetNext(compared, Wait))
+	{
+		if(compared.mDownloadFailed)
+		{
+			std::runtime_error e(compared.mFailureMessage);
+			rParams.NotifyDownloadFailed(compared.mLocalFilename,
+				compared.mStoreFilename, compared.mSize, e);
+			continue;
+		}
+
+		if(compared.mLocalFileReadFailed &&
+			compared.mFailureMessage.empty())
+		{
+			rParams.NotifyLocalFileReadFailed(
+				compared.mLocalFilename,
+				compared.mStoreFilename, compared.mSize);
+		}
+		else if(compared.mLocalFileReadFailed)
+		{
+			std::runtime_error e(compared.mFailureMessage);
+			rParams.NotifyLocalFileReadFailed(
+				compared.mLocalFilename,
+				compared.mStoreFilename, compared.mSize, e);
+		}
+
+		rParams.NotifyFileCompared(compared.mLocalFilename,
+			compared.mStoreFilename, compared.mSize,
+			compared.mHasDifferentAttributes,
+			compared.mHasDifferentContents,
+			compared.mModifiedAfterLastSync,
+			compared.mHasStoreAttributes);
+	}
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -1658,6 +1798,14 @@ void BackupQueries::Compare(int64_t DirID, const std::string &rStoreDir,
 {
 	rParams.NotifyDirComparing(rLocalDir, rStoreDir);
 
+	// When comparing on several threads, the listing may have been
+	// requested already, and must be received even if it's not needed
+	std::auto_ptr<BackupStoreDirectory> apDir;
+	if(mpCompareQueue != 0)
+	{
+		apDir.reset(mpCompareQueue->GetDirectory(DirID).release());
+	}
+
 	// Get info on the local directory
 	EMU_STRUCT_STAT st;
 	if(EMU_LSTAT(rLocalDir.c_str(), &st) != 0)
@@ -1674,20 +1822,24 @@ void BackupQueries::Compare(int64_t DirID, const std::string &rStoreDir,
 		return;
 	}
 
-	// Get the directory listing from the store
-	mrConnection.QueryListDirectory(
-		DirID,
-		BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
-		// get everything
-		BackupProtocolListDirectory::Flags_OldVersion |
-		BackupProtocolListDirectory::Flags_Deleted,
-		// except for old versions and deleted files
-		true /* want attributes */);
+	if(!apDir.get())
+	{
+		// Get the directory listing from the store
+		mrConnection.QueryListDirectory(
+			DirID,
+			BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+			// get everything
+			BackupProtocolListDirectory::Flags_OldVersion |
+			BackupProtocolListDirectory::Flags_Deleted,
+			// except for old versions and deleted files
+			true /* want attributes */);
 
-	// Retrieve the directory from the stream following
-	BackupStoreDirectory dir;
-	std::auto_ptr<IOStream> dirstream(mrConnection.ReceiveStream());
-	dir.ReadFromStream(*dirstream, mrConnection.GetTimeout());
+		// Retrieve the directory from the stream following
+		apDir.reset(new BackupStoreDirectory);
+		std::auto_ptr<IOStream> dirstream(mrConnection.ReceiveStream());
+		apDir->ReadFromStream(*dirstream, mrConnection.GetTimeout());
+	}
+	BackupStoreDirectory &dir(*apDir);
 
 	// Test out the attributes
 	if(!dir.HasAttributes())
@@ -1872,6 +2024,19 @@ void BackupQueries::Compare(int64_t DirID, const std::string &rStoreDir,
 				rParams.NotifyLocalFileMissing(localPath,
 					storePath);
 			}
+			else if(mpCompareQueue != 0)
+			{
+				BackupStoreDirectory::Entry *pEntry = i->second;
+				mpCompareQueue->Add(DirID, pEntry->GetObjectID(),
+					localPath, storePath,
+					pEntry->HasAttributes() ?
+						&pEntry->GetAttributes() : 0,
+					pEntry->GetSizeInBlocks());
+				localFiles.erase(local);
+
+				// Report those compared already, in order
+				NotifyQueuedFilesCompared(rParams, false);
+			}
 			else
 			{				
 				CompareOneFile(DirID, i->second, localPath,
@@ -1881,6 +2046,20 @@ void BackupQueries::Compare(int64_t DirID, const std::string &rStoreDir,
 				localFiles.erase(local);
 			}
 		}
+
+		// Ask for the listings of the directories to recurse into now,
+		// so that they arrive while the files are being compared
+		for(std::set<std::pair<std::string, BackupStoreDirectory::Entry *> >::const_iterator i = storeDirs.begin();
+			mpCompareQueue != 0 && i != storeDirs.end(); ++i)
+		{
+			if(localDirs.find(i->first) != localDirs.end() &&
+				!rParams.IsExcludedDir(MakeFullPath(rLocalDir,
+					i->first)))
+			{
+				mpCompareQueue->AddDirectory(
+					i->second->GetObjectID());
+			}
+		}
 		
 		// Report any files which exist locally, but not on the store
 		for(string_set_iter_t i = localFiles.begin(); i != localFiles.end(); ++i)
@@ -2002,13 +2181,22 @@ void BackupQueries::Compare(int64_t DirID, const std::string &rStoreDir,
 //		Created: 23/11/03
 //
 // --------------------------------------------------------------------------
-void BackupQueries::CommandRestore(const std::vector<std::string> &args, const bool *opts)
+void BackupQueries::CommandRestore(const std::vector<std::string> &rArgs, const bool *opts)
 {
+	// Number of files to restore at once, given before the names
+	int threads = 1;
+	std::vector<std::string> args(rArgs);
+	if(opts['j'] && !args.empty())
+	{
+		threads = ::atoi(args[0].c_str());
+		args.erase(args.begin());
+	}
+
 	// Check arguments
-	if(args.size() < 1 || args.size() > 2)
+	if(args.size() < 1 || args.size() > 2 || threads < 1)
 	{
-		BOX_ERROR("Incorrect usage. restore [-drif] <remote-name> "
-			"[<local-name>]");
+		BOX_ERROR("Incorrect usage. restore [-drif] [-j <threads>] "
+			"<remote-name> [<local-name>]");
 		return;
 	}
 
@@ -2082,6 +2270,10 @@ void BackupQueries::CommandRestore(const std::vector<std::string> &args, const b
 	// Go and restore...
 	int result;
 
+	// Blocks of big files, which are decoded as they arrive, are
+	// decoded on the same number of threads
+	BackupStoreFile::SetDecodingThreads(threads);
+
 	try
 	{
 		// At TRACE level, we print a line for each file and
@@ -2092,21 +2284,26 @@ void BackupQueries::CommandRestore(const std::vector<std::string> &args, const b
 			true /* print progress dots */, restoreDeleted, 
 			false /* don't undelete after restore! */, 
 			opts['r'] /* resume? */,
-			opts['f'] /* force continue after errors */);
+			opts['f'] /* force continue after errors */,
+			threads);
 	}
 	catch(std::exception &e)
 	{
+		BackupStoreFile::SetDecodingThreads(1);
 		BOX_ERROR("Failed to restore: " << e.what());
 		SetReturnCode(ReturnCode::Command_Error);
 		return;
 	}
 	catch(...)
 	{
+		BackupStoreFile::SetDecodingThreads(1);
 		BOX_ERROR("Failed to restore: unknown exception");
 		SetReturnCode(ReturnCode::Command_Error);
 		return;
 	}
 
+	BackupStoreFile::SetDecodingThreads(1);
+
 	switch(result)
 	{
 	case Restore_Complete:
@@ -18,6 +18,7 @@
 #include "BoxBackupCompareParams.h"
 #include "BackupStoreDirectory.h"
 
+class BackupClientCompareQueue;
 class BackupProtocolCallable;
 class Configuration;
 class ExcludeList;
@@ -119,6 +120,8 @@ public:
 		int mUncheckedFiles;
 		int mExcludedDirs;
 		int mExcludedFiles;
+		int64_t mFilesCompared;
+		int64_t mBytesCompared;
 
 		std::string ConvertForConsole(const std::string& rUtf8String)
 		{
@@ -313,6 +316,8 @@ public:
 			bool ModifiedAfterLastSync, bool NewAttributesApplied)
 		{
 			int NewDifferences = 0;
+			mFilesCompared ++;
+			mBytesCompared += NumBytes;
 			
 			if(HasDifferentAttributes)
 			{
@@ -354,6 +359,8 @@ public:
 			mDifferences += NewDifferences;
 		}
 	};
+	bool CompareSelected(const std::vector<std::string> &args,
+		const bool *opts, CompareParams &params);
 	void CompareLocation(const std::string &rLocation,
 		BoxBackupCompareParams &rParams);
 	void Compare(const std::string &rStoreDir,
@@ -363,6 +370,8 @@ public:
 	void CompareOneFile(int64_t DirID, BackupStoreDirectory::Entry *pEntry,
 		const std::string& rLocalPath, const std::string& rStorePath,
 		BoxBackupCompareParams &rParams);
+	void NotifyQueuedFilesCompared(BoxBackupCompareParams &rParams,
+		bool Wait);
 
 public:
 
@@ -403,6 +412,8 @@ private:
 	bool mRunningAsRoot;
 	bool mWarnedAboutOwnerAttributes;
 	int mReturnCode;
+	// Only set while comparing on several threads
+	BackupClientCompareQueue *mpCompareQueue;
 };
 
 typedef std::vector<std::string> (*CompletionHandler)
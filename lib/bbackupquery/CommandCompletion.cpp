@@ -437,9 +437,9 @@ QueryCommandSpecification commands[] =
 		{CompleteRemoteId, CompleteLocalDir} },
 	{ "get",	"i",		Command_Get,
 		{CompleteGetFileOrId, CompleteLocalDir} },
-	{ "compare",	"alcqAEQ",	Command_Compare,
+	{ "compare",	"alcqAEQj",	Command_Compare,
 		{CompleteCompareLocationOrRemoteDir, CompleteCompareNoneOrLocalDir} },
-	{ "restore",	"drif",		Command_Restore,
+	{ "restore",	"drifj",	Command_Restore,
 		{CompleteRestoreRemoteDirOrId, CompleteLocalDir} },
 	{ "help",	"",		Command_Help,	{} },
 	{ "usage",	"m",		Command_Usage,	{} },
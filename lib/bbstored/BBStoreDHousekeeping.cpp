@@ -132,6 +132,8 @@ void BackupStoreDaemon::RunHousekeepingIfNeeded()
 			// Do housekeeping on this account
 			HousekeepStoreAccount housekeeping(*i, rootDir,
 				discSet, this);
+			housekeeping.SetCompactDirectories(
+				mCompactDirectories);
 			housekeeping.DoHousekeeping();
 		}
 		catch(BoxException &e)
@@ -20,6 +20,7 @@
 #include "BackupStoreContext.h"
 #include "BackupStoreDaemon.h"
 #include "BackupStoreConfigVerify.h"
+#include "BackupStoreFile.h"
 #include "autogen_BackupProtocol.h"
 #include "RaidFileController.h"
 #include "BackupStoreAccountDatabase.h"
@@ -40,6 +41,9 @@ BackupStoreDaemon::BackupStoreDaemon()
 	: mpAccountDatabase(0),
 	  mpAccounts(0),
 	  mExtendedLogging(false),
+	  mDirectoryCacheSize(-1),
+	  mCompactDirectories(false),
+	  mDirectoryJournalSize(0),
 	  mHaveForkedHousekeeping(false),
 	  mIsHousekeepingProcess(false),
 	  mHousekeepingInited(false),
@@ -171,6 +175,36 @@ void BackupStoreDaemon::Run()
 	mExtendedLogging = false;
 	const Configuration &config(GetConfiguration());
 	mExtendedLogging = config.GetKeyValueBool("ExtendedLogging");
+
+	// Keep old versions of files rebuilt from patches, so that they
+	// can be sent again without combining the patches again
+	mapCombinedFileCache.reset();
+	if(config.KeyExists("CombinedFileCacheDirectory"))
+	{
+		mapCombinedFileCache.reset(new BackupStoreCombinedFileCache(
+			config.GetKeyValue("CombinedFileCacheDirectory"),
+			((int64_t)config.GetKeyValueInt("CombinedFileCacheSize"))
+				* 1024 * 1024));
+	}
+
+	// Memory for the cache of directories of each connection, if it
+	// isn't the default
+	mDirectoryCacheSize = -1;
+	if(config.KeyExists("DirectoryCacheSize"))
+	{
+		mDirectoryCacheSize =
+			((int64_t)config.GetKeyValueInt("DirectoryCacheSize"))
+			* 1024 * 1024;
+	}
+
+	// Write directories in the compact format, once every server
+	// which uses the store can read it
+	mCompactDirectories = config.GetKeyValueBool("CompactDirectories");
+
+	// Journal changes to directories, once every server which uses the
+	// store reads the journals
+	mDirectoryJournalSize =
+		((int64_t)config.GetKeyValueInt("DirectoryJournalSize")) * 1024;
 	
 	// Fork off housekeeping daemon -- must only do this the first
 	// time Run() is called.  Housekeeping runs synchronously on Win32
@@ -335,6 +369,19 @@ void BackupStoreDaemon::Connection2(std::auto_ptr<SocketStreamTLS> apStream)
 	{
 		context.SetTestHook(*mpTestHook);
 	}
+
+	if(mapCombinedFileCache.get())
+	{
+		context.SetCombinedFileCache(*mapCombinedFileCache);
+	}
+
+	if(mDirectoryCacheSize >= 0)
+	{
+		context.SetDirectoryCacheSize(mDirectoryCacheSize);
+	}
+
+	context.SetCompactDirectories(mCompactDirectories);
+	context.SetDirectoryJournalMaxSize(mDirectoryJournalSize);
 	
 	// See if the client has an account?
 	if(mpAccounts && mpAccounts->AccountExists(id))
@@ -356,22 +403,27 @@ void BackupStoreDaemon::Connection2(std::auto_ptr<SocketStreamTLS> apStream)
 	}
 	catch(...)
 	{
-		LogConnectionStats(id, context.GetAccountName(), server);
+		LogConnectionStats(id, context, server);
 		throw;
 	}
-	LogConnectionStats(id, context.GetAccountName(), server);
+	LogConnectionStats(id, context, server);
 	context.CleanUp();
 }
 
 void BackupStoreDaemon::LogConnectionStats(uint32_t accountId,
-	const std::string& accountName, const BackupProtocolServer &server)
+	BackupStoreContext &rContext, const BackupProtocolServer &server)
 {
 	// Log the amount of data transferred
 	BOX_NOTICE("Connection statistics for " << 
 		BOX_FORMAT_ACCOUNT(accountId) << " "
-		"(name=" << accountName << "):"
+		"(name=" << rContext.GetAccountName() << "):"
 		" IN="  << server.GetBytesRead() <<
 		" OUT=" << server.GetBytesWritten() <<
 		" NET_IN=" << (server.GetBytesRead() - server.GetBytesWritten()) <<
 		" TOTAL=" << (server.GetBytesRead() + server.GetBytesWritten()));
+
+	rContext.LogDirectoryCacheStats();
+
+	// Buffers are kept for the next connection handled by this process
+	BackupStoreFile::LogCodingPoolStats();
 }
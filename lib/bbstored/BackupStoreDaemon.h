@@ -13,6 +13,7 @@
 #include "ServerTLS.h"
 #include "BoxPortsAndFiles.h"
 #include "BackupConstants.h"
+#include "BackupStoreCombinedFileCache.h"
 #include "BackupStoreContext.h"
 #include "HousekeepStoreAccount.h"
 #include "IOStreamGetLine.h"
@@ -64,7 +65,7 @@ protected:
 	void HousekeepingProcess();
 
 	void LogConnectionStats(uint32_t accountId,
-		const std::string& accountName, const BackupProtocolServer &server);
+		BackupStoreContext &rContext, const BackupProtocolServer &server);
 
 public:
 	// HousekeepingInterface implementation
@@ -75,6 +76,10 @@ private:
 	BackupStoreAccountDatabase *mpAccountDatabase;
 	BackupStoreAccounts *mpAccounts;
 	bool mExtendedLogging;
+	std::auto_ptr<BackupStoreCombinedFileCache> mapCombinedFileCache;
+	int64_t mDirectoryCacheSize;
+	bool mCompactDirectories;
+	int64_t mDirectoryJournalSize;
 	bool mHaveForkedHousekeeping;
 	bool mIsHousekeepingProcess;
 	bool mHousekeepingInited;
@@ -28,6 +28,10 @@
 #	include <unistd.h>
 #endif
 
+#ifndef WIN32
+#	include <pthread.h>
+#endif
+
 #include <cstdlib> // for std::atexit
 #include <map>
 #include <set>
@@ -126,14 +130,66 @@ MemLeakSuppressionGuard::~MemLeakSuppressionGuard()
 	memleakfinder_global_enable = true;
 }
 
+// The tracking data is shared by all threads, so access to it must be
+// serialised. The lock must be recursive, because these functions call
+// each other and allocate memory themselves. It is created on first use,
+// because memory is allocated by static constructors before main().
+#ifdef WIN32
+static CRITICAL_SECTION sTrackingLock;
+static volatile LONG sTrackingLockState = 0;
+
+static void memleakfinder_lock()
+{
+	if(InterlockedCompareExchange(&sTrackingLockState, 1, 0) == 0)
+	{
+		InitializeCriticalSection(&sTrackingLock);
+		sTrackingLockState = 2;
+	}
+	while(sTrackingLockState != 2)
+	{
+		Sleep(0);
+	}
+	EnterCriticalSection(&sTrackingLock);
+}
+
+static void memleakfinder_unlock()
+{
+	LeaveCriticalSection(&sTrackingLock);
+}
+#else
+static pthread_once_t sTrackingLockOnce = PTHREAD_ONCE_INIT;
+static pthread_mutex_t sTrackingLock;
+
+static void memleakfinder_init_lock()
+{
+	pthread_mutexattr_t attr;
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&sTrackingLock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+static void memleakfinder_lock()
+{
+	pthread_once(&sTrackingLockOnce, memleakfinder_init_lock);
+	pthread_mutex_lock(&sTrackingLock);
+}
+
+static void memleakfinder_unlock()
+{
+	pthread_mutex_unlock(&sTrackingLock);
+}
+#endif
+
 // these functions may well allocate memory, which we don't want to track.
+// Only meaningful while the tracking lock is held.
 static int sInternalAllocDepth = 0;
 
 class InternalAllocGuard
 {
 	public:
-	InternalAllocGuard () { sInternalAllocDepth++; }
-	~InternalAllocGuard() { sInternalAllocDepth--; }
+	InternalAllocGuard () { memleakfinder_lock(); sInternalAllocDepth++; }
+	~InternalAllocGuard() { sInternalAllocDepth--; memleakfinder_unlock(); }
 };
 
 void memleakfinder_malloc_add_block(void *b, size_t size, const char *file, int line)
@@ -665,16 +721,12 @@ void remove_object_block(void *block)
 
 static void *internal_new(size_t size, const char *file, int line)
 {
-	void *r;
+	InternalAllocGuard guard;
+	void *r = std::malloc(size);
 
+	// Don't track allocations made by the tracking functions themselves
+	if (sInternalAllocDepth == 1)
 	{
-		InternalAllocGuard guard;
-		r = std::malloc(size);
-	}
-	
-	if (sInternalAllocDepth == 0)
-	{
-		InternalAllocGuard guard;
 		add_object_block(r, size, file, line, false);
 		//TRACE4("new(), %d, %s, %d, %08x\n", size, file, line, r);
 	}
@@ -0,0 +1,262 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    FileHoles.cpp
+//		Purpose: Find the holes in sparse files
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <errno.h>
+#include <fcntl.h>
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#include "FileHoles.h"
+#include "Logging.h"
+
+#include "MemLeakFindOn.h"
+
+#if defined SEEK_HOLE && defined SEEK_DATA && !defined WIN32
+	#define FILEHOLES_USE_SEEK_HOLE
+#endif
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileHoles::FileHoles()
+//		Purpose: Constructor. There are no holes until Find() is called.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+FileHoles::FileHoles()
+{
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileHoles::IsSupported()
+//		Purpose: Whether holes can be found on this platform at all.
+//			 The file system must support it too.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool FileHoles::IsSupported()
+{
+#ifdef FILEHOLES_USE_SEEK_HOLE
+	return true;
+#else
+	return false;
+#endif
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileHoles::Find(const std::string &)
+//		Purpose: Finds the holes in the file, replacing any found
+//			 before. Returns false, with no holes, if they can't be
+//			 found. A hole at the end of the file is included, but
+//			 there's no hole after it.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool FileHoles::Find(const std::string &rFilename)
+{
+	Clear();
+
+#ifdef FILEHOLES_USE_SEEK_HOLE
+	int fd = ::open(rFilename.c_str(), O_RDONLY);
+	if(fd == -1)
+	{
+		return false;
+	}
+
+	bool found = true;
+	off_t size = ::lseek(fd, 0, SEEK_END);
+	off_t position = 0;
+	while(size != -1 && position < size)
+	{
+		off_t holeStart = ::lseek(fd, position, SEEK_HOLE);
+		if(holeStart == -1)
+		{
+			// Most likely EINVAL, not supported by the file system
+			found = false;
+			break;
+		}
+		if(holeStart >= size)
+		{
+			// Only the implicit hole at the end of the file
+			break;
+		}
+
+		off_t holeEnd = ::lseek(fd, holeStart, SEEK_DATA);
+		if(holeEnd == -1)
+		{
+			if(errno != ENXIO)
+			{
+				found = false;
+				break;
+			}
+			// No more data, the hole runs to the end of the file
+			holeEnd = size;
+		}
+		if(holeEnd <= holeStart)
+		{
+			// The file changed under us
+			found = false;
+			break;
+		}
+
+		Hole hole;
+		hole.mStart = holeStart;
+		hole.mEnd = holeEnd;
+		mHoles.push_back(hole);
+		position = holeEnd;
+	}
+
+	::close(fd);
+
+	if(!found)
+	{
+		BOX_TRACE("Failed to find holes in " << rFilename);
+		Clear();
+	}
+	return found;
+#else
+	return false;
+#endif
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileHoles::Add(int64_t, int64_t)
+//		Purpose: Adds a hole after all the others, for holes which are
+//			 known some other way than finding them in a file.
+//			 Joins it to the last one if they meet.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void FileHoles::Add(int64_t Offset, int64_t Length)
+{
+	if(Length <= 0)
+	{
+		return;
+	}
+	ASSERT(mHoles.empty() || mHoles.back().mEnd <= Offset);
+
+	if(!mHoles.empty() && mHoles.back().mEnd == Offset)
+	{
+		mHoles.back().mEnd += Length;
+		return;
+	}
+
+	Hole hole;
+	hole.mStart = Offset;
+	hole.mEnd = Offset + Length;
+	mHoles.push_back(hole);
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileHoles::Clear()
+//		Purpose: Forgets all the holes
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void FileHoles::Clear()
+{
+	mHoles.clear();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileHoles::GetTotalSize()
+//		Purpose: Returns the number of bytes in all the holes
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t FileHoles::GetTotalSize() const
+{
+	int64_t total = 0;
+	for(size_t h = 0; h < mHoles.size(); ++h)
+	{
+		total += mHoles[h].mEnd - mHoles[h].mStart;
+	}
+	return total;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileHoles::GetExtentAt(int64_t, bool &)
+//		Purpose: Finds whether the byte at Offset is in a hole or in
+//			 data, and returns the offset where that hole or run of
+//			 data ends, or -1 if it's data which continues to the
+//			 end of the file.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int64_t FileHoles::GetExtentAt(int64_t Offset, bool &rIsHoleOut) const
+{
+	// Binary search for the first hole which ends after Offset
+	size_t low = 0, high = mHoles.size();
+	while(low < high)
+	{
+		size_t middle = (low + high) / 2;
+		if(mHoles[middle].mEnd <= Offset)
+		{
+			low = middle + 1;
+		}
+		else
+		{
+			high = middle;
+		}
+	}
+
+	if(low == mHoles.size())
+	{
+		rIsHoleOut = false;
+		return -1;
+	}
+
+	rIsHoleOut = (mHoles[low].mStart <= Offset);
+	return rIsHoleOut ? mHoles[low].mEnd : mHoles[low].mStart;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileHoles::Contains(int64_t, int64_t)
+//		Purpose: Whether the whole of a range of the file is in one
+//			 hole, so that it's all zeros without reading it.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool FileHoles::Contains(int64_t Offset, int64_t Length) const
+{
+	if(mHoles.empty() || Length <= 0)
+	{
+		return false;
+	}
+
+	bool isHole = false;
+	int64_t end = GetExtentAt(Offset, isHole);
+	return isHole && end >= Offset + Length;
+}
@@ -0,0 +1,62 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    FileHoles.h
+//		Purpose: Find the holes in sparse files
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef FILEHOLES__H
+#define FILEHOLES__H
+
+#include <string>
+#include <vector>
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    FileHoles
+//		Purpose: The holes in a sparse file, which read as zeros but
+//			 have no data stored on disc, as found with
+//			 lseek(SEEK_HOLE / SEEK_DATA) when the file is examined.
+//
+//			 Finding holes is an optimisation, and Find() simply
+//			 returns false if it isn't possible (not supported on
+//			 this platform or file system), in which case the file
+//			 is treated as having no holes. If the file is written
+//			 to afterwards, the holes found may no longer be holes,
+//			 just as any data read from it may no longer be current.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class FileHoles
+{
+public:
+	FileHoles();
+
+	bool Find(const std::string &rFilename);
+	void Add(int64_t Offset, int64_t Length);
+	void Clear();
+
+	bool IsEmpty() const { return mHoles.empty(); }
+	int64_t GetNumberOfHoles() const { return mHoles.size(); }
+	int64_t GetTotalSize() const;
+
+	int64_t GetExtentAt(int64_t Offset, bool &rIsHoleOut) const;
+	bool Contains(int64_t Offset, int64_t Length) const;
+
+	static bool IsSupported();
+
+private:
+	typedef struct
+	{
+		int64_t mStart;
+		int64_t mEnd;
+	} Hole;
+
+	// In order of position in the file, and never adjacent
+	std::vector<Hole> mHoles;
+};
+
+#endif // FILEHOLES__H
@@ -463,3 +463,23 @@ bool FileStream::CompareWith(IOStream& rOther, int Timeout)
 
 	return true;
 }
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    FileStream::AdviseSequential()
+//		Purpose: Tell the OS that the file will be read from start to
+//			 end, so that it reads further ahead. Only a hint, so
+//			 it does nothing where that isn't supported.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void FileStream::AdviseSequential()
+{
+#if defined HAVE_POSIX_FADVISE && !defined WIN32
+	if(mOSFileHandle != INVALID_FILE)
+	{
+		::posix_fadvise(mOSFileHandle, 0, 0, POSIX_FADV_SEQUENTIAL);
+	}
+#endif
+}
@@ -50,11 +50,13 @@ public:
 	virtual bool StreamClosed();
 
 	bool CompareWith(IOStream& rOther, int Timeout = IOStream::TimeOutInfinite);
+	void AdviseSequential();
 	std::string ToString() const
 	{
 		return std::string("local file ") + mFileName;
 	}
 	const std::string GetFileName() const { return mFileName; }
+	tOSFileHandle GetFileHandle() const { return mOSFileHandle; }
 
 private:
 	tOSFileHandle mOSFileHandle;
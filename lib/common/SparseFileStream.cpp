@@ -0,0 +1,244 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    SparseFileStream.cpp
+//		Purpose: File stream which skips over the holes in sparse files
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <string.h>
+
+#include "SparseFileStream.h"
+
+#include "MemLeakFindOn.h"
+
+namespace
+{
+	bool IsAllZeros(const uint8_t *pData, int Length)
+	{
+		// Compare the data with itself one byte on, which is faster
+		// than looking at each byte
+		return Length > 0 && pData[0] == 0 &&
+			::memcmp(pData, pData + 1, Length - 1) == 0;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    SparseFileStream::SparseFileStream(const std::string &, int, int)
+//		Purpose: Constructor, opens file, and finds its holes if it's
+//			 only going to be read.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+SparseFileStream::SparseFileStream(const std::string& rFilename, int flags,
+	int mode)
+: FileStream(rFilename, flags, mode),
+  mSkippedTo(0)
+{
+	if((flags & (O_WRONLY | O_RDWR)) == 0)
+	{
+		mHoles.Find(rFilename);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    SparseFileStream::~SparseFileStream()
+//		Purpose: Destructor, extends the file over any hole at its end
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+SparseFileStream::~SparseFileStream()
+{
+	if(mSkippedTo != 0)
+	{
+		try
+		{
+			ExtendOverHole();
+		}
+		catch(...)
+		{
+			// Can't throw from a destructor, call Close() to find out
+		}
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    SparseFileStream::Read(void *, int, int)
+//		Purpose: Reads bytes from the file, or fills the buffer with
+//			 zeros if they're in a hole. Never returns bytes from
+//			 both a hole and data at once.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int SparseFileStream::Read(void *pBuffer, int NBytes, int Timeout)
+{
+	if(mHoles.IsEmpty())
+	{
+		return FileStream::Read(pBuffer, NBytes, Timeout);
+	}
+
+	IOStream::pos_type position = GetPosition();
+	bool isHole = false;
+	int64_t end = mHoles.GetExtentAt(position, isHole);
+	if(end != -1 && end - position < NBytes)
+	{
+		NBytes = end - position;
+	}
+
+	if(!isHole)
+	{
+		return FileStream::Read(pBuffer, NBytes, Timeout);
+	}
+
+	// Don't go past the end if the file has been truncated since its
+	// holes were found, and let FileStream notice the end of the file.
+	IOStream::pos_type left = BytesLeftToRead();
+	if(left <= 0)
+	{
+		return FileStream::Read(pBuffer, NBytes, Timeout);
+	}
+	if(left < NBytes)
+	{
+		NBytes = left;
+	}
+
+	::memset(pBuffer, 0, NBytes);
+	Seek(NBytes, IOStream::SeekType_Relative);
+	return NBytes;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    SparseFileStream::Write(const void *, int, int)
+//		Purpose: Writes bytes to the file, seeking over any
+//			 SPARSEFILESTREAM_MIN_HOLE byte blocks of zeros in the
+//			 holes given to SetHoles(), so that the file system can
+//			 leave holes there.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void SparseFileStream::Write(const void *pBuffer, int NBytes, int Timeout)
+{
+	if(mHoles.IsEmpty())
+	{
+		FileStream::Write(pBuffer, NBytes, Timeout);
+		return;
+	}
+
+	const uint8_t *buffer = (const uint8_t *)pBuffer;
+	const uint8_t *data = buffer;
+	int dataLength = 0;
+	int zerosLength = 0;
+
+	// Look at the data in pieces aligned to the file's blocks, so that
+	// whole blocks of zeros can be left as holes, however the data is
+	// split into writes
+	IOStream::pos_type position = GetPosition();
+	int offset = 0;
+	while(offset < NBytes)
+	{
+		int piece = SPARSEFILESTREAM_MIN_HOLE -
+			(int)((position + offset) % SPARSEFILESTREAM_MIN_HOLE);
+		if(piece > NBytes - offset)
+		{
+			piece = NBytes - offset;
+		}
+
+		if(mHoles.Contains(position + offset, piece) &&
+			IsAllZeros(buffer + offset, piece))
+		{
+			if(dataLength != 0)
+			{
+				FileStream::Write(data, dataLength, Timeout);
+				dataLength = 0;
+			}
+			zerosLength += piece;
+		}
+		else
+		{
+			if(zerosLength != 0)
+			{
+				Seek(zerosLength, IOStream::SeekType_Relative);
+				zerosLength = 0;
+			}
+			if(dataLength == 0)
+			{
+				data = buffer + offset;
+			}
+			dataLength += piece;
+		}
+
+		offset += piece;
+	}
+
+	if(dataLength != 0)
+	{
+		FileStream::Write(data, dataLength, Timeout);
+	}
+	if(zerosLength != 0)
+	{
+		Seek(zerosLength, IOStream::SeekType_Relative);
+		if(position + NBytes > mSkippedTo)
+		{
+			mSkippedTo = position + NBytes;
+		}
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    SparseFileStream::Close()
+//		Purpose: Extends the file over any hole at its end, and closes
+//			 it.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void SparseFileStream::Close()
+{
+	if(mSkippedTo != 0)
+	{
+		ExtendOverHole();
+	}
+	FileStream::Close();
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    SparseFileStream::ExtendOverHole()
+//		Purpose: Private. If zeros were seeked over at the end of the
+//			 file, writes the last of them, so that the file is the
+//			 size it would have been if they'd all been written.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void SparseFileStream::ExtendOverHole()
+{
+	IOStream::pos_type skippedTo = mSkippedTo;
+	mSkippedTo = 0;
+
+	IOStream::pos_type size = GetPosition() + BytesLeftToRead();
+	if(skippedTo > size)
+	{
+		Seek(skippedTo - 1, IOStream::SeekType_Absolute);
+		uint8_t zero = 0;
+		FileStream::Write(&zero, 1);
+	}
+}
@@ -0,0 +1,70 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    SparseFileStream.h
+//		Purpose: File stream which skips over the holes in sparse files
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef SPARSEFILESTREAM__H
+#define SPARSEFILESTREAM__H
+
+#include "FileHoles.h"
+#include "FileStream.h"
+
+// Blocks of zeros of this size, at multiples of it in the file, are left
+// as holes when they are written, if they're in the holes given
+#define SPARSEFILESTREAM_MIN_HOLE	4096
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    SparseFileStream
+//		Purpose: A FileStream which doesn't read the holes in sparse
+//			 files, but fills the buffer with zeros instead, and
+//			 which leaves runs of zeros written to it as holes, by
+//			 seeking over them instead of writing them, where it's
+//			 told the file should have holes.
+//
+//			 The holes to skip when reading are found when the file
+//			 is opened read-only. The holes to leave when writing
+//			 are given with SetHoles(), and zeros written anywhere
+//			 else are written as they are, so that they stay
+//			 allocated. The file is extended over a hole at its end
+//			 when it's closed, so Close() it explicitly to find out
+//			 whether that fails.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class SparseFileStream : public FileStream
+{
+public:
+	SparseFileStream(const std::string& rFilename,
+		int flags = (O_RDONLY | O_BINARY),
+		int mode = (S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH | S_IWOTH));
+	virtual ~SparseFileStream();
+private:
+	// No copying allowed
+	SparseFileStream(const SparseFileStream &);
+	SparseFileStream &operator=(const SparseFileStream &);
+
+public:
+	virtual int Read(void *pBuffer, int NBytes, int Timeout = IOStream::TimeOutInfinite);
+	virtual void Write(const void *pBuffer, int NBytes,
+		int Timeout = IOStream::TimeOutInfinite);
+	virtual void Close();
+
+	const FileHoles &GetHoles() const { return mHoles; }
+	void SetHoles(const FileHoles &rHoles) { mHoles = rHoles; }
+
+private:
+	void ExtendOverHole();
+
+	FileHoles mHoles;
+	// The end of the furthest run of zeros which was seeked over
+	// instead of being written
+	IOStream::pos_type mSkippedTo;
+};
+
+#endif // SPARSEFILESTREAM__H
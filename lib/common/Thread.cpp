@@ -0,0 +1,392 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    Thread.cpp
+//		Purpose: Minimal portable threads and mutexes, for spreading
+//			 CPU-bound work over several processors
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#ifdef WIN32
+	#include <process.h>
+#else
+	#include <signal.h>
+#endif
+
+#ifdef HAVE_UNISTD_H
+	#include <unistd.h>
+#endif
+
+#include "CommonException.h"
+#include "Thread.h"
+
+#include "MemLeakFindOn.h"
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Mutex()
+//		Purpose: Constructor
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+Mutex::Mutex()
+{
+#ifdef WIN32
+	InitializeCriticalSection(&mCriticalSection);
+#else
+	int result = pthread_mutex_init(&mMutex, NULL);
+	if(result != 0)
+	{
+		THROW_SYS_ERROR_NUMBER("Failed to initialise mutex", result,
+			CommonException, ThreadFailed);
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::~Mutex()
+//		Purpose: Destructor
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+Mutex::~Mutex()
+{
+#ifdef WIN32
+	DeleteCriticalSection(&mCriticalSection);
+#else
+	pthread_mutex_destroy(&mMutex);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Lock()
+//		Purpose: Wait until the mutex is available, and take it
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void Mutex::Lock()
+{
+#ifdef WIN32
+	EnterCriticalSection(&mCriticalSection);
+#else
+	int result = pthread_mutex_lock(&mMutex);
+	if(result != 0)
+	{
+		THROW_SYS_ERROR_NUMBER("Failed to lock mutex", result,
+			CommonException, ThreadFailed);
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Mutex::Unlock()
+//		Purpose: Release the mutex
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void Mutex::Unlock()
+{
+#ifdef WIN32
+	LeaveCriticalSection(&mCriticalSection);
+#else
+	pthread_mutex_unlock(&mMutex);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::ConditionVariable()
+//		Purpose: Constructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ConditionVariable::ConditionVariable()
+{
+#ifdef WIN32
+	InitializeConditionVariable(&mCondition);
+#else
+	int result = pthread_cond_init(&mCondition, NULL);
+	if(result != 0)
+	{
+		THROW_SYS_ERROR_NUMBER("Failed to initialise condition variable",
+			result, CommonException, ThreadFailed);
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::~ConditionVariable()
+//		Purpose: Destructor
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+ConditionVariable::~ConditionVariable()
+{
+#ifndef WIN32
+	pthread_cond_destroy(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::Wait(Mutex &)
+//		Purpose: Release the mutex, which must be held, wait until
+//			 woken, and take the mutex again
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ConditionVariable::Wait(Mutex &rMutex)
+{
+#ifdef WIN32
+	SleepConditionVariableCS(&mCondition, &rMutex.mCriticalSection,
+		INFINITE);
+#else
+	int result = pthread_cond_wait(&mCondition, &rMutex.mMutex);
+	if(result != 0)
+	{
+		THROW_SYS_ERROR_NUMBER("Failed to wait for condition variable",
+			result, CommonException, ThreadFailed);
+	}
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::Signal()
+//		Purpose: Wake one of the threads waiting, if any
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ConditionVariable::Signal()
+{
+#ifdef WIN32
+	WakeConditionVariable(&mCondition);
+#else
+	pthread_cond_signal(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    ConditionVariable::Broadcast()
+//		Purpose: Wake all the threads waiting
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void ConditionVariable::Broadcast()
+{
+#ifdef WIN32
+	WakeAllConditionVariable(&mCondition);
+#else
+	pthread_cond_broadcast(&mCondition);
+#endif
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Thread()
+//		Purpose: Constructor. The thread isn't started until Start()
+//			 is called.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+Thread::Thread()
+:
+#ifdef WIN32
+  mThreadHandle(INVALID_HANDLE_VALUE),
+#endif
+  mStarted(false),
+  mFailed(false)
+{
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::~Thread()
+//		Purpose: Destructor. The thread must already have been joined,
+//			 because the derived class which it is running in has
+//			 already been destroyed by now.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+Thread::~Thread()
+{
+	if(mStarted)
+	{
+		BOX_ERROR("Thread destroyed without being joined");
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Start()
+//		Purpose: Start running Run() in a new thread
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void Thread::Start()
+{
+	ASSERT(!mStarted);
+	mFailed = false;
+	mFailureMessage.clear();
+
+#ifdef WIN32
+	mThreadHandle = (HANDLE)_beginthreadex(NULL, 0, ThreadFunction, this,
+		0, NULL);
+	if(mThreadHandle == 0)
+	{
+		mThreadHandle = INVALID_HANDLE_VALUE;
+		THROW_SYS_ERROR("Failed to start thread", CommonException,
+			ThreadFailed);
+	}
+#else
+	// Block all signals while creating the thread, so that it inherits
+	// a mask with them all blocked, and restore ours afterwards. Signals
+	// caused by the thread itself, such as SIGBUS when a mapped file is
+	// truncated, can't be redirected, so leave them unblocked.
+	sigset_t all, old;
+	sigfillset(&all);
+	sigdelset(&all, SIGBUS);
+	sigdelset(&all, SIGFPE);
+	sigdelset(&all, SIGILL);
+	sigdelset(&all, SIGSEGV);
+	pthread_sigmask(SIG_SETMASK, &all, &old);
+	int result = pthread_create(&mThread, NULL, ThreadFunction, this);
+	pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+	if(result != 0)
+	{
+		THROW_SYS_ERROR_NUMBER("Failed to start thread", result,
+			CommonException, ThreadFailed);
+	}
+#endif
+
+	mStarted = true;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::Join()
+//		Purpose: Wait for the thread to finish. If Run() threw an
+//			 exception, throws CommonException(ThreadFailed) with
+//			 its message.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void Thread::Join()
+{
+	if(!mStarted)
+	{
+		return;
+	}
+
+#ifdef WIN32
+	WaitForSingleObject(mThreadHandle, INFINITE);
+	CloseHandle(mThreadHandle);
+	mThreadHandle = INVALID_HANDLE_VALUE;
+#else
+	pthread_join(mThread, NULL);
+#endif
+
+	mStarted = false;
+
+	if(mFailed)
+	{
+		THROW_EXCEPTION_MESSAGE(CommonException, ThreadFailed,
+			mFailureMessage);
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::RunAndCatch()
+//		Purpose: Run the thread body, recording any exception which
+//			 escapes from it, as it can't propagate any further.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void Thread::RunAndCatch()
+{
+	try
+	{
+		Run();
+	}
+	catch(BoxException &e)
+	{
+		mFailed = true;
+		mFailureMessage = e.what();
+		if(!e.GetMessage().empty())
+		{
+			mFailureMessage += ": ";
+			mFailureMessage += e.GetMessage();
+		}
+	}
+	catch(std::exception &e)
+	{
+		mFailed = true;
+		mFailureMessage = e.what();
+	}
+	catch(...)
+	{
+		mFailed = true;
+		mFailureMessage = "unknown exception";
+	}
+}
+
+#ifdef WIN32
+unsigned int __stdcall Thread::ThreadFunction(void *pThread)
+{
+	((Thread *)pThread)->RunAndCatch();
+	return 0;
+}
+#else
+void *Thread::ThreadFunction(void *pThread)
+{
+	((Thread *)pThread)->RunAndCatch();
+	return NULL;
+}
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    Thread::GetNumberOfProcessors()
+//		Purpose: Static. Returns the number of processors available,
+//			 or 1 if it can't be determined.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+int Thread::GetNumberOfProcessors()
+{
+#ifdef WIN32
+	SYSTEM_INFO info;
+	GetSystemInfo(&info);
+	return (info.dwNumberOfProcessors > 0) ? info.dwNumberOfProcessors : 1;
+#elif defined _SC_NPROCESSORS_ONLN
+	long processors = sysconf(_SC_NPROCESSORS_ONLN);
+	return (processors > 0) ? (int)processors : 1;
+#else
+	return 1;
+#endif
+}
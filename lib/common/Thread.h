@@ -0,0 +1,162 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    Thread.h
+//		Purpose: Minimal portable threads and mutexes, for spreading
+//			 CPU-bound work over several processors
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+
+#ifndef THREAD__H
+#define THREAD__H
+
+#include <string>
+
+#ifndef WIN32
+	#include <pthread.h>
+#endif
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    Mutex
+//		Purpose: A simple (non-recursive) mutual exclusion lock
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+class Mutex
+{
+public:
+	Mutex();
+	~Mutex();
+private:
+	// No copying allowed
+	Mutex(const Mutex &);
+	Mutex &operator=(const Mutex &);
+
+public:
+	void Lock();
+	void Unlock();
+
+private:
+	friend class ConditionVariable;
+#ifdef WIN32
+	CRITICAL_SECTION mCriticalSection;
+#else
+	pthread_mutex_t mMutex;
+#endif
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    MutexLock
+//		Purpose: Holds a Mutex for as long as it is in scope
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+class MutexLock
+{
+public:
+	MutexLock(Mutex &rMutex)
+	: mrMutex(rMutex)
+	{
+		mrMutex.Lock();
+	}
+	~MutexLock()
+	{
+		mrMutex.Unlock();
+	}
+private:
+	// No copying allowed
+	MutexLock(const MutexLock &);
+	MutexLock &operator=(const MutexLock &);
+
+	Mutex &mrMutex;
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    ConditionVariable
+//		Purpose: Lets threads wait, holding a Mutex, until another
+//			 thread tells them that something has changed. Wakeups
+//			 can be spurious, so always wait in a loop which checks
+//			 the condition being waited for.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class ConditionVariable
+{
+public:
+	ConditionVariable();
+	~ConditionVariable();
+private:
+	// No copying allowed
+	ConditionVariable(const ConditionVariable &);
+	ConditionVariable &operator=(const ConditionVariable &);
+
+public:
+	void Wait(Mutex &rMutex);
+	void Signal();
+	void Broadcast();
+
+private:
+#ifdef WIN32
+	CONDITION_VARIABLE mCondition;
+#else
+	pthread_cond_t mCondition;
+#endif
+};
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    Thread
+//		Purpose: A thread of execution, which runs the Run() function of
+//			 a derived class. Asynchronous signals are blocked in the
+//			 new thread, so that they are still delivered to the main
+//			 thread (timers depend on this). Exceptions thrown by Run() are
+//			 caught, and rethrown as CommonException(ThreadFailed)
+//			 by Join(). Derived classes must call Join() before
+//			 they are destroyed.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+class Thread
+{
+public:
+	Thread();
+	virtual ~Thread();
+private:
+	// No copying allowed
+	Thread(const Thread &);
+	Thread &operator=(const Thread &);
+
+public:
+	void Start();
+	void Join();
+	bool IsStarted() const { return mStarted; }
+
+	static int GetNumberOfProcessors();
+
+protected:
+	virtual void Run() = 0;
+
+private:
+#ifdef WIN32
+	static unsigned int __stdcall ThreadFunction(void *pThread);
+	HANDLE mThreadHandle;
+#else
+	static void *ThreadFunction(void *pThread);
+	pthread_t mThread;
+#endif
+	void RunAndCatch();
+
+	bool mStarted;
+	bool mFailed;
+	std::string mFailureMessage;
+};
+
+#endif // THREAD__H
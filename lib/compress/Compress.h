@@ -27,7 +27,7 @@ template<bool Compressing>
 class Compress
 {
 public:
-	Compress()
+	Compress(int Level = Z_DEFAULT_COMPRESSION)
 		: mFinished(false),
 		  mFlush(Z_NO_FLUSH)
 	{	
@@ -37,7 +37,7 @@ public:
 		mStream.opaque = Z_NULL;
 		mStream.data_type = Z_BINARY;
 
-		if((Compressing)?(deflateInit(&mStream, Z_DEFAULT_COMPRESSION))
+		if((Compressing)?(deflateInit(&mStream, Level))
 			:(inflateInit(&mStream)) != Z_OK)
 		{
 			THROW_EXCEPTION(CompressException, InitFailed)
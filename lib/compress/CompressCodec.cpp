@@ -0,0 +1,348 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    CompressCodec.cpp
+//		Purpose: Choice of compression codecs for blocks of data
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <string.h>
+
+#ifdef HAVE_LIBZSTD
+	#include <zstd.h>
+	#ifndef ZSTD_CLEVEL_DEFAULT
+		#define ZSTD_CLEVEL_DEFAULT 3
+	#endif
+#endif
+
+#ifdef HAVE_LIBLZ4
+	#include <lz4.h>
+#endif
+
+#include "Compress.h"
+#include "CompressCodec.h"
+#include "CompressException.h"
+
+#include "MemLeakFindOn.h"
+
+namespace
+{
+	const char *sCodecNames[CompressCodec::NumCodecs] =
+	{
+		"zlib",
+		"zstd",
+		"lz4"
+	};
+
+	// LooksCompressible() looks at this many windows of this many bytes
+	const int sSampleWindows = 16;
+	const int sSampleWindowSize = 256;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::IsSupported(int)
+//		Purpose: Whether blocks can be compressed and decompressed with
+//			 the given codec in this build.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool CompressCodec::IsSupported(int Codec)
+{
+	switch(Codec)
+	{
+	case Zlib:
+		return true;
+#ifdef HAVE_LIBZSTD
+	case Zstd:
+		return true;
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+		return true;
+#endif
+	default:
+		return false;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::GetCodecFromName(const std::string &, int &)
+//		Purpose: Looks up a codec by name, as used in configuration
+//			 files. Returns false if there's no such codec, which
+//			 isn't the same as it not being supported.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool CompressCodec::GetCodecFromName(const std::string &rName, int &rCodecOut)
+{
+	for(int c = 0; c < NumCodecs; ++c)
+	{
+		if(rName == sCodecNames[c])
+		{
+			rCodecOut = c;
+			return true;
+		}
+	}
+	return false;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::GetName(int)
+//		Purpose: Returns the name of a codec
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+const char *CompressCodec::GetName(int Codec)
+{
+	if(Codec < 0 || Codec >= NumCodecs)
+	{
+		return "unknown";
+	}
+	return sCodecNames[Codec];
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::IsValidLevel(int, int)
+//		Purpose: Whether the level can be used with the codec
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool CompressCodec::IsValidLevel(int Codec, int Level)
+{
+	if(Level == 0)
+	{
+		return true;
+	}
+
+	switch(Codec)
+	{
+	case Zlib:
+		return Level >= Z_BEST_SPEED && Level <= Z_BEST_COMPRESSION;
+#ifdef HAVE_LIBZSTD
+	case Zstd:
+		return Level >= ZSTD_minCLevel() && Level <= ZSTD_maxCLevel();
+#endif
+	default:
+		return false;
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::MaxCompressedSize(int, int)
+//		Purpose: The largest that InLength bytes of data can become
+//			 when they're compressed with the codec.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int CompressCodec::MaxCompressedSize(int Codec, int InLength)
+{
+	switch(Codec)
+	{
+#ifdef HAVE_LIBZSTD
+	case Zstd:
+		return (int)ZSTD_compressBound(InLength);
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+		return LZ4_compressBound(InLength);
+#endif
+	default:
+		return Compress_MaxSizeForCompressedData(InLength);
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::LooksCompressible(const void *, int)
+//		Purpose: Quickly estimates whether a block of data is worth
+//			 compressing, from samples spread through it, so that
+//			 data which is already compressed (media files,
+//			 archives) isn't run through a compressor for nothing.
+//
+//			 The samples are judged on their byte frequencies,
+//			 using the order 2 (collision) entropy, which needs no
+//			 logarithms, and on how many 4 byte sequences repeat,
+//			 which catches data which has a high entropy but
+//			 repeats itself.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool CompressCodec::LooksCompressible(const void *pData, int Length)
+{
+	const uint8_t *data = (const uint8_t *)pData;
+
+	// Windows to sample, evenly spaced, or the whole block if it's
+	// smaller than the samples
+	int windows = sSampleWindows;
+	int windowSize = sSampleWindowSize;
+	if(Length <= sSampleWindows * sSampleWindowSize)
+	{
+		windows = 1;
+		windowSize = Length;
+	}
+	int stride = (windows > 1)
+		? (Length - windowSize) / (windows - 1) : 0;
+
+	uint32_t counts[256];
+	::memset(counts, 0, sizeof(counts));
+	uint32_t seen[1024];
+	::memset(seen, 0, sizeof(seen));
+	int sequences = 0;
+	int repeats = 0;
+
+	for(int w = 0; w < windows; ++w)
+	{
+		const uint8_t *window = data + (w * stride);
+		uint32_t sequence = 0;
+		for(int b = 0; b < windowSize; ++b)
+		{
+			counts[window[b]]++;
+			sequence = (sequence << 8) | window[b];
+			if(b >= 3)
+			{
+				uint32_t hash = (sequence * 2654435761U) >> 22;
+				if(seen[hash] == sequence)
+				{
+					++repeats;
+				}
+				seen[hash] = sequence;
+				++sequences;
+			}
+		}
+	}
+
+	if(sequences > 0 && repeats * 16 > sequences)
+	{
+		return true;
+	}
+
+	// Compressible if the collision entropy is less than 7.5 bits per
+	// byte, that is, the sum of the squares of the byte probabilities
+	// is more than 2^-7.5, or 1/181. Random data comes out at about 1/240.
+	uint64_t total = (uint64_t)windows * windowSize;
+	uint64_t sumOfSquares = 0;
+	for(int c = 0; c < 256; ++c)
+	{
+		sumOfSquares += (uint64_t)counts[c] * counts[c];
+	}
+	return sumOfSquares * 181 > total * total;
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::CompressBlock(int, int, const void *, int, void *, int)
+//		Purpose: Compresses a whole block of data with zstd or lz4 into
+//			 the output buffer, which must be at least
+//			 MaxCompressedSize(). Returns the compressed size.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int CompressCodec::CompressBlock(int Codec, int Level, const void *pIn,
+	int InLength, void *pOut, int OutLength)
+{
+	ASSERT(OutLength >= MaxCompressedSize(Codec, InLength));
+
+	switch(Codec)
+	{
+#ifdef HAVE_LIBZSTD
+	case Zstd:
+		{
+			size_t size = ZSTD_compress(pOut, OutLength, pIn, InLength,
+				(Level == 0) ? ZSTD_CLEVEL_DEFAULT : Level);
+			if(ZSTD_isError(size))
+			{
+				THROW_EXCEPTION_MESSAGE(CompressException,
+					TransformFailed, "zstd: " <<
+					ZSTD_getErrorName(size));
+			}
+			return (int)size;
+		}
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+		{
+			int size = LZ4_compress_default((const char *)pIn,
+				(char *)pOut, InLength, OutLength);
+			if(size <= 0)
+			{
+				THROW_EXCEPTION(CompressException, TransformFailed)
+			}
+			return size;
+		}
+#endif
+	default:
+		THROW_EXCEPTION_MESSAGE(CompressException, CodecNotSupported,
+			GetName(Codec));
+	}
+}
+
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CompressCodec::DecompressBlock(int, const void *, int, void *, int)
+//		Purpose: Decompresses a whole block of data compressed with
+//			 CompressBlock(). Returns the decompressed size, and
+//			 throws an exception if it doesn't fit in the output
+//			 buffer, or the data is corrupt.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int CompressCodec::DecompressBlock(int Codec, const void *pIn, int InLength,
+	void *pOut, int OutLength)
+{
+	switch(Codec)
+	{
+#ifdef HAVE_LIBZSTD
+	case Zstd:
+		{
+			size_t size = ZSTD_decompress(pOut, OutLength, pIn,
+				InLength);
+			if(ZSTD_isError(size))
+			{
+				THROW_EXCEPTION_MESSAGE(CompressException,
+					TransformFailed, "zstd: " <<
+					ZSTD_getErrorName(size));
+			}
+			return (int)size;
+		}
+#endif
+#ifdef HAVE_LIBLZ4
+	case LZ4:
+		{
+			int size = LZ4_decompress_safe((const char *)pIn,
+				(char *)pOut, InLength, OutLength);
+			if(size < 0)
+			{
+				THROW_EXCEPTION(CompressException, TransformFailed)
+			}
+			return size;
+		}
+#endif
+	default:
+		THROW_EXCEPTION_MESSAGE(CompressException, CodecNotSupported,
+			GetName(Codec));
+	}
+}
@@ -0,0 +1,56 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    CompressCodec.h
+//		Purpose: Choice of compression codecs for blocks of data
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+
+#ifndef COMPRESSCODEC__H
+#define COMPRESSCODEC__H
+
+#include <string>
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    CompressCodec
+//		Purpose: The compression codecs which blocks of data can be
+//			 compressed with. zlib is always available, and is used
+//			 through Compress<>. zstd and lz4 are only available if
+//			 the libraries were found when building, and compress
+//			 and decompress whole blocks in one go.
+//
+//			 Levels are specific to each codec, with 0 meaning the
+//			 codec's default: 1 -- 9 for zlib, ZSTD_minCLevel() --
+//			 ZSTD_maxCLevel() for zstd, and only the default for lz4.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+class CompressCodec
+{
+public:
+	// Stored in the headers of encoded blocks, so never change these
+	enum
+	{
+		Zlib = 0,
+		Zstd = 1,
+		LZ4 = 2,
+		NumCodecs = 3
+	};
+
+	static bool IsSupported(int Codec);
+	static bool GetCodecFromName(const std::string &rName, int &rCodecOut);
+	static const char *GetName(int Codec);
+	static bool IsValidLevel(int Codec, int Level);
+	static int MaxCompressedSize(int Codec, int InLength);
+	static bool LooksCompressible(const void *pData, int Length);
+
+	static int CompressBlock(int Codec, int Level, const void *pIn,
+		int InLength, void *pOut, int OutLength);
+	static int DecompressBlock(int Codec, const void *pIn, int InLength,
+		void *pOut, int OutLength);
+};
+
+#endif // COMPRESSCODEC__H
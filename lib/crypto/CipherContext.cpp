@@ -154,6 +154,50 @@ void CipherContext::Init(CipherContext::CipherFunction Function, const CipherDes
 	mInitialised = true;
 }
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::Init(const CipherContext &)
+//		Purpose: Initialises the context as a copy of another one, with
+//				 the same function, cipher and key, so that the same
+//				 encryption can be done in another thread
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void CipherContext::Init(const CipherContext &rSource)
+{
+	if(mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, AlreadyInitialised);
+	}
+	if(!rSource.mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised);
+	}
+
+#ifdef HAVE_OLD_SSL
+	// The old version keeps its own copy of the description
+	Init(rSource.mFunction, *rSource.mpDescription);
+#else
+	BOX_OPENSSL_INIT_CTX(ctx);
+	if(EVP_CIPHER_CTX_copy(BOX_OPENSSL_CTX(ctx),
+		BOX_OPENSSL_CTX(rSource.ctx)) != 1)
+	{
+		BOX_OPENSSL_CLEANUP_CTX(ctx);
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPInitFailure,
+			"Failed to copy " << rSource.mCipherName << ": " <<
+			LogError("copying cipher"));
+	}
+
+	mFunction = rSource.mFunction;
+	mCipherName = rSource.mCipherName;
+	mpDescription = rSource.mpDescription;
+	mInitialised = true;
+#endif
+
+	mPaddingOn = rSource.mPaddingOn;
+}
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -213,6 +257,44 @@ void CipherContext::Begin()
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::Begin(const void *)
+//		Purpose: Begin a transformation with the given IV (which must
+//				 be correctly sized, use GetIVLength). The same as
+//				 SetIV() then Begin(), but only resets the context once.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+void CipherContext::Begin(const void *pIV)
+{
+#ifdef HAVE_OLD_SSL
+	SetIV(pIV);
+	Begin();
+#else
+	if(!mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised);
+	}
+
+	if(mWithinTransform)
+	{
+		THROW_EXCEPTION(CipherException, AlreadyInTransform);
+	}
+
+	if(EVP_CipherInit_ex(BOX_OPENSSL_CTX(ctx), NULL, NULL, NULL,
+		(const unsigned char *)pIV, -1) != 1)
+	{
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPInitFailure,
+			"Failed to set IV for " << mCipherName << ": " << LogError(GetFunction()));
+	}
+
+	mWithinTransform = true;
+#endif
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -515,6 +597,61 @@ int CipherContext::TransformBlock(void *pOutBuffer, int OutLength, const void *p
 }
 
 
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CipherContext::TransformWithIV(void *, int, const void *, const void *, int)
+//		Purpose: Transform one block to another all in one go, starting
+//				 from the given IV, with a single update of the
+//				 already keyed context. The output buffer may be the
+//				 same as the input buffer (but mustn't overlap it
+//				 otherwise), and must have room for an extra cipher
+//				 block. Returns the size of the output.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+int CipherContext::TransformWithIV(void *pOutBuffer, int OutLength,
+	const void *pIV, const void *pInBuffer, int InLength)
+{
+	if(!mInitialised)
+	{
+		THROW_EXCEPTION(CipherException, NotInitialised)
+	}
+
+	if(OutLength < (InLength + EVP_CIPHER_CTX_block_size(BOX_OPENSSL_CTX(ctx))))
+	{
+		THROW_EXCEPTION(CipherException, OutputBufferTooSmall);
+	}
+
+	Begin(pIV);
+
+	int output_space_used = OutLength;
+	if(EVP_CipherUpdate(BOX_OPENSSL_CTX(ctx), (unsigned char*)pOutBuffer, &output_space_used,
+		(const unsigned char*)pInBuffer, InLength) != 1)
+	{
+		mWithinTransform = false;
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPUpdateFailure,
+			"Failed to update " << mCipherName << ": " << LogError(GetFunction()));
+	}
+
+	int output_space_remain = OutLength - output_space_used;
+#ifdef HAVE_OLD_SSL
+	OldOpenSSLFinal(((unsigned char*)pOutBuffer) + output_space_used, output_space_remain);
+#else
+	if(EVP_CipherFinal(BOX_OPENSSL_CTX(ctx), ((unsigned char*)pOutBuffer) + output_space_used,
+		&output_space_remain) != 1)
+	{
+		mWithinTransform = false;
+		THROW_EXCEPTION_MESSAGE(CipherException, EVPFinalFailure,
+			"Failed to finalise " << mCipherName << ": " << LogError(GetFunction()));
+	}
+#endif
+
+	mWithinTransform = false;
+	return output_space_used + output_space_remain;
+}
+
+
 // --------------------------------------------------------------------------
 //
 // Function
@@ -63,15 +63,19 @@ public:
 	} CipherFunction;
 
 	void Init(CipherContext::CipherFunction Function, const CipherDescription &rDescription);
+	void Init(const CipherContext &rSource);
 	void Reset();
 	
 	void Begin();
+	void Begin(const void *pIV);
 	int Transform(void *pOutBuffer, int OutLength, const void *pInBuffer, int InLength);
 	int Final(void *pOutBuffer, int OutLength);
 	int InSizeForOutBufferSize(int OutLength);
 	int MaxOutSizeForInBufferSize(int InLength);
 	
 	int TransformBlock(void *pOutBuffer, int OutLength, const void *pInBuffer, int InLength);
+	int TransformWithIV(void *pOutBuffer, int OutLength, const void *pIV,
+		const void *pInBuffer, int InLength);
 
 	bool IsInitialised() {return mInitialised;}
 	
@@ -9,6 +9,11 @@
 
 #include "Box.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+	#include <cpuid.h>
+	#define BOX_HAVE_CPUID
+#endif
+
 #define TLS_CLASS_IMPLEMENTATION_CPP
 #include <openssl/ssl.h>
 #include <openssl/err.h>
@@ -44,3 +49,27 @@ std::string CryptoUtils::LogError(const std::string& rErrorDuringAction)
 	return firstError;
 }
 
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    CryptoUtils::HasHardwareAES()
+//		Purpose: Whether the processor has AES instructions, which
+//			 OpenSSL uses automatically when they're there, so that
+//			 it can be reported. Always false where it can't tell.
+//		Created: 2026/10/18
+//
+// --------------------------------------------------------------------------
+bool CryptoUtils::HasHardwareAES()
+{
+#ifdef BOX_HAVE_CPUID
+	unsigned int eax = 0, ebx = 0, ecx = 0, edx = 0;
+	if(__get_cpuid(1, &eax, &ebx, &ecx, &edx) == 0)
+	{
+		return false;
+	}
+	return (ecx & bit_AES) != 0;
+#else
+	return false;
+#endif
+}
@@ -21,6 +21,7 @@
 namespace CryptoUtils
 {
 	std::string LogError(const std::string& rErrorDuringAction);
+	bool HasHardwareAES();
 };
 
 #endif // CRYPTOUTILS__H
@@ -0,0 +1,571 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    XXH128Digest.cpp
+//		Purpose: Fast non-cryptographic 128 bit digests (XXH3-128)
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+
+#include "Box.h"
+
+#include <string.h>
+
+#include "XXH128Digest.h"
+
+// SSE2 is part of the base instruction set on x86-64, so no runtime
+// detection is needed to use it there.
+#if defined(__SSE2__) || defined(_M_X64) || \
+	(defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+	#define XXH128DIGEST_USE_SSE2
+	#include <emmintrin.h>
+#endif
+
+#include "MemLeakFindOn.h"
+
+// Constants from the XXH3 specification
+#define PRIME32_1	0x9E3779B1U
+#define PRIME32_2	0x85EBCA77U
+#define PRIME32_3	0xC2B2AE3DU
+#define PRIME64_1	0x9E3779B185EBCA87ULL
+#define PRIME64_2	0xC2B2AE3D27D4EB4FULL
+#define PRIME64_3	0x165667B19E3779F9ULL
+#define PRIME64_4	0x85EBCA77C2B2AE63ULL
+#define PRIME64_5	0x27D4EB2F165667C5ULL
+#define PRIME_MX1	0x165667919E3779F9ULL
+#define PRIME_MX2	0x9FB21C651E98DF25ULL
+
+#define SECRET_SIZE		192
+#define SECRET_LIMIT		(SECRET_SIZE - 64)
+#define SECRET_CONSUME_RATE	8
+#define STRIPES_PER_BLOCK	(SECRET_LIMIT / SECRET_CONSUME_RATE)
+#define SECRET_LASTACC_START	7
+#define SECRET_MERGEACCS_START	11
+#define MIDSIZE_MAX		240
+#define MIDSIZE_STARTOFFSET	3
+#define MIDSIZE_LASTOFFSET	17
+#define SECRET_SIZE_MIN		136
+
+static const uint8_t sSecret[SECRET_SIZE] =
+{
+	0xb8, 0xfe, 0x6c, 0x39, 0x23, 0xa4, 0x4b, 0xbe, 0x7c, 0x01, 0x81, 0x2c, 0xf7, 0x21, 0xad, 0x1c,
+	0xde, 0xd4, 0x6d, 0xe9, 0x83, 0x90, 0x97, 0xdb, 0x72, 0x40, 0xa4, 0xa4, 0xb7, 0xb3, 0x67, 0x1f,
+	0xcb, 0x79, 0xe6, 0x4e, 0xcc, 0xc0, 0xe5, 0x78, 0x82, 0x5a, 0xd0, 0x7d, 0xcc, 0xff, 0x72, 0x21,
+	0xb8, 0x08, 0x46, 0x74, 0xf7, 0x43, 0x24, 0x8e, 0xe0, 0x35, 0x90, 0xe6, 0x81, 0x3a, 0x26, 0x4c,
+	0x3c, 0x28, 0x52, 0xbb, 0x91, 0xc3, 0x00, 0xcb, 0x88, 0xd0, 0x65, 0x8b, 0x1b, 0x53, 0x2e, 0xa3,
+	0x71, 0x64, 0x48, 0x97, 0xa2, 0x0d, 0xf9, 0x4e, 0x38, 0x19, 0xef, 0x46, 0xa9, 0xde, 0xac, 0xd8,
+	0xa8, 0xfa, 0x76, 0x3f, 0xe3, 0x9c, 0x34, 0x3f, 0xf9, 0xdc, 0xbb, 0xc7, 0xc7, 0x0b, 0x4f, 0x1d,
+	0x8a, 0x51, 0xe0, 0x4b, 0xcd, 0xb4, 0x59, 0x31, 0xc8, 0x9f, 0x7e, 0xc9, 0xd9, 0x78, 0x73, 0x64,
+	0xea, 0xc5, 0xac, 0x83, 0x34, 0xd3, 0xeb, 0xc3, 0xc5, 0x81, 0xa0, 0xff, 0xfa, 0x13, 0x63, 0xeb,
+	0x17, 0x0d, 0xdd, 0x51, 0xb7, 0xf0, 0xda, 0x49, 0xd3, 0x16, 0x55, 0x26, 0x29, 0xd4, 0x68, 0x9e,
+	0x2b, 0x16, 0xbe, 0x58, 0x7d, 0x47, 0xa1, 0xfc, 0x8f, 0xf8, 0xb8, 0xd1, 0x7a, 0xd0, 0x31, 0xce,
+	0x45, 0xcb, 0x3a, 0x8f, 0x95, 0x16, 0x04, 0x28, 0xaf, 0xd7, 0xfb, 0xca, 0xbb, 0x4b, 0x40, 0x7e,
+};
+
+// Little-endian reads, which work regardless of the host's byte order
+// and alignment (compilers turn these into single loads where possible)
+static inline uint32_t ReadLE32(const uint8_t *p)
+{
+	return ((uint32_t)p[0]) | ((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+static inline uint64_t ReadLE64(const uint8_t *p)
+{
+	return ((uint64_t)ReadLE32(p)) | ((uint64_t)ReadLE32(p + 4) << 32);
+}
+
+static inline uint32_t Swap32(uint32_t x)
+{
+	return ((x << 24) & 0xff000000U) | ((x << 8) & 0x00ff0000U) |
+		((x >> 8) & 0x0000ff00U) | ((x >> 24) & 0x000000ffU);
+}
+
+static inline uint64_t Swap64(uint64_t x)
+{
+	return ((uint64_t)Swap32((uint32_t)x) << 32) |
+		(uint64_t)Swap32((uint32_t)(x >> 32));
+}
+
+static inline uint32_t RotL32(uint32_t x, int r)
+{
+	return (x << r) | (x >> (32 - r));
+}
+
+static inline uint64_t XorShift64(uint64_t v, int Shift)
+{
+	return v ^ (v >> Shift);
+}
+
+// 64 x 64 -> 128 bit multiplication, done in 32 bit parts for portability
+static inline void Mult64To128(uint64_t a, uint64_t b, uint64_t &rLow,
+	uint64_t &rHigh)
+{
+	uint64_t lolo = (a & 0xFFFFFFFFULL) * (b & 0xFFFFFFFFULL);
+	uint64_t hilo = (a >> 32) * (b & 0xFFFFFFFFULL);
+	uint64_t lohi = (a & 0xFFFFFFFFULL) * (b >> 32);
+	uint64_t hihi = (a >> 32) * (b >> 32);
+
+	uint64_t cross = (lolo >> 32) + (hilo & 0xFFFFFFFFULL) + lohi;
+	rHigh = (hilo >> 32) + (cross >> 32) + hihi;
+	rLow = (cross << 32) | (lolo & 0xFFFFFFFFULL);
+}
+
+static inline uint64_t Mul128Fold64(uint64_t a, uint64_t b)
+{
+	uint64_t low, high;
+	Mult64To128(a, b, low, high);
+	return low ^ high;
+}
+
+static inline uint64_t XXH64Avalanche(uint64_t h)
+{
+	h ^= h >> 33;
+	h *= PRIME64_2;
+	h ^= h >> 29;
+	h *= PRIME64_3;
+	h ^= h >> 32;
+	return h;
+}
+
+static inline uint64_t XXH3Avalanche(uint64_t h)
+{
+	h = XorShift64(h, 37);
+	h *= PRIME_MX1;
+	h = XorShift64(h, 32);
+	return h;
+}
+
+static inline uint64_t Mix16B(const uint8_t *pInput, const uint8_t *pSecret)
+{
+	return Mul128Fold64(ReadLE64(pInput) ^ ReadLE64(pSecret),
+		ReadLE64(pInput + 8) ^ ReadLE64(pSecret + 8));
+}
+
+static inline void Mix32B(uint64_t &rLow, uint64_t &rHigh,
+	const uint8_t *pInput1, const uint8_t *pInput2, const uint8_t *pSecret)
+{
+	rLow += Mix16B(pInput1, pSecret);
+	rLow ^= ReadLE64(pInput2) + ReadLE64(pInput2 + 8);
+	rHigh += Mix16B(pInput2, pSecret + 16);
+	rHigh ^= ReadLE64(pInput1) + ReadLE64(pInput1 + 8);
+}
+
+// Accumulate a number of consecutive 64 byte stripes, using the secret
+// at an offset which moves on 8 bytes for each stripe
+static void Accumulate(uint64_t *pAcc, const uint8_t *pInput,
+	const uint8_t *pSecret, int Stripes)
+{
+#ifdef XXH128DIGEST_USE_SSE2
+	__m128i acc[4];
+	for(int i = 0; i < 4; ++i)
+	{
+		acc[i] = _mm_loadu_si128((const __m128i *)(pAcc + (i * 2)));
+	}
+
+	for(int n = 0; n < Stripes; ++n)
+	{
+		const uint8_t *in = pInput + (n * 64);
+		const uint8_t *secret = pSecret + (n * SECRET_CONSUME_RATE);
+		for(int i = 0; i < 4; ++i)
+		{
+			__m128i data = _mm_loadu_si128(
+				(const __m128i *)(in + (i * 16)));
+			__m128i key = _mm_loadu_si128(
+				(const __m128i *)(secret + (i * 16)));
+			__m128i dataKey = _mm_xor_si128(data, key);
+			// Multiply the low and high 32 bits of each 64 bit lane
+			__m128i dataKeyHigh = _mm_shuffle_epi32(dataKey,
+				_MM_SHUFFLE(0, 3, 0, 1));
+			__m128i product = _mm_mul_epu32(dataKey, dataKeyHigh);
+			// Add each lane's data to the other lane in the pair
+			__m128i dataSwap = _mm_shuffle_epi32(data,
+				_MM_SHUFFLE(1, 0, 3, 2));
+			acc[i] = _mm_add_epi64(product,
+				_mm_add_epi64(acc[i], dataSwap));
+		}
+	}
+
+	for(int i = 0; i < 4; ++i)
+	{
+		_mm_storeu_si128((__m128i *)(pAcc + (i * 2)), acc[i]);
+	}
+#else
+	for(int n = 0; n < Stripes; ++n)
+	{
+		const uint8_t *in = pInput + (n * 64);
+		const uint8_t *secret = pSecret + (n * SECRET_CONSUME_RATE);
+		for(int i = 0; i < 8; ++i)
+		{
+			uint64_t data = ReadLE64(in + (i * 8));
+			uint64_t dataKey = data ^ ReadLE64(secret + (i * 8));
+			pAcc[i ^ 1] += data;
+			pAcc[i] += (dataKey & 0xFFFFFFFFULL) * (dataKey >> 32);
+		}
+	}
+#endif
+}
+
+static void ScrambleAcc(uint64_t *pAcc, const uint8_t *pSecret)
+{
+	for(int i = 0; i < 8; ++i)
+	{
+		uint64_t acc = XorShift64(pAcc[i], 47);
+		acc ^= ReadLE64(pSecret + (i * 8));
+		acc *= PRIME32_1;
+		pAcc[i] = acc;
+	}
+}
+
+static uint64_t MergeAccs(const uint64_t *pAcc, const uint8_t *pSecret,
+	uint64_t Start)
+{
+	uint64_t result = Start;
+	for(int i = 0; i < 4; ++i)
+	{
+		result += Mul128Fold64(pAcc[i * 2] ^ ReadLE64(pSecret + (i * 16)),
+			pAcc[(i * 2) + 1] ^ ReadLE64(pSecret + (i * 16) + 8));
+	}
+	return XXH3Avalanche(result);
+}
+
+// Store the two halves of the hash in canonical (big-endian) order
+static void StoreCanonical(uint64_t Low, uint64_t High, uint8_t *pDigest)
+{
+	for(int i = 0; i < 8; ++i)
+	{
+		pDigest[i] = (uint8_t)(High >> (56 - (i * 8)));
+		pDigest[i + 8] = (uint8_t)(Low >> (56 - (i * 8)));
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    XXH128Digest::XXH128Digest()
+//		Purpose: Constructor
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+XXH128Digest::XXH128Digest()
+	: mBufferedSize(0),
+	  mStripesSoFar(0),
+	  mTotalLength(0)
+{
+	mAcc[0] = PRIME32_3;
+	mAcc[1] = PRIME64_1;
+	mAcc[2] = PRIME64_2;
+	mAcc[3] = PRIME64_3;
+	mAcc[4] = PRIME64_4;
+	mAcc[5] = PRIME32_2;
+	mAcc[6] = PRIME64_5;
+	mAcc[7] = PRIME32_1;
+	::memset(mDigest, 0, sizeof(mDigest));
+}
+
+XXH128Digest::~XXH128Digest()
+{
+}
+
+void XXH128Digest::Add(const std::string &rString)
+{
+	Add(rString.c_str(), rString.size());
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    XXH128Digest::Add(const void *, int)
+//		Purpose: Add data to the digest. Whole stripes are consumed
+//			 directly from the input; only the last (up to) 256
+//			 bytes are kept back, as the end of the data is treated
+//			 differently.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void XXH128Digest::Add(const void *pData, int Length)
+{
+	const uint8_t *input = (const uint8_t *)pData;
+	mTotalLength += Length;
+
+	if(mBufferedSize + Length <= BufferSize)
+	{
+		::memcpy(mBuffer + mBufferedSize, input, Length);
+		mBufferedSize += Length;
+		return;
+	}
+
+	// There's more than a buffer full, so it can't be the end
+	if(mBufferedSize > 0)
+	{
+		int load = BufferSize - mBufferedSize;
+		::memcpy(mBuffer + mBufferedSize, input, load);
+		input += load;
+		Length -= load;
+		ConsumeStripes(mAcc, mStripesSoFar, mBuffer,
+			BufferSize / StripeLength);
+		mBufferedSize = 0;
+	}
+
+	if(Length > BufferSize)
+	{
+		do
+		{
+			ConsumeStripes(mAcc, mStripesSoFar, input,
+				BufferSize / StripeLength);
+			input += BufferSize;
+			Length -= BufferSize;
+		}
+		while(Length > BufferSize);
+
+		// Keep the last stripe consumed, in case it's needed to make
+		// up the final stripe
+		::memcpy(mBuffer + BufferSize - StripeLength,
+			input - StripeLength, StripeLength);
+	}
+
+	::memcpy(mBuffer, input, Length);
+	mBufferedSize = Length;
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    XXH128Digest::ConsumeStripes(uint64_t *, int &, const uint8_t *, int)
+//		Purpose: Accumulate stripes, scrambling the accumulators
+//			 whenever a whole block of stripes has been consumed
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void XXH128Digest::ConsumeStripes(uint64_t *pAcc, int &rStripesSoFar,
+	const uint8_t *pInput, int Stripes) const
+{
+	if(STRIPES_PER_BLOCK - rStripesSoFar <= Stripes)
+	{
+		int toEnd = STRIPES_PER_BLOCK - rStripesSoFar;
+		Accumulate(pAcc, pInput,
+			sSecret + (rStripesSoFar * SECRET_CONSUME_RATE), toEnd);
+		ScrambleAcc(pAcc, sSecret + SECRET_LIMIT);
+		Accumulate(pAcc, pInput + (toEnd * StripeLength), sSecret,
+			Stripes - toEnd);
+		rStripesSoFar = Stripes - toEnd;
+	}
+	else
+	{
+		Accumulate(pAcc, pInput,
+			sSecret + (rStripesSoFar * SECRET_CONSUME_RATE), Stripes);
+		rStripesSoFar += Stripes;
+	}
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    XXH128Digest::Finish()
+//		Purpose: Calculate the digest of all the data added
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void XXH128Digest::Finish()
+{
+	if(mTotalLength <= MIDSIZE_MAX)
+	{
+		// All the data is still in the buffer
+		DigestShort(mBuffer, mBufferedSize);
+		return;
+	}
+
+	// Work on copies, so that the state is left alone
+	uint64_t acc[8];
+	::memcpy(acc, mAcc, sizeof(acc));
+	int stripesSoFar = mStripesSoFar;
+	const uint8_t *lastStripe;
+	uint8_t lastStripeBuffer[StripeLength];
+
+	if(mBufferedSize >= StripeLength)
+	{
+		ConsumeStripes(acc, stripesSoFar, mBuffer,
+			(mBufferedSize - 1) / StripeLength);
+		lastStripe = mBuffer + mBufferedSize - StripeLength;
+	}
+	else
+	{
+		// Make up the last stripe from the end of the previous data
+		int catchUp = StripeLength - mBufferedSize;
+		::memcpy(lastStripeBuffer, mBuffer + BufferSize - catchUp,
+			catchUp);
+		::memcpy(lastStripeBuffer + catchUp, mBuffer, mBufferedSize);
+		lastStripe = lastStripeBuffer;
+	}
+
+	Accumulate(acc, lastStripe,
+		sSecret + SECRET_LIMIT - SECRET_LASTACC_START, 1);
+
+	uint64_t low = MergeAccs(acc, sSecret + SECRET_MERGEACCS_START,
+		mTotalLength * PRIME64_1);
+	uint64_t high = MergeAccs(acc,
+		sSecret + SECRET_SIZE - 64 - SECRET_MERGEACCS_START,
+		~(mTotalLength * PRIME64_2));
+	StoreCanonical(low, high, mDigest);
+}
+
+// --------------------------------------------------------------------------
+//
+// Function
+//		Name:    XXH128Digest::DigestShort(const uint8_t *, int)
+//		Purpose: Calculate the digest of data up to 240 bytes long,
+//			 which has its own algorithms for several lengths
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+void XXH128Digest::DigestShort(const uint8_t *pInput, int Length)
+{
+	uint64_t len = Length;
+	uint64_t low, high;
+
+	if(Length == 0)
+	{
+		low = XXH64Avalanche(ReadLE64(sSecret + 64) ^
+			ReadLE64(sSecret + 72));
+		high = XXH64Avalanche(ReadLE64(sSecret + 80) ^
+			ReadLE64(sSecret + 88));
+	}
+	else if(Length <= 3)
+	{
+		uint32_t c1 = pInput[0];
+		uint32_t c2 = pInput[Length >> 1];
+		uint32_t c3 = pInput[Length - 1];
+		uint32_t combinedLow = (c1 << 16) | (c2 << 24) | c3 |
+			((uint32_t)Length << 8);
+		uint32_t combinedHigh = RotL32(Swap32(combinedLow), 13);
+		uint64_t bitflipLow = ReadLE32(sSecret) ^ ReadLE32(sSecret + 4);
+		uint64_t bitflipHigh = ReadLE32(sSecret + 8) ^
+			ReadLE32(sSecret + 12);
+		low = XXH64Avalanche((uint64_t)combinedLow ^ bitflipLow);
+		high = XXH64Avalanche((uint64_t)combinedHigh ^ bitflipHigh);
+	}
+	else if(Length <= 8)
+	{
+		uint32_t inputLow = ReadLE32(pInput);
+		uint32_t inputHigh = ReadLE32(pInput + Length - 4);
+		uint64_t input64 = inputLow + ((uint64_t)inputHigh << 32);
+		uint64_t bitflip = ReadLE64(sSecret + 16) ^
+			ReadLE64(sSecret + 24);
+		Mult64To128(input64 ^ bitflip, PRIME64_1 + (len << 2),
+			low, high);
+		high += (low << 1);
+		low ^= (high >> 3);
+		low = XorShift64(low, 35);
+		low *= PRIME_MX2;
+		low = XorShift64(low, 28);
+		high = XXH3Avalanche(high);
+	}
+	else if(Length <= 16)
+	{
+		uint64_t bitflipLow = ReadLE64(sSecret + 32) ^
+			ReadLE64(sSecret + 40);
+		uint64_t bitflipHigh = ReadLE64(sSecret + 48) ^
+			ReadLE64(sSecret + 56);
+		uint64_t inputLow = ReadLE64(pInput);
+		uint64_t inputHigh = ReadLE64(pInput + Length - 8);
+		uint64_t mLow, mHigh;
+		Mult64To128(inputLow ^ inputHigh ^ bitflipLow, PRIME64_1,
+			mLow, mHigh);
+		mLow += (len - 1) << 54;
+		inputHigh ^= bitflipHigh;
+		mHigh += inputHigh + (inputHigh & 0xFFFFFFFFULL) *
+			(uint64_t)(PRIME32_2 - 1);
+		mLow ^= Swap64(mHigh);
+		Mult64To128(mLow, PRIME64_2, low, high);
+		high += mHigh * PRIME64_2;
+		low = XXH3Avalanche(low);
+		high = XXH3Avalanche(high);
+	}
+	else
+	{
+		uint64_t accLow = len * PRIME64_1;
+		uint64_t accHigh = 0;
+
+		if(Length <= 128)
+		{
+			if(Length > 32)
+			{
+				if(Length > 64)
+				{
+					if(Length > 96)
+					{
+						Mix32B(accLow, accHigh,
+							pInput + 48,
+							pInput + Length - 64,
+							sSecret + 96);
+					}
+					Mix32B(accLow, accHigh, pInput + 32,
+						pInput + Length - 48,
+						sSecret + 64);
+				}
+				Mix32B(accLow, accHigh, pInput + 16,
+					pInput + Length - 32, sSecret + 32);
+			}
+			Mix32B(accLow, accHigh, pInput, pInput + Length - 16,
+				sSecret);
+		}
+		else
+		{
+			int rounds = Length / 32;
+			for(int i = 0; i < 4; ++i)
+			{
+				Mix32B(accLow, accHigh, pInput + (32 * i),
+					pInput + (32 * i) + 16,
+					sSecret + (32 * i));
+			}
+			accLow = XXH3Avalanche(accLow);
+			accHigh = XXH3Avalanche(accHigh);
+			for(int i = 4; i < rounds; ++i)
+			{
+				Mix32B(accLow, accHigh, pInput + (32 * i),
+					pInput + (32 * i) + 16,
+					sSecret + MIDSIZE_STARTOFFSET +
+					(32 * (i - 4)));
+			}
+			// The last bytes
+			Mix32B(accLow, accHigh, pInput + Length - 16,
+				pInput + Length - 32,
+				sSecret + SECRET_SIZE_MIN -
+				MIDSIZE_LASTOFFSET - 16);
+		}
+
+		low = accLow + accHigh;
+		high = (accLow * PRIME64_1) + (accHigh * PRIME64_4) +
+			(len * PRIME64_2);
+		low = XXH3Avalanche(low);
+		high = 0 - XXH3Avalanche(high);
+	}
+
+	StoreCanonical(low, high, mDigest);
+}
+
+std::string XXH128Digest::DigestAsString()
+{
+	std::string r;
+
+	static const char *hex = "0123456789abcdef";
+
+	for(unsigned int l = 0; l < sizeof(mDigest); ++l)
+	{
+		r += hex[(mDigest[l] & 0xf0) >> 4];
+		r += hex[(mDigest[l] & 0x0f)];
+	}
+
+	return r;
+}
+
+int XXH128Digest::CopyDigestTo(uint8_t *to)
+{
+	::memcpy(to, mDigest, DigestLength);
+	return DigestLength;
+}
+
+bool XXH128Digest::DigestMatches(uint8_t *pCompareWith) const
+{
+	return ::memcmp(pCompareWith, mDigest, DigestLength) == 0;
+}
@@ -0,0 +1,73 @@
+// --------------------------------------------------------------------------
+//
+// File
+//		Name:    XXH128Digest.h
+//		Purpose: Fast non-cryptographic 128 bit digests (XXH3-128)
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+
+#ifndef XXH128DIGEST_H
+#define XXH128DIGEST_H
+
+#include <string>
+
+// --------------------------------------------------------------------------
+//
+// Class
+//		Name:    XXH128Digest
+//		Purpose: Calculates 128 bit XXH3 hashes (with the default secret
+//			 and a seed of zero), with the same interface as MD5Digest.
+//			 The digest is stored in the canonical (big-endian) form.
+//			 Many times faster than MD5, but not cryptographically
+//			 secure: use it to detect changes, not to resist attacks.
+//		Created: 2026/10/17
+//
+// --------------------------------------------------------------------------
+class XXH128Digest
+{
+public:
+	XXH128Digest();
+	virtual ~XXH128Digest();
+
+	void Add(const std::string &rString);
+	void Add(const void *pData, int Length);
+
+	void Finish();
+
+	std::string DigestAsString();
+	uint8_t *DigestAsData(int *pLength = 0)
+	{
+		if(pLength) *pLength = sizeof(mDigest);
+		return mDigest;
+	}
+
+	enum
+	{
+		DigestLength = 16
+	};
+
+	int CopyDigestTo(uint8_t *to);
+
+	bool DigestMatches(uint8_t *pCompareWith) const;
+
+private:
+	enum
+	{
+		StripeLength = 64,
+		BufferSize = 256
+	};
+
+	void ConsumeStripes(uint64_t *pAcc, int &rStripesSoFar,
+		const uint8_t *pInput, int Stripes) const;
+	void DigestShort(const uint8_t *pInput, int Length);
+
+	uint64_t mAcc[8];
+	uint8_t mBuffer[BufferSize];
+	int mBufferedSize;
+	int mStripesSoFar;
+	uint64_t mTotalLength;
+	uint8_t mDigest[DigestLength];
+};
+
+#endif // XXH128DIGEST_H
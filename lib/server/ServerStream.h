@@ -14,10 +14,16 @@
 #include <errno.h>
 
 #ifndef WIN32
+	#include <poll.h>
+	#include <signal.h>
 	#include <sys/wait.h>
 #endif
 
+#include <map>
+#include <vector>
+
 #include "autogen_ServerException.h"
+#include "BoxTime.h"
 #include "Daemon.h"
 #include "SocketListen.h"
 #include "Utils.h"
@@ -26,6 +32,14 @@
 
 #include "MemLeakFindOn.h"
 
+// Workers above the minimum are stopped, one a second, once more than one
+// of them has been idle for this many seconds
+#define SERVERSTREAM_SPARE_WORKER_TIMEOUT	10
+
+// Workers still busy with a connection this many seconds after being asked
+// to stop for a configuration reload are killed
+#define SERVERSTREAM_WORKER_STOP_TIMEOUT	60
+
 // --------------------------------------------------------------------------
 //
 // Class
@@ -147,6 +161,7 @@ public:
 			// finished child processes, and allows the daemon
 			// to terminate reasonably quickly on request.
 			WaitForEvent connectionWait(1000);
+			int minWorkers = 0, maxWorkers = 0;
 			
 			// BLOCK
 			{
@@ -155,6 +170,19 @@ public:
 				const Configuration &config(this->GetConfiguration());
 				const Configuration &server(config.GetSubConfiguration("Server"));
 				std::string addrs = server.GetKeyValue("ListenAddresses");
+
+				// Size of the pool of worker processes, if any
+				minWorkers = server.GetKeyValueInt("MinWorkers");
+				maxWorkers = server.KeyExists("MaxWorkers")
+					? server.GetKeyValueInt("MaxWorkers")
+					: minWorkers;
+				if(minWorkers < 0 || maxWorkers < minWorkers)
+				{
+					THROW_EXCEPTION_MESSAGE(ServerException,
+						ServerStreamBadWorkers,
+						"MinWorkers = " << minWorkers <<
+						", MaxWorkers = " << maxWorkers);
+				}
 	
 				// split up the list of addresses
 				std::vector<std::string> addrlist;
@@ -240,6 +268,16 @@ public:
 			}
 			
 			NotifyListenerIsReady();
+
+			#ifndef WIN32
+			if(ForkToHandleRequests && !IsSingleProcess() &&
+				minWorkers > 0)
+			{
+				// Returns when the daemon is stopping, in this
+				// process and in every worker
+				RunWorkerPool(minWorkers, maxWorkers, rChildExit);
+			}
+			#endif // !WIN32
 	
 			while(!StopRun())
 			{
@@ -336,7 +374,7 @@ public:
 	}
 
 	#ifndef WIN32 // no waitpid() on Windows
-	void WaitForChildren()
+	void WaitForChildren(std::vector<pid_t> *pExited = NULL)
 	{
 		int p = 0;
 		do
@@ -364,8 +402,15 @@ public:
 			{
 				// no children exited, will return from
 				// function
+				continue;
+			}
+
+			if(pExited)
+			{
+				pExited->push_back(p);
 			}
-			else if(WIFEXITED(status))
+
+			if(WIFEXITED(status))
 			{
 				BOX_INFO("child process " << p << " "
 					"terminated normally");
@@ -430,12 +475,443 @@ private:
 		mSockets.clear();
 	}
 
+	#ifndef WIN32 // no fork() on Windows
+	typedef enum
+	{
+		WorkerIdle = 0,
+		WorkerBusy,
+		WorkerStopping
+	} WorkerState;
+
+	// Sent by the workers to the parent process through a pipe, which
+	// they all share. Much smaller than PIPE_BUF, so writes are atomic.
+	typedef struct
+	{
+		pid_t mPid;
+		int mState;
+	} WorkerStatus;
+
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    ServerStream::RunWorkerPool(int, int, bool &)
+	//		Purpose: Forks worker processes which accept connections
+	//			 on the listening sockets and handle them one
+	//			 after another, so that connections don't wait
+	//			 for a fork, and workers keep whatever they
+	//			 cache between them. Keeps between MinWorkers
+	//			 and MaxWorkers of them, starting another when
+	//			 none is idle, until the daemon is asked to
+	//			 stop. Also returns in the workers when they
+	//			 stop, with rChildExit set.
+	//		Created: 2026/10/18
+	//
+	// --------------------------------------------------------------------------
+	void RunWorkerPool(int MinWorkers, int MaxWorkers, bool &rChildExit)
+	{
+		// The workers all wait for the same connections
+		for(unsigned int l = 0; l < mSockets.size(); ++l)
+		{
+			mSockets[l]->SetNonBlocking(true);
+		}
+
+		int statusPipe[2];
+		if(::pipe(statusPipe) != 0)
+		{
+			THROW_SYS_ERROR("Failed to create worker status pipe",
+				ServerException, WorkerPipeFailed);
+		}
+
+		std::map<pid_t, WorkerState> workers;
+		try
+		{
+			int flags = ::fcntl(statusPipe[0], F_GETFL);
+			if(flags == -1 || ::fcntl(statusPipe[0], F_SETFL,
+				flags | O_NONBLOCK) == -1)
+			{
+				THROW_SYS_ERROR("Failed to set up worker status "
+					"pipe", ServerException,
+					WorkerPipeFailed);
+			}
+
+			// When more than one worker was last needed
+			box_time_t lastNeeded = GetCurrentBoxTime();
+
+			while(!StopRun())
+			{
+				int numWorkers = 0, numIdle = 0;
+				for(typename std::map<pid_t, WorkerState>::const_iterator
+					i(workers.begin()); i != workers.end(); ++i)
+				{
+					if(i->second != WorkerStopping)
+					{
+						++numWorkers;
+					}
+					if(i->second == WorkerIdle)
+					{
+						++numIdle;
+					}
+				}
+
+				if(numWorkers < MinWorkers ||
+					(numIdle == 0 && numWorkers < MaxWorkers))
+				{
+					pid_t pid = ::fork();
+					switch(pid)
+					{
+					case -1:
+						THROW_EXCEPTION(ServerException,
+							ServerForkError)
+						break;
+
+					case 0:
+						// Worker process. The other workers
+						// aren't its to stop, and nothing may
+						// unwind into the catch below, which
+						// would stop them.
+						rChildExit = true;
+						workers.clear();
+						::close(statusPipe[0]);
+						try
+						{
+							RunWorker(statusPipe[1]);
+						}
+						catch(BoxException &e)
+						{
+							BOX_ERROR("Error in worker process: "
+								"exception " << e.what() <<
+								" (" << e.GetType() << "/" <<
+								e.GetSubType() << ")");
+							_exit(1);
+						}
+						catch(std::exception &e)
+						{
+							BOX_ERROR("Error in worker process: "
+								"exception " << e.what());
+							_exit(1);
+						}
+						catch(...)
+						{
+							BOX_ERROR("Error in worker process: "
+								"unknown exception");
+							_exit(1);
+						}
+						return;
+
+					default:
+						break;
+					}
+
+					BOX_TRACE("Forked worker process " << pid);
+					workers[pid] = WorkerIdle;
+					lastNeeded = GetCurrentBoxTime();
+					continue;
+				}
+
+				box_time_t now = GetCurrentBoxTime();
+				if(numIdle <= 1 || numWorkers <= MinWorkers)
+				{
+					lastNeeded = now;
+				}
+				else if(now - lastNeeded >= SecondsToBoxTime(
+					SERVERSTREAM_SPARE_WORKER_TIMEOUT))
+				{
+					// Stop a spare worker, and perhaps
+					// another in a second
+					for(typename std::map<pid_t, WorkerState>::iterator
+						i(workers.begin());
+						i != workers.end(); ++i)
+					{
+						if(i->second == WorkerIdle)
+						{
+							BOX_TRACE("Stopping spare "
+								"worker process " <<
+								i->first);
+							::kill(i->first, SIGTERM);
+							i->second = WorkerStopping;
+							break;
+						}
+					}
+					lastNeeded = now + SecondsToBoxTime(1) -
+						SecondsToBoxTime(
+						SERVERSTREAM_SPARE_WORKER_TIMEOUT);
+				}
+
+				// Wait for workers to report, or a second
+				struct pollfd p;
+				p.fd = statusPipe[0];
+				p.events = POLLIN;
+				p.revents = 0;
+				if(::poll(&p, 1, 1000) == -1 && errno != EINTR)
+				{
+					THROW_SYS_ERROR("Failed to wait for "
+						"worker status", ServerException,
+						SocketPollError);
+				}
+				ReadWorkerStatus(statusPipe[0], workers);
+
+				OnIdle();
+
+				// Replace any workers which have stopped
+				std::vector<pid_t> exited;
+				WaitForChildren(&exited);
+				for(std::vector<pid_t>::const_iterator
+					i(exited.begin()); i != exited.end(); ++i)
+				{
+					workers.erase(*i);
+				}
+			}
+		}
+		catch(...)
+		{
+			StopWorkers(workers, false);
+			::close(statusPipe[0]);
+			::close(statusPipe[1]);
+			throw;
+		}
+
+		// The workers must close the listening sockets before they
+		// can be opened again with the new configuration
+		StopWorkers(workers, !IsTerminateWanted());
+		::close(statusPipe[0]);
+		::close(statusPipe[1]);
+	}
+
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    ServerStream::RunWorker(int)
+	//		Purpose: Accepts and handles connections in a worker
+	//			 process until the parent asks it to stop, which
+	//			 it only does between connections. Tells the
+	//			 parent when it's busy through StatusPipe. An
+	//			 exception from one connection is logged, and
+	//			 the worker carries on with the next.
+	//		Created: 2026/10/18
+	//
+	// --------------------------------------------------------------------------
+	void RunWorker(int StatusPipe)
+	{
+		// The parent reloads the configuration, and stops the
+		// workers with SIGTERM, which is caught as usual
+		::signal(SIGHUP, SIG_IGN);
+		SetProcessTitle("idle");
+
+		// Memory leak test the forked process
+		#ifdef BOX_MEMORY_LEAK_TESTING
+			memleakfinder_startsectionmonitor();
+		#endif
+
+		// Can't use the parent's, which may be a kqueue
+		WaitForEvent connectionWait(1000);
+		for(unsigned int l = 0; l < mSockets.size(); ++l)
+		{
+			connectionWait.Add(mSockets[l]);
+		}
+
+		sigset_t terminate;
+		sigemptyset(&terminate);
+		sigaddset(&terminate, SIGTERM);
+
+		while(!StopRun())
+		{
+			SocketListen<StreamType, ListenBacklog> *psocket
+				= (SocketListen<StreamType, ListenBacklog> *)connectionWait.Wait();
+			if(!psocket)
+			{
+				continue;
+			}
+
+			std::auto_ptr<StreamType> connection(
+				psocket->Accept(0, &mConnectionDetails));
+			if(!connection.get())
+			{
+				// Another worker accepted it
+				continue;
+			}
+
+			// Finish the connection before stopping
+			::sigprocmask(SIG_BLOCK, &terminate, NULL);
+			SendWorkerStatus(StatusPipe, WorkerBusy);
+			SetProcessTitle("transaction");
+			LogConnectionDetails(mConnectionDetails);
+
+			try
+			{
+				HandleConnection(connection);
+			}
+			catch(BoxException &e)
+			{
+				BOX_ERROR("Error in worker process, terminating "
+					"connection: exception " << e.what() <<
+					" (" << e.GetType() << "/" <<
+					e.GetSubType() << ")");
+			}
+			catch(std::exception &e)
+			{
+				BOX_ERROR("Error in worker process, terminating "
+					"connection: exception " << e.what());
+			}
+			catch(...)
+			{
+				BOX_ERROR("Error in worker process, terminating "
+					"connection: unknown exception");
+			}
+			connection.reset();
+
+			SetProcessTitle("idle");
+			SendWorkerStatus(StatusPipe, WorkerIdle);
+			::sigprocmask(SIG_UNBLOCK, &terminate, NULL);
+		}
+
+		::close(StatusPipe);
+	}
+
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    ServerStream::SendWorkerStatus(int, WorkerState)
+	//		Purpose: Tells the parent process whether this worker
+	//			 is handling a connection.
+	//		Created: 2026/10/18
+	//
+	// --------------------------------------------------------------------------
+	static void SendWorkerStatus(int StatusPipe, WorkerState State)
+	{
+		WorkerStatus status;
+		status.mPid = ::getpid();
+		status.mState = State;
+		if(::write(StatusPipe, &status, sizeof(status)) !=
+			sizeof(status))
+		{
+			BOX_LOG_SYS_WARNING("Failed to send worker status to "
+				"parent process");
+		}
+	}
+
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    ServerStream::ReadWorkerStatus(int, std::map<pid_t, WorkerState> &)
+	//		Purpose: Reads whatever the workers have reported,
+	//			 without waiting, and notes which are idle.
+	//		Created: 2026/10/18
+	//
+	// --------------------------------------------------------------------------
+	static void ReadWorkerStatus(int StatusPipe,
+		std::map<pid_t, WorkerState> &rWorkers)
+	{
+		WorkerStatus status[16];
+		ssize_t bytes;
+		while((bytes = ::read(StatusPipe, status, sizeof(status))) > 0)
+		{
+			// Each write is atomic, so only whole records are read
+			for(unsigned int s = 0; s < bytes / sizeof(WorkerStatus);
+				++s)
+			{
+				typename std::map<pid_t, WorkerState>::iterator
+					i(rWorkers.find(status[s].mPid));
+				if(i != rWorkers.end() &&
+					i->second != WorkerStopping)
+				{
+					i->second = (WorkerState)status[s].mState;
+				}
+			}
+		}
+	}
+
+	// --------------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    ServerStream::StopWorkers(std::map<pid_t, WorkerState> &, bool)
+	//		Purpose: Asks the workers to stop once they've finished
+	//			 any connection they're handling, and waits for
+	//			 them to stop if Wait is set. Any still busy after
+	//			 SERVERSTREAM_WORKER_STOP_TIMEOUT seconds are
+	//			 killed, so that a reload can't wait forever.
+	//		Created: 2026/10/18
+	//
+	// --------------------------------------------------------------------------
+	void StopWorkers(std::map<pid_t, WorkerState> &rWorkers, bool Wait)
+	{
+		for(typename std::map<pid_t, WorkerState>::iterator
+			i(rWorkers.begin()); i != rWorkers.end(); ++i)
+		{
+			::kill(i->first, SIGTERM);
+			i->second = WorkerStopping;
+		}
+
+		if(!Wait || rWorkers.empty())
+		{
+			return;
+		}
+
+		BOX_INFO("Waiting for " << rWorkers.size() << " worker "
+			"processes to stop");
+		box_time_t deadline = GetCurrentBoxTime() +
+			SecondsToBoxTime(SERVERSTREAM_WORKER_STOP_TIMEOUT);
+		while(true)
+		{
+			for(typename std::map<pid_t, WorkerState>::iterator
+				i(rWorkers.begin()); i != rWorkers.end();)
+			{
+				int status;
+				pid_t p = ::waitpid(i->first, &status, WNOHANG);
+				if(p == i->first || (p == -1 && errno == ECHILD))
+				{
+					rWorkers.erase(i++);
+				}
+				else
+				{
+					++i;
+				}
+			}
+
+			if(rWorkers.empty())
+			{
+				break;
+			}
+
+			if(GetCurrentBoxTime() >= deadline)
+			{
+				BOX_WARNING("Killing " << rWorkers.size() <<
+					" worker processes which are still "
+					"busy after " <<
+					SERVERSTREAM_WORKER_STOP_TIMEOUT <<
+					" seconds");
+				for(typename std::map<pid_t, WorkerState>::iterator
+					i(rWorkers.begin());
+					i != rWorkers.end(); ++i)
+				{
+					::kill(i->first, SIGKILL);
+				}
+				for(typename std::map<pid_t, WorkerState>::iterator
+					i(rWorkers.begin());
+					i != rWorkers.end(); ++i)
+				{
+					int status;
+					while(::waitpid(i->first, &status, 0) == -1 &&
+						errno == EINTR)
+					{
+					}
+				}
+				rWorkers.clear();
+				break;
+			}
+
+			ShortSleep(MilliSecondsToBoxTime(100), false);
+		}
+	}
+	#endif // !WIN32
+
 private:
 	std::vector<SocketListen<StreamType, ListenBacklog> *> mSockets;
 };
 
 #define SERVERSTREAM_VERIFY_SERVER_KEYS(DEFAULT_ADDRESSES) \
 	ConfigurationVerifyKey("ListenAddresses", 0, DEFAULT_ADDRESSES), \
+	ConfigurationVerifyKey("MinWorkers", ConfigTest_IsInt, 0), \
+	ConfigurationVerifyKey("MaxWorkers", ConfigTest_IsInt), \
 	DAEMON_VERIFY_SERVER_KEYS 
 
 #include "MemLeakFindOff.h"
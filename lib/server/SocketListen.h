@@ -22,6 +22,7 @@
 #endif
 
 #ifndef WIN32
+	#include <fcntl.h>
 	#include <poll.h>
 #endif
 
@@ -81,7 +82,8 @@ class SocketListen
 public:
 	// Initialise
 	SocketListen()
-		: mSocketHandle(-1)
+		: mSocketHandle(-1),
+		  mNonBlocking(false)
 	{
 	}
 	// Close socket nicely
@@ -192,6 +194,39 @@ public:
 		}
 	}
 	
+#ifndef WIN32
+	// ------------------------------------------------------------------
+	//
+	// Function
+	//		Name:    SocketListen::SetNonBlocking(bool)
+	//		Purpose: Sets whether accepting a connection may fail
+	//			 instead of waiting, for sockets shared by
+	//			 several processes, where another one may
+	//			 accept the connection which woke them all.
+	//		Created: 2026/10/18
+	//
+	// ------------------------------------------------------------------
+	void SetNonBlocking(bool NonBlocking)
+	{
+		if(mSocketHandle == -1)
+		{
+			THROW_EXCEPTION(ServerException, BadSocketHandle);
+		}
+
+		int flags = ::fcntl(mSocketHandle, F_GETFL);
+		if(flags == -1 || ::fcntl(mSocketHandle, F_SETFL,
+			NonBlocking ? (flags | O_NONBLOCK)
+				: (flags & ~O_NONBLOCK)) == -1)
+		{
+			THROW_EXCEPTION_MESSAGE(ServerException,
+				SocketSetNonBlockingFailed,
+				BOX_SOCKET_ERROR_MESSAGE(mType, mName, mPort,
+					"Failed to change blocking mode"));
+		}
+		mNonBlocking = NonBlocking;
+	}
+#endif // !WIN32
+
 	// ------------------------------------------------------------------
 	//
 	// Function
@@ -199,7 +234,9 @@ public:
 	//		Purpose: Accepts a connection, returning a pointer to
 	//			 a class of the specified type. May return a
 	//			 null pointer if a signal happens, or there's
-	//			 a timeout. Timeout specified in
+	//			 a timeout, or if the socket is non-blocking
+	//			 and there's no connection to accept after
+	//			 all. Timeout specified in
 	//			 milliseconds, defaults to infinite time.
 	//		Created: 2003/07/31
 	//
@@ -267,6 +304,25 @@ public:
 		}
 
 		// Got socket (or error), unlock (implicit in destruction)
+#ifndef WIN32
+		if(sock == -1 && mNonBlocking && (errno == EAGAIN ||
+			errno == EWOULDBLOCK || errno == EINTR ||
+			errno == ECONNABORTED))
+		{
+			// Someone else accepted it first, or it went away
+			return std::auto_ptr<SocketType>();
+		}
+		else if(sock != -1 && mNonBlocking)
+		{
+			// Some systems pass the flag on to the new socket
+			int flags = ::fcntl(sock, F_GETFL);
+			if(flags != -1)
+			{
+				::fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+			}
+		}
+#endif // !WIN32
+
 		if(sock == -1)
 		{
 			THROW_EXCEPTION_MESSAGE(ServerException, SocketAcceptError,
@@ -324,6 +380,7 @@ public:
 	
 private:
 	int mSocketHandle;
+	bool mNonBlocking;
 };
 
 #include "MemLeakFindOff.h"
@@ -12,17 +12,24 @@
 #include <stdio.h>
 #include <string.h>
 
+#include <set>
+#include <vector>
+
 #include "Test.h"
 #include "BackupClientCryptoKeys.h"
+#include "BackupStoreConstants.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreFileEncodeStream.h"
 #include "BackupStoreFilenameClear.h"
+#include "FileHoles.h"
 #include "FileStream.h"
 #include "BackupStoreFileWire.h"
 #include "BackupStoreObjectMagic.h"
 #include "BackupStoreFileCryptVar.h"
 #include "BackupStoreException.h"
 #include "CollectInBufferStream.h"
+#include "CommonException.h"
+#include "SparseFileStream.h"
 
 #include "MemLeakFindOn.h"
 
@@ -386,6 +393,706 @@ void test_combined_diffs()
 	}
 }
 
+// Diff a file using several threads, and check that the result decodes to
+// the right thing. The blocks found may not be exactly the same as when
+// using a single thread, so the block counts aren't checked.
+void test_parallel_diff(int from, int to, int threads)
+{
+	char from_encoded[256];
+	sprintf(from_encoded, "testfiles/f%d.encoded", from);
+	char to_orig[256];
+	sprintf(to_orig, "testfiles/f%d", to);
+	char to_diff[256];
+	sprintf(to_diff, "testfiles/f%d.pardiff%d", to, threads);
+	char to_encoded[256];
+	sprintf(to_encoded, "testfiles/f%d.parenc%d", to, threads);
+	char to_testdec[256];
+	sprintf(to_testdec, "testfiles/f%d.pardec%d", to, threads);
+
+	bool completelyDifferent = true;
+	{
+		FileStream blockindex(from_encoded);
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+		BackupStoreFilenameClear f1name("filename");
+		FileStream out(to_diff, O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFileDiff(
+				to_orig,
+				1 /* dir ID */,
+				f1name,
+				1000 + from /* object ID of the file diffing from */,
+				blockindex,
+				IOStream::TimeOutInfinite,
+				NULL, // DiffTimer interface
+				0,
+				&completelyDifferent,
+				NULL, // BackgroundTask
+				threads));
+		encoded->CopyStreamTo(out);
+	}
+	TEST_THAT(!completelyDifferent);
+
+	{
+		FileStream diff(to_diff);
+		FileStream diff2(to_diff);
+		FileStream from(from_encoded);
+		FileStream out(to_encoded, O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+
+	{
+		FileStream enc(to_encoded);
+		BackupStoreFile::DecodeFile(enc, to_testdec,
+			IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical(to_orig, to_testdec));
+	}
+}
+
+// Check that a file which grows while it's being encoded still decodes to
+// what it was when the encoding started.
+void test_file_changed_while_encoding()
+{
+	{
+		FileStream in("testfiles/f1");
+		FileStream out("testfiles/f1.changing", O_WRONLY | O_CREAT | O_EXCL);
+		in.CopyStreamTo(out);
+	}
+
+	{
+		BackupStoreFilenameClear name("changing");
+		FileStream out("testfiles/f1.changing.encoded",
+			O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile(
+			"testfiles/f1.changing", 1 /* dir ID */, name));
+
+		// Encode the header and the first few blocks
+		char buffer[16384];
+		TEST_THAT(encoded->Read(buffer, sizeof(buffer)) == sizeof(buffer));
+		out.Write(buffer, sizeof(buffer));
+
+		FileStream append("testfiles/f1.changing", O_WRONLY | O_APPEND);
+		append.Write("more data", 9);
+		append.Close();
+
+		encoded->CopyStreamTo(out);
+	}
+
+	FileStream enc("testfiles/f1.changing.encoded");
+	BackupStoreFile::DecodeFile(enc, "testfiles/f1.changing.dec",
+		IOStream::TimeOutInfinite);
+	TEST_THAT(files_identical("testfiles/f1", "testfiles/f1.changing.dec"));
+}
+
+// Read the magic value of the block index of an encoded file
+int32_t get_block_index_magic(const char *filename)
+{
+	FileStream enc(filename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	return ntohl(hdr.mMagicValue);
+}
+
+// Encode a file with fast strong checksums, diff against it, and check that
+// the diff uses the same checksums as the file it's diffed from, whatever
+// the current setting, and that everything combines and decodes.
+void test_fast_checksums()
+{
+	BackupStoreFile::SetFastBlockChecksums(true);
+
+	{
+		BackupStoreFilenameClear f0name("f0");
+		FileStream out("testfiles/f0.fastenc", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile(
+			"testfiles/f0", 1 /* dir ID */, f0name));
+		encoded->CopyStreamTo(out);
+	}
+	TEST_EQUAL(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2,
+		get_block_index_magic("testfiles/f0.fastenc"));
+	{
+		FileStream enc("testfiles/f0.fastenc");
+		TEST_THAT(BackupStoreFile::VerifyEncodedFileFormat(enc));
+	}
+
+	// Diff a changed file against it, with fast checksums turned off, as
+	// they would be when talking to an old server
+	BackupStoreFile::SetFastBlockChecksums(false);
+	bool completelyDifferent = true;
+	{
+		FileStream blockindex("testfiles/f0.fastenc");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex);
+		BackupStoreFilenameClear f2name("filename");
+		FileStream out("testfiles/f2.fastdiff", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFileDiff(
+				"testfiles/f2",
+				1 /* dir ID */,
+				f2name,
+				1000 /* object ID of the file diffing from */,
+				blockindex,
+				IOStream::TimeOutInfinite,
+				NULL, // DiffTimer interface
+				0,
+				&completelyDifferent));
+		encoded->CopyStreamTo(out);
+	}
+	TEST_THAT(!completelyDifferent);
+	TEST_EQUAL(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2,
+		get_block_index_magic("testfiles/f2.fastdiff"));
+
+	{
+		FileStream diff("testfiles/f2.fastdiff");
+		FileStream diff2("testfiles/f2.fastdiff");
+		FileStream from("testfiles/f0.fastenc");
+		FileStream out("testfiles/f2.fastenc", O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+	TEST_EQUAL(OBJECTMAGIC_FILE_BLOCKS_MAGIC_VALUE_V2,
+		get_block_index_magic("testfiles/f2.fastenc"));
+
+	{
+		FileStream enc("testfiles/f2.fastenc");
+		BackupStoreFile::DecodeFile(enc, "testfiles/f2.fastdec",
+			IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/f2", "testfiles/f2.fastdec"));
+	}
+	{
+		FileStream index("testfiles/f2.fastenc");
+		BackupStoreFile::MoveStreamPositionToBlockIndex(index);
+		TEST_THAT(BackupStoreFile::CompareFileContentsAgainstBlockIndex(
+			"testfiles/f2", index, IOStream::TimeOutInfinite));
+	}
+
+	// A diff can't be combined with a file which uses the other kind of
+	// strong checksums
+	{
+		FileStream diff("testfiles/f2.fastdiff");
+		FileStream diff2("testfiles/f2.fastdiff");
+		FileStream from("testfiles/f0.encoded");
+		CollectInBufferStream out;
+		TEST_CHECK_THROWS(BackupStoreFile::CombineFile(diff, diff2, from,
+			out), BackupStoreException, BadBackupStoreFile);
+	}
+}
+
+// Count the blocks in the index of an encoded file which are stored in
+// the file itself, and those which refer to the file it was diffed from
+void count_encoded_blocks(const char *filename, int64_t &rNew, int64_t &rOld)
+{
+	FileStream enc(filename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+
+	rNew = 0;
+	rOld = 0;
+	for(int64_t b = box_ntoh64(hdr.mNumBlocks); b > 0; --b)
+	{
+		file_BlockIndexEntry en;
+		TEST_THAT(enc.ReadFullBuffer(&en, sizeof(en), 0));
+		if((int64_t)box_ntoh64(en.mEncodedSize) > 0)
+		{
+			rNew++;
+		}
+		else
+		{
+			rOld++;
+		}
+	}
+}
+
+// Count the blocks of an encoded file which are marked as being in holes,
+// checking that they're all encoded differently. Returns -1 if they aren't.
+int64_t count_distinct_hole_blocks(const char *filename)
+{
+	FileStream enc(filename);
+	BackupStoreFile::MoveStreamPositionToBlockIndex(enc);
+	IOStream::pos_type indexPosition = enc.GetPosition();
+	file_BlockIndexHeader hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+
+	// The blocks come just before the index, in order
+	std::vector<int64_t> holeBlockPositions;
+	std::vector<int64_t> holeBlockSizes;
+	int64_t position = 0;
+	for(int64_t b = 0; b < (int64_t)box_ntoh64(hdr.mNumBlocks); ++b)
+	{
+		file_BlockIndexEntry en;
+		TEST_THAT(enc.ReadFullBuffer(&en, sizeof(en), 0));
+		int64_t s = box_ntoh64(en.mEncodedSize);
+		TEST_THAT(s > 0);
+
+		uint64_t iv = box_hton64(box_ntoh64(hdr.mEntryIVBase) + b);
+		sBlowfishDecryptBlockEntry.SetIV(&iv);
+		file_BlockIndexEntryEnc entryEnc;
+		sBlowfishDecryptBlockEntry.TransformBlock(&entryEnc,
+			sizeof(entryEnc), en.mEnEnc, sizeof(en.mEnEnc));
+		if(ntohl(entryEnc.mWeakChecksum) == BLOCK_INDEX_HOLE_WEAK_CHECKSUM)
+		{
+			holeBlockPositions.push_back(position);
+			holeBlockSizes.push_back(s);
+		}
+		position += s;
+	}
+
+	std::set<std::string> holeBlocks;
+	for(size_t h = 0; h < holeBlockPositions.size(); ++h)
+	{
+		enc.Seek(indexPosition - position + holeBlockPositions[h],
+			IOStream::SeekType_Absolute);
+		std::string block(holeBlockSizes[h], '\0');
+		TEST_THAT(enc.ReadFullBuffer(&block[0], block.size(), 0));
+		holeBlocks.insert(block);
+	}
+
+	TEST_EQUAL(holeBlockPositions.size(), holeBlocks.size());
+	return (holeBlockPositions.size() == holeBlocks.size())
+		? (int64_t)holeBlocks.size() : -1;
+}
+
+// Read the options from the header of an encoded file
+int32_t get_file_options(const char *filename)
+{
+	FileStream enc(filename);
+	file_StreamFormat hdr;
+	TEST_THAT(enc.ReadFullBuffer(&hdr, sizeof(hdr), 0));
+	return ntohl(hdr.mOptions);
+}
+
+// Diff a file against an encoded one, combine the diff with it, and check
+// that the result decodes to the file. The options from the header of the
+// encoded file are passed to the diff, unless pass_options is false, as
+// when the server is too old to return them.
+void diff_and_combine(const char *from_encoded, const char *to_orig,
+	const char *to_diff, const char *to_encoded, const char *to_decoded,
+	bool pass_options = true)
+{
+	bool completelyDifferent = true;
+	{
+		FileStream blockindex(from_encoded);
+		int32_t options = 0;
+		BackupStoreFile::MoveStreamPositionToBlockIndex(blockindex,
+			&options);
+		TEST_EQUAL(get_file_options(from_encoded), options);
+		BackupStoreFilenameClear name("filename");
+		FileStream out(to_diff, O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(
+			BackupStoreFile::EncodeFileDiff(
+				to_orig,
+				1 /* dir ID */,
+				name,
+				2000 /* object ID of the file diffing from */,
+				blockindex,
+				IOStream::TimeOutInfinite,
+				NULL, // DiffTimer interface
+				0,
+				&completelyDifferent,
+				NULL, // BackgroundTask
+				1, // DiffingThreads
+				CompressCodec::Zlib, 0,
+				pass_options ? &options : NULL));
+		encoded->CopyStreamTo(out);
+	}
+	TEST_THAT(!completelyDifferent);
+
+	{
+		FileStream diff(to_diff);
+		FileStream diff2(to_diff);
+		FileStream from(from_encoded);
+		FileStream out(to_encoded, O_WRONLY | O_CREAT | O_EXCL);
+		BackupStoreFile::CombineFile(diff, diff2, from, out);
+	}
+
+	{
+		FileStream enc(to_encoded);
+		BackupStoreFile::DecodeFile(enc, to_decoded,
+			IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical(to_orig, to_decoded));
+	}
+}
+
+// Encode a file split into content defined chunks, then diff a version
+// with data inserted near the start and changed in the middle against it,
+// and check that only the chunks around the changes are uploaded again.
+void test_content_defined_chunking()
+{
+	// Random data, so that the rolling checksum search for the most
+	// common block sizes won't find much if chunks aren't looked up.
+	std::vector<uint8_t> data(1024*1024);
+	uint32_t seed = 0x12345678;
+	for(size_t i = 0; i < data.size(); ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t)(seed >> 16);
+	}
+	{
+		FileStream out("testfiles/cdc0", O_WRONLY | O_CREAT | O_EXCL);
+		out.Write(&data[0], data.size());
+	}
+	data.insert(data.begin() + 1000, 100, (uint8_t)'x');
+	for(int i = 0; i < 10; ++i)
+	{
+		data[600000 + i] ^= 0xff;
+	}
+	{
+		FileStream out("testfiles/cdc1", O_WRONLY | O_CREAT | O_EXCL);
+		out.Write(&data[0], data.size());
+	}
+
+	BackupStoreFile::SetContentDefinedChunking(true);
+
+	{
+		BackupStoreFilenameClear name("cdc0");
+		FileStream out("testfiles/cdc0.encoded", O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile(
+			"testfiles/cdc0", 1 /* dir ID */, name));
+		encoded->CopyStreamTo(out);
+	}
+	TEST_EQUAL((FILE_OPTION_CONTENT_DEFINED_CHUNKS |
+		(12 << FILE_OPTION_CHUNK_SIZE_SHIFT)),
+		get_file_options("testfiles/cdc0.encoded"));
+	{
+		FileStream enc("testfiles/cdc0.encoded");
+		TEST_THAT(BackupStoreFile::VerifyEncodedFileFormat(enc));
+		enc.Seek(0, IOStream::SeekType_Absolute);
+		BackupStoreFile::DecodeFile(enc, "testfiles/cdc0.decoded",
+			IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical("testfiles/cdc0", "testfiles/cdc0.decoded"));
+	}
+
+	int64_t chunks, none;
+	count_encoded_blocks("testfiles/cdc0.encoded", chunks, none);
+	TEST_THAT(none == 0);
+	TEST_THAT(chunks > 128 && chunks < 512);
+
+	diff_and_combine("testfiles/cdc0.encoded", "testfiles/cdc1",
+		"testfiles/cdc1.diff", "testfiles/cdc1.encoded",
+		"testfiles/cdc1.decoded");
+	TEST_EQUAL(get_file_options("testfiles/cdc0.encoded"),
+		get_file_options("testfiles/cdc1.diff"));
+
+	// Each change should only affect a chunk or two
+	int64_t nnew, nold;
+	count_encoded_blocks("testfiles/cdc1.diff", nnew, nold);
+	TEST_THAT(nnew >= 2 && nnew <= 6);
+	TEST_THAT(nold >= chunks - 4);
+
+	// Without the options from the old version's header, its chunk
+	// size isn't known, so its chunks aren't looked up, and little of
+	// the random data is found by the rolling checksum search.
+	diff_and_combine("testfiles/cdc0.encoded", "testfiles/cdc1",
+		"testfiles/cdc1.nooptsdiff", "testfiles/cdc1.nooptsenc",
+		"testfiles/cdc1.nooptsdec", false);
+	int64_t unew, uold;
+	count_encoded_blocks("testfiles/cdc1.nooptsdiff", unew, uold);
+	TEST_THAT(uold < nold / 2);
+
+	// Diffing a file with fixed size blocks falls back to the rolling
+	// checksum search, and splits the new data into chunks
+	diff_and_combine("testfiles/f0.encoded", "testfiles/f2",
+		"testfiles/f2.cdcdiff", "testfiles/f2.cdcenc",
+		"testfiles/f2.cdcdec");
+	TEST_EQUAL((FILE_OPTION_CONTENT_DEFINED_CHUNKS |
+		(12 << FILE_OPTION_CHUNK_SIZE_SHIFT)),
+		get_file_options("testfiles/f2.cdcdiff"));
+	count_encoded_blocks("testfiles/f2.cdcdiff", nnew, nold);
+	TEST_THAT(nold == 32);
+
+	BackupStoreFile::SetContentDefinedChunking(false);
+}
+
+// Write some pseudo-random data to a file, appending if it exists
+void write_random_data(const char *filename, int size, uint32_t seed)
+{
+	std::vector<uint8_t> data(size);
+	for(size_t i = 0; i < data.size(); ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t)(seed >> 16);
+	}
+	FileStream out(filename, O_WRONLY | O_CREAT | O_APPEND);
+	out.Write(&data[0], data.size());
+}
+
+// Diff a file which has only had data added to the end, and check that
+// every old block is used, and only the data added is uploaded.
+void test_append_only_diff()
+{
+	write_random_data("testfiles/append0", 300000, 1);
+	{
+		BackupStoreFilenameClear name("append0");
+		FileStream out("testfiles/append0.encoded",
+			O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile(
+			"testfiles/append0", 1 /* dir ID */, name));
+		encoded->CopyStreamTo(out);
+	}
+	int64_t blocks, none;
+	count_encoded_blocks("testfiles/append0.encoded", blocks, none);
+	TEST_THAT(blocks > 2);
+
+	TEST_THAT(::rename("testfiles/append0", "testfiles/append1") == 0);
+	write_random_data("testfiles/append1", 50000, 2);
+	diff_and_combine("testfiles/append0.encoded", "testfiles/append1",
+		"testfiles/append1.diff", "testfiles/append1.encoded",
+		"testfiles/append1.decoded");
+	int64_t nnew, nold;
+	count_encoded_blocks("testfiles/append1.diff", nnew, nold);
+	TEST_EQUAL(blocks, nold);
+	TEST_THAT(nnew > 0);
+
+	// If the old data has changed too, the file is searched as usual
+	{
+		FileStream file("testfiles/append1", O_WRONLY);
+		file.Seek(1000, IOStream::SeekType_Absolute);
+		file.Write("changed", 7);
+	}
+	diff_and_combine("testfiles/append0.encoded", "testfiles/append1",
+		"testfiles/append2.diff", "testfiles/append2.encoded",
+		"testfiles/append2.decoded");
+	count_encoded_blocks("testfiles/append2.diff", nnew, nold);
+	TEST_THAT(nold > 0 && nold < blocks);
+}
+
+// Encode a file, and check that it decodes to the original, returning
+// the number of blocks it was split into
+int64_t encode_and_check(const char *orig, const char *encoded_name,
+	const char *decoded_name)
+{
+	{
+		BackupStoreFilenameClear name("filename");
+		FileStream out(encoded_name, O_WRONLY | O_CREAT | O_EXCL);
+		std::auto_ptr<IOStream> encoded(BackupStoreFile::EncodeFile(
+			orig, 1 /* dir ID */, name));
+		encoded->CopyStreamTo(out);
+	}
+	{
+		FileStream enc(encoded_name);
+		TEST_THAT(BackupStoreFile::VerifyEncodedFileFormat(enc));
+		enc.Seek(0, IOStream::SeekType_Absolute);
+		BackupStoreFile::DecodeFile(enc, decoded_name,
+			IOStream::TimeOutInfinite);
+		TEST_THAT(files_identical(orig, decoded_name));
+	}
+	int64_t blocks, none;
+	count_encoded_blocks(encoded_name, blocks, none);
+	TEST_EQUAL(0, none);
+	return blocks;
+}
+
+// Encode and diff files with several encoding threads, and check that they're split into the same blocks as when
+// they're encoded one block at a time, and decode to the same data. (The
+// encoded data itself differs, as every block has a random IV.)
+void test_parallel_encoding()
+{
+	int64_t serial = encode_and_check("testfiles/append1",
+		"testfiles/append1.serial", "testfiles/append1.serialdec");
+	int64_t snew, sold;
+	count_encoded_blocks("testfiles/append2.diff", snew, sold);
+	int64_t cnew, cold;
+	count_encoded_blocks("testfiles/cdc1.diff", cnew, cold);
+
+	BackupStoreFile::SetEncodingThreads(4);
+
+	TEST_EQUAL(serial, encode_and_check("testfiles/append1",
+		"testfiles/append1.par", "testfiles/append1.pardec"));
+
+	// Fixed size blocks, with some from the old file
+	diff_and_combine("testfiles/append0.encoded", "testfiles/append1",
+		"testfiles/append3.diff", "testfiles/append3.enc",
+		"testfiles/append3.dec");
+	int64_t nnew, nold;
+	count_encoded_blocks("testfiles/append3.diff", nnew, nold);
+	TEST_EQUAL(snew, nnew);
+	TEST_EQUAL(sold, nold);
+
+	// Content defined chunks
+	BackupStoreFile::SetContentDefinedChunking(true);
+	diff_and_combine("testfiles/cdc0.encoded", "testfiles/cdc1",
+		"testfiles/cdc1.pardiff", "testfiles/cdc1.parenc",
+		"testfiles/cdc1.pardec");
+	BackupStoreFile::SetContentDefinedChunking(false);
+	count_encoded_blocks("testfiles/cdc1.pardiff", nnew, nold);
+	TEST_EQUAL(cnew, nnew);
+	TEST_EQUAL(cold, nold);
+
+	BackupStoreFile::SetEncodingThreads(1);
+}
+
+// Decode files with several decoding threads, which decode the blocks after
+// the one being read, and check that they decode to the same data, and that
+// diffs and damaged blocks are still rejected.
+void test_parallel_decoding()
+{
+	BackupStoreFile::SetDecodingThreads(4);
+	{
+		FileStream enc("testfiles/append1.serial");
+		BackupStoreFile::DecodeFile(enc, "testfiles/append1.threadsdec",
+			IOStream::TimeOutInfinite);
+	}
+	TEST_THAT(files_identical("testfiles/append1",
+		"testfiles/append1.threadsdec"));
+
+	// Diffs don't contain all the blocks
+	{
+		FileStream enc("testfiles/append2.diff");
+		TEST_CHECK_THROWS(BackupStoreFile::DecodeFile(enc,
+			"testfiles/append2.threadsdec",
+			IOStream::TimeOutInfinite), BackupStoreException,
+			CannotDecodeDiffedFilesWithoutCombining);
+	}
+	TEST_THAT(!TestFileExists("testfiles/append2.threadsdec"));
+
+	// Damage a block in the middle of the file
+	{
+		FileStream enc("testfiles/append1.serial");
+		FileStream out("testfiles/append1.damaged",
+			O_WRONLY | O_CREAT | O_EXCL);
+		enc.CopyStreamTo(out);
+	}
+	{
+		FileStream out("testfiles/append1.damaged", O_WRONLY);
+		out.Seek(TestGetFileSize("testfiles/append1.damaged") / 2,
+			IOStream::SeekType_Absolute);
+		out.Write("damaged", 7);
+	}
+	{
+		FileStream enc("testfiles/append1.damaged");
+		TEST_CHECK_THROWS(BackupStoreFile::DecodeFile(enc,
+			"testfiles/append1.damageddec",
+			IOStream::TimeOutInfinite), CommonException,
+			ThreadFailed);
+	}
+	TEST_THAT(!TestFileExists("testfiles/append1.damageddec"));
+	BackupStoreFile::SetDecodingThreads(1);
+}
+
+// Write a sparse file, with holes between and after some random data, and
+// zeros which aren't in a hole after the first of it
+void write_sparse_file(const char *filename, uint32_t seed)
+{
+	std::vector<uint8_t> data(6 * 1024 * 1024, 0);
+	for(int i = 0; i < 200000; ++i)
+	{
+		seed = seed * 1103515245 + 12345;
+		data[i] = (uint8_t)(seed >> 16);
+		data[4 * 1024 * 1024 + i] = (uint8_t)(seed >> 8);
+	}
+	SparseFileStream out(filename, O_WRONLY | O_CREAT | O_TRUNC);
+	FileHoles holes;
+	holes.Add(1024 * 1024, 3 * 1024 * 1024);
+	holes.Add(5 * 1024 * 1024, 1024 * 1024);
+	out.SetHoles(holes);
+	out.Write(&data[0], data.size());
+	out.Close();
+}
+
+// Encode, decode and diff sparse files, with the blocks in holes not read,
+// and check that they're restored with holes if the file system has them.
+void test_sparse_files()
+{
+	write_sparse_file("testfiles/sparse0", 4);
+	FileHoles holes;
+	bool haveHoles = holes.Find("testfiles/sparse0") && !holes.IsEmpty();
+	if(!haveHoles)
+	{
+		BOX_NOTICE("File system doesn't support holes, not testing "
+			"that sparse files are restored sparse");
+	}
+
+	int64_t serial = encode_and_check("testfiles/sparse0",
+		"testfiles/sparse0.encoded", "testfiles/sparse0.decoded");
+	if(haveHoles)
+	{
+		FileHoles decodedHoles;
+		TEST_THAT(decodedHoles.Find("testfiles/sparse0.decoded"));
+		TEST_EQUAL(holes.GetNumberOfHoles(),
+			decodedHoles.GetNumberOfHoles());
+		// Zeros which weren't in a hole aren't restored as one
+		TEST_THAT(!holes.Contains(512 * 1024, 4096));
+		TEST_THAT(!decodedHoles.Contains(512 * 1024, 4096));
+	}
+
+	// The blocks in holes are marked, but not encoded the same, as that
+	// would show the store which they are
+	if(haveHoles)
+	{
+		TEST_THAT(count_distinct_hole_blocks("testfiles/sparse0.encoded") > 1);
+	}
+
+	// The blocks of zeros compress to next to nothing
+	TEST_THAT(TestGetFileSize("testfiles/sparse0.encoded") < 1024 * 1024);
+
+	BackupStoreFile::SetEncodingThreads(4);
+	TEST_EQUAL(serial, encode_and_check("testfiles/sparse0",
+		"testfiles/sparse0.par", "testfiles/sparse0.pardec"));
+	BackupStoreFile::SetEncodingThreads(1);
+
+	// Change some of the data, and diff it from the first version,
+	// which finds the blocks of zeros too
+	write_sparse_file("testfiles/sparse1", 4);
+	{
+		FileStream file("testfiles/sparse1", O_WRONLY);
+		file.Seek(4 * 1024 * 1024 + 1000, IOStream::SeekType_Absolute);
+		file.Write("changed", 7);
+	}
+	diff_and_combine("testfiles/sparse0.encoded", "testfiles/sparse1",
+		"testfiles/sparse1.diff", "testfiles/sparse1.encoded",
+		"testfiles/sparse1.decoded");
+	int64_t nnew, nold;
+	count_encoded_blocks("testfiles/sparse1.diff", nnew, nold);
+	TEST_THAT(nnew >= 1 && nnew <= 3);
+	TEST_EQUAL(serial, nnew + nold);
+
+	// The blocks in holes which were reused are still marked
+	if(haveHoles)
+	{
+		FileHoles decodedHoles;
+		TEST_THAT(decodedHoles.Find("testfiles/sparse1.decoded"));
+		TEST_EQUAL(holes.GetNumberOfHoles(),
+			decodedHoles.GetNumberOfHoles());
+		TEST_THAT(!decodedHoles.Contains(512 * 1024, 4096));
+	}
+}
+
+// Check that huge files are only split into blocks bigger than the usual
+// maximum when large blocks are enabled, and then into few enough blocks
+// to keep the block index small.
+void test_large_blocks()
+{
+	int64_t numBlocks;
+	int32_t blockSize, lastBlockSize;
+	const int64_t gigabyte = 1024 * 1024 * 1024;
+
+	// 2 TB
+	BackupStoreFileEncodeStream::CalculateBlockSizes(2048 * gigabyte,
+		numBlocks, blockSize, lastBlockSize);
+	TEST_EQUAL(BACKUP_FILE_MAX_BLOCK_SIZE, blockSize);
+	TEST_EQUAL(4 * 1024 * 1024, numBlocks);
+
+	BackupStoreFile::SetLargeBlocks(true);
+	BackupStoreFileEncodeStream::CalculateBlockSizes(2048 * gigabyte,
+		numBlocks, blockSize, lastBlockSize);
+	TEST_EQUAL(BACKUP_FILE_MAX_LARGE_BLOCK_SIZE, blockSize);
+	TEST_EQUAL(128 * 1024, numBlocks);
+	TEST_EQUAL(BACKUP_FILE_MAX_LARGE_BLOCK_SIZE, lastBlockSize);
+
+	// Files which aren't huge are split as usual
+	BackupStoreFileEncodeStream::CalculateBlockSizes(10 * gigabyte + 1,
+		numBlocks, blockSize, lastBlockSize);
+	TEST_EQUAL(BACKUP_FILE_MAX_BLOCK_SIZE, blockSize);
+	TEST_EQUAL(20480, numBlocks);
+	TEST_EQUAL(BACKUP_FILE_MAX_BLOCK_SIZE + 1, lastBlockSize);
+
+	// And the blocks of those in between grow only as far as necessary
+	BackupStoreFileEncodeStream::CalculateBlockSizes(64 * gigabyte - 1,
+		numBlocks, blockSize, lastBlockSize);
+	TEST_EQUAL(2 * 1024 * 1024, blockSize);
+	TEST_EQUAL(BACKUP_FILE_INCREASE_LARGE_BLOCK_SIZE_AFTER, numBlocks);
+	TEST_EQUAL(blockSize - 1, lastBlockSize);
+	BackupStoreFile::SetLargeBlocks(false);
+}
+
 int test(int argc, const char *argv[])
 {
 	// Want to trace out all the details
@@ -459,6 +1166,36 @@ int test(int argc, const char *argv[])
 	
 	// Test that combining diffs works
 	test_combined_diffs();
+
+	// Test that diffing with several threads gives the same files back
+	for(int f = 0; f < 7; ++f)
+	{
+		test_parallel_diff(f, f + 1, 2);
+		test_parallel_diff(f, f + 1, 4);
+	}
+
+	test_file_changed_while_encoding();
+
+	// Test fast strong checksums
+	test_fast_checksums();
+
+	// Test content defined chunking
+	test_content_defined_chunking();
+
+	// Test diffing files which have had data added to the end
+	test_append_only_diff();
+
+	// Test encoding blocks on several threads
+	test_parallel_encoding();
+
+	// Test decoding blocks on several threads
+	test_parallel_decoding();
+
+	// Test encoding and restoring sparse files
+	test_sparse_files();
+
+	// Test block sizes for huge files
+	test_large_blocks();
 	
 	// Check zero sized file works OK to encode on its own, using normal encoding
 	{
@@ -13,24 +13,33 @@
 #include <string.h>
 
 #include "Archive.h"
+#include "BackupClientCompareQueue.h"
 #include "BackupClientCryptoKeys.h"
 #include "BackupClientFileAttributes.h"
+#include "BackupClientRestore.h"
+#include "BackupClientRestoreJournal.h"
 #include "BackupProtocol.h"
 #include "BackupStoreAccountDatabase.h"
 #include "BackupStoreAccounts.h"
+#include "BackupStoreCombinedFileCache.h"
 #include "BackupStoreConfigVerify.h"
 #include "BackupStoreConstants.h"
 #include "BackupStoreDirectory.h"
+#include "BackupStoreDirectoryJournal.h"
 #include "BackupStoreException.h"
 #include "BackupStoreFile.h"
 #include "BackupStoreFilenameClear.h"
 #include "BackupStoreFileEncodeStream.h"
+#include "BackupStoreFileWire.h"
 #include "BackupStoreInfo.h"
 #include "BackupStoreObjectMagic.h"
 #include "BackupStoreRefCountDatabase.h"
 #include "BoxPortsAndFiles.h"
 #include "CollectInBufferStream.h"
+#include "CompressCodec.h"
+#include "CompressException.h"
 #include "Configuration.h"
+#include "FileModificationTime.h"
 #include "FileStream.h"
 #include "HousekeepStoreAccount.h"
 #include "MemBlockStream.h"
@@ -38,6 +47,7 @@
 #include "RaidFileException.h"
 #include "RaidFileRead.h"
 #include "RaidFileWrite.h"
+#include "Random.h"
 #include "SSLLib.h"
 #include "ServerControl.h"
 #include "Socket.h"
@@ -435,6 +445,237 @@ bool test_backupstore_directory()
 			TEST_THAT(dir2.GetNumberOfEntries() == DIR_FILES - 1);
 		}
 
+		// Look entries up by ID and by name, while changing the
+		// directory after the indexes have been built
+		{
+			BackupStoreFilenameClear names[10];
+			BackupStoreDirectory d1(20, 12);
+			for(int e = 0; e < 100; ++e)
+			{
+				std::ostringstream name;
+				name << "name" << (e % 10);
+				names[e % 10] = BackupStoreFilenameClear(name.str());
+				d1.AddEntry(names[e % 10], e, e + 1, 1,
+					(e < 90)
+					? (BackupStoreDirectory::Entry::Flags_File |
+						BackupStoreDirectory::Entry::Flags_OldVersion)
+					: BackupStoreDirectory::Entry::Flags_File, 0);
+			}
+
+			TEST_THAT(d1.FindEntryByID(0) == 0);
+			TEST_THAT(d1.FindEntryByID(101) == 0);
+			for(int e = 0; e < 100; ++e)
+			{
+				BackupStoreDirectory::Entry *en =
+					d1.FindEntryByID(e + 1);
+				TEST_THAT(en != 0 && en->GetName() == names[e % 10]);
+			}
+
+			std::vector<BackupStoreDirectory::Entry *> found;
+			d1.FindEntriesByName(names[3], found);
+			TEST_EQUAL(10, found.size());
+			d1.FindEntriesByName(names[3], found,
+				BackupStoreDirectory::Entry::Flags_File,
+				BackupStoreDirectory::Entry::Flags_OldVersion);
+			TEST_EQUAL(1, found.size());
+			TEST_EQUAL(94, found[0]->GetObjectID());
+			d1.FindEntriesByName(BackupStoreFilenameClear("missing"),
+				found);
+			TEST_EQUAL(0, found.size());
+
+			d1.DeleteEntry(94);
+			TEST_THAT(d1.FindEntryByID(94) == 0);
+			d1.FindEntriesByName(names[3], found);
+			TEST_EQUAL(9, found.size());
+			TEST_CHECK_THROWS(d1.DeleteEntry(94), BackupStoreException,
+				CouldNotFindEntryInDirectory);
+
+			BackupStoreFilenameClear newName("newname");
+			d1.AddEntry(names[3], 200, 200, 1,
+				BackupStoreDirectory::Entry::Flags_File, 0);
+			TEST_THAT(d1.FindEntryByID(200) != 0);
+			d1.RenameEntry(d1.FindEntryByID(200), newName);
+			d1.FindEntriesByName(names[3], found);
+			TEST_EQUAL(9, found.size());
+			d1.FindEntriesByName(newName, found);
+			TEST_EQUAL(1, found.size());
+			TEST_EQUAL(200, found[0]->GetObjectID());
+			TEST_THAT(d1.NameInUse(newName));
+
+			// A copy read back from a stream finds the same entries
+			CollectInBufferStream stream;
+			d1.WriteToStream(stream);
+			stream.SetForReading();
+			BackupStoreDirectory d2(stream);
+			TEST_EQUAL(100, d2.GetNumberOfEntries());
+			TEST_THAT(d2.FindEntryByID(94) == 0);
+			TEST_THAT(d2.FindEntryByID(93) != 0);
+			d2.FindEntriesByName(newName, found);
+			TEST_EQUAL(1, found.size());
+			d2.FindEntriesByName(names[3], found);
+			TEST_EQUAL(9, found.size());
+
+			// Only a damaged directory has two entries with the same
+			// ID. The first is found until it's deleted.
+			d2.AddEntry(names[5], 0, 1, 1,
+				BackupStoreDirectory::Entry::Flags_File, 0);
+			TEST_THAT(d2.FindEntryByID(1)->GetName() == names[0]);
+			d2.DeleteEntry(1);
+			TEST_THAT(d2.FindEntryByID(1) != 0 &&
+				d2.FindEntryByID(1)->GetName() == names[5]);
+		}
+
+		// Deleting entries leaves the rest in the same order, which
+		// housekeeping relies on, both before and after the slots
+		// they leave are removed
+		{
+			BackupStoreFilenameClear name("name");
+			BackupStoreDirectory d1(21, 12);
+			for(int e = 1; e <= 99; ++e)
+			{
+				d1.AddEntry(name, e, e, 1,
+					BackupStoreDirectory::Entry::Flags_File, 0);
+			}
+
+			for(int e = 1; e <= 99; ++e)
+			{
+				if(e % 3 == 0)
+				{
+					continue;
+				}
+				d1.DeleteEntry(e);
+				TEST_THAT(d1.FindEntryByID(e) == 0);
+
+				int64_t last = 0;
+				unsigned int count = 0;
+				BackupStoreDirectory::Iterator i(d1);
+				BackupStoreDirectory::Entry *en = 0;
+				while((en = i.Next()) != 0)
+				{
+					TEST_THAT(en->GetObjectID() > last);
+					TEST_THAT(d1.FindEntryByID(en->GetObjectID()) == en);
+					last = en->GetObjectID();
+					++count;
+				}
+				TEST_EQUAL(d1.GetNumberOfEntries(), count);
+			}
+			TEST_EQUAL(33, d1.GetNumberOfEntries());
+
+			int64_t next = 99;
+			BackupStoreDirectory::ReverseIterator r(d1);
+			BackupStoreDirectory::Entry *en = 0;
+			while((en = r.Next()) != 0)
+			{
+				TEST_EQUAL(next, en->GetObjectID());
+				next -= 3;
+			}
+			TEST_EQUAL(0, next);
+
+			// Only the entries left are written
+			CollectInBufferStream stream;
+			d1.WriteCompactToStream(stream);
+			stream.SetForReading();
+			BackupStoreDirectory d2(stream);
+			TEST_EQUAL(33, d2.GetNumberOfEntries());
+			TEST_THAT(d2.FindEntryByID(3) != 0);
+			TEST_THAT(d2.FindEntryByID(4) == 0);
+
+			// Finding and deleting entries by ID doesn't decode their
+			// names, so using one afterwards adds it to the memory
+			// used
+			d2.DeleteEntry(3);
+			BackupStoreDirectory::Entry *psix = d2.FindEntryByID(6);
+			int64_t before = d2.GetMemoryUsage();
+			TEST_THAT(psix->GetName() == name);
+			TEST_EQUAL(before + (int64_t)name.GetEncodedFilename().size(),
+				d2.GetMemoryUsage());
+		}
+
+		// Store a directory in the compact format, which is read
+		// without decoding the names and attributes of the entries
+		{
+			int attrI[4] = {1, 2, 3, 4};
+			StreamableMemBlock attr(attrI, sizeof(attrI));
+			BackupStoreDirectory d1(30, 12);
+			d1.SetAttributes(attr, 4358973984LL);
+			for(int e = 0; e < DIR_NUM; ++e)
+			{
+				BackupStoreDirectory::Entry *en = d1.AddEntry(
+					ens[e].fn, ens[e].mod, ens[e].id,
+					ens[e].size, ens[e].flags, ens[e].attrmod);
+				if(e % 3 == 0)
+				{
+					en->SetAttributes(attr, e);
+				}
+			}
+			d1.FindEntryByID(ens[8].id)->SetDependsNewer(ens[9].id);
+			d1.FindEntryByID(ens[9].id)->SetDependsOlder(ens[8].id);
+
+			CollectInBufferStream compact;
+			d1.WriteCompactToStream(compact);
+			compact.SetForReading();
+			BackupStoreDirectory d2(compact);
+			TEST_EQUAL(DIR_NUM, d2.GetNumberOfEntries());
+			TEST_EQUAL(30, d2.GetObjectID());
+			TEST_EQUAL(12, d2.GetContainerID());
+			TEST_THAT(d2.GetAttributes() == attr);
+			TEST_EQUAL(4358973984LL, d2.GetAttributesModTime());
+			TEST_THAT(d2.FindEntryByID(ens[3].id)->HasAttributes());
+			TEST_THAT(!d2.FindEntryByID(ens[4].id)->HasAttributes());
+			TEST_EQUAL(ens[9].id,
+				d2.FindEntryByID(ens[8].id)->GetDependsNewer());
+			CheckEntries(d2, BackupStoreDirectory::Entry::Flags_INCLUDE_EVERYTHING, BackupStoreDirectory::Entry::Flags_EXCLUDE_NOTHING);
+
+			// Both formats written from it are the same as those
+			// written from the original, whether or not the names
+			// and attributes have been decoded
+			for(int decoded = 0; decoded < 2; ++decoded)
+			{
+				CollectInBufferStream again;
+				MemBlockStream source(compact);
+				BackupStoreDirectory d4(source);
+				(decoded ? d2 : d4).WriteCompactToStream(again);
+				TEST_EQUAL(compact.GetSize(), again.GetSize());
+				TEST_THAT(::memcmp(compact.GetBuffer(),
+					again.GetBuffer(), compact.GetSize()) == 0);
+			}
+			CollectInBufferStream standard1, standard2;
+			d1.WriteToStream(standard1);
+			d2.WriteToStream(standard2);
+			TEST_EQUAL(standard1.GetSize(), standard2.GetSize());
+			TEST_THAT(::memcmp(standard1.GetBuffer(),
+				standard2.GetBuffer(), standard1.GetSize()) == 0);
+
+			// Copies of entries don't depend on the directory
+			std::auto_ptr<BackupStoreDirectory::Entry> apCopy;
+			{
+				MemBlockStream source(compact);
+				BackupStoreDirectory d4(source);
+				apCopy.reset(new BackupStoreDirectory::Entry(
+					*d4.FindEntryByID(ens[0].id)));
+			}
+			TEST_THAT(apCopy->GetName() == ens[0].fn);
+			TEST_THAT(apCopy->GetAttributes() == attr);
+
+			// Truncated or corrupt directories can't be read
+			{
+				MemBlockStream truncated(compact.GetBuffer(),
+					compact.GetSize() - 1);
+				TEST_CHECK_THROWS(BackupStoreDirectory d4(truncated),
+					BackupStoreException,
+					CouldntReadEntireStructureFromStream);
+			}
+			{
+				std::string corrupt((const char *)compact.GetBuffer(),
+					compact.GetSize());
+				// The data offset of the first entry
+				corrupt[40 + 48] = 0x7f;
+				MemBlockStream source(corrupt);
+				TEST_CHECK_THROWS(BackupStoreDirectory d4(source),
+					BackupStoreException, BadDirectoryFormat);
+			}
+		}
+
 		// Check attributes
 		{
 			int attrI[4] = {1, 2, 3, 4};
@@ -797,6 +1038,37 @@ std::auto_ptr<RaidFileRead> get_raid_file(int64_t ObjectID)
 	return RaidFileRead::Open(0, filename);
 }
 
+// Reads a directory with its journal applied, and returns its size in blocks,
+// including the journal, as recorded in its parent's entry for it
+int64_t read_directory(int64_t ObjectID, BackupStoreDirectory &rDirOut)
+{
+	std::string filename;
+	StoreStructure::MakeObjectFilename(ObjectID,
+		"backup/01234567/" /* mStoreRoot */, 0 /* mStoreDiscSet */,
+		filename, false /* EnsureDirectoryExists */);
+	int64_t size = 0;
+	BackupStoreDirectoryJournal::ReadDirectory(0, filename, rDirOut, &size);
+	return size;
+}
+
+int64_t get_directory_size(int64_t ObjectID)
+{
+	BackupStoreDirectory dir;
+	return read_directory(ObjectID, dir);
+}
+
+// A writable local connection to the test account, which lets tests get at
+// its BackupStoreContext to configure and inspect it
+class ContextProtocolLocal : public BackupProtocolLocal2
+{
+public:
+	ContextProtocolLocal()
+	: BackupProtocolLocal2(0x01234567, "test", "backup/01234567/",
+		0, false)
+	{ }
+	using BackupProtocolLocal2::GetContext;
+};
+
 int64_t create_directory(BackupProtocolCallable& protocol,
 	int64_t parent_dir_id = BACKUPSTORE_ROOT_DIRECTORY_ID);
 int64_t create_file(BackupProtocolCallable& protocol, int64_t subdirid,
@@ -846,6 +1118,87 @@ bool test_temporary_refcount_db_is_independent()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+// Make random changes to reference counts, through a mapping and through
+// the file, and check that they're all there after committing them, logging
+// how many changes per second each way could make.
+bool test_refcount_database_random_updates()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	std::auto_ptr<BackupStoreAccountDatabase> apAccounts(
+		BackupStoreAccountDatabase::Read("testfiles/accounts.txt"));
+	const BackupStoreAccountDatabase::Entry &rAccount(
+		apAccounts->GetEntry(0x1234567));
+	const int numObjects = 100000, numUpdates = 200000;
+
+	for(int mapped = 0; mapped < 2; ++mapped)
+	{
+		BackupStoreRefCountDatabase::UseMappedFiles = (mapped != 0);
+		std::vector<BackupStoreRefCountDatabase::refcount_t>
+			expected(numObjects + 1, 0);
+		expected[BACKUPSTORE_ROOT_DIRECTORY_ID] = 1;
+		R250 random(numObjects);
+
+		std::auto_ptr<BackupStoreRefCountDatabase> temp(
+			BackupStoreRefCountDatabase::Create(rAccount));
+		box_time_t start = GetCurrentBoxTime();
+		for(int i = 0; i < numUpdates; ++i)
+		{
+			int64_t id = 1 + ((unsigned int)random.next() % numObjects);
+			if(expected[id] > 0 && (random.next() & 3) == 0)
+			{
+				temp->RemoveReference(id);
+				expected[id]--;
+			}
+			else
+			{
+				temp->AddReference(id);
+				expected[id]++;
+			}
+		}
+		temp->Commit();
+		box_time_t elapsed = GetCurrentBoxTime() - start;
+		BOX_NOTICE("Made " << numUpdates << " random reference count "
+			"changes " << (mapped ? "through a mapping" :
+			"through the file") << " in " <<
+			BoxTimeToMilliSeconds(elapsed) << " ms (" <<
+			((int64_t)numUpdates * 1000000 / (elapsed + 1)) <<
+			" per second)");
+
+		std::auto_ptr<BackupStoreRefCountDatabase> perm(
+			BackupStoreRefCountDatabase::Load(rAccount, true));
+		int64_t lastID = perm->GetLastObjectIDUsed();
+		TEST_THAT(lastID <= numObjects);
+		int errors = 0;
+		for(int64_t id = 1; id <= numObjects; ++id)
+		{
+			if((id <= lastID ? perm->GetRefCount(id) : 0) !=
+				expected[id])
+			{
+				errors++;
+			}
+		}
+		TEST_EQUAL(0, errors);
+
+		// A read-only database sees objects added by another
+		// process after it was opened
+		std::auto_ptr<BackupStoreRefCountDatabase> writable(
+			BackupStoreRefCountDatabase::Load(rAccount, false));
+		writable->AddReference(numObjects + 1);
+		writable->AddReference(numObjects + 1);
+		writable.reset();
+		TEST_EQUAL(2, perm->GetRefCount(numObjects + 1));
+		TEST_EQUAL(numObjects + 1, perm->GetLastObjectIDUsed());
+		perm.reset();
+	}
+	BackupStoreRefCountDatabase::UseMappedFiles = true;
+
+	// Put back the reference counts which the store really has
+	BackupStoreRefCountDatabase::Create(rAccount)->Commit();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_server_housekeeping()
 {
 	SETUP_TEST_BACKUPSTORE();
@@ -870,7 +1223,9 @@ bool test_server_housekeeping()
 	BackupProtocolLocal2 protocol(0x01234567, "test", "backup/01234567/",
 		0, false);
 
-	int root_dir_blocks = get_raid_file(BACKUPSTORE_ROOT_DIRECTORY_ID)->GetDiscUsageInBlocks();
+	// The size of the root directory includes its journal, so it's
+	// measured again before checking the block counts each time
+	int root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_files(0, 0, 0, 1));
 	TEST_THAT(check_num_blocks(protocol, 0, 0, 0, root_dir_blocks,
 		root_dir_blocks));
@@ -975,6 +1330,24 @@ bool test_server_housekeeping()
 			// Check against uploaded file
 			TEST_THAT(check_block_index("testfiles/file1_upload1", *blockIndexStream));
 		}
+
+		// and by name with the options from the file's header, which
+		// are none, as it wasn't split into content defined chunks
+		{
+			std::auto_ptr<BackupProtocolBlockIndex> getblockindex(protocol.QueryGetBlockIndexByName2(BACKUPSTORE_ROOT_DIRECTORY_ID, store1name));
+			TEST_EQUAL(store1objid, getblockindex->GetObjectID());
+			TEST_EQUAL(0, getblockindex->GetFileOptions());
+			std::auto_ptr<IOStream> blockIndexStream(protocol.ReceiveStream());
+			TEST_THAT(check_block_index("testfiles/file1_upload1", *blockIndexStream));
+		}
+
+		// which returns no object ID, and no stream, if there's no
+		// file with that name
+		{
+			BackupStoreFilenameClear missing("no-such-file");
+			std::auto_ptr<BackupProtocolBlockIndex> getblockindex(protocol.QueryGetBlockIndexByName2(BACKUPSTORE_ROOT_DIRECTORY_ID, missing));
+			TEST_EQUAL(0, getblockindex->GetObjectID());
+		}
 	}
 
 	// Get the directory again, and see if the entry is in it
@@ -1004,6 +1377,7 @@ bool test_server_housekeeping()
 
 	int file1_blocks = get_raid_file(store1objid)->GetDiscUsageInBlocks();
 	TEST_THAT(check_num_files(1, 0, 0, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, file1_blocks, 0, 0, root_dir_blocks,
 		file1_blocks + root_dir_blocks));
 
@@ -1027,6 +1401,7 @@ bool test_server_housekeeping()
 	// contents are identical, so it will create an empty patch.
 
 	TEST_THAT(check_num_files(1, 1, 0, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, file1_blocks, patch1_blocks, 0,
 		root_dir_blocks, file1_blocks + patch1_blocks + root_dir_blocks));
 
@@ -1054,6 +1429,7 @@ bool test_server_housekeeping()
 	int patch2_blocks = get_raid_file(patch1_id)->GetDiscUsageInBlocks();
 
 	TEST_THAT(check_num_files(1, 2, 0, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, file1_blocks, patch1_blocks + patch2_blocks, 0,
 		root_dir_blocks, file1_blocks + patch1_blocks + patch2_blocks +
 		root_dir_blocks));
@@ -1064,6 +1440,7 @@ bool test_server_housekeeping()
 	protocol.Reopen();
 
 	TEST_THAT(check_num_files(1, 2, 0, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, file1_blocks, patch1_blocks + patch2_blocks, 0,
 		root_dir_blocks, file1_blocks + patch1_blocks + patch2_blocks +
 		root_dir_blocks));
@@ -1086,6 +1463,7 @@ bool test_server_housekeeping()
 	int replaced_blocks = get_raid_file(replaced_id)->GetDiscUsageInBlocks();
 
 	TEST_THAT(check_num_files(1, 3, 0, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, replaced_blocks, // current
 		file1_blocks + patch1_blocks + patch2_blocks, // old
 		0, // deleted
@@ -1099,6 +1477,7 @@ bool test_server_housekeeping()
 	protocol.Reopen();
 
 	TEST_THAT(check_num_files(1, 3, 0, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, replaced_blocks, // current
 		file1_blocks + patch1_blocks + patch2_blocks, // old
 		0, // deleted
@@ -1115,6 +1494,7 @@ bool test_server_housekeeping()
 	protocol.Reopen();
 
 	TEST_THAT(check_num_files(1, 1, 0, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, replaced_blocks, // current
 		file1_blocks, // old
 		0, // deleted
@@ -1128,6 +1508,7 @@ bool test_server_housekeeping()
 
 	// The old version file is deleted as well!
 	TEST_THAT(check_num_files(0, 1, 2, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, 0, // current
 		file1_blocks, // old
 		replaced_blocks + file1_blocks, // deleted
@@ -1142,6 +1523,7 @@ bool test_server_housekeeping()
 	protocol.Reopen();
 
 	TEST_THAT(check_num_files(0, 0, 0, 1));
+	root_dir_blocks = get_directory_size(BACKUPSTORE_ROOT_DIRECTORY_ID);
 	TEST_THAT(check_num_blocks(protocol, 0, 0, 0, root_dir_blocks, root_dir_blocks));
 
 	// Used to not consume the stream
@@ -1633,7 +2015,7 @@ bool test_server_commands()
 			TEST_EQUAL(subdirid, en->GetObjectID());
 			TEST_THAT(en->GetName() == dirname);
 			TEST_EQUAL(BackupProtocolListDirectory::Flags_Dir, en->GetFlags());
-			int64_t actual_size = get_raid_file(subdirid)->GetDiscUsageInBlocks();
+			int64_t actual_size = get_directory_size(subdirid);
 			TEST_EQUAL(actual_size, en->GetSizeInBlocks());
 			TEST_EQUAL(FAKE_MODIFICATION_TIME, en->GetModificationTime());
 		}
@@ -2072,16 +2454,20 @@ bool test_directory_parent_entry_tracks_directory_size()
 {
 	SETUP_TEST_BACKUPSTORE();
 
-	BackupProtocolLocal2 protocol(0x01234567, "test", "backup/01234567/",
-		0, false);
+	ContextProtocolLocal protocol;
+	protocol.GetContext().SetDirectoryJournalMaxSize(256 * 1024);
 	BackupProtocolLocal2 protocolReadOnly(0x01234567, "test",
 		"backup/01234567/", 0, true); // read only
 
 	int64_t subdirid = create_directory(protocol);
+	std::string subdirfn;
+	StoreStructure::MakeObjectFilename(subdirid,
+		"backup/01234567/" /* mStoreRoot */, 0 /* mStoreDiscSet */,
+		subdirfn, false /* EnsureDirectoryExists */);
 
 	// Get the root directory cached in the read-only connection, and
 	// test that the initial size is correct.
-	int old_size = get_raid_file(subdirid)->GetDiscUsageInBlocks();
+	int old_size = get_directory_size(subdirid);
 	TEST_THAT(old_size > 0);
 	TEST_EQUAL(old_size, get_object_size(protocolReadOnly, subdirid,
 		BACKUPSTORE_ROOT_DIRECTORY_ID));
@@ -2102,9 +2488,14 @@ bool test_directory_parent_entry_tracks_directory_size()
 		name << "testfile_" << i;
 		last_added_filename = name.str();
 		last_added_file_id = create_file(protocol, subdirid, name.str());
-		new_size = get_raid_file(subdirid)->GetDiscUsageInBlocks();
+		new_size = get_directory_size(subdirid);
 	}
 
+	// The directory object hasn't been rewritten, but the journal of the
+	// changes to it counts towards its size
+	TEST_THAT(BackupStoreDirectoryJournal::Exists(0, subdirfn));
+	TEST_EQUAL(old_size, get_raid_file(subdirid)->GetDiscUsageInBlocks());
+
 	// Check that the root directory entry has been updated
 	TEST_EQUAL(new_size, get_object_size(protocolReadOnly, subdirid,
 		BACKUPSTORE_ROOT_DIRECTORY_ID));
@@ -2123,6 +2514,10 @@ bool test_directory_parent_entry_tracks_directory_size()
 	protocol.Reopen();
 	protocolReadOnly.Reopen();
 
+	TEST_EQUAL(old_size, get_directory_size(subdirid));
+
+	// Housekeeping compacted the journal, so the size is the object's
+	TEST_THAT(!BackupStoreDirectoryJournal::Exists(0, subdirfn));
 	TEST_EQUAL(old_size, get_raid_file(subdirid)->GetDiscUsageInBlocks());
 
 	// Check that the entry in the root directory was updated too
@@ -2154,7 +2549,7 @@ bool test_directory_parent_entry_tracks_directory_size()
 
 	// Repair the error ourselves, as bbstoreaccounts can't.
 	protocol.QueryFinished();
-	enCopy.SetSizeInBlocks(get_raid_file(subdirid)->GetDiscUsageInBlocks());
+	enCopy.SetSizeInBlocks(get_directory_size(subdirid));
 	root.AddEntry(enCopy);
 	TEST_THAT(write_dir(root));
 
@@ -2162,8 +2557,8 @@ bool test_directory_parent_entry_tracks_directory_size()
 	// create_directory(), because otherwise we can't create it again.
 	// (Perhaps it should not have been committed because we failed to
 	// update the parent, but currently it is.)
-	BackupStoreDirectory subdir(*get_raid_file(subdirid),
-		IOStream::TimeOutInfinite);
+	BackupStoreDirectory subdir;
+	read_directory(subdirid, subdir);
 	{
 		BackupStoreDirectory::Iterator i(subdir);
 		en = i.FindMatchingClearName(
@@ -2177,7 +2572,7 @@ bool test_directory_parent_entry_tracks_directory_size()
 	// This should have fixed the error, so we should be able to add the
 	// entry now. This should push the object size back up.
 	int64_t dir2id = create_directory(protocol, subdirid);
-	TEST_EQUAL(new_size, get_raid_file(subdirid)->GetDiscUsageInBlocks());
+	TEST_EQUAL(new_size, get_directory_size(subdirid));
 	TEST_EQUAL(new_size, get_object_size(protocolReadOnly, subdirid,
 		BACKUPSTORE_ROOT_DIRECTORY_ID));
 
@@ -2194,7 +2589,7 @@ bool test_directory_parent_entry_tracks_directory_size()
 	protocolReadOnly.Reopen();
 
 	// Check that the entry in the root directory was updated
-	TEST_EQUAL(old_size, get_raid_file(subdirid)->GetDiscUsageInBlocks());
+	TEST_EQUAL(old_size, get_directory_size(subdirid));
 	TEST_EQUAL(old_size, get_object_size(protocolReadOnly, subdirid,
 		BACKUPSTORE_ROOT_DIRECTORY_ID));
 
@@ -2232,6 +2627,363 @@ bool test_directory_parent_entry_tracks_directory_size()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+void list_directory(BackupProtocolCallable& protocol, int64_t DirectoryID)
+{
+	protocol.QueryListDirectory(DirectoryID, 0, // FlagsMustBeSet
+		BackupProtocolListDirectory::Flags_EXCLUDE_NOTHING,
+		false /* no attributes */);
+	BackupStoreDirectory dir(protocol.ReceiveStream());
+}
+
+bool test_directory_cache()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	ContextProtocolLocal protocol;
+	int64_t dir1 = create_directory(protocol, BACKUPSTORE_ROOT_DIRECTORY_ID);
+	int64_t dir2 = create_directory(protocol, dir1);
+	int64_t dir3 = create_directory(protocol, dir2);
+
+	// Start with an empty cache, big enough for everything
+	protocol.QueryFinished();
+	protocol.Reopen();
+	BackupStoreContext &rContext(protocol.GetContext());
+	rContext.SetDirectoryCacheSize(1024 * 1024);
+	TEST_EQUAL(0, rContext.GetNumberOfCachedDirectories());
+	TEST_EQUAL(0, rContext.GetDirectoryCacheSize());
+	int64_t hits = rContext.GetDirectoryCacheHits();
+	int64_t misses = rContext.GetDirectoryCacheMisses();
+	int64_t evictions = rContext.GetDirectoryCacheEvictions();
+
+	list_directory(protocol, dir3);
+	int64_t dir3Size = rContext.GetDirectoryCacheSize();
+	list_directory(protocol, BACKUPSTORE_ROOT_DIRECTORY_ID);
+	int64_t rootSize = rContext.GetDirectoryCacheSize() - dir3Size;
+	TEST_THAT(dir3Size > 0);
+	TEST_THAT(rootSize > 0);
+	protocol.QueryFinished();
+	protocol.Reopen();
+	TEST_EQUAL(0, rContext.GetNumberOfCachedDirectories());
+
+	list_directory(protocol, BACKUPSTORE_ROOT_DIRECTORY_ID);
+	list_directory(protocol, dir1);
+	list_directory(protocol, dir2);
+	TEST_EQUAL(misses + 5, rContext.GetDirectoryCacheMisses());
+	list_directory(protocol, dir2);
+	list_directory(protocol, dir1);
+	TEST_EQUAL(hits + 2, rContext.GetDirectoryCacheHits());
+	TEST_EQUAL(3, rContext.GetNumberOfCachedDirectories());
+
+	// Adding another directory to a full cache only pushes out the
+	// least recently used one, the root
+	rContext.SetDirectoryCacheSize(rContext.GetDirectoryCacheSize() -
+		rootSize + dir3Size);
+	list_directory(protocol, dir3);
+	TEST_EQUAL(misses + 6, rContext.GetDirectoryCacheMisses());
+	TEST_EQUAL(evictions + 1, rContext.GetDirectoryCacheEvictions());
+	TEST_EQUAL(3, rContext.GetNumberOfCachedDirectories());
+	list_directory(protocol, dir1);
+	list_directory(protocol, dir2);
+	list_directory(protocol, dir3);
+	TEST_EQUAL(hits + 5, rContext.GetDirectoryCacheHits());
+	list_directory(protocol, BACKUPSTORE_ROOT_DIRECTORY_ID);
+	TEST_EQUAL(misses + 7, rContext.GetDirectoryCacheMisses());
+
+	// Changing a cached directory changes its size in the cache
+	rContext.SetDirectoryCacheSize(1024 * 1024);
+	list_directory(protocol, dir2);
+	list_directory(protocol, dir3);
+	int64_t size = rContext.GetDirectoryCacheSize();
+	create_file(protocol, dir3, "file");
+	TEST_THAT(rContext.GetDirectoryCacheSize() > size);
+
+	// A cache too small for anything still keeps the directory in use
+	rContext.SetDirectoryCacheSize(0);
+	protocol.QueryFinished();
+	protocol.Reopen();
+	list_directory(protocol, dir1);
+	TEST_EQUAL(1, rContext.GetNumberOfCachedDirectories());
+
+	protocol.QueryFinished();
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+bool test_directory_journal()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	ContextProtocolLocal protocol;
+	BackupProtocolLocal2 protocolReadOnly(0x01234567, "test",
+		"backup/01234567/", 0, true); // read only
+	int64_t subdirid = create_directory(protocol);
+	protocol.QueryFinished();
+	protocol.Reopen();
+
+	std::string filename;
+	StoreStructure::MakeObjectFilename(subdirid,
+		"backup/01234567/" /* mStoreRoot */, 0 /* mStoreDiscSet */,
+		filename, false /* EnsureDirectoryExists */);
+	int64_t revisionID = 0, newRevisionID = 0;
+	TEST_THAT(RaidFileRead::FileExists(0, filename, &revisionID));
+	TEST_THAT(!BackupStoreDirectoryJournal::Exists(0, filename));
+
+	// Directories aren't journaled unless the store is configured to,
+	// as older servers ignore journals
+	BackupStoreContext &rContext(protocol.GetContext());
+	TEST_EQUAL(0, rContext.GetDirectoryJournalMaxSize());
+	{
+		// Creating the subdirectory changed the root directory
+		std::string rootfilename;
+		StoreStructure::MakeObjectFilename(
+			BACKUPSTORE_ROOT_DIRECTORY_ID,
+			"backup/01234567/" /* mStoreRoot */,
+			0 /* mStoreDiscSet */, rootfilename,
+			false /* EnsureDirectoryExists */);
+		TEST_THAT(!BackupStoreDirectoryJournal::Exists(0,
+			rootfilename));
+	}
+	rContext.SetDirectoryJournalMaxSize(256 * 1024);
+
+	// Changes are appended to the journal, and the directory object
+	// isn't rewritten
+	int64_t file1 = create_file(protocol, subdirid, "file1");
+	int64_t file2 = create_file(protocol, subdirid, "file2");
+	protocol.QueryDeleteFile(subdirid, BackupStoreFilenameClear("file1"));
+	TEST_THAT(BackupStoreDirectoryJournal::Exists(0, filename));
+	TEST_THAT(RaidFileRead::FileExists(0, filename, &newRevisionID));
+	TEST_EQUAL(revisionID, newRevisionID);
+	{
+		BackupStoreDirectory dir(*get_raid_file(subdirid),
+			IOStream::TimeOutInfinite);
+		TEST_EQUAL(0, dir.GetNumberOfEntries());
+	}
+
+	// Other connections see the changes, whichever way they read it
+	{
+		protocolReadOnly.QueryListDirectory(subdirid, 0,
+			BackupProtocolListDirectory::Flags_EXCLUDE_NOTHING,
+			false /* no attributes */);
+		BackupStoreDirectory dir(protocolReadOnly.ReceiveStream());
+		TEST_EQUAL(2, dir.GetNumberOfEntries());
+		BackupStoreDirectory::Entry *en = dir.FindEntryByID(file1);
+		TEST_THAT_OR(en != 0, return false);
+		TEST_THAT(en->IsDeleted());
+		TEST_THAT(dir.FindEntryByID(file2) != 0);
+	}
+	{
+		protocolReadOnly.QueryGetObject(subdirid);
+		BackupStoreDirectory dir(protocolReadOnly.ReceiveStream());
+		TEST_EQUAL(2, dir.GetNumberOfEntries());
+	}
+
+	// There's a copy of the journal on every disc, so the changes
+	// aren't lost with any one of them
+	TEST_EQUAL(3, BackupStoreDirectoryJournal::GetNumberOfCopies(0));
+	for(int disc = 0; disc < 3; disc++)
+	{
+		TEST_THAT(FileExists(BackupStoreDirectoryJournal::GetFilename(0,
+			filename, disc)));
+	}
+	TEST_EQUAL(0, ::unlink(BackupStoreDirectoryJournal::GetFilename(0,
+		filename, 1).c_str()));
+	{
+		BackupStoreDirectory dir;
+		TEST_THAT(BackupStoreDirectoryJournal::ReadDirectory(0,
+			filename, dir));
+		TEST_EQUAL(2, dir.GetNumberOfEntries());
+	}
+
+	// The journal is kept when the session finishes, and the next
+	// session carries on with it, replacing the lost copy
+	protocol.QueryFinished();
+	TEST_THAT(BackupStoreDirectoryJournal::Exists(0, filename));
+	protocol.Reopen();
+	create_file(protocol, subdirid, "file3");
+	TEST_THAT(FileExists(BackupStoreDirectoryJournal::GetFilename(0,
+		filename, 1)));
+	TEST_THAT(RaidFileRead::FileExists(0, filename, &newRevisionID));
+	TEST_EQUAL(revisionID, newRevisionID);
+	for(int disc = 0; disc < 3; disc++)
+	{
+		TEST_EQUAL(TestGetFileSize(
+			BackupStoreDirectoryJournal::GetFilename(0, filename, 0)),
+			TestGetFileSize(BackupStoreDirectoryJournal::GetFilename(
+				0, filename, disc)));
+	}
+	{
+		BackupStoreDirectory dir;
+		TEST_THAT(BackupStoreDirectoryJournal::ReadDirectory(0,
+			filename, dir));
+		TEST_EQUAL(3, dir.GetNumberOfEntries());
+	}
+
+	// The journal counts towards the size of the directory in its
+	// parent, and so in the blocks used by the account
+	int64_t objectSize = get_raid_file(subdirid)->GetDiscUsageInBlocks();
+	int64_t journalSize = BackupStoreDirectoryJournal::GetSizeInBlocks(0,
+		TestGetFileSize(BackupStoreDirectoryJournal::GetFilename(0,
+			filename, 0)));
+	TEST_THAT(journalSize > 0);
+	TEST_EQUAL(objectSize + journalSize, get_directory_size(subdirid));
+	TEST_EQUAL(objectSize + journalSize, get_object_size(protocolReadOnly,
+		subdirid, BACKUPSTORE_ROOT_DIRECTORY_ID));
+
+	// bbstoreaccounts check counts the journals in the blocks used too
+	protocol.QueryFinished();
+	protocolReadOnly.QueryFinished();
+	TEST_EQUAL(0, check_account_for_errors());
+	protocol.Reopen();
+	protocolReadOnly.Reopen();
+
+	// The directory is written in full when the journal is too big, and
+	// its size is just the object's again
+	int64_t maxSize = rContext.GetDirectoryJournalMaxSize();
+	rContext.SetDirectoryJournalMaxSize(1);
+	create_file(protocol, subdirid, "file4");
+	rContext.SetDirectoryJournalMaxSize(maxSize);
+	protocol.QueryFinished();
+	TEST_THAT(!BackupStoreDirectoryJournal::Exists(0, filename));
+	TEST_EQUAL(get_raid_file(subdirid)->GetDiscUsageInBlocks(),
+		get_object_size(protocolReadOnly, subdirid,
+			BACKUPSTORE_ROOT_DIRECTORY_ID));
+
+	{
+		BackupStoreDirectory dir(*get_raid_file(subdirid),
+			IOStream::TimeOutInfinite);
+		TEST_EQUAL(4, dir.GetNumberOfEntries());
+		BackupStoreDirectory::Entry *en = dir.FindEntryByID(file1);
+		TEST_THAT_OR(en != 0, return false);
+		TEST_THAT(en->IsDeleted());
+	}
+
+	// A journal is applied by anything which reads the directory, and
+	// compacted by housekeeping
+	protocol.Reopen();
+	StreamableMemBlock attr(attr2, sizeof(attr2));
+	{
+		std::auto_ptr<IOStream> attrnew(
+			new MemBlockStream(attr2, sizeof(attr2)));
+		std::auto_ptr<BackupProtocolSuccess> changereply(
+			protocol.QueryChangeDirAttributes(subdirid,
+				FAKE_ATTR_MODIFICATION_TIME + 1, attrnew));
+		TEST_EQUAL(subdirid, changereply->GetObjectID());
+	}
+	protocol.QueryFinished();
+	TEST_THAT(BackupStoreDirectoryJournal::Exists(0, filename));
+	{
+		BackupStoreDirectory dir;
+		TEST_THAT(BackupStoreDirectoryJournal::ReadDirectory(0,
+			filename, dir));
+		TEST_THAT(dir.GetAttributes() == attr);
+	}
+
+	protocolReadOnly.QueryFinished();
+	TEST_THAT(run_housekeeping_and_check_account());
+	TEST_THAT(!BackupStoreDirectoryJournal::Exists(0, filename));
+	{
+		BackupStoreDirectory dir(*get_raid_file(subdirid),
+			IOStream::TimeOutInfinite);
+		TEST_THAT(dir.GetAttributes() == attr);
+		TEST_EQUAL(FAKE_ATTR_MODIFICATION_TIME + 1,
+			dir.GetAttributesModTime());
+	}
+
+	// When bbstoreaccounts check fixes a directory, it writes it in full
+	// with the changes in its journal
+	protocol.Reopen();
+	int64_t file5 = create_file(protocol, subdirid, "file5");
+	int64_t file6 = create_file(protocol, subdirid, "file6");
+	protocol.QueryFinished();
+	TEST_THAT(BackupStoreDirectoryJournal::Exists(0, filename));
+	{
+		std::string file6fn;
+		StoreStructure::MakeObjectFilename(file6,
+			"backup/01234567/" /* mStoreRoot */, 0 /* mStoreDiscSet */,
+			file6fn, false /* EnsureDirectoryExists */);
+		RaidFileWrite del(0, file6fn);
+		del.Delete();
+	}
+	set_refcount(file6, 0);
+	TEST_THAT(check_account_for_errors() > 0);
+	TEST_THAT(!BackupStoreDirectoryJournal::Exists(0, filename));
+	{
+		BackupStoreDirectory dir(*get_raid_file(subdirid),
+			IOStream::TimeOutInfinite);
+		TEST_THAT(dir.FindEntryByID(file5) != 0);
+		TEST_THAT(dir.FindEntryByID(file6) == 0);
+	}
+	TEST_EQUAL(0, check_account_for_errors());
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+uint32_t get_directory_format(int64_t ObjectID)
+{
+	uint32_t magic = 0;
+	get_raid_file(ObjectID)->ReadFullBuffer(&magic, sizeof(magic),
+		0 /* not interested in bytes read if this fails */);
+	return ntohl(magic);
+}
+
+bool test_compact_directories()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// Directories are written in the standard format unless the store
+	// is configured to use the compact one
+	ContextProtocolLocal protocol;
+	BackupStoreContext &rContext(protocol.GetContext());
+	rContext.SetDirectoryJournalMaxSize(0);
+	int64_t subdirid = create_directory(protocol);
+	create_file(protocol, subdirid, "file1");
+	TEST_EQUAL(OBJECTMAGIC_DIR_MAGIC_VALUE, get_directory_format(subdirid));
+
+	// Turning it on converts each directory when it's next written
+	rContext.SetCompactDirectories(true);
+	create_file(protocol, subdirid, "file2");
+	TEST_EQUAL(OBJECTMAGIC_DIR_COMPACT_MAGIC_VALUE,
+		get_directory_format(subdirid));
+	TEST_EQUAL(OBJECTMAGIC_DIR_MAGIC_VALUE,
+		get_directory_format(BACKUPSTORE_ROOT_DIRECTORY_ID));
+
+	// Directories in both formats are read, and clients are sent the
+	// standard format whichever one is stored
+	protocol.QueryFinished();
+	TEST_EQUAL(0, check_account_for_errors());
+	BackupProtocolLocal2 protocolReadOnly(0x01234567, "test",
+		"backup/01234567/", 0, true); // read only
+	{
+		protocolReadOnly.QueryListDirectory(subdirid, 0,
+			BackupProtocolListDirectory::Flags_EXCLUDE_NOTHING,
+			false /* no attributes */);
+		BackupStoreDirectory dir(protocolReadOnly.ReceiveStream());
+		TEST_EQUAL(2, dir.GetNumberOfEntries());
+	}
+	{
+		protocolReadOnly.QueryGetObject(subdirid);
+		std::auto_ptr<IOStream> stream(protocolReadOnly.ReceiveStream());
+		CollectInBufferStream buf;
+		stream->CopyStreamTo(buf);
+		buf.SetForReading();
+		uint32_t magic;
+		TEST_THAT(buf.ReadFullBuffer(&magic, sizeof(magic), 0));
+		TEST_EQUAL(OBJECTMAGIC_DIR_MAGIC_VALUE, ntohl(magic));
+	}
+	protocolReadOnly.QueryFinished();
+
+	// Turning it off again doesn't convert them back until they're next
+	// written
+	protocol.Reopen();
+	rContext.SetCompactDirectories(false);
+	TEST_EQUAL(OBJECTMAGIC_DIR_COMPACT_MAGIC_VALUE,
+		get_directory_format(subdirid));
+	create_file(protocol, subdirid, "file3");
+	TEST_EQUAL(OBJECTMAGIC_DIR_MAGIC_VALUE, get_directory_format(subdirid));
+	protocol.QueryFinished();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_cannot_open_multiple_writable_connections()
 {
 	SETUP_TEST_BACKUPSTORE();
@@ -2345,9 +3097,160 @@ bool test_encoding()
 			// Check it came out of the wash the same
 			TEST_THAT(::memcmp(encfile, decoded, ENCFILE_SIZE) == 0);
 
+			// Chunks with reserved header bits set, or compressed
+			// with a codec this build doesn't have, are rejected
+			encoded.mpBuffer[0] |= HEADER_RESERVED_BITS;
+			TEST_CHECK_THROWS(BackupStoreFile::DecodeChunk(encoded.mpBuffer,
+				encSize, decoded, decBlockSize), BackupStoreException,
+				ChunkHasUnknownEncoding);
+			encoded.mpBuffer[0] &= ~HEADER_RESERVED_BITS;
+
+			for(int codec = 0; codec < CompressCodec::NumCodecs; ++codec)
+			{
+				if(CompressCodec::IsSupported(codec))
+				{
+					continue;
+				}
+				encoded.mpBuffer[0] |= codec << HEADER_CODEC_SHIFT;
+				TEST_CHECK_THROWS(BackupStoreFile::DecodeChunk(
+					encoded.mpBuffer, encSize, decoded,
+					decBlockSize), BackupStoreException,
+					ChunkHasUnknownEncoding);
+				encoded.mpBuffer[0] &= ~(HEADER_CODEC_MASK << HEADER_CODEC_SHIFT);
+			}
+
 			free(decoded);
 		}
 
+		// Encode and decode a big block with each codec and some
+		// levels this build supports, and a whole file with each codec.
+		// Codecs found by configure must actually be supported. The
+		// block repeats text, as lz4 can't compress encfile at all.
+		uint8_t text[ENCFILE_SIZE];
+		for(int l = 0; l < ENCFILE_SIZE; ++l)
+		{
+			text[l] = "Box Backup compresses this text. "[l % 33];
+		}
+#ifdef HAVE_LIBZSTD
+		TEST_THAT(CompressCodec::IsSupported(CompressCodec::Zstd));
+#endif
+#ifdef HAVE_LIBLZ4
+		TEST_THAT(CompressCodec::IsSupported(CompressCodec::LZ4));
+#endif
+		for(int codec = 0; codec < CompressCodec::NumCodecs; ++codec)
+		{
+			BackupStoreFilenameClear name("testfiles/testenc1");
+			if(!CompressCodec::IsSupported(codec))
+			{
+				TEST_CHECK_THROWS(BackupStoreFile::EncodeFile(
+					"testfiles/testenc1", 32, name, NULL, NULL,
+					NULL, NULL, codec, 0),
+					CompressException, CodecNotSupported);
+				continue;
+			}
+
+			int levels[] = {0, 1, 9};
+			for(size_t l = 0; l < sizeof(levels) / sizeof(levels[0]); ++l)
+			{
+				if(!CompressCodec::IsValidLevel(codec, levels[l]))
+				{
+					continue;
+				}
+
+				BackupStoreFile::EncodingBuffer encoded;
+				encoded.Allocate(BackupStoreFile::MaxBlockSizeForChunkSize(ENCFILE_SIZE));
+				int encSize = BackupStoreFile::EncodeChunk(text, ENCFILE_SIZE, encoded,
+					true /* try compressing */, codec, levels[l]);
+				TEST_THAT((encoded.mpBuffer[0] & 1) == 1);
+				TEST_EQUAL(codec, ((encoded.mpBuffer[0] >> HEADER_CODEC_SHIFT) &
+					HEADER_CODEC_MASK));
+				TEST_THAT(encSize < ENCFILE_SIZE);
+
+				int decBlockSize = BackupStoreFile::OutputBufferSizeForKnownOutputSize(ENCFILE_SIZE);
+				uint8_t *decoded = (uint8_t*)malloc(decBlockSize);
+				int decSize = BackupStoreFile::DecodeChunk(encoded.mpBuffer, encSize, decoded, decBlockSize);
+				TEST_EQUAL(ENCFILE_SIZE, decSize);
+				TEST_THAT(::memcmp(text, decoded, ENCFILE_SIZE) == 0);
+				free(decoded);
+			}
+
+			// A file encoded with the codec decodes to the same data
+			{
+				FileStream f("testfiles/testenc1", O_WRONLY | O_CREAT | O_TRUNC);
+				f.Write(text, sizeof(text));
+			}
+			CollectInBufferStream enc;
+			BackupStoreFile::EncodeFile("testfiles/testenc1", 32, name,
+				NULL, NULL, NULL, NULL, codec, 0)->CopyStreamTo(enc);
+			enc.SetForReading();
+			TEST_THAT(enc.GetSize() < (int)sizeof(text));
+			UNLINK_IF_EXISTS("testfiles/testenc1_orig");
+			BackupStoreFile::DecodeFile(enc, "testfiles/testenc1_orig",
+				IOStream::TimeOutInfinite);
+			TEST_EQUAL(sizeof(text), TestGetFileSize("testfiles/testenc1_orig"));
+			{
+				FileStream in("testfiles/testenc1_orig");
+				uint8_t decoded[sizeof(text)];
+				TEST_EQUAL((int)sizeof(decoded), in.Read(decoded, sizeof(decoded)));
+				TEST_THAT(::memcmp(text, decoded, sizeof(decoded)) == 0);
+			}
+			UNLINK_IF_EXISTS("testfiles/testenc1_orig");
+			UNLINK_IF_EXISTS("testfiles/testenc1");
+		}
+
+		// Coding chunks are reused from the pool
+		{
+			BackupStoreFile::ReleaseCodingPool();
+			void *a = BackupStoreFile::CodingChunkAlloc(ENCFILE_SIZE);
+			TEST_THAT(((uint64_t)a) % BACKUPSTOREFILE_CODING_BLOCKSIZE ==
+				BACKUPSTOREFILE_CODING_OFFSET);
+			::memset(a, 0, ENCFILE_SIZE);
+			BackupStoreFile::CodingChunkFree(a);
+			void *b = BackupStoreFile::CodingChunkAlloc(ENCFILE_SIZE + 1);
+			TEST_THAT(b == a);
+			void *c = BackupStoreFile::CodingChunkAlloc(ENCFILE_SIZE * 2);
+			TEST_THAT(c != a);
+			BackupStoreFile::CodingChunkFree(b);
+			BackupStoreFile::CodingChunkFree(c);
+
+			BackupStoreFileCodingPoolStats stats(BackupStoreFile::GetCodingPoolStats());
+			TEST_EQUAL(3, stats.mRequests);
+			TEST_EQUAL(1, stats.mReused);
+			TEST_THAT(stats.mBytesRetained >= ENCFILE_SIZE * 3);
+			BackupStoreFile::ReleaseCodingPool();
+			TEST_EQUAL(0, BackupStoreFile::GetCodingPoolStats().mBytesRetained);
+		}
+
+		// Blocks which don't look compressible, or which the caller
+		// doesn't want compressed, are stored as they are
+		{
+			uint8_t random[ENCFILE_SIZE];
+			Random::Generate(random, sizeof(random));
+
+			BackupStoreFile::EncodingBuffer encoded;
+			encoded.Allocate(BackupStoreFile::MaxBlockSizeForChunkSize(ENCFILE_SIZE));
+			int encSize = BackupStoreFile::EncodeChunk(random, ENCFILE_SIZE, encoded);
+			TEST_THAT(!BackupStoreFile::ChunkIsCompressed(encoded));
+			TEST_THAT(encSize > ENCFILE_SIZE);
+
+			encSize = BackupStoreFile::EncodeChunk(encfile, ENCFILE_SIZE, encoded,
+				false /* don't try compressing */);
+			TEST_THAT(!BackupStoreFile::ChunkIsCompressed(encoded));
+
+			int decBlockSize = BackupStoreFile::OutputBufferSizeForKnownOutputSize(ENCFILE_SIZE);
+			uint8_t *decoded = (uint8_t*)malloc(decBlockSize);
+			TEST_EQUAL(ENCFILE_SIZE, BackupStoreFile::DecodeChunk(encoded.mpBuffer,
+				encSize, decoded, decBlockSize));
+			TEST_THAT(::memcmp(encfile, decoded, ENCFILE_SIZE) == 0);
+			free(decoded);
+
+			TEST_THAT(BackupStoreFile::IsCompressedFileType("photos/IMG_0001.JPG"));
+			TEST_THAT(BackupStoreFile::IsCompressedFileType("backup.tar.gz"));
+			TEST_THAT(!BackupStoreFile::IsCompressedFileType("backup.tar"));
+			TEST_THAT(!BackupStoreFile::IsCompressedFileType("zip"));
+			TEST_THAT(!BackupStoreFile::IsCompressedFileType("archive.zip" DIRECTORY_SEPARATOR "file"));
+		}
+
 		// The test block to a file
 		{
 			FileStream f("testfiles/testenc1", O_WRONLY | O_CREAT);
@@ -2708,6 +3611,572 @@ bool test_login_with_no_refcount_db()
 	TEARDOWN_TEST_BACKUPSTORE();
 }
 
+// Files uploaded by test_parallel_restore(), one of which is big enough to
+// be decoded straight from the connection rather than buffered
+#define PARALLEL_RESTORE_NUM_FILES	20
+#define PARALLEL_RESTORE_BIG_FILE	7
+
+int parallel_restore_file_size(int t)
+{
+	return (t == PARALLEL_RESTORE_BIG_FILE) ? (2 * 1024 * 1024) :
+		(t * 1021 + 1);
+}
+
+std::string parallel_restore_file_name(const std::string& rDir, int t)
+{
+	std::ostringstream name;
+	name << rDir;
+	// Every fourth file goes in a subdirectory
+	if(t % 4 == 3)
+	{
+		name << "/lovely_directory";
+	}
+	name << "/parallel" << t;
+	return name.str();
+}
+
+int64_t create_parallel_restore_directory(BackupProtocolCallable& protocol,
+	int64_t parent_dir_id, const std::string& rLocalName)
+{
+	BackupClientFileAttributes attr;
+	attr.ReadAttributes(rLocalName);
+	std::auto_ptr<IOStream> attrStream(new MemBlockStream(attr));
+
+	BackupStoreFilenameClear dirname("lovely_directory");
+	int64_t dirid = protocol.QueryCreateDirectory2(parent_dir_id,
+		FAKE_ATTR_MODIFICATION_TIME, FAKE_MODIFICATION_TIME, dirname,
+		attrStream)->GetObjectID();
+	set_refcount(dirid, 1);
+	return dirid;
+}
+
+void check_parallel_restore(const std::string& rDir)
+{
+	for(int t = 0; t < PARALLEL_RESTORE_NUM_FILES; ++t)
+	{
+		std::string filename = parallel_restore_file_name(rDir, t);
+		TEST_THAT_OR(FileExists(filename), continue);
+
+		int size = parallel_restore_file_size(t);
+		FileStream in(filename.c_str());
+		TEST_EQUAL(size, in.BytesLeftToRead());
+
+		unsigned char *data = (unsigned char*)malloc(size);
+		TEST_THAT(in.ReadFullBuffer(data, size, 0));
+
+		R250 r(t + 1);
+		for(int l = 0; l < size; ++l)
+		{
+			if(data[l] != (r.next() & 0xff))
+			{
+				TEST_FAIL_WITH_MESSAGE("Restored file " << filename <<
+					" differs at offset " << l);
+				break;
+			}
+		}
+
+		free(data);
+	}
+}
+
+// Creates the files in testfiles/file-parallel and uploads them, returning
+// their IDs
+std::vector<int64_t> upload_parallel_restore_files(
+	BackupProtocolCallable& protocol, int64_t dirid, int64_t subdirid)
+{
+	std::vector<int64_t> fileids;
+
+	for(int t = 0; t < PARALLEL_RESTORE_NUM_FILES; ++t)
+	{
+		std::string filename =
+			parallel_restore_file_name("testfiles/file-parallel", t);
+		int size = parallel_restore_file_size(t);
+		unsigned char *data = (unsigned char*)malloc(size);
+		R250 r(t + 1);
+		for(int l = 0; l < size; ++l)
+		{
+			data[l] = r.next() & 0xff;
+		}
+		{
+			FileStream write(filename.c_str(), O_WRONLY | O_CREAT);
+			write.Write(data, size);
+		}
+		free(data);
+
+		int64_t parent = (t % 4 == 3) ? subdirid : dirid;
+		std::ostringstream remote_name;
+		remote_name << "parallel" << t;
+		BackupStoreFilenameClear remote_filename(remote_name.str());
+		int64_t modtime;
+		std::auto_ptr<IOStream> upload(BackupStoreFile::EncodeFile(
+			filename, parent, remote_filename, &modtime));
+		std::auto_ptr<BackupProtocolSuccess> stored(
+			protocol.QueryStoreFile(parent, modtime, modtime,
+				0, /* diff from ID */
+				remote_filename, upload));
+		set_refcount(stored->GetObjectID(), 1);
+		fileids.push_back(stored->GetObjectID());
+	}
+
+	return fileids;
+}
+
+bool test_parallel_restore()
+{
+	SETUP_TEST_BACKUPSTORE();
+	TEST_THAT_OR(StartServer(), FAIL);
+
+	std::auto_ptr<BackupProtocolCallable> apProtocol =
+		connect_and_login(context);
+
+	// The directories need real attributes, as they're restored too
+	TEST_THAT_OR(mkdir("testfiles/file-parallel", 0755) == 0, FAIL);
+	TEST_THAT_OR(mkdir("testfiles/file-parallel/lovely_directory", 0755) == 0,
+		FAIL);
+	int64_t dirid = create_parallel_restore_directory(*apProtocol,
+		BACKUPSTORE_ROOT_DIRECTORY_ID, "testfiles/file-parallel");
+	int64_t subdirid = create_parallel_restore_directory(*apProtocol, dirid,
+		"testfiles/file-parallel/lovely_directory");
+	std::vector<int64_t> fileids = upload_parallel_restore_files(
+		*apProtocol, dirid, subdirid);
+
+	// Restore with requests pipelined on the network connection
+	TEST_EQUAL(Restore_Complete, BackupClientRestore(*apProtocol, dirid,
+		"lovely_directory", "testfiles/restore-parallel",
+		false /* PrintDots */, false /* RestoreDeleted */,
+		false /* UndeleteAfterRestoreDeleted */, false /* Resume */,
+		false /* ContinueAfterErrors */, 4 /* Threads */));
+	check_parallel_restore("testfiles/restore-parallel");
+
+	// The connection must still be usable afterwards
+	apProtocol->QueryListDirectory(dirid,
+		BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+		BackupProtocolListDirectory::Flags_EXCLUDE_NOTHING,
+		false /* no attributes */);
+	BackupStoreDirectory dir(apProtocol->ReceiveStream(), SHORT_TIMEOUT);
+	TEST_EQUAL(PARALLEL_RESTORE_NUM_FILES -
+		PARALLEL_RESTORE_NUM_FILES / 4 + 1, dir.GetNumberOfEntries());
+	apProtocol->QueryFinished();
+
+	// And with a local connection, which can't be pipelined
+	BackupProtocolLocal2 protocolReadOnly(0x01234567, "test",
+		"backup/01234567/", 0, true); // ReadOnly
+	TEST_EQUAL(Restore_Complete, BackupClientRestore(protocolReadOnly,
+		dirid, "lovely_directory", "testfiles/restore-parallel-local",
+		false /* PrintDots */, false /* RestoreDeleted */,
+		false /* UndeleteAfterRestoreDeleted */, false /* Resume */,
+		false /* ContinueAfterErrors */, 3 /* Threads */));
+	check_parallel_restore("testfiles/restore-parallel-local");
+
+	// Resume a restore which was interrupted after restoring the first
+	// file, which shouldn't be restored again
+	TEST_THAT(mkdir("testfiles/restore-parallel-resume", 0755) == 0);
+	{
+		BackupClientRestoreJournal journal;
+		journal.Create("testfiles/restore-parallel-resume.boxbackupresume");
+		journal.GetRoot().SetRestored(fileids[0]);
+		journal.Checkpoint();
+	}
+	TEST_EQUAL(Restore_ResumePossible, BackupClientRestore(protocolReadOnly,
+		dirid, "lovely_directory", "testfiles/restore-parallel-resume",
+		false /* PrintDots */, false /* RestoreDeleted */,
+		false /* UndeleteAfterRestoreDeleted */, false /* Resume */,
+		false /* ContinueAfterErrors */, 3 /* Threads */));
+	TEST_EQUAL(Restore_Complete, BackupClientRestore(protocolReadOnly,
+		dirid, "lovely_directory", "testfiles/restore-parallel-resume",
+		false /* PrintDots */, false /* RestoreDeleted */,
+		false /* UndeleteAfterRestoreDeleted */, true /* Resume */,
+		false /* ContinueAfterErrors */, 3 /* Threads */));
+	TEST_THAT(!FileExists("testfiles/restore-parallel-resume/parallel0"));
+	TEST_THAT(FileExists("testfiles/restore-parallel-resume/parallel1"));
+	TEST_THAT(FileExists("testfiles/restore-parallel-resume/"
+		"lovely_directory/parallel3"));
+	TEST_THAT(!FileExists("testfiles/restore-parallel-resume.boxbackupresume"));
+	protocolReadOnly.QueryFinished();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+// Files changed locally by test_parallel_compare(), one of which is
+// compared straight from the connection
+#define PARALLEL_COMPARE_CHANGED_FILE	5
+
+// Compares the files in testfiles/file-parallel with those on the store,
+// and one which isn't on the store, using a compare queue
+void check_parallel_compare(BackupProtocolCallable& protocol, int64_t dirid,
+	int64_t subdirid, bool QuickCompare)
+{
+	BackupClientCompareQueue queue(protocol, 4, QuickCompare,
+		false /* IgnoreAttributes */, GetCurrentBoxTime());
+	queue.AddDirectory(dirid);
+	queue.AddDirectory(subdirid);
+
+	int64_t dirids[2] = {dirid, subdirid};
+	for(int d = 0; d < 2; ++d)
+	{
+		std::auto_ptr<BackupStoreDirectory> apDir =
+			queue.GetDirectory(dirids[d]);
+		BackupStoreDirectory::Iterator i(*apDir);
+		BackupStoreDirectory::Entry *en;
+		while((en = i.Next(BackupStoreDirectory::Entry::Flags_File)) != 0)
+		{
+			std::string name =
+				BackupStoreFilenameClear(en->GetName())
+				.GetClearFilename();
+			std::string local = std::string("testfiles/file-parallel") +
+				((d == 0) ? "/" : "/lovely_directory/") + name;
+			queue.Add(dirids[d], en->GetObjectID(), local, name,
+				0, en->GetSizeInBlocks());
+		}
+	}
+	queue.Add(dirid, 0x7fffffff, "testfiles/file-parallel/parallel0",
+		"missing", 0, 1);
+
+	int compared = 0;
+	BackupClientCompareQueue::Compared result;
+	while(queue.GetNext(result, true))
+	{
+		if(result.mStoreFilename == "missing")
+		{
+			TEST_THAT(result.mDownloadFailed);
+			continue;
+		}
+
+		compared++;
+		int t = ::atoi(result.mStoreFilename.c_str() + strlen("parallel"));
+		bool changed = (t == PARALLEL_COMPARE_CHANGED_FILE ||
+			t == PARALLEL_RESTORE_BIG_FILE);
+		TEST_THAT(!result.mDownloadFailed);
+		TEST_THAT(!result.mLocalFileReadFailed);
+		TEST_EQUAL_LINE(changed, result.mHasDifferentContents,
+			result.mStoreFilename);
+		TEST_EQUAL(parallel_restore_file_size(t), result.mSize);
+		if(!changed)
+		{
+			TEST_THAT(!result.mHasDifferentAttributes);
+		}
+	}
+	TEST_EQUAL(PARALLEL_RESTORE_NUM_FILES, compared);
+	TEST_THAT(queue.IsEmpty());
+}
+
+bool test_parallel_compare()
+{
+	SETUP_TEST_BACKUPSTORE();
+	TEST_THAT_OR(StartServer(), FAIL);
+
+	std::auto_ptr<BackupProtocolCallable> apProtocol =
+		connect_and_login(context);
+
+	TEST_THAT_OR(mkdir("testfiles/file-parallel", 0755) == 0, FAIL);
+	TEST_THAT_OR(mkdir("testfiles/file-parallel/lovely_directory", 0755) == 0,
+		FAIL);
+	int64_t dirid = create_parallel_restore_directory(*apProtocol,
+		BACKUPSTORE_ROOT_DIRECTORY_ID, "testfiles/file-parallel");
+	int64_t subdirid = create_parallel_restore_directory(*apProtocol, dirid,
+		"testfiles/file-parallel/lovely_directory");
+	upload_parallel_restore_files(*apProtocol, dirid, subdirid);
+
+	// Change a small file, and the big one, without changing their sizes
+	int changed[2] = {PARALLEL_COMPARE_CHANGED_FILE,
+		PARALLEL_RESTORE_BIG_FILE};
+	for(int c = 0; c < 2; ++c)
+	{
+		FileStream file(parallel_restore_file_name(
+			"testfiles/file-parallel", changed[c]), O_WRONLY);
+		file.Seek(100, IOStream::SeekType_Absolute);
+		file.Write("changed", 7);
+	}
+
+	// With requests pipelined on the network connection, for a quick
+	// compare of block indexes and a full compare of the files
+	check_parallel_compare(*apProtocol, dirid, subdirid, true);
+	check_parallel_compare(*apProtocol, dirid, subdirid, false);
+
+	// The connection must still be usable afterwards
+	apProtocol->QueryListDirectory(dirid,
+		BackupProtocolListDirectory::Flags_INCLUDE_EVERYTHING,
+		BackupProtocolListDirectory::Flags_EXCLUDE_NOTHING,
+		false /* no attributes */);
+	BackupStoreDirectory dir(apProtocol->ReceiveStream(), SHORT_TIMEOUT);
+	TEST_EQUAL(PARALLEL_RESTORE_NUM_FILES -
+		PARALLEL_RESTORE_NUM_FILES / 4 + 1, dir.GetNumberOfEntries());
+	apProtocol->QueryFinished();
+
+	// And with a local connection, which can't be pipelined
+	BackupProtocolLocal2 protocolReadOnly(0x01234567, "test",
+		"backup/01234567/", 0, true); // ReadOnly
+	check_parallel_compare(protocolReadOnly, dirid, subdirid, true);
+	check_parallel_compare(protocolReadOnly, dirid, subdirid, false);
+	protocolReadOnly.QueryFinished();
+
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
+bool test_restore_resume_journal()
+{
+	SETUP();
+
+	const char *filename = "testfiles/restore-journal";
+	{
+		BackupClientRestoreJournal journal;
+		journal.Create(filename);
+		BackupClientRestoreJournal::Level &root(journal.GetRoot());
+		root.SetRestored(1);
+		root.SetRestored(3);
+		root.SetRestored(2);
+		root.AddLevel(10, "sub").SetRestored(11);
+		journal.Checkpoint();
+
+		// Not written, as there's no checkpoint
+		root.GetNextLevel().SetRestored(12);
+	}
+
+	// Simulate a record being cut short by a crash
+	{
+		FileStream file(filename, O_WRONLY);
+		file.Seek(0, IOStream::SeekType_End);
+		file.Write("crash", 5);
+	}
+
+	{
+		BackupClientRestoreJournal journal;
+		TEST_THAT_OR(journal.Resume(filename), FAIL);
+		BackupClientRestoreJournal::Level &root(journal.GetRoot());
+		TEST_THAT(root.IsRestored(1));
+		TEST_THAT(root.IsRestored(2));
+		TEST_THAT(root.IsRestored(3));
+		TEST_THAT(!root.IsRestored(4));
+		TEST_THAT_OR(root.HasNextLevel(), FAIL);
+		TEST_EQUAL(10, root.GetNextLevelID());
+		TEST_EQUAL("sub", root.GetNextLevelLocalName());
+		TEST_THAT(root.GetNextLevel().IsRestored(11));
+		TEST_THAT(!root.GetNextLevel().IsRestored(12));
+
+		// The half written record was dropped
+		TEST_EQUAL(journal.GetFileSize(), TestGetFileSize(filename));
+
+		root.FinishLevel();
+		journal.Checkpoint();
+	}
+
+	// Finished levels are forgotten, except that they were restored
+	{
+		BackupClientRestoreJournal journal;
+		TEST_THAT_OR(journal.Resume(filename), FAIL);
+		BackupClientRestoreJournal::Level &root(journal.GetRoot());
+		TEST_THAT(root.IsRestored(10));
+		TEST_THAT(!root.IsRestored(11));
+		TEST_THAT(!root.HasNextLevel());
+
+		// Restore lots of subdirectories, and check that the journal
+		// is compacted rather than growing forever
+		for(int64_t d = 100; d < 2100; ++d)
+		{
+			BackupClientRestoreJournal::Level &level(
+				root.AddLevel(d, "subdirectory"));
+			for(int64_t f = 1; f <= 100; ++f)
+			{
+				level.SetRestored(d * 1000 + f);
+			}
+			root.FinishLevel();
+			journal.Checkpoint();
+			TEST_EQUAL(journal.GetFileSize(),
+				TestGetFileSize(filename));
+		}
+		TEST_THAT(journal.GetFileSize() <=
+			BACKUPCLIENTRESTOREJOURNAL_MIN_COMPACT_SIZE);
+	}
+
+	{
+		BackupClientRestoreJournal journal;
+		TEST_THAT_OR(journal.Resume(filename), FAIL);
+		BackupClientRestoreJournal::Level &root(journal.GetRoot());
+		for(int64_t d = 100; d < 2100; ++d)
+		{
+			TEST_THAT(root.IsRestored(d));
+		}
+		TEST_THAT(!root.IsRestored(100001));
+		journal.Delete();
+	}
+	TEST_THAT(!FileExists(filename));
+
+	// Files which aren't journals can't be resumed
+	{
+		FileStream file(filename, O_WRONLY | O_CREAT);
+		file.Write("This is not a journal", 21);
+	}
+	{
+		BackupClientRestoreJournal journal;
+		TEST_THAT(!journal.Resume(filename));
+	}
+
+	TEARDOWN();
+}
+
+std::string combined_file_cache_entry(int64_t ObjectID)
+{
+	std::string filename;
+	StoreStructure::MakeObjectFilename(ObjectID, "backup/01234567/", 0,
+		filename, false);
+	int64_t revisionID = 0;
+	TEST_THAT(RaidFileRead::FileExists(0, filename, &revisionID));
+
+	char leaf[64];
+	::snprintf(leaf, sizeof(leaf), "%08x-%016llx-%016llx", 0x01234567,
+		(unsigned long long)ObjectID, (unsigned long long)revisionID);
+	return std::string("testfiles/file-combinedcache" DIRECTORY_SEPARATOR) +
+		leaf;
+}
+
+bool test_combined_file_cache()
+{
+	SETUP_TEST_BACKUPSTORE();
+
+	// The cache on its own first
+	{
+		BackupStoreCombinedFileCache cache(
+			"testfiles/file-combinedcache-unit", 3000);
+		char data[4000];
+		for(int f = 0; f < 4; ++f)
+		{
+			::memset(data, 'a' + f, sizeof(data));
+			MemBlockStream entry(data, 1000);
+			cache.Put(1, f + 2, 3, entry);
+		}
+		TEST_EQUAL(3, cache.GetNumberOfEntries());
+		TEST_EQUAL(3000, cache.GetSize());
+
+		// The oldest was removed to make space for the last one
+		TEST_THAT(cache.Get(1, 2, 3).get() == 0);
+		std::auto_ptr<IOStream> entry(cache.Get(1, 3, 3));
+		TEST_THAT_OR(entry.get() != 0, FAIL);
+		CollectInBufferStream buf;
+		entry->CopyStreamTo(buf);
+		TEST_EQUAL(1000, buf.GetSize());
+		TEST_EQUAL('b', ((const char *)buf.GetBuffer())[999]);
+		entry.reset();
+
+		// The key includes the account and revision
+		TEST_THAT(cache.Get(2, 3, 3).get() == 0);
+		TEST_THAT(cache.Get(1, 3, 4).get() == 0);
+
+		// Getting an entry makes it the most recently used, so the
+		// next one is removed to make space instead. File times may
+		// only be accurate to the second.
+		::safe_sleep(1);
+		TEST_THAT(cache.Get(1, 3, 3).get() != 0);
+		::memset(data, 'z', sizeof(data));
+		MemBlockStream another(data, 1000);
+		cache.Put(1, 6, 3, another);
+		TEST_THAT(cache.Get(1, 3, 3).get() != 0);
+		TEST_THAT(cache.Get(1, 4, 3).get() == 0);
+		TEST_THAT(cache.Get(1, 5, 3).get() != 0);
+		TEST_THAT(cache.Get(1, 6, 3).get() != 0);
+
+		// Entries too big for the cache aren't added at all
+		MemBlockStream huge(data, sizeof(data));
+		cache.Put(1, 7, 3, huge);
+		TEST_THAT(cache.Get(1, 7, 3).get() == 0);
+		TEST_EQUAL(3, cache.GetNumberOfEntries());
+
+		// Files which aren't entries are left alone, and not counted
+		{
+			FileStream other("testfiles/file-combinedcache-unit/"
+				"other", O_WRONLY | O_CREAT);
+			other.Write(data, 100);
+		}
+		TEST_EQUAL(3000, cache.GetSize());
+		TEST_THAT(FileExists("testfiles/file-combinedcache-unit/other"));
+	}
+
+	// And then an old version fetched from a server using it
+	TEST_THAT_OR(StartServer(), FAIL);
+	std::auto_ptr<BackupProtocolCallable> apProtocol =
+		connect_and_login(context);
+
+	int size = 64 * 1024;
+	unsigned char *data = (unsigned char *)malloc(size);
+	R250 r(6789);
+	for(int l = 0; l < size; ++l)
+	{
+		data[l] = r.next() & 0xff;
+	}
+	{
+		FileStream write("testfiles/file-combined", O_WRONLY | O_CREAT);
+		write.Write(data, size);
+	}
+	::memset(data + 30000, 0, 100);
+	{
+		FileStream write("testfiles/file-combined.mod",
+			O_WRONLY | O_CREAT);
+		write.Write(data, size);
+	}
+	free(data);
+
+	BackupStoreFilenameClear remote_filename("combined");
+	int64_t modtime;
+	std::auto_ptr<IOStream> upload(BackupStoreFile::EncodeFile(
+		"testfiles/file-combined", BACKUPSTORE_ROOT_DIRECTORY_ID,
+		remote_filename, &modtime));
+	int64_t oldID = apProtocol->QueryStoreFile(
+		BACKUPSTORE_ROOT_DIRECTORY_ID, modtime, modtime,
+		0, /* diff from ID */
+		remote_filename, upload)->GetObjectID();
+	set_refcount(oldID, 1);
+
+	// Upload the new version as a patch, which turns the old version
+	// into a patch from the new one
+	apProtocol->QueryGetBlockIndexByID(oldID);
+	std::auto_ptr<IOStream> blockIndex(apProtocol->ReceiveStream());
+	bool isCompletelyDifferent = true;
+	std::auto_ptr<IOStream> patch(BackupStoreFile::EncodeFileDiff(
+		"testfiles/file-combined.mod", BACKUPSTORE_ROOT_DIRECTORY_ID,
+		remote_filename, oldID, *blockIndex, SHORT_TIMEOUT,
+		NULL, // pointer to DiffTimer impl
+		&modtime, &isCompletelyDifferent));
+	TEST_THAT(!isCompletelyDifferent);
+	int64_t newID = apProtocol->QueryStoreFile(
+		BACKUPSTORE_ROOT_DIRECTORY_ID, modtime, modtime,
+		oldID, /* diff from ID */
+		remote_filename, patch)->GetObjectID();
+	set_refcount(newID, 1);
+
+	std::string entry = combined_file_cache_entry(oldID);
+	TEST_THAT(!FileExists(entry));
+
+	// Fetch the old version twice: the first time it's combined and
+	// cached, and the second time it comes from the cache
+	box_time_t lastUsed = 0;
+	for(int f = 0; f < 2; ++f)
+	{
+		apProtocol->QueryGetFile(BACKUPSTORE_ROOT_DIRECTORY_ID, oldID);
+		std::auto_ptr<IOStream> filestream(apProtocol->ReceiveStream());
+		BackupStoreFile::DecodeFile(*filestream,
+			"testfiles/file-combined.downloaded", SHORT_TIMEOUT);
+		TEST_THAT(check_files_same("testfiles/file-combined.downloaded",
+			"testfiles/file-combined"));
+		TEST_THAT(::unlink("testfiles/file-combined.downloaded") == 0);
+
+		EMU_STRUCT_STAT st;
+		TEST_THAT_OR(EMU_STAT(entry.c_str(), &st) == 0, FAIL);
+		TEST_THAT(FileModificationTime(st) > lastUsed);
+		lastUsed = FileModificationTime(st);
+		::safe_sleep(1);
+	}
+
+	// The latest version isn't stored as a patch, so isn't cached
+	apProtocol->QueryGetFile(BACKUPSTORE_ROOT_DIRECTORY_ID, newID);
+	CollectInBufferStream latest;
+	apProtocol->ReceiveStream()->CopyStreamTo(latest);
+	BackupStoreCombinedFileCache cache("testfiles/file-combinedcache",
+		16 * 1024 * 1024);
+	TEST_EQUAL(1, cache.GetNumberOfEntries());
+
+	apProtocol->QueryFinished();
+	TEARDOWN_TEST_BACKUPSTORE();
+}
+
 bool test_housekeeping_deletes_files()
 {
 	// Test the deletion of objects by the housekeeping system
@@ -3290,10 +4759,14 @@ int test(int argc, const char *argv[])
 
 	TEST_THAT(test_filename_encoding());
 	TEST_THAT(test_temporary_refcount_db_is_independent());
+	TEST_THAT(test_refcount_database_random_updates());
 	TEST_THAT(test_bbstoreaccounts_create());
 	TEST_THAT(test_bbstoreaccounts_delete());
 	TEST_THAT(test_backupstore_directory());
 	TEST_THAT(test_directory_parent_entry_tracks_directory_size());
+	TEST_THAT(test_directory_cache());
+	TEST_THAT(test_directory_journal());
+	TEST_THAT(test_compact_directories());
 	TEST_THAT(test_cannot_open_multiple_writable_connections());
 	TEST_THAT(test_encoding());
 	TEST_THAT(test_symlinks());
@@ -3311,6 +4784,10 @@ int test(int argc, const char *argv[])
 	TEST_THAT(test_server_commands());
 	TEST_THAT(test_account_limits_respected());
 	TEST_THAT(test_multiple_uploads());
+	TEST_THAT(test_parallel_restore());
+	TEST_THAT(test_parallel_compare());
+	TEST_THAT(test_restore_resume_journal());
+	TEST_THAT(test_combined_file_cache());
 	TEST_THAT(test_housekeeping_deletes_files());
 	TEST_THAT(test_read_write_attr_streamformat());
 
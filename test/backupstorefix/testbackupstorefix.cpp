@@ -484,6 +484,11 @@ int test(int argc, const char *argv[])
 		int x1id = fake_upload(client, file_path, 0);
 		client.QueryFinished();
 
+		// The session leaves its changes to the root directory in
+		// its journal, so have housekeeping write it in full, as the
+		// tests below read and break the directory object directly
+		TEST_THAT(run_housekeeping_and_check_account());
+
 		// Now break the reverse dependency by deleting x1 (the file,
 		// not the directory entry)
 		std::string x1FileName;
@@ -516,6 +521,7 @@ int test(int argc, const char *argv[])
 
 		int x1aid = fake_upload(client, file_path, x1id);
 		client.QueryFinished();
+		TEST_THAT(run_housekeeping_and_check_account());
 
 		// Check that we've ended up with the right preconditions
 		// for the tests below.
@@ -607,6 +613,9 @@ int test(int argc, const char *argv[])
 		}
 	}
 
+	// Write the directories in full, without their journals, as above
+	TEST_THAT(run_housekeeping_and_check_account());
+
 	// Check that we're starting off with the right numbers of files and blocks.
 	// Otherwise the test that check the counts after breaking things will fail
 	// because the numbers won't match.
@@ -13,6 +13,7 @@
 #include <stdio.h>
 #include <time.h>
 
+#include <sstream>
 #include <typeinfo>
 
 #include "Test.h"
@@ -23,6 +24,7 @@
 #include "IOStreamGetLine.h"
 #include "ServerTLS.h"
 #include "CollectInBufferStream.h"
+#include "CommonException.h"
 
 #include "TestContext.h"
 #include "autogen_TestProtocol.h"
@@ -104,6 +106,18 @@ void testservers_connection(SocketStream &rStream)
 		{
 			break;
 		}
+		if(line == "PID")
+		{
+			std::ostringstream pid;
+			pid << getpid() << '\n';
+			rStream.Write(pid.str().c_str(), pid.str().size());
+			continue;
+		}
+		if(line == "THROW")
+		{
+			// A connection which goes wrong
+			THROW_EXCEPTION(CommonException, Internal)
+		}
 		if(line == "LARGEDATA")
 		{
 			// This part of the test is timing-sensitive, because we write
@@ -613,6 +627,97 @@ int test(int argc, const char *argv[])
 		}
 	}
 
+	#ifndef WIN32
+	// Launch it again with a pool of worker processes, starting with
+	// one, which must grow to handle three connections at once
+	{
+		std::string cmd = TEST_EXECUTABLE " --test-daemon-args=";
+		cmd += test_args;
+		cmd += " srv2 testfiles/srv2-workers.conf";
+		int pid = LaunchServer(cmd, "testfiles/srv2-workers.pid");
+
+		TEST_THAT(pid != -1 && pid != 0);
+
+		if(pid > 0)
+		{
+			TEST_THAT(ServerIsAlive(pid));
+
+			// The workers must stop, so that it can listen again
+			TEST_THAT(HUPServer(pid));
+			::sleep(1);
+			TEST_THAT(ServerIsAlive(pid));
+
+			for(int round = 0; round < 2; ++round)
+			{
+				SocketStream conn1;
+				conn1.Open(Socket::TypeINET, "localhost", 2003);
+				SocketStream conn2;
+				conn2.Open(Socket::TypeUNIX,
+					"testfiles/srv2-workers.sock");
+				SocketStream conn3;
+				conn3.Open(Socket::TypeINET, "localhost", 2003);
+
+				std::vector<IOStream *> conns;
+				conns.push_back(&conn1);
+				conns.push_back(&conn2);
+				conns.push_back(&conn3);
+
+				// Workers which handled the first round
+				// handle the second
+				Srv2TestConversations(conns);
+			}
+
+			// A connection which throws an exception is dropped,
+			// but the worker carries on, and so do the others
+			{
+				SocketStream conn1;
+				conn1.Open(Socket::TypeUNIX,
+					"testfiles/srv2-workers.sock");
+				conn1.Write("PID\nTHROW\n", 10);
+				IOStreamGetLine getline(conn1);
+				std::string line;
+				TEST_THAT(getline.GetLine(line, false,
+					SHORT_TIMEOUT));
+				int workerPid = atoi(line.c_str());
+				TEST_THAT(workerPid != 0 && workerPid != pid);
+				// Nothing more, just the end of the stream
+				getline.GetLine(line, false, SHORT_TIMEOUT);
+				TEST_THAT(line.empty());
+				TEST_THAT(getline.IsEOF());
+				::sleep(2);
+				TEST_THAT(ServerIsAlive(workerPid));
+
+				SocketStream conn2;
+				conn2.Open(Socket::TypeUNIX,
+					"testfiles/srv2-workers.sock");
+				std::vector<IOStream *> conns;
+				conns.push_back(&conn2);
+				Srv2TestConversations(conns);
+			}
+
+			TEST_THAT(HUPServer(pid));
+			::sleep(1);
+			TEST_THAT(ServerIsAlive(pid));
+
+			// Still accepting connections after reloading
+			{
+				SocketStream conn1;
+				conn1.Open(Socket::TypeUNIX,
+					"testfiles/srv2-workers.sock");
+				std::vector<IOStream *> conns;
+				conns.push_back(&conn1);
+				Srv2TestConversations(conns);
+			}
+
+			TEST_THAT(KillServer(pid));
+			::sleep(1);
+			TEST_THAT(!ServerIsAlive(pid));
+
+			TestRemoteProcessMemLeaks("test-srv2.memleaks");
+		}
+	}
+	#endif // !WIN32
+
 	// Launch a test SSL server
 	{
 		std::string cmd = TEST_EXECUTABLE " --test-daemon-args=";
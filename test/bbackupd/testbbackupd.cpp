@@ -40,11 +40,13 @@
 #endif
 
 #include <map>
+#include <sstream>
 
 #ifdef HAVE_SYSCALL
 	#include <sys/syscall.h>
 #endif
 
+#include "BackupClientBlockIndexCache.h"
 #include "BackupClientCryptoKeys.h"
 #include "BackupClientContext.h"
 #include "BackupClientFileAttributes.h"
@@ -1009,7 +1011,7 @@ bool compare(BackupQueries::ReturnCode::Type expected_status,
 
 bool compare_local(BackupQueries::ReturnCode::Type expected_status,
 	BackupProtocolCallable& client,
-	const std::string& compare_options = "acQ")
+	const std::string& compare_options = "acQ", int threads = 1)
 {
 	std::auto_ptr<Configuration> config =
 		load_config_file(DEFAULT_BBACKUPD_CONFIG_FILE, BackupDaemonConfigVerify);
@@ -1023,6 +1025,13 @@ bool compare_local(BackupQueries::ReturnCode::Type expected_status,
 	{
 		opts[(unsigned char)*i] = true;
 	}
+	if(threads > 1)
+	{
+		std::ostringstream threads_arg;
+		threads_arg << threads;
+		args.push_back(threads_arg.str());
+		opts['j'] = true;
+	}
 	bbackupquery.CommandCompare(args, opts);
 	TEST_EQUAL_OR(expected_status, bbackupquery.GetReturnCode(),
 		return false);
@@ -1553,6 +1562,143 @@ bool test_ssl_keepalives()
 	TEARDOWN_TEST_BBACKUPD();
 }
 
+class BlockIndexCountingProtocolLocal : public BackupProtocolLocal2
+{
+public:
+	int mNumBlockIndexesRequested;
+
+public:
+	BlockIndexCountingProtocolLocal(int32_t AccountNumber,
+		const std::string& ConnectionDetails,
+		const std::string& AccountRootDir, int DiscSetNumber,
+		bool ReadOnly)
+	: BackupProtocolLocal2(AccountNumber, ConnectionDetails, AccountRootDir,
+		DiscSetNumber, ReadOnly),
+	  mNumBlockIndexesRequested(0)
+	{ }
+
+	std::auto_ptr<BackupProtocolSuccess> Query(const BackupProtocolGetBlockIndexByName &rQuery)
+	{
+		mNumBlockIndexesRequested++;
+		return BackupProtocolLocal::Query(rQuery);
+	}
+	std::auto_ptr<BackupProtocolBlockIndex> Query(const BackupProtocolGetBlockIndexByName2 &rQuery)
+	{
+		mNumBlockIndexesRequested++;
+		return BackupProtocolLocal::Query(rQuery);
+	}
+};
+
+bool test_block_index_cache_avoids_index_downloads()
+{
+	SETUP_TEST_BBACKUPD();
+
+	BlockIndexCountingProtocolLocal connection(0x01234567, "test",
+		"backup/01234567/", 0, false);
+	MockBackupDaemon bbackupd(connection);
+	TEST_THAT_OR(setup_test_bbackupd(bbackupd,
+		true, // do_unpack_files
+		false // do_start_bbstored
+		), FAIL);
+
+	// Make a configuration with the block index cache enabled
+	{
+		FileStream in("testfiles/bbackupd.conf");
+		FileStream out("testfiles/bbackupd-blockindexcache.conf",
+			O_WRONLY | O_CREAT | O_TRUNC);
+		in.CopyStreamTo(out);
+		std::string key("\nBlockIndexCacheSize = 1000000\n");
+		out.Write(key.c_str(), key.size());
+	}
+	TEST_THAT_OR(configure_bbackupd(bbackupd,
+		"testfiles/bbackupd-blockindexcache.conf"), FAIL);
+
+	// The initial backup has nothing to diff, but caches the indexes
+	// of the files over DiffingUploadSizeThreshold
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(0, connection.mNumBlockIndexesRequested);
+	int64_t num_entries;
+	{
+		BackupClientBlockIndexCache cache(
+			"testfiles/bbackupd-data/blockindexcache", 1000000);
+		num_entries = cache.GetNumberOfEntries();
+		TEST_THAT(num_entries > 0);
+	}
+
+	// Entries are only found by the object ID and modification time
+	// they were stored with
+	{
+		BackupClientBlockIndexCache cache(
+			"testfiles/bbackupd-data/blockindexcache-keys", 1000000);
+		CollectInBufferStream index;
+		index.Write("index", 5);
+		index.SetForReading();
+		cache.Put(0x1234, 5678, 0x0c01, index);
+		int32_t options = 0;
+		TEST_THAT(cache.Get(0x1234, 5679, options).get() == NULL);
+		TEST_THAT(cache.Get(0x1235, 5678, options).get() == NULL);
+		std::auto_ptr<IOStream> found(cache.Get(0x1234, 5678, options));
+		TEST_THAT_OR(found.get() != NULL, FAIL);
+		TEST_EQUAL(0x0c01, options);
+		char buffer[5];
+		TEST_EQUAL(5, found->Read(buffer, sizeof(buffer)));
+		TEST_THAT(memcmp(buffer, "index", 5) == 0);
+		cache.Remove(0x1234, 5678);
+		TEST_THAT(cache.Get(0x1234, 5678, options).get() == NULL);
+		TEST_EQUAL(0, cache.GetNumberOfEntries());
+	}
+
+	// Changing the file should diff it against the cached index,
+	// without asking the server for it
+	{
+		int fd = open("testfiles/TestDir1/x1/dsfdsfs98.fd", O_WRONLY);
+		TEST_THAT_OR(fd > 0, FAIL);
+		char buffer[1000];
+		memset(buffer, 0, sizeof(buffer));
+		TEST_EQUAL_LINE(sizeof(buffer),
+			write(fd, buffer, sizeof(buffer)),
+			"Buffer write");
+		TEST_THAT(close(fd) == 0);
+		wait_for_operation(5, "modified file to be old enough");
+	}
+
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(0, connection.mNumBlockIndexesRequested);
+	TEST_COMPARE_LOCAL(Compare_Same, connection);
+
+	// The index of the old version is replaced by the new one
+	{
+		BackupClientBlockIndexCache cache(
+			"testfiles/bbackupd-data/blockindexcache", 1000000);
+		TEST_EQUAL(num_entries, cache.GetNumberOfEntries());
+	}
+
+	// Without the cache, the index comes from the server as before
+	TEST_THAT_OR(configure_bbackupd(bbackupd, "testfiles/bbackupd.conf"),
+		FAIL);
+	{
+		int fd = open("testfiles/TestDir1/x1/dsfdsfs98.fd", O_WRONLY);
+		TEST_THAT_OR(fd > 0, FAIL);
+		char buffer[1000];
+		memset(buffer, 1, sizeof(buffer));
+		TEST_EQUAL_LINE(sizeof(buffer),
+			write(fd, buffer, sizeof(buffer)),
+			"Buffer write");
+		TEST_THAT(close(fd) == 0);
+		wait_for_operation(5, "modified file to be old enough");
+	}
+
+	bbackupd.RunSyncNow();
+	TEST_EQUAL(1, connection.mNumBlockIndexesRequested);
+	TEST_COMPARE_LOCAL(Compare_Same, connection);
+
+	// Compare on several threads too
+	TEST_COMPARE_LOCAL(Compare_Same, connection, "acQ", 4);
+	TEST_COMPARE_LOCAL(Compare_Same, connection, "acqQ", 4);
+
+	TEARDOWN_TEST_BBACKUPD();
+}
+
 bool test_backup_hardlinked_files()
 {
 	SETUP_WITH_BBSTORED();
@@ -2705,6 +2851,10 @@ bool test_delete_update_and_symlink_files()
 
 		// Try a quick compare, just for fun
 		TEST_COMPARE(Compare_Same, "", "-acqQ");
+
+		// And compare on several threads, both ways
+		TEST_COMPARE(Compare_Same, "", "-acQj 4");
+		TEST_COMPARE(Compare_Same, "", "-acqQj 4");
 	}
 
 	TEARDOWN_TEST_BBACKUPD();
@@ -4072,6 +4222,7 @@ int test(int argc, const char *argv[])
 	// TEST_THAT(test_replace_zero_byte_file_with_nonzero_byte_file());
 	TEST_THAT(test_backup_disappearing_directory());
 	TEST_THAT(test_ssl_keepalives());
+	TEST_THAT(test_block_index_cache_avoids_index_downloads());
 	TEST_THAT(test_backup_hardlinked_files());
 	TEST_THAT(test_backup_pauses_when_store_is_full());
 	TEST_THAT(test_bbackupd_exclusions());
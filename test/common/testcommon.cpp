@@ -31,6 +31,8 @@
 #include "Archive.h"
 #include "Timer.h"
 #include "Logging.h"
+#include "FileHoles.h"
+#include "SparseFileStream.h"
 #include "ZeroStream.h"
 #include "PartialReadStream.h"
 
@@ -936,5 +938,122 @@ int test(int argc, const char *argv[])
 		}
 	}
 
+	// Test reading a file after advising that it's read sequentially,
+	// which is only a hint, so it's read the same as without
+	{
+		std::string seqfile("testfiles" DIRECTORY_SEPARATOR "seqfile");
+		std::string data;
+		for(int i = 0; i < 256 * 1024; ++i)
+		{
+			data += (char)('a' + (i % 26));
+		}
+		{
+			FileStream fs(seqfile, O_WRONLY | O_CREAT | O_TRUNC);
+			fs.Write(data.c_str(), data.size());
+		}
+
+		{
+			std::vector<uint8_t> buffer(data.size());
+			FileStream fs(seqfile);
+			fs.AdviseSequential();
+			TEST_THAT(fs.ReadFullBuffer(&buffer[0], data.size(), 0));
+			TEST_THAT(::memcmp(&buffer[0], data.c_str(),
+				data.size()) == 0);
+			TEST_THAT(fs.Read(&buffer[0], 1) == 0);
+		}
+
+		TEST_THAT(::unlink(seqfile.c_str()) == 0);
+	}
+
+	// Test sparse files, with a hole in the middle and one at the end,
+	// and zeros which aren't in either, so they're written
+	{
+		std::string sparsefile("testfiles" DIRECTORY_SEPARATOR "sparsefile");
+		std::vector<uint8_t> data(2 * 1024 * 1024 + 3 * 8192, 0);
+		for(int i = 0; i < 8192; ++i)
+		{
+			data[i] = 'a' + (i % 26);
+			data[8192 + 1024 * 1024 + i] = 'z' - (i % 26);
+		}
+		// A zero in the data, which is too short to be a hole
+		data[100] = 0;
+		{
+			SparseFileStream out(sparsefile, O_WRONLY | O_CREAT | O_TRUNC);
+			TEST_THAT(out.GetHoles().IsEmpty());
+			FileHoles toWrite;
+			toWrite.Add(16384, 1024 * 1024 - 16384);
+			toWrite.Add(1024 * 1024 + 65536, 8192);
+			toWrite.Add(1024 * 1024 + 73728, data.size() - 1024 * 1024 - 73728);
+			TEST_EQUAL(2, toWrite.GetNumberOfHoles());
+			out.SetHoles(toWrite);
+			for(size_t i = 0; i < data.size(); i += 12345)
+			{
+				size_t size = data.size() - i;
+				if(size > 12345) size = 12345;
+				out.Write(&data[i], size);
+			}
+			out.Close();
+		}
+
+		{
+			FileStream in(sparsefile);
+			TEST_EQUAL((IOStream::pos_type)data.size(), in.BytesLeftToRead());
+			std::vector<uint8_t> read(data.size());
+			TEST_THAT(in.ReadFullBuffer(&read[0], read.size(), 0));
+			TEST_THAT(read == data);
+		}
+
+		// Holes read as zeros, whether they're found or not, and
+		// never in the same read as data
+		{
+			SparseFileStream in(sparsefile);
+			std::vector<uint8_t> read(data.size() + 1);
+			size_t got = 0;
+			int r;
+			while((r = in.Read(&read[got], 100000)) > 0)
+			{
+				got += r;
+			}
+			TEST_EQUAL(data.size(), got);
+			read.resize(got);
+			TEST_THAT(read == data);
+			TEST_THAT(!in.StreamDataLeft());
+		}
+
+		FileHoles holes;
+		TEST_THAT(!holes.Find("testfiles" DIRECTORY_SEPARATOR "DOESNTEXIST"));
+		TEST_THAT(holes.IsEmpty());
+		if(holes.Find(sparsefile) && !holes.IsEmpty())
+		{
+			// The file system supports holes, so the runs of zeros
+			// written should have been left as holes
+			TEST_EQUAL(2, holes.GetNumberOfHoles());
+			TEST_THAT(holes.GetTotalSize() > 1024 * 1024);
+			TEST_THAT(!holes.Contains(0, 1));
+			TEST_THAT(holes.Contains(65536, 65536));
+			TEST_THAT(!holes.Contains(65536, 1024 * 1024));
+			// Zeros outside the holes given were written
+			TEST_THAT(!holes.Contains(1024 * 1024, 4096));
+			TEST_THAT(!holes.Contains(1024 * 1024 + 20480, 4096));
+			// The file was extended by writing its last byte
+			TEST_THAT(holes.Contains(data.size() - 65536, 32768));
+			TEST_THAT(!holes.Contains(data.size() - 1, 1));
+
+			bool isHole = true;
+			TEST_EQUAL(-1, holes.GetExtentAt(data.size(), isHole));
+			TEST_THAT(!isHole);
+			int64_t end = holes.GetExtentAt(0, isHole);
+			TEST_THAT(!isHole);
+			TEST_THAT(end >= 8192 && end <= 65536);
+			TEST_THAT(holes.GetExtentAt(end, isHole) > end);
+			TEST_THAT(isHole);
+
+			holes.Clear();
+			TEST_THAT(holes.IsEmpty());
+		}
+
+		TEST_THAT(::unlink(sparsefile.c_str()) == 0);
+	}
+
 	return 0;
 }
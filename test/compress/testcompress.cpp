@@ -14,6 +14,8 @@
 
 #include "Test.h"
 #include "Compress.h"
+#include "CompressCodec.h"
+#include "CompressException.h"
 #include "CompressStream.h"
 #include "CollectInBufferStream.h"
 
@@ -167,6 +169,103 @@ int test_stream()
 	return 0;
 }
 
+int test_codecs()
+{
+	char *data = (char *)malloc(DATA_SIZE);
+	for(int l = 0; l < DATA_SIZE; ++l)
+	{
+		data[l] = l*23;
+	}
+
+	for(int codec = 0; codec < CompressCodec::NumCodecs; ++codec)
+	{
+		int found = -1;
+		TEST_THAT(CompressCodec::GetCodecFromName(
+			CompressCodec::GetName(codec), found));
+		TEST_EQUAL(codec, found);
+		TEST_THAT(CompressCodec::IsValidLevel(codec, 0));
+
+		// zlib is always compressed through Compress<>
+		if(codec == CompressCodec::Zlib)
+		{
+			continue;
+		}
+
+		int maxOutput = CompressCodec::MaxCompressedSize(codec, DATA_SIZE);
+		TEST_THAT(maxOutput >= DATA_SIZE);
+		char *compressed = (char *)malloc(maxOutput);
+
+		if(!CompressCodec::IsSupported(codec))
+		{
+			TEST_CHECK_THROWS(CompressCodec::CompressBlock(codec, 0,
+				data, DATA_SIZE, compressed, maxOutput),
+				CompressException, CodecNotSupported);
+			::free(compressed);
+			continue;
+		}
+
+		int compressedSize = CompressCodec::CompressBlock(codec, 0, data,
+			DATA_SIZE, compressed, maxOutput);
+		TEST_THAT(compressedSize < DATA_SIZE);
+
+		char *decompressed = (char *)malloc(DATA_SIZE);
+		TEST_EQUAL(DATA_SIZE, CompressCodec::DecompressBlock(codec,
+			compressed, compressedSize, decompressed, DATA_SIZE));
+		TEST_THAT(::memcmp(data, decompressed, DATA_SIZE) == 0);
+
+		// Not enough space for the output
+		TEST_CHECK_THROWS(CompressCodec::DecompressBlock(codec,
+			compressed, compressedSize, decompressed, DATA_SIZE / 2),
+			CompressException, TransformFailed);
+
+		::free(compressed);
+		::free(decompressed);
+	}
+
+	int found = -1;
+	TEST_THAT(!CompressCodec::GetCodecFromName("gzip", found));
+	TEST_THAT(CompressCodec::IsValidLevel(CompressCodec::Zlib, 9));
+	TEST_THAT(!CompressCodec::IsValidLevel(CompressCodec::Zlib, 10));
+	TEST_THAT(!CompressCodec::IsValidLevel(CompressCodec::LZ4, 1));
+
+	::free(data);
+	return 0;
+}
+
+int test_compressibility()
+{
+	// Pseudo-random data, which is as good as compressed
+	char *data = (char *)malloc(DATA_SIZE);
+	uint32_t state = 2463534242U;
+	for(int l = 0; l < DATA_SIZE; ++l)
+	{
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		data[l] = state >> 24;
+	}
+	TEST_THAT(!CompressCodec::LooksCompressible(data, DATA_SIZE));
+	TEST_THAT(!CompressCodec::LooksCompressible(data, 1000));
+
+	// The same random data repeated
+	for(int l = 256; l < DATA_SIZE; ++l)
+	{
+		data[l] = data[l % 256];
+	}
+	TEST_THAT(CompressCodec::LooksCompressible(data, DATA_SIZE));
+
+	// Text
+	for(int l = 0; l < DATA_SIZE; ++l)
+	{
+		data[l] = "the quick brown fox jumps over the lazy dog"[(l * 7) % 43];
+	}
+	TEST_THAT(CompressCodec::LooksCompressible(data, DATA_SIZE));
+	TEST_THAT(CompressCodec::LooksCompressible(data, 300));
+
+	::free(data);
+	return 0;
+}
+
 // Test basic interface
 int test(int argc, const char *argv[])
 {
@@ -258,5 +357,7 @@ int test(int argc, const char *argv[])
 	::free(compressed);
 	::free(decompressed);
 	
-	return test_stream();
+	TEST_THAT(test_stream() == 0);
+	TEST_THAT(test_codecs() == 0);
+	return test_compressibility();
 }
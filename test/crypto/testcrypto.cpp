@@ -9,6 +9,7 @@
 
 #include "Box.h"
 
+#include <stdio.h>
 #include <string.h>
 #include <openssl/rand.h>
 
@@ -16,10 +17,13 @@
 #include "CipherBlowfish.h"
 #include "CipherAES.h"
 #include "CipherException.h"
+#include "BoxTime.h"
 #include "CollectInBufferStream.h"
+#include "CryptoUtils.h"
 #include "Guards.h"
 #include "RollingChecksum.h"
 #include "Random.h"
+#include "XXH128Digest.h"
 #include "Test.h"
 
 #include "MemLeakFindOn.h"
@@ -35,6 +39,10 @@
 #define CHECKSUM_BLOCK_SIZE_LAST	(CHECKSUM_BLOCK_SIZE_BASE + 64)
 #define CHECKSUM_ROLLS				16
 
+// Size and number of chunks encrypted to measure cipher throughput
+#define SPEED_CHUNK_SIZE			(64*1024)
+#define SPEED_CHUNKS				256
+
 // Copied from BackupClientCryptoKeys.h
 #define BACKUPCRYPTOKEYS_FILENAME_KEY_START				0
 #define BACKUPCRYPTOKEYS_FILENAME_KEY_LENGTH			56
@@ -256,6 +264,132 @@ void test_cipher()
 	}
 }
 
+void test_xxh128()
+{
+	// Known answers from the reference XXH3-128 implementation, for
+	// input[i] = (i * 7 + 3), covering each of its length classes
+	static const struct
+	{
+		int length;
+		const char *digest;
+	} known[] =
+	{
+		{ 0,     "99aa06d3014798d86001c324468d497f" },
+		{ 1,     "22bbb76b211a39ba13e608bc156defed" },
+		{ 3,     "ce31763cbf8245a5a9088dda485b481c" },
+		{ 4,     "47197970590746b1788a609154b0fe20" },
+		{ 8,     "e3bc8a5f461715553cd024e3d63a1588" },
+		{ 9,     "c72c88247a9a56d7eafab1c7f123109f" },
+		{ 16,    "ce0b9647ab24f88460d75c5e47d40a24" },
+		{ 17,    "bfd327edcc2fbd12eeed7654312a26d7" },
+		{ 128,   "1b1962a096bac78bc580008b6c92ac53" },
+		{ 129,   "293e4968c4619023bd91ce7ace4d385b" },
+		{ 240,   "ad46c1021b076bc704e0b5f034bee80b" },
+		{ 241,   "ac6c3492c3d6b45d8beadd3a8874fe17" },
+		{ 1024,  "18bc0eaca9a336369b81661c641c72b1" },
+		{ 4096,  "1546867423105cd5d7428746842be37e" },
+		{ 10000, "614feaaa3ff5ae66fcd0ecba1a48462d" }
+	};
+
+	uint8_t data[10000];
+	for(int i = 0; i < (int)sizeof(data); ++i)
+	{
+		data[i] = (uint8_t)(i * 7 + 3);
+	}
+
+	for(unsigned int k = 0; k < sizeof(known) / sizeof(known[0]); ++k)
+	{
+		XXH128Digest digest;
+		digest.Add(data, known[k].length);
+		digest.Finish();
+		TEST_EQUAL_LINE(known[k].digest, digest.DigestAsString(),
+			"length " << known[k].length);
+
+		// Adding the same data in awkwardly sized pieces must give
+		// the same result as adding it all at once
+		XXH128Digest split;
+		for(int pos = 0; pos < known[k].length; pos += 37)
+		{
+			int len = known[k].length - pos;
+			split.Add(data + pos, (len < 37) ? len : 37);
+		}
+		split.Finish();
+		TEST_EQUAL_LINE(known[k].digest, split.DigestAsString(),
+			"length " << known[k].length << " in pieces");
+		TEST_THAT(split.DigestMatches(digest.DigestAsData()));
+	}
+}
+
+template<typename CipherType, int BLOCKSIZE>
+void test_chunk_cipher_speed(const char *pName)
+{
+	CipherContext encrypt;
+	encrypt.Init(CipherContext::Encrypt, CipherType(CipherDescription::Mode_CBC, KEY, sizeof(KEY)));
+	CipherContext decrypt;
+	decrypt.Init(CipherContext::Decrypt, CipherType(CipherDescription::Mode_CBC, KEY, sizeof(KEY)));
+
+	MemoryBlockGuard<uint8_t *> clear(SPEED_CHUNK_SIZE);
+	Random::Generate(clear, SPEED_CHUNK_SIZE);
+	int bufferSize = encrypt.MaxOutSizeForInBufferSize(SPEED_CHUNK_SIZE);
+	MemoryBlockGuard<uint8_t *> piecewise(bufferSize);
+	MemoryBlockGuard<uint8_t *> whole(bufferSize);
+	uint8_t iv[BLOCKSIZE];
+	Random::Generate(iv, sizeof(iv));
+
+	// Encrypting a chunk in pieces, the way chunks used to be, and in
+	// one go from the IV must give the same result
+	int piecewiseSize = 0;
+	box_time_t start = GetCurrentBoxTime();
+	for(int c = 0; c < SPEED_CHUNKS; ++c)
+	{
+		encrypt.SetIV(iv);
+		encrypt.Begin();
+		piecewiseSize = 0;
+		for(int o = 0; o < SPEED_CHUNK_SIZE; o += 2048)
+		{
+			piecewiseSize += encrypt.Transform(piecewise + piecewiseSize,
+				bufferSize - piecewiseSize, clear + o, 2048);
+		}
+		piecewiseSize += encrypt.Final(piecewise + piecewiseSize,
+			bufferSize - piecewiseSize);
+	}
+	box_time_t piecewiseTime = GetCurrentBoxTime() - start;
+
+	int wholeSize = 0;
+	start = GetCurrentBoxTime();
+	for(int c = 0; c < SPEED_CHUNKS; ++c)
+	{
+		wholeSize = encrypt.TransformWithIV(whole, bufferSize, iv,
+			clear, SPEED_CHUNK_SIZE);
+	}
+	box_time_t wholeTime = GetCurrentBoxTime() - start;
+
+	TEST_EQUAL(piecewiseSize, wholeSize);
+	TEST_THAT(::memcmp(piecewise, whole, wholeSize) == 0);
+
+	// Decrypt in place
+	start = GetCurrentBoxTime();
+	int decryptedSize = 0;
+	for(int c = 0; c < SPEED_CHUNKS; ++c)
+	{
+		::memcpy(piecewise, whole, wholeSize);
+		decryptedSize = decrypt.TransformWithIV(piecewise, bufferSize, iv,
+			piecewise, wholeSize);
+	}
+	box_time_t decryptTime = GetCurrentBoxTime() - start;
+
+	TEST_EQUAL(SPEED_CHUNK_SIZE, decryptedSize);
+	TEST_THAT(::memcmp(piecewise, clear, SPEED_CHUNK_SIZE) == 0);
+
+	// Throughput in MB/s is bytes per microsecond
+	double bytes = (double)SPEED_CHUNK_SIZE * SPEED_CHUNKS;
+	#define SPEED(time) (bytes / ((time) ? (time) : 1))
+	::printf("%s: encrypt %.1f MB/s in 2 KB pieces, %.1f MB/s in one go, "
+		"decrypt %.1f MB/s\n", pName, SPEED(piecewiseTime),
+		SPEED(wholeTime), SPEED(decryptTime));
+	#undef SPEED
+}
+
 int test(int argc, const char *argv[])
 {
 	Random::Initialise();
@@ -269,6 +403,14 @@ int test(int argc, const char *argv[])
 #else
 	::printf("Skipping AES -- not supported by version of OpenSSL in use.\n");
 #endif
+
+	// Throughput of encrypting whole chunks of files
+	test_chunk_cipher_speed<CipherBlowfish, 8>("Blowfish");
+#ifndef HAVE_OLD_SSL
+	::printf("Hardware AES: %s\n",
+		CryptoUtils::HasHardwareAES() ? "yes" : "no");
+	test_chunk_cipher_speed<CipherAES, 16>("AES");
+#endif
 	
 	// Test with known plaintext and ciphertext (correct algorithm used, etc)
 	{
@@ -371,6 +513,9 @@ int test(int argc, const char *argv[])
 	}
 	::free(checkdata_blk);
 
+	// Fast strong checksums
+	test_xxh128();
+
 	// Random integers
 	check_random_int(0);
 	check_random_int(1);